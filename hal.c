@@ -0,0 +1,123 @@
+/*----------------------------------------------------------------------------*/
+/* Peripheral setup behind hal.h that is too long for a macro. Target only,   */
+/* the host build gets these from the simulator.                              */
+/*----------------------------------------------------------------------------*/
+#include "hal.h"
+
+/*------------------------------------------*/
+/* PS2 port n. Both lines open drain and    */
+/* released, they still read as inputs.     */
+/* Port 0: RB6 data, RB7/INT0 clock, Timer1 */
+/* Port 1: RB8 data, RB9/RP9 clock routed   */
+/*         to INT1 by PPS, Timer4           */
+/* Timers and INTx all at level 4, above    */
+/* the SPI link, so none preempts another   */
+/*------------------------------------------*/
+void halPs2Setup(uint8_t n){
+
+   if(n == 0){
+      ODCBbits.ODB6 = 1;                                                        //Data line open drain
+      TRISBbits.TRISB6 = 0;                                                     //Output, input can still be read
+      LATBbits.LATB6 = 1;                                                       //Released
+      ODCBbits.ODB7 = 1;                                                        //Clock line, same
+      TRISBbits.TRISB7 = 0;
+      LATBbits.LATB7 = 1;
+      INTCON2bits.INT0EP = 1;                                                   //Interrupt on falling edge
+      IPC0bits.INT0IP = 4;
+      T1CON = 0x0010;                                                           //1:8 prescale, started per use
+      IPC0bits.T1IP = 4;
+   }
+   else{
+      ODCBbits.ODB8 = 1;
+      TRISBbits.TRISB8 = 0;
+      LATBbits.LATB8 = 1;
+      ODCBbits.ODB9 = 1;
+      TRISBbits.TRISB9 = 0;
+      LATBbits.LATB9 = 1;
+      __builtin_write_OSCCONL(OSCCON & 0xBF);                                   //Unlock peripheral pin select
+      RPINR0bits.INT1R = 9;                                                     //INT1 on RP9
+      __builtin_write_OSCCONL(OSCCON | 0x40);                                   //Lock it again
+      INTCON2bits.INT1EP = 1;
+      IPC5bits.INT1IP = 4;
+      T4CON = 0x0010;
+      IPC6bits.T4IP = 4;
+   }
+}
+
+/*------------------------------------------*/
+/* SPI1 slave link to the master controller */
+/* RB13/RP13 SCK1 in   RB14/RP14 SDI1       */
+/* RB15/RP15 SDO1      RB11/RP11 SS1 (CN15) */
+/*------------------------------------------*/
+void halSpiSetup(void){
+
+   AD1PCFGbits.PCFG11 = 1;                                                      //RB13-RB15 digital
+   AD1PCFGbits.PCFG10 = 1;
+   AD1PCFGbits.PCFG9 = 1;
+   TRISBbits.TRISB11 = 1;                                                       //SS1, SCK1 and SDI1 are inputs
+   TRISBbits.TRISB13 = 1;
+   TRISBbits.TRISB14 = 1;
+   TRISBbits.TRISB15 = 0;                                                       //SDO1 is an output
+
+   __builtin_write_OSCCONL(OSCCON & 0xBF);                                      //Unlock peripheral pin select
+   RPINR20bits.SCK1R = 13;
+   RPINR20bits.SDI1R = 14;
+   RPINR21bits.SS1R = 11;
+   RPOR7bits.RP15R = 7;                                                         //SDO1 function
+   __builtin_write_OSCCONL(OSCCON | 0x40);                                      //Lock it again
+
+   SPI1STAT = 0;
+   SPI1CON1 = 0;                                                                //Slave, 8 bit, SMP must be 0 in slave mode
+   SPI1CON1bits.CKE = 1;                                                        //Mode 0 (CKP = 0, CKE = 1)
+   SPI1CON1bits.SSEN = 1;                                                       //Only shift while SS1 is low
+   SPI1CON2 = 0;                                                                //Standard buffer, interrupt per byte
+   IPC2bits.SPI1IP = 3;                                                         //Below INT0 so PS2 edges are never held off
+   IFS0bits.SPI1IF = 0;
+   IEC0bits.SPI1IE = 1;
+
+   CNEN1bits.CN15IE = 1;                                                        //Select/deselect edges on SS1
+   IPC4bits.CNIP = 3;
+   IFS1bits.CNIF = 0;
+   IEC1bits.CNIE = 1;
+
+   SPI1STATbits.SPIEN = 1;
+}
+
+/*------------------------------------------*/
+/* Free running 32-bit timebase, Timer2/3   */
+/* at FCY. Wraps every 268s; only compare   */
+/* differences. The wrap interrupts, only   */
+/* to wake the main loop from Idle (see     */
+/* power.c)                                 */
+/*------------------------------------------*/
+void halTimebaseSetup(void){
+
+   T2CON = 0;
+   T3CON = 0;
+   T2CONbits.T32 = 1;                                                           //Timer2/3 as one 32-bit timer, 1:1
+   TMR3 = 0;
+   TMR2 = 0;
+   PR3 = 0xFFFF;
+   PR2 = 0xFFFF;
+   IPC2bits.T3IP = 1;                                                           //Wrap, lowest level
+   IFS0bits.T3IF = 0;
+   IEC0bits.T3IE = 1;
+   T2CONbits.TON = 1;
+}
+
+uint32_t halNow(void){
+
+   uint16_t hi, lo;
+
+   do{                                                                          //Not TMR3HLD: an ISR reading TMR2 would reload it
+      hi = TMR3;
+      lo = TMR2;
+   }while(hi != TMR3);                                                          //Carry between the reads, try again
+
+   return ((uint32_t)hi << 16) | lo;
+}
+
+void HAL_ISR _T3Interrupt(void)
+{
+   IFS0bits.T3IF = 0;
+}
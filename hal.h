@@ -0,0 +1,97 @@
+/*
+ * File:   hal.h
+ *
+ * Thin hardware abstraction for the PS2 ports (pins, external interrupt and
+ * bus timer of each), the host notification pin, the Timer2/3 timebase, the
+ * SPI1 host link, busy-wait delays and Idle. Target builds map straight onto
+ * the PIC24 registers (peripheral setup that is too long for a macro lives in
+ * hal.c). Host builds (HOST_SIM) map onto the virtual-time bus simulator in
+ * sim/ so the driver can be run and measured on a workstation.
+ */
+
+#ifndef HAL_H
+#define	HAL_H
+
+#include <stdint.h>
+#include "sys.h"
+
+#define HAL_US_TICKS(us)    ((uint32_t)(us) * (FCY / 1000000UL))                //halNow() ticks
+
+void     halPs2Setup(uint8_t n);                                                //PS2 port n: open drain lines released, INTx edge, bus timer
+void     halSpiSetup(void);                                                     //SPI1 slave, PPS and SS1 change notification
+void     halTimebaseSetup(void);                                                //Start the free running timebase
+uint32_t halNow(void);                                                          //Timebase in FCY ticks
+
+#ifdef HOST_SIM
+#include "sim/simhal.h"
+#else
+#include <xc.h>
+#include <libpic30.h>                                                           //For __delay_us()
+
+/*----------------------------------------------------*/
+/* PS2 ports, n = 0 or 1 (pins and PPS in hal.c)      */
+/* Port 0: RB6 data, RB7 clock on INT0, Timer1        */
+/* Port 1: RB8 data, RB9 clock on INT1, Timer4        */
+/* n is a constant in the ISRs, so these fold to one  */
+/* register access there                              */
+/*----------------------------------------------------*/
+#define HAL_PS2_DATA(n,v)   do{ if(n) LATBbits.LATB8 = (v); else LATBbits.LATB6 = (v); }while(0) //Data line latch, 1 = released
+#define HAL_PS2_CLOCK(n,v)  do{ if(n) LATBbits.LATB9 = (v); else LATBbits.LATB7 = (v); }while(0) //Clock line latch, 1 = released
+#define HAL_PS2_DATA_P(n)   ((n) ? PORTBbits.RB8 : PORTBbits.RB6)               //Data line level
+#define HAL_PS2_CLOCK_P(n)  ((n) ? PORTBbits.RB9 : PORTBbits.RB7)               //Clock line level
+
+/*----------------------------------------------------*/
+/* Host notification pin                              */
+/*----------------------------------------------------*/
+#define KB_FLAG_A   AD1PCFGbits.PCFG12                                          //Notification pin
+#define KB_FLAG_T   TRISBbits.TRISB12
+#define KB_FLAG_L   LATBbits.LATB12
+
+/*----------------------------------------------------*/
+/* PS2 clock interrupts, INT0 and INT1 (falling edge) */
+/*----------------------------------------------------*/
+#define HAL_ISR             __attribute ((interrupt, no_auto_psv))
+#define HAL_PS2_INT_ENABLE(n)  do{ if(n) IEC1bits.INT1IE = 1; else IEC0bits.INT0IE = 1; }while(0)
+#define HAL_PS2_INT_DISABLE(n) do{ if(n) IEC1bits.INT1IE = 0; else IEC0bits.INT0IE = 0; }while(0)
+#define HAL_PS2_INT_CLEAR(n)   do{ if(n) IFS1bits.INT1IF = 0; else IFS0bits.INT0IF = 0; }while(0)
+
+/*----------------------------------------------------*/
+/* PS2 bus timers, Timer1 and Timer4 (1:8 prescale,   */
+/* 0.5us ticks)                                       */
+/*----------------------------------------------------*/
+#define HAL_PS2_TICKS(us)   ((uint16_t)((us) * (FCY / 8000000UL)))
+#define HAL_T1_START(t)     do{ T1CONbits.TON = 0; TMR1 = 0; PR1 = (t); IFS0bits.T1IF = 0; IEC0bits.T1IE = 1; T1CONbits.TON = 1; }while(0)
+#define HAL_T4_START(t)     do{ T4CONbits.TON = 0; TMR4 = 0; PR4 = (t); IFS1bits.T4IF = 0; IEC1bits.T4IE = 1; T4CONbits.TON = 1; }while(0)
+#define HAL_PS2_TMR_START(n,t) do{ if(n) HAL_T4_START(t); else HAL_T1_START(t); }while(0)
+#define HAL_PS2_TMR_STOP(n) do{ if(n){ T4CONbits.TON = 0; IEC1bits.T4IE = 0; } else{ T1CONbits.TON = 0; IEC0bits.T1IE = 0; } }while(0)
+#define HAL_PS2_TMR_CLEAR(n) do{ if(n) IFS1bits.T4IF = 0; else IFS0bits.T1IF = 0; }while(0)
+#define HAL_TICK16()        TMR2                                                //Timebase low word, short intervals from an ISR
+
+/*----------------------------------------------------*/
+/* SPI1 slave link to the host (pins in hal.c)        */
+/*----------------------------------------------------*/
+#define HAL_SS_P            PORTBbits.RB11                                      //Slave select from the host, active low
+
+#define HAL_SPI_READ()      SPI1BUF
+#define HAL_SPI_WRITE(b)    SPI1BUF = (b)
+#define HAL_SPI_FLUSH()     do{ SPI1STATbits.SPIEN = 0; SPI1STATbits.SPIEN = 1; }while(0) //Drop a stale preload
+#define HAL_SPI_CLEAR()     do{ SPI1STATbits.SPIROV = 0; IFS0bits.SPI1IF = 0; }while(0)
+#define HAL_SPI_LOCK()      IEC0bits.SPI1IE = 0                                 //Keep the SPI ISR off the queue
+#define HAL_SPI_UNLOCK()    IEC0bits.SPI1IE = 1
+#define HAL_LINK_LOCK()     do{ IEC0bits.SPI1IE = 0; IEC1bits.CNIE = 0; }while(0) //Select edges as well, for the transaction state
+#define HAL_LINK_UNLOCK()   do{ IEC1bits.CNIE = 1; IEC0bits.SPI1IE = 1; }while(0)
+#define HAL_CN_CLEAR()      IFS1bits.CNIF = 0
+
+/*----------------------------------------------------*/
+/* Timing and main loop                               */
+/*----------------------------------------------------*/
+#define HAL_DELAY_US(us)    __delay_us(us)
+#define HAL_SPIN()                                                              //Busy-wait body, nothing to do on target
+#define HAL_COST(cyc)                                                           //Cycles the simulator charges for a code path
+#define HAL_RUNNING()       1                                                   //Main loop never exits on target
+#define HAL_IDLE_LOCK(s)    SET_AND_SAVE_CPU_IPL(s,7)                           //CPU priority 7: interrupts still wake Idle, their ISRs wait
+#define HAL_IDLE_UNLOCK(s)  RESTORE_CPU_IPL(s)
+#define HAL_IDLE()          Idle()                                              //PWRSAV #1, the clock and peripherals keep running
+#endif
+
+#endif	/* HAL_H */
@@ -0,0 +1,293 @@
+/*----------------------------------------------------------------------------*/
+/* SPI1 slave link to the master controller                                   */
+/*                                                                            */
+/* The master owns the clock. KB_FLAG (RB12) goes high when the output queue  */
+/* has data; the master then selects us and runs one transaction:             */
+/*                                                                            */
+/*   byte   master -> slave        slave -> master                            */
+/*   0      opcode                 length n (queued bytes, at most 255)       */
+/*   1..n   don't care             queued bytes, oldest first                 */
+/*                                                                            */
+/* The length byte has to be in SPI1BUF before the master starts clocking, so */
+/* it is loaded ahead of time: at deselect and just before KB_FLAG is raised. */
+/* Bytes posted after that wait for the next transaction, so n never exceeds  */
+/* what is really queued. Each byte is taken off the queue as it is loaded    */
+/* for shifting out, which means the master must clock all n bytes.           */
+/*                                                                            */
+/* HOST_OP_DIAG and HOST_OP_KEYS do not touch the queue. Byte 0 still         */
+/* returns the length n, byte 1 returns the size m of the record (kbDiag_t or */
+/* kbKeyState_t) and bytes 2..m+1 the record itself, copied when the opcode   */
+/* arrives. The master can ask for either at any time, KB_FLAG or not.        */
+/* HOST_OP_MOUSE (PS2_MOUSE builds) works the same way and takes the oldest   */
+/* msReport_t off the mouse layer; it does not raise KB_FLAG, the master      */
+/* polls at its own pace. A report sums the motion up to a button change.     */
+/*                                                                            */
+/* HOST_OP_ASCII, HOST_OP_EVENTS and HOST_OP_UTF8 drain the queue like        */
+/* HOST_OP_READ but put a format byte first:                                  */
+/*                                                                            */
+/*   byte   master -> slave        slave -> master                            */
+/*   0      opcode                 length n                                   */
+/*   1      don't care             KB_OUT_xxx the n bytes are in              */
+/*   2..n+1 don't care             queued bytes, oldest first                 */
+/*                                                                            */
+/* and ask for that format. The firmware switches once the queue is empty, so */
+/* queued bytes are never of mixed format; the master keeps draining with the */
+/* new opcode until byte 1 shows the format it asked for. In KB_OUT_UTF8 a    */
+/* character is never split by a drop, but one can straddle two               */
+/* transactions when more than HOST_BURST_MAX bytes are queued.               */
+/*                                                                            */
+/* HOST_OP_LAYOUT picks the keyboard layout (KB_LAYOUT_xxx, layouts.h):       */
+/*                                                                            */
+/*   byte   master -> slave        slave -> master                            */
+/*   0      opcode                 length n, not drained                      */
+/*   1      layout wanted          layout in use                              */
+/*                                                                            */
+/* An unknown layout changes nothing, so 0xFF just reads the one in use. The  */
+/* switch happens in the main loop and applies to keys translated after it.   */
+/*                                                                            */
+/* HOST_OP_MACRO uploads one macro record (see macro.c):                      */
+/*                                                                            */
+/*   byte   master -> slave        slave -> master                            */
+/*   0      opcode                 length n, not drained                      */
+/*   1      record length m        MC_xxx status of the record before         */
+/*   2..m+1 record                 don't care                                 */
+/*                                                                            */
+/* The main loop applies the record after deselect, so its status comes back  */
+/* with the next HOST_OP_MACRO; m = 0 only reads it. MC_BUSY means the record */
+/* before has not been applied yet and this one is ignored: send it again.    */
+/*                                                                            */
+/* HOST_OP_REPEAT sets up the typematic repeat (see typematic.c) the same     */
+/* way, with a tmConfig_t record:                                             */
+/*                                                                            */
+/*   byte   master -> slave        slave -> master                            */
+/*   0      opcode                 length n, not drained                      */
+/*   1      record length m        TM_xxx mode in use, TM_BUSY if ignored     */
+/*   2..m+1 first m bytes          don't care                                 */
+/*                                                                            */
+/* Bytes past m keep their value, so m = 1 only changes the mode, m = 6 the   */
+/* delay and period as well, and m = 0 reads the mode.                        */
+/*                                                                            */
+/* After every byte the SPI ISR loads the next one, so the master must leave  */
+/* a few microseconds between bytes. KB_FLAG drops at deselect once the queue */
+/* is empty.                                                                  */
+/*                                                                            */
+/* With HOST_NOTIFY_BYTES above 1, KB_FLAG is held back until that many bytes */
+/* are queued or HOST_NOTIFY_US have passed since the first of them, so the   */
+/* master drains a burst of typing in one transaction. Enter and Esc          */
+/* (KB_URGENT) raise it at once.                                              */
+/*----------------------------------------------------------------------------*/
+#include "hal.h"
+#include "host.h"
+#include "ps2kb.h"
+#include "ps2ms.h"
+#include "macro.h"
+#include "typematic.h"
+
+/*------------------------------------------*/
+/* Global variables                         */
+/*------------------------------------------*/
+extern queue_t xOutBuf, *pOutBuf;
+extern kbFlags_t xFlags, *pFlags;
+extern uint8_t kbOutMode;
+extern volatile uint8_t kbOutReq;
+extern uint8_t kbLayout;
+extern volatile uint8_t kbLayoutReq;
+
+volatile hostStates_t hostState;                                                //Transaction state
+volatile uint8_t burstLen;                                                      //Length byte currently loaded for byte 0
+volatile uint8_t burstLeft;                                                     //Bytes still to load this transaction
+uint8_t  notifyPending;                                                         //Bytes queued, KB_FLAG held back
+uint32_t notifyFirst;                                                           //Timebase when the first of them was seen
+
+//Record being shifted out
+union{
+   kbDiag_t     diag;
+   kbKeyState_t keys;
+#if PS2_MOUSE
+   msReport_t   mouse;
+#endif
+}xRec;
+uint8_t recLen;
+uint8_t recIdx;
+
+/*------------------------------------------*/
+/* Load the length byte for the next        */
+/* transaction. Only called while the       */
+/* master is not selecting us               */
+/*------------------------------------------*/
+static void hostPreload(void){
+
+   uint16_t n = qCount(pOutBuf);
+
+   if(n > HOST_BURST_MAX)
+      n = HOST_BURST_MAX;
+   burstLen = n;
+   HAL_SPI_FLUSH();                                                             //Throw away the stale length
+   HAL_SPI_WRITE(n);
+}
+
+void hostInitialize(void){
+
+   //Init notification pin
+   KB_FLAG_A = 1;                                                               //Set flag pin to digital
+   KB_FLAG_T = 0;                                                               //Set to output
+   KB_FLAG_L = 0;                                                               //Set low; Active high
+
+   hostState = HOST_IDLE;
+   halSpiSetup();
+   hostPreload();
+}
+
+/*------------------------------------------*/
+/* Main loop: tell the master there is data */
+/*------------------------------------------*/
+void hostService(void){
+
+   uint16_t n;
+
+   if(KB_FLAG_L){                                                               //Already notified, the master drains it all
+      pFlags->urgent = 0;
+      return;
+   }
+   n = qCount(pOutBuf);
+   if(!n){                                                                      //Nothing to say
+      notifyPending = 0;
+      return;
+   }
+
+#if HOST_NOTIFY_BYTES > 1
+   if(!notifyPending){
+      notifyPending = 1;
+      notifyFirst = halNow();
+   }
+   if(n < HOST_NOTIFY_BYTES && !pFlags->urgent &&                               //Wait for more?
+      halNow() - notifyFirst < HAL_US_TICKS(HOST_NOTIFY_US))
+      return;
+#endif
+
+   HAL_LINK_LOCK();                                                             //A select now waits until the preload is done
+   if(hostState == HOST_IDLE && HAL_SS_P){                                      //Only touch SPI1BUF while deselected
+      hostPreload();
+      KB_FLAG_L = 1;                                                            //Notify the host
+      notifyPending = 0;
+      pFlags->urgent = 0;
+   }
+   HAL_LINK_UNLOCK();
+}
+
+/*------------------------------------------*/
+/* Bytes queued that the master has not     */
+/* been told about. While it is selecting   */
+/* us the deselect (CN) wakes the CPU. With */
+/* HOST_NOTIFY_BYTES the main loop stays up */
+/* for the moderation time                  */
+/*------------------------------------------*/
+uint8_t hostBusy(void){
+   return qCount(pOutBuf) && !KB_FLAG_L && HAL_SS_P;
+}
+
+/*------------------------------------------*/
+/* SPI1 ISR, once per byte from the master  */
+/*------------------------------------------*/
+void HAL_ISR _SPI1Interrupt(void)
+{
+   uint8_t rx = HAL_SPI_READ();
+   uint8_t tx = 0x00;
+
+   HAL_SPI_CLEAR();
+
+   if(hostState == HOST_OPCODE){                                                //First byte is the opcode
+      if(rx == HOST_OP_READ){
+         burstLeft = burstLen;
+         hostState = HOST_BURST;
+      }
+      else if(rx == HOST_OP_ASCII || rx == HOST_OP_EVENTS || rx == HOST_OP_UTF8){
+         kbOutReq = rx == HOST_OP_EVENTS ? KB_OUT_EVENTS :                      //kbOutService() switches once drained
+                    rx == HOST_OP_UTF8 ? KB_OUT_UTF8 : KB_OUT_ASCII;
+         burstLeft = burstLen;
+         hostState = HOST_BURST;
+         HAL_SPI_WRITE(kbOutMode);                                              //Format byte goes first
+         return;
+      }
+      else if(rx == HOST_OP_LAYOUT){
+         hostState = HOST_ARG;
+         HAL_SPI_WRITE(kbLayout);                                               //Goes out while the argument comes in
+         return;
+      }
+      else if(rx == HOST_OP_MACRO){
+         tx = mcRxStart();
+         hostState = tx == MC_BUSY ? HOST_DONE : HOST_UPLOAD;
+         HAL_SPI_WRITE(tx);                                                     //Status goes out while the record length comes in
+         return;
+      }
+      else if(rx == HOST_OP_REPEAT){
+         tx = tmRxStart();
+         hostState = tx & TM_BUSY ? HOST_DONE : HOST_REPEAT;
+         HAL_SPI_WRITE(tx);
+         return;
+      }
+      else if(rx == HOST_OP_DIAG || rx == HOST_OP_KEYS || (PS2_MOUSE && rx == HOST_OP_MOUSE)){
+         if(rx == HOST_OP_DIAG){
+            kbDiagRead(&xRec.diag);
+            recLen = sizeof(xRec.diag);
+         }
+         else if(rx == HOST_OP_KEYS){
+            kbKeysRead(&xRec.keys);
+            recLen = sizeof(xRec.keys);
+         }
+#if PS2_MOUSE
+         else{
+            msRead(&xRec.mouse);
+            recLen = sizeof(xRec.mouse);
+         }
+#endif
+         recIdx = 0;
+         hostState = HOST_RECORD;
+         HAL_SPI_WRITE(recLen);                                                 //Record length goes first
+         return;
+      }
+      else
+         hostState = HOST_DONE;
+   }
+
+   if(hostState == HOST_ARG){                                                   //Layout wanted, kbOutService() applies it
+      kbLayoutReq = rx;
+      hostState = HOST_DONE;
+   }
+   else if(hostState == HOST_UPLOAD){                                           //Record byte, mcService() applies the record
+      if(!mcRx(rx))
+         hostState = HOST_DONE;
+   }
+   else if(hostState == HOST_REPEAT){                                           //tmService() applies the record
+      if(!tmRx(rx))
+         hostState = HOST_DONE;
+   }
+   else if(hostState == HOST_BURST && burstLeft){                               //Load the next queued byte
+      qGet(pOutBuf,&tx);
+      burstLeft--;
+   }
+   else if(hostState == HOST_RECORD && recIdx < recLen)
+      tx = ((uint8_t *)&xRec)[recIdx++];
+
+   HAL_SPI_WRITE(tx);
+   return;
+}
+
+/*------------------------------------------*/
+/* Change notification ISR, SS1 edges       */
+/*------------------------------------------*/
+void HAL_ISR _CNInterrupt(void)
+{
+   HAL_CN_CLEAR();
+
+   if(!HAL_SS_P){                                                               //Selected, a transaction starts
+      hostState = HOST_OPCODE;
+      return;
+   }
+
+   hostState = HOST_IDLE;                                                       //Deselected
+   hostPreload();
+   if(!qCount(pOutBuf))                                                         //All drained?
+      KB_FLAG_L = 0;                                                            //Yes.. drop the notification
+   return;
+}
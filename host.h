@@ -0,0 +1,58 @@
+/*
+ * File:   host.h
+ */
+
+#ifndef HOST_H
+#define	HOST_H
+
+#include <stdint.h>
+
+/*----------------------------------------------------*/
+/* Defines                                            */
+/*----------------------------------------------------*/
+#define HOST_BURST_MAX  255                                                     //Most queued bytes handed over per transaction
+
+//Notify moderation: KB_FLAG goes up once HOST_NOTIFY_BYTES are queued, or
+//HOST_NOTIFY_US after the first of them, or at once for a KB_URGENT character
+#ifndef HOST_NOTIFY_BYTES
+#define HOST_NOTIFY_BYTES 1                                                     //1 = notify on every byte, no moderation
+#endif
+#ifndef HOST_NOTIFY_US
+#define HOST_NOTIFY_US  0
+#endif
+
+//Opcodes, first byte the master clocks in
+#define HOST_OP_NOP     0x00                                                    //Only read the length byte
+#define HOST_OP_READ    0x01                                                    //Drain: length byte, then that many queued bytes
+#define HOST_OP_DIAG    0x02                                                    //Diagnostics: record length, then the kbDiag_t record
+#define HOST_OP_KEYS    0x03                                                    //Key state: record length, then the kbKeyState_t record
+#define HOST_OP_ASCII   0x04                                                    //Drain like READ with the format byte first, ask for KB_OUT_ASCII
+#define HOST_OP_EVENTS  0x05                                                    //Same, ask for KB_OUT_EVENTS
+#define HOST_OP_MOUSE   0x06                                                    //Mouse: record length, then the oldest msReport_t (PS2_MOUSE)
+#define HOST_OP_LAYOUT  0x07                                                    //Keyboard layout: byte 1 in is the one wanted, out is the one in use
+#define HOST_OP_UTF8    0x08                                                    //Same as HOST_OP_ASCII, ask for KB_OUT_UTF8
+#define HOST_OP_MACRO   0x09                                                    //Macro upload: byte 1 in is the record length, out the MC_xxx status
+#define HOST_OP_REPEAT  0x0A                                                    //Typematic settings: byte 1 in is the record length, out the TM_xxx mode
+
+/*----------------------------------------------------*/
+/* Enumerations                                       */
+/*----------------------------------------------------*/
+typedef enum{
+    HOST_IDLE,                                                                  //Not selected
+    HOST_OPCODE,                                                                //Selected, waiting for the opcode
+    HOST_BURST,                                                                 //Shifting out queued bytes
+    HOST_RECORD,                                                                //Shifting out a record (HOST_OP_DIAG, HOST_OP_KEYS, HOST_OP_MOUSE)
+    HOST_ARG,                                                                   //Waiting for the argument byte (HOST_OP_LAYOUT)
+    HOST_UPLOAD,                                                                //Taking a record in (HOST_OP_MACRO)
+    HOST_REPEAT,                                                                //Taking a record in (HOST_OP_REPEAT)
+    HOST_DONE                                                                   //Nothing more to send this transaction
+}hostStates_t;
+
+/*----------------------------------------------------*/
+/* Function declarations                              */
+/*----------------------------------------------------*/
+void            hostInitialize(void);                                           //SPI1 slave and notify pin
+uint8_t         hostBusy(void);                                                 //Bytes queued, notify not raised yet
+void            hostService(void);                                              //Main loop: raise notify when there is data
+
+#endif	/* HOST_H */
@@ -0,0 +1,190 @@
+/*----------------------------------------------------------------------------*/
+/* Keyboard command scheduler                                                 */
+/*                                                                            */
+/* Commands are queued and sent one byte at a time, the argument only after   */
+/* the keyboard has ACKed the command byte. Every received byte is offered to */
+/* kbCmdReply() before the decoder: ACK, RESEND and ECHO (and the reply bytes */
+/* of DEVID, the scan code set query and RESET) are matched to the command    */
+/* outstanding, anything else is a keystroke and goes on to the decoder, so   */
+/* typing keeps flowing while commands are in flight.                         */
+/*                                                                            */
+/* A 0xFE, a failed transmit or no reply within the timeout sends the current */
+/* byte again, up to KB_CMD_RETRIES times, then the command is dropped with   */
+/* an error and the next one starts.                                          */
+/*                                                                            */
+/* Every port has its own scheduler in its ps2Port_t, so commands to the      */
+/* keyboard and to a device on the second port run side by side.              */
+/*----------------------------------------------------------------------------*/
+#include "hal.h"
+#include "ps2kb.h"
+#include "ps2port.h"
+#include <string.h>                                                             //For memset()
+
+void kbCmdInitialize(ps2Port_t *p){
+   memset(&p->cmd,0x00,sizeof(p->cmd));
+}
+
+uint8_t kbCmdQueue(ps2Port_t *p, uint8_t cmd, uint8_t arg){
+
+   kbCmdEngine_t *pCmd = &p->cmd;
+   kbCmd_t *c;
+
+   if((uint8_t)(pCmd->head - pCmd->tail) >= KB_CMDQ){                           //No room?
+      pCmd->last.cmd = cmd;
+      pCmd->last.arg = arg;
+      pCmd->last.result = CMDR_FULL;
+      pCmd->failures++;
+      ps2Error(p,ERR_CMD_FAIL);
+      return 0;
+   }
+   c = &pCmd->queue[pCmd->head & (KB_CMDQ - 1)];
+   c->cmd = cmd;
+   c->arg = arg;
+   pCmd->head++;
+   return 1;
+}
+
+uint8_t kbCmdBusy(ps2Port_t *p){
+
+   kbCmdEngine_t *pCmd = &p->cmd;
+
+   return pCmd->state != CMD_IDLE || pCmd->head != pCmd->tail;
+}
+
+/*------------------------------------------*/
+/* Bytes the device sends after the ACK     */
+/*------------------------------------------*/
+static uint8_t kbCmdReplies(const kbCmdEngine_t *pCmd, const kbCmd_t *c){
+   switch(c->cmd){
+      case CMD_DEVID:    return pCmd->mouse ? 1 : 2;                            //0xAB 0x83, a mouse 0x00 or 0x03
+      case CMD_CODE_SET: return pCmd->mouse ? 0 : c->arg == 0x00 ? 1 : 0;       //Current set on a query, a mouse takes F0 as remote mode
+      case CMD_RESET:    return pCmd->mouse ? 2 : 1;                            //BAT result, then a mouse's ID
+      default:           return 0;
+   }
+}
+
+static void kbCmdWait(ps2Port_t *p, uint8_t state, uint32_t us){
+
+   kbCmdEngine_t *pCmd = &p->cmd;
+
+   pCmd->state = state;
+   pCmd->sentAt = halNow();
+   pCmd->timeout = HAL_US_TICKS(us);
+}
+
+/*------------------------------------------*/
+/* Put the current byte on the wire         */
+/*------------------------------------------*/
+static void kbCmdSend(ps2Port_t *p){
+
+   kbCmdEngine_t *pCmd = &p->cmd;
+   kbCmd_t *c = &pCmd->queue[pCmd->tail & (KB_CMDQ - 1)];
+   uint8_t argStage = pCmd->state == CMD_WAIT_ARG_ACK;
+
+   ps2SendCmd(p, argStage ? c->arg : c->cmd, NO_ARGS);                          //Transmitter is ours, never busy here
+   kbCmdWait(p, argStage ? CMD_WAIT_ARG_ACK : CMD_WAIT_ACK, KB_CMD_TIMEOUT_US);
+}
+
+static void kbCmdFinish(ps2Port_t *p, uint8_t result){
+
+   kbCmdEngine_t *pCmd = &p->cmd;
+   kbCmd_t *c = &pCmd->queue[pCmd->tail & (KB_CMDQ - 1)];
+
+   pCmd->last.cmd = c->cmd;
+   pCmd->last.arg = c->arg;
+   pCmd->last.result = result;
+   pCmd->tail++;
+   pCmd->state = CMD_IDLE;
+
+   if(result != CMDR_OK){
+      pCmd->failures++;
+      ps2Error(p,(c->cmd == CMD_SET_LED) ? ERR_LCK_NOACK : ERR_CMD_FAIL);
+   }
+}
+
+/*------------------------------------------*/
+/* Send the current byte again or give up   */
+/*------------------------------------------*/
+static void kbCmdRetry(ps2Port_t *p, uint8_t result){
+
+   kbCmdEngine_t *pCmd = &p->cmd;
+
+   if(++pCmd->tries > KB_CMD_RETRIES){
+      kbCmdFinish(p, result);
+      return;
+   }
+   if(pCmd->state == CMD_WAIT_REPLY)                                            //Lost reply bytes, start the command over
+      pCmd->state = CMD_WAIT_ACK;
+   kbCmdSend(p);
+}
+
+uint8_t kbCmdReply(ps2Port_t *p, uint8_t code){
+
+   kbCmdEngine_t *pCmd = &p->cmd;
+   kbCmd_t *c = &pCmd->queue[pCmd->tail & (KB_CMDQ - 1)];
+
+   switch(pCmd->state){
+      case CMD_WAIT_ACK:
+      case CMD_WAIT_ARG_ACK:
+         if(code == KB_RSND){                                                   //Keyboard wants the byte again
+            pCmd->resends++;
+            kbCmdRetry(p, CMDR_RESEND);
+            return 1;
+         }
+         if(code == KB_ECHO && c->cmd == CMD_ECHO){                             //Echo answers with itself
+            kbCmdFinish(p, CMDR_OK);
+            return 1;
+         }
+         if(code != KB_ACK)                                                     //Keystroke, not for us
+            return 0;
+
+         pCmd->tries = 0;
+         if(pCmd->state == CMD_WAIT_ACK && c->arg != NO_ARGS){                  //Argument next
+            pCmd->state = CMD_WAIT_ARG_ACK;
+            kbCmdSend(p);
+            return 1;
+         }
+         pCmd->last.nReply = 0;
+         pCmd->replyLeft = kbCmdReplies(pCmd, c);
+         if(pCmd->replyLeft)
+            kbCmdWait(p, CMD_WAIT_REPLY, c->cmd == CMD_RESET ? KB_BAT_TIMEOUT_US : KB_CMD_TIMEOUT_US);
+         else
+            kbCmdFinish(p, CMDR_OK);
+         return 1;
+
+      case CMD_WAIT_REPLY:
+         pCmd->last.reply[pCmd->last.nReply++] = code;
+         if(--pCmd->replyLeft == 0)
+            kbCmdFinish(p, CMDR_OK);
+         return 1;
+
+      default:
+         return 0;
+   }
+}
+
+void kbCmdService(ps2Port_t *p){
+
+   kbCmdEngine_t *pCmd = &p->cmd;
+
+   if(pCmd->state == CMD_IDLE){
+      if(pCmd->head == pCmd->tail || ps2TxBusy(p))                              //Nothing to do
+         return;
+      pCmd->tries = 0;
+      pCmd->state = CMD_WAIT_ACK;
+      kbCmdSend(p);
+      return;
+   }
+
+   if(ps2TxBusy(p))                                                             //Byte still on the wire
+      return;
+   if(p->txStatus == TX_NOACK || p->txStatus == TX_TIMEOUT){                    //Never made it out
+      p->txStatus = TX_IDLE;
+      kbCmdRetry(p, CMDR_TIMEOUT);
+      return;
+   }
+   if(halNow() - pCmd->sentAt > pCmd->timeout){
+      pCmd->timeouts++;
+      kbCmdRetry(p, CMDR_TIMEOUT);
+   }
+}
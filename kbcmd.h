@@ -0,0 +1,78 @@
+/*
+ * File:   kbcmd.h
+ */
+
+#ifndef KBCMD_H
+#define	KBCMD_H
+
+#include <stdint.h>
+
+/*----------------------------------------------------*/
+/* Defines                                            */
+/*----------------------------------------------------*/
+#define KB_CMDQ             8                                                   //Queued commands, must be a power of two
+#define KB_CMD_RETRIES      3                                                   //Resends after the first attempt
+#define KB_CMD_TIMEOUT_US   20000                                               //Device reply time per byte
+#define KB_BAT_TIMEOUT_US   1000000                                             //Reset to BAT result
+
+/*----------------------------------------------------*/
+/* Enumerations                                       */
+/*----------------------------------------------------*/
+typedef enum{
+    CMD_IDLE,                                                                   //Nothing outstanding
+    CMD_WAIT_ACK,                                                               //Command byte sent
+    CMD_WAIT_ARG_ACK,                                                           //Argument byte sent
+    CMD_WAIT_REPLY                                                              //ACKed, collecting reply bytes (ID, scan code set, BAT)
+}kbCmdStates_t;
+
+typedef enum{
+    CMDR_NONE,                                                                  //Nothing finished yet
+    CMDR_OK,
+    CMDR_RESEND,                                                                //Still 0xFE after all retries
+    CMDR_TIMEOUT,                                                               //No reply after all retries
+    CMDR_FULL                                                                   //Queue full, never sent
+}kbCmdResults_t;
+
+/*----------------------------------------------------*/
+/* Structures                                         */
+/*----------------------------------------------------*/
+typedef struct{
+    uint8_t cmd;
+    uint8_t arg;                                                                //NO_ARGS if none
+}kbCmd_t;
+
+typedef struct{                                                                 //Last command to finish
+    uint8_t cmd;
+    uint8_t arg;
+    uint8_t result;                                                             //kbCmdResults_t
+    uint8_t nReply;
+    uint8_t reply[2];                                                           //Bytes after the ACK
+}kbCmdDone_t;
+
+typedef struct{
+    kbCmd_t queue[KB_CMDQ];
+    uint8_t head, tail;                                                         //Free running, main loop only
+    uint8_t state;                                                              //kbCmdStates_t
+    uint8_t tries;                                                              //Attempts at the current byte
+    uint8_t replyLeft;
+    uint32_t sentAt;                                                            //halNow() when the wait started
+    uint32_t timeout;                                                           //Ticks allowed for this wait
+    kbCmdDone_t last;
+    uint8_t mouse;                                                              //Device is a mouse: one ID byte, also sent after BAT
+    uint16_t resends;                                                           //Statistics
+    uint16_t timeouts;
+    uint16_t failures;
+}kbCmdEngine_t;
+
+/*----------------------------------------------------*/
+/* Function declarations                              */
+/*----------------------------------------------------*/
+struct ps2Port;                                                                 //Each port runs its own scheduler, see ps2port.h
+
+void            kbCmdInitialize(struct ps2Port *);
+uint8_t         kbCmdQueue(struct ps2Port *, uint8_t, uint8_t);                 //Queue a command and argument, 0 = queue full
+uint8_t         kbCmdBusy(struct ps2Port *);                                    //Commands outstanding or queued
+uint8_t         kbCmdReply(struct ps2Port *, uint8_t);                          //Offer a received byte, 1 = it was the reply
+void            kbCmdService(struct ps2Port *);                                 //Main loop: start commands, time them out
+
+#endif	/* KBCMD_H */
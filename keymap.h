@@ -0,0 +1,164 @@
+/*
+ * File:   keymap.h
+ *
+ * Scan code set 2 key descriptor table. Every key the decoder knows is one
+ * KEY() line; the keycode enum and the translate table in ps2kb.c are both
+ * generated from it, so a key is added or changed in exactly one place.
+ *
+ *   KEY(name, keycode, kind, plain, shifted)
+ *
+ * keycode  Single byte make code, or 0x80 | code for E0 prefixed keys. F7
+ *          (0x83) is folded onto the unused 0x02 and Pause (E1 ...) onto
+ *          the unused 0x80 so every key fits in one byte.
+ * kind     KC_CHAR  plain/shifted characters, caps lock shifts letters
+ *          KC_LAYOUT plain is the key's slot (SL_xxx) in the layout tables
+ *                   built from layouts.h, the host picks the layout
+ *          KC_PAD   keypad, plain with num lock on, shifted with it off
+ *          KC_FUNC  plain is a private code (0x80-0x9F) or control char
+ *          KC_MOD   plain is the modifier bit (KM_xxx)
+ *          KC_LOCK  plain is the lock (LK_xxx), toggles on release
+ *          KC_NONE  known key, nothing to post
+ */
+
+#ifndef KEYMAP_H
+#define	KEYMAP_H
+
+#define KEYMAP(KEY) \
+    /* Function row */ \
+    KEY(ESC,      0x76, KC_FUNC, ESC,      ESC)      \
+    KEY(F1,       0x05, KC_FUNC, F1,       F1)       \
+    KEY(F2,       0x06, KC_FUNC, F2,       F2)       \
+    KEY(F3,       0x04, KC_FUNC, F3,       F3)       \
+    KEY(F4,       0x0C, KC_FUNC, F4,       F4)       \
+    KEY(F5,       0x03, KC_FUNC, F5,       F5)       \
+    KEY(F6,       0x0B, KC_FUNC, F6,       F6)       \
+    KEY(F7,       0x02, KC_FUNC, F7,       F7)       \
+    KEY(F8,       0x0A, KC_FUNC, F8,       F8)       \
+    KEY(F9,       0x01, KC_FUNC, F9,       F9)       \
+    KEY(F10,      0x09, KC_FUNC, F10,      F10)      \
+    KEY(F11,      0x78, KC_FUNC, F11,      F11)      \
+    KEY(F12,      0x07, KC_FUNC, F12,      F12)      \
+    KEY(PRTSC,    0xFC, KC_FUNC, PRT_SCR,  PRT_SCR)  \
+    KEY(SCROLL,   0x7E, KC_LOCK, LK_SCROLL,0)        \
+    KEY(PAUSE,    0x80, KC_FUNC, PAUSE,    PAUSE)    \
+    KEY(BREAK,    0xFE, KC_FUNC, PAUSE,    PAUSE)    /* Ctrl+Pause */ \
+    /* Number row */ \
+    KEY(GRAVE,    0x0E, KC_LAYOUT, SL_GRAVE,    0) \
+    KEY(1,        0x16, KC_LAYOUT, SL_1,        0) \
+    KEY(2,        0x1E, KC_LAYOUT, SL_2,        0) \
+    KEY(3,        0x26, KC_LAYOUT, SL_3,        0) \
+    KEY(4,        0x25, KC_LAYOUT, SL_4,        0) \
+    KEY(5,        0x2E, KC_LAYOUT, SL_5,        0) \
+    KEY(6,        0x36, KC_LAYOUT, SL_6,        0) \
+    KEY(7,        0x3D, KC_LAYOUT, SL_7,        0) \
+    KEY(8,        0x3E, KC_LAYOUT, SL_8,        0) \
+    KEY(9,        0x46, KC_LAYOUT, SL_9,        0) \
+    KEY(0,        0x45, KC_LAYOUT, SL_0,        0) \
+    KEY(MINUS,    0x4E, KC_LAYOUT, SL_MINUS,    0) \
+    KEY(EQUAL,    0x55, KC_LAYOUT, SL_EQUAL,    0) \
+    KEY(BKSP,     0x66, KC_FUNC, BKSP,     BKSP)     \
+    /* Top row */ \
+    KEY(TAB,      0x0D, KC_FUNC, TAB,      TAB)      \
+    KEY(Q,        0x15, KC_LAYOUT, SL_Q,        0) \
+    KEY(W,        0x1D, KC_LAYOUT, SL_W,        0) \
+    KEY(E,        0x24, KC_LAYOUT, SL_E,        0) \
+    KEY(R,        0x2D, KC_LAYOUT, SL_R,        0) \
+    KEY(T,        0x2C, KC_LAYOUT, SL_T,        0) \
+    KEY(Y,        0x35, KC_LAYOUT, SL_Y,        0) \
+    KEY(U,        0x3C, KC_LAYOUT, SL_U,        0) \
+    KEY(I,        0x43, KC_LAYOUT, SL_I,        0) \
+    KEY(O,        0x44, KC_LAYOUT, SL_O,        0) \
+    KEY(P,        0x4D, KC_LAYOUT, SL_P,        0) \
+    KEY(LBRACKET, 0x54, KC_LAYOUT, SL_LBRACKET, 0) \
+    KEY(RBRACKET, 0x5B, KC_LAYOUT, SL_RBRACKET, 0) \
+    KEY(BSLASH,   0x5D, KC_LAYOUT, SL_BSLASH,   0) \
+    /* Home row */ \
+    KEY(CAPS,     0x58, KC_LOCK, LK_CAPS,  0)        \
+    KEY(A,        0x1C, KC_LAYOUT, SL_A,        0) \
+    KEY(S,        0x1B, KC_LAYOUT, SL_S,        0) \
+    KEY(D,        0x23, KC_LAYOUT, SL_D,        0) \
+    KEY(F,        0x2B, KC_LAYOUT, SL_F,        0) \
+    KEY(G,        0x34, KC_LAYOUT, SL_G,        0) \
+    KEY(H,        0x33, KC_LAYOUT, SL_H,        0) \
+    KEY(J,        0x3B, KC_LAYOUT, SL_J,        0) \
+    KEY(K,        0x42, KC_LAYOUT, SL_K,        0) \
+    KEY(L,        0x4B, KC_LAYOUT, SL_L,        0) \
+    KEY(SEMI,     0x4C, KC_LAYOUT, SL_SEMI,     0) \
+    KEY(QUOTE,    0x52, KC_LAYOUT, SL_QUOTE,    0) \
+    KEY(ENTER,    0x5A, KC_FUNC, ENTER,    ENTER)    \
+    /* Bottom row */ \
+    KEY(LSHIFT,   0x12, KC_MOD,  KM_LSHIFT,0)        \
+    KEY(ISO,      0x61, KC_LAYOUT, SL_ISO,      0) /* 102nd key */ \
+    KEY(Z,        0x1A, KC_LAYOUT, SL_Z,        0) \
+    KEY(X,        0x22, KC_LAYOUT, SL_X,        0) \
+    KEY(C,        0x21, KC_LAYOUT, SL_C,        0) \
+    KEY(V,        0x2A, KC_LAYOUT, SL_V,        0) \
+    KEY(B,        0x32, KC_LAYOUT, SL_B,        0) \
+    KEY(N,        0x31, KC_LAYOUT, SL_N,        0) \
+    KEY(M,        0x3A, KC_LAYOUT, SL_M,        0) \
+    KEY(COMMA,    0x41, KC_LAYOUT, SL_COMMA,    0) \
+    KEY(PERIOD,   0x49, KC_LAYOUT, SL_PERIOD,   0) \
+    KEY(SLASH,    0x4A, KC_LAYOUT, SL_SLASH,    0) \
+    KEY(RSHIFT,   0x59, KC_MOD,  KM_RSHIFT,0)        \
+    /* Space row */ \
+    KEY(LCTRL,    0x14, KC_MOD,  KM_LCTRL, 0)        \
+    KEY(LGUI,     0x9F, KC_MOD,  KM_LGUI,  0)        \
+    KEY(LALT,     0x11, KC_MOD,  KM_LALT,  0)        \
+    KEY(SPACE,    0x29, KC_CHAR, ' ',      ' ')      \
+    KEY(RALT,     0x91, KC_MOD,  KM_RALT,  0)        \
+    KEY(RGUI,     0xA7, KC_MOD,  KM_RGUI,  0)        \
+    KEY(APPS,     0xAF, KC_FUNC, APPS,     APPS)     \
+    KEY(RCTRL,    0x94, KC_MOD,  KM_RCTRL, 0)        \
+    /* Navigation block */ \
+    KEY(INSERT,   0xF0, KC_FUNC, INSERT,   INSERT)   \
+    KEY(HOME,     0xEC, KC_FUNC, HOME,     HOME)     \
+    KEY(PGUP,     0xFD, KC_FUNC, PG_UP,    PG_UP)    \
+    KEY(DELETE,   0xF1, KC_FUNC, DEL,      DEL)      \
+    KEY(END,      0xE9, KC_FUNC, END,      END)      \
+    KEY(PGDN,     0xFA, KC_FUNC, PG_DN,    PG_DN)    \
+    KEY(UP,       0xF5, KC_FUNC, ARROW_UP, ARROW_UP) \
+    KEY(LEFT,     0xEB, KC_FUNC, ARROW_LT, ARROW_LT) \
+    KEY(DOWN,     0xF2, KC_FUNC, ARROW_DN, ARROW_DN) \
+    KEY(RIGHT,    0xF4, KC_FUNC, ARROW_RT, ARROW_RT) \
+    /* Keypad */ \
+    KEY(NUM,      0x77, KC_LOCK, LK_NUM,   0)        \
+    KEY(KP_SLASH, 0xCA, KC_CHAR, '/',      '/')      \
+    KEY(KP_STAR,  0x7C, KC_CHAR, '*',      '*')      \
+    KEY(KP_MINUS, 0x7B, KC_CHAR, '-',      '-')      \
+    KEY(KP_PLUS,  0x79, KC_CHAR, '+',      '+')      \
+    KEY(KP_ENTER, 0xDA, KC_FUNC, ENTER,    ENTER)    \
+    KEY(KP_1,     0x69, KC_PAD,  '1',      END)      \
+    KEY(KP_2,     0x72, KC_PAD,  '2',      ARROW_DN) \
+    KEY(KP_3,     0x7A, KC_PAD,  '3',      PG_DN)    \
+    KEY(KP_4,     0x6B, KC_PAD,  '4',      ARROW_LT) \
+    KEY(KP_5,     0x73, KC_PAD,  '5',      0)        \
+    KEY(KP_6,     0x74, KC_PAD,  '6',      ARROW_RT) \
+    KEY(KP_7,     0x6C, KC_PAD,  '7',      HOME)     \
+    KEY(KP_8,     0x75, KC_PAD,  '8',      ARROW_UP) \
+    KEY(KP_9,     0x7D, KC_PAD,  '9',      PG_UP)    \
+    KEY(KP_0,     0x70, KC_PAD,  '0',      INSERT)   \
+    KEY(KP_DOT,   0x71, KC_PAD,  '.',      DEL)      \
+    /* ACPI and multimedia (E0 prefixed) */ \
+    KEY(POWER,    0xB7, KC_FUNC, POWER,    POWER)    \
+    KEY(SLEEP,    0xBF, KC_FUNC, SLEEP,    SLEEP)    \
+    KEY(WAKE,     0xDE, KC_FUNC, WAKE,     WAKE)     \
+    KEY(NEXT,     0xCD, KC_NONE, 0,        0)        \
+    KEY(PREV,     0x95, KC_NONE, 0,        0)        \
+    KEY(STOP,     0xBB, KC_NONE, 0,        0)        \
+    KEY(PLAY,     0xB4, KC_NONE, 0,        0)        \
+    KEY(MUTE,     0xA3, KC_NONE, 0,        0)        \
+    KEY(VOL_UP,   0xB2, KC_NONE, 0,        0)        \
+    KEY(VOL_DN,   0xA1, KC_NONE, 0,        0)        \
+    KEY(MEDIA,    0xD0, KC_NONE, 0,        0)        \
+    KEY(MAIL,     0xC8, KC_NONE, 0,        0)        \
+    KEY(CALC,     0xAB, KC_NONE, 0,        0)        \
+    KEY(MY_PC,    0xC0, KC_NONE, 0,        0)        \
+    KEY(WWW_SRCH, 0x90, KC_NONE, 0,        0)        \
+    KEY(WWW_HOME, 0xBA, KC_NONE, 0,        0)        \
+    KEY(WWW_BACK, 0xB8, KC_NONE, 0,        0)        \
+    KEY(WWW_FWD,  0xB0, KC_NONE, 0,        0)        \
+    KEY(WWW_STOP, 0xA8, KC_NONE, 0,        0)        \
+    KEY(WWW_RFSH, 0xA0, KC_NONE, 0,        0)        \
+    KEY(WWW_FAV,  0x98, KC_NONE, 0,        0)
+
+#endif	/* KEYMAP_H */
@@ -0,0 +1,312 @@
+/*
+ * File:   layouts.h
+ *
+ * Keyboard layouts. The keys whose characters depend on the layout (the 48
+ * KC_LAYOUT keys of the main block in keymap.h) are numbered by the order of
+ * LAYOUT_US; every layout is one line per key of the same form,
+ *
+ *   SLOT(key, plain, shifted, altgr, caps)
+ *
+ * and ps2kb.c builds a packed table per layout from them at compile time:
+ * three characters per key plus a caps lock bitmask. A layout may list its
+ * keys in any order, keys it leaves out produce nothing.
+ *
+ * Characters are Latin-1, plus CH_EURO for the euro sign. 0 means the
+ * combination produces nothing; for altgr it means AltGr is ignored and the
+ * key acts as without it. DK_xxx (0x01-0x05) is a dead key: it produces
+ * nothing by itself and accents the next character (KB_COMPOSE), or posts
+ * its spacing form if there is no accented version. caps 1 means caps lock
+ * selects the shifted character.
+ */
+
+#ifndef LAYOUTS_H
+#define	LAYOUTS_H
+
+//Layouts the master can select with HOST_OP_LAYOUT, in KB_LAYOUT_xxx order
+#define LAYOUTS(L) L(US) L(UK) L(DE) L(FR)
+
+//Dead keys, also the accent argument of KB_COMPOSE
+#define DK_GRAVE    0x01
+#define DK_ACUTE    0x02
+#define DK_CIRC     0x03
+#define DK_DIAER    0x04
+#define DK_TILDE    0x05
+#define DK_LAST     DK_TILDE
+
+//Euro sign. Not Latin-1: 0x80 as in Windows-1252 in KB_OUT_ASCII, U+20AC in
+//KB_OUT_UTF8. The private codes of ps2kb.h start above it
+#define CH_EURO     0x80
+
+//Latin-1 characters used below
+#define L1_POUND    0xA3
+#define L1_CURRENCY 0xA4
+#define L1_BROKEN   0xA6                                                        //Broken bar
+#define L1_SECTION  0xA7
+#define L1_DIAER    0xA8                                                        //Spacing diaeresis
+#define L1_NOT      0xAC
+#define L1_DEGREE   0xB0
+#define L1_SUP2     0xB2
+#define L1_SUP3     0xB3
+#define L1_ACUTE    0xB4                                                        //Spacing acute
+#define L1_MICRO    0xB5
+#define L1_A_GRAVE  0xC0
+#define L1_A_ACUTE  0xC1
+#define L1_A_CIRC   0xC2
+#define L1_A_TILDE  0xC3
+#define L1_A_DIAER  0xC4
+#define L1_E_GRAVE  0xC8
+#define L1_E_ACUTE  0xC9
+#define L1_E_CIRC   0xCA
+#define L1_E_DIAER  0xCB
+#define L1_I_GRAVE  0xCC
+#define L1_I_ACUTE  0xCD
+#define L1_I_CIRC   0xCE
+#define L1_I_DIAER  0xCF
+#define L1_N_TILDE  0xD1
+#define L1_O_GRAVE  0xD2
+#define L1_O_ACUTE  0xD3
+#define L1_O_CIRC   0xD4
+#define L1_O_TILDE  0xD5
+#define L1_O_DIAER  0xD6
+#define L1_U_GRAVE  0xD9
+#define L1_U_ACUTE  0xDA
+#define L1_U_CIRC   0xDB
+#define L1_U_DIAER  0xDC
+#define L1_Y_ACUTE  0xDD
+#define L1_SZLIG    0xDF                                                        //Sharp s
+#define L1_LOWER    0x20                                                        //Add to a capital above for the small letter
+#define L1_Y_DIAER  0xFF                                                        //Small y diaeresis, its capital is not Latin-1
+
+#define LAYOUT_US(SLOT) \
+    SLOT(GRAVE,    '`',  '~',  0, 0) \
+    SLOT(1,        '1',  '!',  0, 0) \
+    SLOT(2,        '2',  '@',  0, 0) \
+    SLOT(3,        '3',  '#',  0, 0) \
+    SLOT(4,        '4',  '$',  0, 0) \
+    SLOT(5,        '5',  '%',  0, 0) \
+    SLOT(6,        '6',  '^',  0, 0) \
+    SLOT(7,        '7',  '&',  0, 0) \
+    SLOT(8,        '8',  '*',  0, 0) \
+    SLOT(9,        '9',  '(',  0, 0) \
+    SLOT(0,        '0',  ')',  0, 0) \
+    SLOT(MINUS,    '-',  '_',  0, 0) \
+    SLOT(EQUAL,    '=',  '+',  0, 0) \
+    SLOT(Q,        'q',  'Q',  0, 1) \
+    SLOT(W,        'w',  'W',  0, 1) \
+    SLOT(E,        'e',  'E',  0, 1) \
+    SLOT(R,        'r',  'R',  0, 1) \
+    SLOT(T,        't',  'T',  0, 1) \
+    SLOT(Y,        'y',  'Y',  0, 1) \
+    SLOT(U,        'u',  'U',  0, 1) \
+    SLOT(I,        'i',  'I',  0, 1) \
+    SLOT(O,        'o',  'O',  0, 1) \
+    SLOT(P,        'p',  'P',  0, 1) \
+    SLOT(LBRACKET, '[',  '{',  0, 0) \
+    SLOT(RBRACKET, ']',  '}',  0, 0) \
+    SLOT(BSLASH,   '\\', '|',  0, 0) \
+    SLOT(A,        'a',  'A',  0, 1) \
+    SLOT(S,        's',  'S',  0, 1) \
+    SLOT(D,        'd',  'D',  0, 1) \
+    SLOT(F,        'f',  'F',  0, 1) \
+    SLOT(G,        'g',  'G',  0, 1) \
+    SLOT(H,        'h',  'H',  0, 1) \
+    SLOT(J,        'j',  'J',  0, 1) \
+    SLOT(K,        'k',  'K',  0, 1) \
+    SLOT(L,        'l',  'L',  0, 1) \
+    SLOT(SEMI,     ';',  ':',  0, 0) \
+    SLOT(QUOTE,    '\'', '"',  0, 0) \
+    SLOT(ISO,      '\\', '|',  0, 0) /* 102nd key, left of Z */ \
+    SLOT(Z,        'z',  'Z',  0, 1) \
+    SLOT(X,        'x',  'X',  0, 1) \
+    SLOT(C,        'c',  'C',  0, 1) \
+    SLOT(V,        'v',  'V',  0, 1) \
+    SLOT(B,        'b',  'B',  0, 1) \
+    SLOT(N,        'n',  'N',  0, 1) \
+    SLOT(M,        'm',  'M',  0, 1) \
+    SLOT(COMMA,    ',',  '<',  0, 0) \
+    SLOT(PERIOD,   '.',  '>',  0, 0) \
+    SLOT(SLASH,    '/',  '?',  0, 0)
+
+#define LAYOUT_UK(SLOT) \
+    SLOT(GRAVE,    '`',  L1_NOT,      L1_BROKEN,                0) \
+    SLOT(1,        '1',  '!',         0,                        0) \
+    SLOT(2,        '2',  '"',         0,                        0) \
+    SLOT(3,        '3',  L1_POUND,    0,                        0) \
+    SLOT(4,        '4',  '$',         CH_EURO,                  0) \
+    SLOT(5,        '5',  '%',         0,                        0) \
+    SLOT(6,        '6',  '^',         0,                        0) \
+    SLOT(7,        '7',  '&',         0,                        0) \
+    SLOT(8,        '8',  '*',         0,                        0) \
+    SLOT(9,        '9',  '(',         0,                        0) \
+    SLOT(0,        '0',  ')',         0,                        0) \
+    SLOT(MINUS,    '-',  '_',         0,                        0) \
+    SLOT(EQUAL,    '=',  '+',         0,                        0) \
+    SLOT(Q,        'q',  'Q',         0,                        1) \
+    SLOT(W,        'w',  'W',         0,                        1) \
+    SLOT(E,        'e',  'E',         L1_E_ACUTE + L1_LOWER,    1) \
+    SLOT(R,        'r',  'R',         0,                        1) \
+    SLOT(T,        't',  'T',         0,                        1) \
+    SLOT(Y,        'y',  'Y',         0,                        1) \
+    SLOT(U,        'u',  'U',         L1_U_ACUTE + L1_LOWER,    1) \
+    SLOT(I,        'i',  'I',         L1_I_ACUTE + L1_LOWER,    1) \
+    SLOT(O,        'o',  'O',         L1_O_ACUTE + L1_LOWER,    1) \
+    SLOT(P,        'p',  'P',         0,                        1) \
+    SLOT(LBRACKET, '[',  '{',         0,                        0) \
+    SLOT(RBRACKET, ']',  '}',         0,                        0) \
+    SLOT(BSLASH,   '#',  '~',         0,                        0) \
+    SLOT(A,        'a',  'A',         L1_A_ACUTE + L1_LOWER,    1) \
+    SLOT(S,        's',  'S',         0,                        1) \
+    SLOT(D,        'd',  'D',         0,                        1) \
+    SLOT(F,        'f',  'F',         0,                        1) \
+    SLOT(G,        'g',  'G',         0,                        1) \
+    SLOT(H,        'h',  'H',         0,                        1) \
+    SLOT(J,        'j',  'J',         0,                        1) \
+    SLOT(K,        'k',  'K',         0,                        1) \
+    SLOT(L,        'l',  'L',         0,                        1) \
+    SLOT(SEMI,     ';',  ':',         0,                        0) \
+    SLOT(QUOTE,    '\'', '@',         0,                        0) \
+    SLOT(ISO,      '\\', '|',         0,                        0) \
+    SLOT(Z,        'z',  'Z',         0,                        1) \
+    SLOT(X,        'x',  'X',         0,                        1) \
+    SLOT(C,        'c',  'C',         0,                        1) \
+    SLOT(V,        'v',  'V',         0,                        1) \
+    SLOT(B,        'b',  'B',         0,                        1) \
+    SLOT(N,        'n',  'N',         0,                        1) \
+    SLOT(M,        'm',  'M',         0,                        1) \
+    SLOT(COMMA,    ',',  '<',         0,                        0) \
+    SLOT(PERIOD,   '.',  '>',         0,                        0) \
+    SLOT(SLASH,    '/',  '?',         0,                        0)
+
+#define LAYOUT_DE(SLOT) \
+    SLOT(GRAVE,    DK_CIRC,               L1_DEGREE,  0,        0) \
+    SLOT(1,        '1',                   '!',        0,        0) \
+    SLOT(2,        '2',                   '"',        L1_SUP2,  0) \
+    SLOT(3,        '3',                   L1_SECTION, L1_SUP3,  0) \
+    SLOT(4,        '4',                   '$',        0,        0) \
+    SLOT(5,        '5',                   '%',        0,        0) \
+    SLOT(6,        '6',                   '&',        0,        0) \
+    SLOT(7,        '7',                   '/',        '{',      0) \
+    SLOT(8,        '8',                   '(',        '[',      0) \
+    SLOT(9,        '9',                   ')',        ']',      0) \
+    SLOT(0,        '0',                   '=',        '}',      0) \
+    SLOT(MINUS,    L1_SZLIG,              '?',        '\\',     0) \
+    SLOT(EQUAL,    DK_ACUTE,              DK_GRAVE,   0,        0) \
+    SLOT(Q,        'q',                   'Q',        '@',      1) \
+    SLOT(W,        'w',                   'W',        0,        1) \
+    SLOT(E,        'e',                   'E',        CH_EURO,  1) \
+    SLOT(R,        'r',                   'R',        0,        1) \
+    SLOT(T,        't',                   'T',        0,        1) \
+    SLOT(Y,        'z',                   'Z',        0,        1) \
+    SLOT(U,        'u',                   'U',        0,        1) \
+    SLOT(I,        'i',                   'I',        0,        1) \
+    SLOT(O,        'o',                   'O',        0,        1) \
+    SLOT(P,        'p',                   'P',        0,        1) \
+    SLOT(LBRACKET, L1_U_DIAER + L1_LOWER, L1_U_DIAER, 0,        1) \
+    SLOT(RBRACKET, '+',                   '*',        '~',      0) \
+    SLOT(BSLASH,   '#',                   '\'',       0,        0) \
+    SLOT(A,        'a',                   'A',        0,        1) \
+    SLOT(S,        's',                   'S',        0,        1) \
+    SLOT(D,        'd',                   'D',        0,        1) \
+    SLOT(F,        'f',                   'F',        0,        1) \
+    SLOT(G,        'g',                   'G',        0,        1) \
+    SLOT(H,        'h',                   'H',        0,        1) \
+    SLOT(J,        'j',                   'J',        0,        1) \
+    SLOT(K,        'k',                   'K',        0,        1) \
+    SLOT(L,        'l',                   'L',        0,        1) \
+    SLOT(SEMI,     L1_O_DIAER + L1_LOWER, L1_O_DIAER, 0,        1) \
+    SLOT(QUOTE,    L1_A_DIAER + L1_LOWER, L1_A_DIAER, 0,        1) \
+    SLOT(ISO,      '<',                   '>',        '|',      0) \
+    SLOT(Z,        'y',                   'Y',        0,        1) \
+    SLOT(X,        'x',                   'X',        0,        1) \
+    SLOT(C,        'c',                   'C',        0,        1) \
+    SLOT(V,        'v',                   'V',        0,        1) \
+    SLOT(B,        'b',                   'B',        0,        1) \
+    SLOT(N,        'n',                   'N',        0,        1) \
+    SLOT(M,        'm',                   'M',        L1_MICRO, 1) \
+    SLOT(COMMA,    ',',                   ';',        0,        0) \
+    SLOT(PERIOD,   '.',                   ':',        0,        0) \
+    SLOT(SLASH,    '-',                   '_',        0,        0)
+
+#define LAYOUT_FR(SLOT) \
+    SLOT(GRAVE,    L1_SUP2,               0,           0,           0) \
+    SLOT(1,        '&',                   '1',         0,           0) \
+    SLOT(2,        L1_E_ACUTE + L1_LOWER, '2',         DK_TILDE,    0) \
+    SLOT(3,        '"',                   '3',         '#',         0) \
+    SLOT(4,        '\'',                  '4',         '{',         0) \
+    SLOT(5,        '(',                   '5',         '[',         0) \
+    SLOT(6,        '-',                   '6',         '|',         0) \
+    SLOT(7,        L1_E_GRAVE + L1_LOWER, '7',         DK_GRAVE,    0) \
+    SLOT(8,        '_',                   '8',         '\\',        0) \
+    SLOT(9,        0xE7,                  '9',         '^',         0) /* c cedilla */ \
+    SLOT(0,        L1_A_GRAVE + L1_LOWER, '0',         '@',         0) \
+    SLOT(MINUS,    ')',                   L1_DEGREE,   ']',         0) \
+    SLOT(EQUAL,    '=',                   '+',         '}',         0) \
+    SLOT(Q,        'a',                   'A',         0,           1) \
+    SLOT(W,        'z',                   'Z',         0,           1) \
+    SLOT(E,        'e',                   'E',         CH_EURO,     1) \
+    SLOT(R,        'r',                   'R',         0,           1) \
+    SLOT(T,        't',                   'T',         0,           1) \
+    SLOT(Y,        'y',                   'Y',         0,           1) \
+    SLOT(U,        'u',                   'U',         0,           1) \
+    SLOT(I,        'i',                   'I',         0,           1) \
+    SLOT(O,        'o',                   'O',         0,           1) \
+    SLOT(P,        'p',                   'P',         0,           1) \
+    SLOT(LBRACKET, DK_CIRC,               DK_DIAER,    0,           0) \
+    SLOT(RBRACKET, '$',                   L1_POUND,    L1_CURRENCY, 0) \
+    SLOT(BSLASH,   '*',                   L1_MICRO,    0,           0) \
+    SLOT(A,        'q',                   'Q',         0,           1) \
+    SLOT(S,        's',                   'S',         0,           1) \
+    SLOT(D,        'd',                   'D',         0,           1) \
+    SLOT(F,        'f',                   'F',         0,           1) \
+    SLOT(G,        'g',                   'G',         0,           1) \
+    SLOT(H,        'h',                   'H',         0,           1) \
+    SLOT(J,        'j',                   'J',         0,           1) \
+    SLOT(K,        'k',                   'K',         0,           1) \
+    SLOT(L,        'l',                   'L',         0,           1) \
+    SLOT(SEMI,     'm',                   'M',         0,           1) \
+    SLOT(QUOTE,    L1_U_GRAVE + L1_LOWER, '%',         0,           0) \
+    SLOT(ISO,      '<',                   '>',         0,           0) \
+    SLOT(Z,        'w',                   'W',         0,           1) \
+    SLOT(X,        'x',                   'X',         0,           1) \
+    SLOT(C,        'c',                   'C',         0,           1) \
+    SLOT(V,        'v',                   'V',         0,           1) \
+    SLOT(B,        'b',                   'B',         0,           1) \
+    SLOT(N,        'n',                   'N',         0,           1) \
+    SLOT(M,        ',',                   '?',         0,           0) \
+    SLOT(COMMA,    ';',                   '.',         0,           0) \
+    SLOT(PERIOD,   ':',                   '/',         0,           0) \
+    SLOT(SLASH,    '!',                   L1_SECTION,  0,           0)
+
+//Dead key compositions, C(accent, base, result); accents without a match
+//post their spacing form (KB_SPACING) then the character
+#define KB_COMPOSE(C) \
+    C(DK_GRAVE, 'a', L1_A_GRAVE + L1_LOWER) C(DK_GRAVE, 'A', L1_A_GRAVE) \
+    C(DK_GRAVE, 'e', L1_E_GRAVE + L1_LOWER) C(DK_GRAVE, 'E', L1_E_GRAVE) \
+    C(DK_GRAVE, 'i', L1_I_GRAVE + L1_LOWER) C(DK_GRAVE, 'I', L1_I_GRAVE) \
+    C(DK_GRAVE, 'o', L1_O_GRAVE + L1_LOWER) C(DK_GRAVE, 'O', L1_O_GRAVE) \
+    C(DK_GRAVE, 'u', L1_U_GRAVE + L1_LOWER) C(DK_GRAVE, 'U', L1_U_GRAVE) \
+    C(DK_ACUTE, 'a', L1_A_ACUTE + L1_LOWER) C(DK_ACUTE, 'A', L1_A_ACUTE) \
+    C(DK_ACUTE, 'e', L1_E_ACUTE + L1_LOWER) C(DK_ACUTE, 'E', L1_E_ACUTE) \
+    C(DK_ACUTE, 'i', L1_I_ACUTE + L1_LOWER) C(DK_ACUTE, 'I', L1_I_ACUTE) \
+    C(DK_ACUTE, 'o', L1_O_ACUTE + L1_LOWER) C(DK_ACUTE, 'O', L1_O_ACUTE) \
+    C(DK_ACUTE, 'u', L1_U_ACUTE + L1_LOWER) C(DK_ACUTE, 'U', L1_U_ACUTE) \
+    C(DK_ACUTE, 'y', L1_Y_ACUTE + L1_LOWER) C(DK_ACUTE, 'Y', L1_Y_ACUTE) \
+    C(DK_CIRC,  'a', L1_A_CIRC + L1_LOWER)  C(DK_CIRC,  'A', L1_A_CIRC)  \
+    C(DK_CIRC,  'e', L1_E_CIRC + L1_LOWER)  C(DK_CIRC,  'E', L1_E_CIRC)  \
+    C(DK_CIRC,  'i', L1_I_CIRC + L1_LOWER)  C(DK_CIRC,  'I', L1_I_CIRC)  \
+    C(DK_CIRC,  'o', L1_O_CIRC + L1_LOWER)  C(DK_CIRC,  'O', L1_O_CIRC)  \
+    C(DK_CIRC,  'u', L1_U_CIRC + L1_LOWER)  C(DK_CIRC,  'U', L1_U_CIRC)  \
+    C(DK_DIAER, 'a', L1_A_DIAER + L1_LOWER) C(DK_DIAER, 'A', L1_A_DIAER) \
+    C(DK_DIAER, 'e', L1_E_DIAER + L1_LOWER) C(DK_DIAER, 'E', L1_E_DIAER) \
+    C(DK_DIAER, 'i', L1_I_DIAER + L1_LOWER) C(DK_DIAER, 'I', L1_I_DIAER) \
+    C(DK_DIAER, 'o', L1_O_DIAER + L1_LOWER) C(DK_DIAER, 'O', L1_O_DIAER) \
+    C(DK_DIAER, 'u', L1_U_DIAER + L1_LOWER) C(DK_DIAER, 'U', L1_U_DIAER) \
+    C(DK_DIAER, 'y', L1_Y_DIAER)                                         \
+    C(DK_TILDE, 'a', L1_A_TILDE + L1_LOWER) C(DK_TILDE, 'A', L1_A_TILDE) \
+    C(DK_TILDE, 'o', L1_O_TILDE + L1_LOWER) C(DK_TILDE, 'O', L1_O_TILDE) \
+    C(DK_TILDE, 'n', L1_N_TILDE + L1_LOWER) C(DK_TILDE, 'N', L1_N_TILDE)
+
+//Spacing form of each dead key, indexed by DK_xxx
+#define KB_SPACING  {0, '`', L1_ACUTE, '^', L1_DIAER, '~'}
+
+#endif	/* LAYOUTS_H */
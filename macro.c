@@ -0,0 +1,294 @@
+/*----------------------------------------------------------------------------*/
+/* Keyboard macros                                                            */
+/*                                                                            */
+/* The master uploads macros with HOST_OP_MACRO (see host.c): a trigger of    */
+/* one to MC_STEPS_MAX steps, each a key and the modifiers held with it, and  */
+/* the bytes it expands to. One step with modifiers is a chord (Ctrl+Alt+F1), */
+/* several make a sequence (F12 then 1). Left and right modifiers count the   */
+/* same. The expansion is posted as uploaded, in one qWrite(), so the master  */
+/* sends it in the format it reads (KB_OUT_ASCII or KB_OUT_UTF8). There are   */
+/* no macros in KB_OUT_EVENTS.                                                */
+/*                                                                            */
+/* The triggers form a trie. Its edges are not lists of children but one      */
+/* open addressed hash table keyed by (node, key, mods), and each node lives  */
+/* in the slot of the edge leading to it, so a step is one hash and a probe   */
+/* run whatever the number of macros. Probing is double hashing, which does   */
+/* not grow clusters the way stepping to the next slot does, and a run never  */
+/* goes past MC_PROBE_MAX slots: an edge that would land further away is      */
+/* refused (MC_FULL), so that is also the most a lookup ever costs. The table */
+/* is kept at most 5/8 full, where the mean run is under three slots. Most    */
+/* keys typed start no trigger; a bitmap of first step keys turns them away   */
+/* before the hash.                                                           */
+/*                                                                            */
+/* Steps of a trigger are held back from the output. If the next key does    */
+/* not continue it they are translated as typed after all and that key is     */
+/* tried as the start of another trigger. A trigger can not be a prefix of    */
+/* another, so the first complete match fires. Modifier keys, releases and    */
+/* typematic repeats are not steps: holding a chord repeats the expansion.    */
+/*                                                                            */
+/* Nodes and expansion bytes are never freed one at a time; a record with no  */
+/* steps clears every macro, after which the master uploads the set again.    */
+/*----------------------------------------------------------------------------*/
+#include "hal.h"
+#include "ps2kb.h"
+#include "macro.h"
+#include <string.h>                                                             //For memset(), memcpy()
+
+/*------------------------------------------*/
+/* Global variables                         */
+/*------------------------------------------*/
+extern const kbKeyDesc_t kbKeyMap[256];                                         //ps2kb.c
+
+mcMacros_t xMacros, *pMacros;
+
+/*------------------------------------------*/
+/* Drop every macro and a trigger half      */
+/* typed. The upload state is left alone    */
+/*------------------------------------------*/
+static void mcClear(void){
+
+   uint16_t i;
+
+   for(i = 0; i < MC_SLOTS; i++)
+      pMacros->node[i].key = 0;
+   memset(pMacros->first,0x00,sizeof(pMacros->first));
+   pMacros->nodes = 0;
+   pMacros->textUsed = 0;
+   pMacros->state = MC_ROOT;
+   pMacros->nHeld = 0;
+}
+
+void mcInitialize(void){
+
+   pMacros = &xMacros;
+   memset(pMacros,0x00,sizeof(xMacros));
+   mcClear();
+   pMacros->status = MC_OK;
+}
+
+/*------------------------------------------*/
+/* Node reached from parent by one step,    */
+/* MC_NONE if there is no such edge. At     */
+/* most MC_PROBE_MAX slots are looked at    */
+/*------------------------------------------*/
+static uint16_t mcFind(uint16_t parent, uint8_t key, uint8_t mods){
+
+   uint16_t h = MC_HASH(parent, key, mods);
+   uint16_t i = MC_FIRST(h);
+   uint16_t stride = MC_STRIDE(h);
+   uint16_t found = MC_NONE;
+   uint8_t probes;
+   mcNode_t *n;
+
+   for(probes = 1; ; probes++){
+      n = &pMacros->node[i];
+      if(n->key && n->parent == parent && n->key == key && n->mods == mods)
+         found = i;
+      if(found != MC_NONE || !n->key || probes == MC_PROBE_MAX)
+         break;
+      i = (i + stride) & MC_MASK;
+   }
+   if(probes > pMacros->probeMax)
+      pMacros->probeMax = probes;
+   return found;
+}
+
+/*------------------------------------------*/
+/* Add the edge parent -> new node. Returns */
+/* MC_NONE if no slot within MC_PROBE_MAX   */
+/* of its hash is free                      */
+/*------------------------------------------*/
+static uint16_t mcInsert(uint16_t parent, uint8_t key, uint8_t mods){
+
+   uint16_t h = MC_HASH(parent, key, mods);
+   uint16_t i = MC_FIRST(h);
+   uint16_t stride = MC_STRIDE(h);
+   uint8_t probes;
+
+   for(probes = 0; pMacros->node[i].key; probes++){
+      if(probes == MC_PROBE_MAX - 1)
+         return MC_NONE;
+      i = (i + stride) & MC_MASK;
+   }
+   pMacros->node[i].parent = parent;
+   pMacros->node[i].key = key;
+   pMacros->node[i].mods = mods;
+   pMacros->node[i].text = MC_NONE;
+   pMacros->nodes++;
+   return i;
+}
+
+/*------------------------------------------*/
+/* Apply one HOST_OP_MACRO record           */
+/*                                          */
+/*   0      steps s, 0 = clear all macros   */
+/*   1..2s  keycode (KEY_xxx), KM_xxx mods  */
+/*   2s+1.. expansion, 1 to MC_LEN_MAX      */
+/*                                          */
+/* Returns the MC_xxx status                */
+/*------------------------------------------*/
+static uint8_t mcDefine(const uint8_t *rec, uint8_t len){
+
+   uint8_t steps = rec[0];
+   uint8_t n, i, j, key;
+   uint16_t at = MC_ROOT, next;
+   uint16_t added[MC_STEPS_MAX];
+
+   if(!steps){
+      if(len != 1)
+         return MC_BAD;
+      mcClear();
+      return MC_OK;
+   }
+   if(steps > MC_STEPS_MAX || len <= 1 + 2 * steps)                             //Too many steps or no expansion
+      return MC_BAD;
+   n = len - 1 - 2 * steps;                                                     //mcRx() only bounds the whole record
+   if(n > MC_LEN_MAX)                                                           //Room for fewer steps is not room for more text
+      return MC_BAD;
+   for(i = 0; i < steps; i++){
+      key = rec[1 + 2 * i];
+      if(kbKeyMap[key].kind == KC_NONE || kbKeyMap[key].kind == KC_MOD)         //Also rejects keycode 0, the free slot mark
+         return MC_BAD;
+   }
+
+   for(i = 0; i < steps; i++){                                                  //Follow the part already in the trie
+      next = mcFind(at, rec[1 + 2 * i], MC_MODS(rec[2 + 2 * i]));
+      if(next == MC_NONE)
+         break;
+      if(pMacros->node[next].text != MC_NONE)                                   //A shorter trigger, or this one, is defined
+         return MC_CLASH;
+      at = next;
+   }
+   if(i == steps)                                                               //Prefix of a longer trigger
+      return MC_CLASH;
+   if(pMacros->nodes + steps - i > MC_FILL || pMacros->textUsed + 1 + n > MC_TEXT)
+      return MC_FULL;
+
+   for(j = 0; i < steps; i++, j++){
+      at = mcInsert(at, rec[1 + 2 * i], MC_MODS(rec[2 + 2 * i]));
+      if(at == MC_NONE){                                                        //Probe run too long, take back this trigger
+         pMacros->nodes -= j;
+         while(j--)
+            pMacros->node[added[j]].key = 0;                                    //Last in, so no probe run goes past them
+         return MC_FULL;
+      }
+      added[j] = at;
+   }
+   pMacros->node[at].text = pMacros->textUsed;
+   pMacros->text[pMacros->textUsed] = n;
+   memcpy(&pMacros->text[pMacros->textUsed + 1], &rec[1 + 2 * steps], n);
+   pMacros->textUsed += 1 + n;
+   pMacros->first[rec[1] >> 3] |= 1 << (rec[1] & 7);
+   return MC_OK;
+}
+
+/*------------------------------------------*/
+/* One key make, not a modifier. MC_MISS    */
+/* with steps held means a trigger broke    */
+/* off: the caller translates the held      */
+/* steps, clears nHeld and asks again       */
+/*------------------------------------------*/
+uint8_t mcMatch(uint8_t key, uint8_t mods){
+
+   mcMacros_t *m = pMacros;
+   uint16_t at;
+
+   if(m->state == MC_ROOT && !(m->first[key >> 3] & (1 << (key & 7))))
+      return MC_MISS;                                                           //Starts no trigger, no hash needed
+
+   at = mcFind(m->state, key, MC_MODS(mods));
+   if(at == MC_NONE){
+      m->state = MC_ROOT;
+      return MC_MISS;
+   }
+   if(m->node[at].text != MC_NONE){                                             //Trigger complete
+      m->state = MC_ROOT;
+      m->nHeld = 0;
+      m->hit = at;
+      m->fired++;
+      return MC_FIRE;
+   }
+   m->state = at;
+   m->held[m->nHeld].key = key;
+   m->held[m->nHeld].mods = mods;
+   m->nHeld++;
+   return MC_HOLD;
+}
+
+const uint8_t *mcText(uint8_t *len){
+
+   const uint8_t *t = &pMacros->text[pMacros->node[pMacros->hit].text];
+
+   *len = t[0];
+   return t + 1;
+}
+
+/*------------------------------------------*/
+/* Forget a trigger half typed, its steps   */
+/* are not posted. For an output format     */
+/* switch                                   */
+/*------------------------------------------*/
+void mcCancel(void){
+   pMacros->state = MC_ROOT;
+   pMacros->nHeld = 0;
+}
+
+/*------------------------------------------*/
+/* Main loop: apply the record the SPI ISR  */
+/* has clocked in. The status is written    */
+/* before ready drops, so the next          */
+/* HOST_OP_MACRO reports this record        */
+/*------------------------------------------*/
+void mcService(void){
+
+   if(!pMacros->ready)
+      return;
+   pMacros->status = mcDefine(pMacros->rec, pMacros->recLen);
+   pMacros->ready = 0;
+}
+
+uint8_t mcBusy(void){
+   return pMacros->ready;
+}
+
+/*------------------------------------------*/
+/* SPI ISR, HOST_OP_MACRO opcode. Returns   */
+/* the status byte; MC_BUSY means the       */
+/* record before is still waiting for the   */
+/* main loop and this one is not taken      */
+/*------------------------------------------*/
+uint8_t mcRxStart(void){
+
+   if(pMacros->ready)
+      return MC_BUSY;
+   pMacros->recLen = 0;                                                         //Length byte next
+   pMacros->recIdx = 0;
+   return pMacros->status;
+}
+
+/*------------------------------------------*/
+/* SPI ISR, one byte after the opcode: the  */
+/* record length (0 = only read the         */
+/* status), then the record. Returns 0 once */
+/* the rest of the transaction is ignored.  */
+/* A record cut short by deselect is        */
+/* dropped by the next mcRxStart()          */
+/*------------------------------------------*/
+uint8_t mcRx(uint8_t b){
+
+   if(!pMacros->recLen){
+      if(!b)
+         return 0;
+      if(b > MC_REC_MAX){                                                       //Will not fit, say so now
+         pMacros->status = MC_BAD;
+         return 0;
+      }
+      pMacros->recLen = b;
+      return 1;
+   }
+   pMacros->rec[pMacros->recIdx++] = b;
+   if(pMacros->recIdx < pMacros->recLen)
+      return 1;
+   pMacros->ready = 1;
+   return 0;
+}
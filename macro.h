@@ -0,0 +1,109 @@
+/*
+ * File:   macro.h
+ */
+
+#ifndef MACRO_H
+#define	MACRO_H
+
+#include <stdint.h>
+
+/*----------------------------------------------------*/
+/* Defines                                            */
+/*----------------------------------------------------*/
+#ifndef MC_SLOTS
+#define MC_SLOTS    256                                                         //Trie nodes, one per trigger step, must be a power of two
+#endif
+#ifndef MC_TEXT
+#define MC_TEXT     1024                                                        //Expansion bytes over all macros
+#endif
+#define MC_MASK     (MC_SLOTS - 1)
+#define MC_FILL     (MC_SLOTS / 8 * 5)                                          //Nodes in use at most
+#define MC_PROBE_MAX 16                                                         //Slots a lookup looks at, at most
+#define MC_STEPS_MAX 4                                                          //Longest trigger sequence
+#define MC_LEN_MAX  64                                                          //Longest expansion
+#define MC_REC_MAX  (1 + 2 * MC_STEPS_MAX + MC_LEN_MAX)                         //Longest HOST_OP_MACRO record
+#define MC_ROOT     MC_SLOTS                                                    //Parent of a first step, not a slot
+#define MC_NONE     0xFFFF                                                      //No node, no expansion
+#define MC_MODS(m)  (((m) | ((m) >> 4)) & 0x0F)                                 //KM_xxx with left and right folded together
+
+//Fibonacci hash of one trie edge. The top bits of the product are the first
+//slot, the low bits made odd the stride, so a probe run can reach every slot
+#define MC_HASH(parent, key, mods) \
+    ((uint16_t)(((uint16_t)((parent) * 40503u) ^ ((uint16_t)(key) << 4) ^ (mods)) * 40503u))
+#define MC_FIRST(h) ((h) >> (16 - MC_BITS))
+#define MC_STRIDE(h) ((h) | 1)
+#if MC_SLOTS == 256
+#define MC_BITS     8
+#elif MC_SLOTS == 512
+#define MC_BITS     9
+#elif MC_SLOTS == 128
+#define MC_BITS     7
+#else
+#error MC_SLOTS must be 128, 256 or 512
+#endif
+
+//Status, byte 1 of HOST_OP_MACRO
+#define MC_OK       0x00                                                        //Last record applied
+#define MC_BUSY     0x01                                                        //Last record not applied yet, this one is ignored
+#define MC_BAD      0x02                                                        //Malformed: length, step count, a modifier or unknown key as a step
+#define MC_CLASH    0x03                                                        //Trigger already defined, or a prefix of one, or one is a prefix of it
+#define MC_FULL     0x04                                                        //No nodes, expansion bytes or free slot in reach left, clear and upload again
+
+/*----------------------------------------------------*/
+/* Enumerations                                       */
+/*----------------------------------------------------*/
+typedef enum{
+    MC_MISS,                                                                    //Not a trigger step, translate the key as usual
+    MC_HOLD,                                                                    //Step of a trigger, held back until it completes or breaks off
+    MC_FIRE                                                                     //Trigger complete, post the expansion
+}mcMatches_t;
+
+/*----------------------------------------------------*/
+/* Structures                                         */
+/*----------------------------------------------------*/
+typedef struct{                                                                 //Trie node, stored in the slot its incoming edge hashes to
+    uint16_t parent;                                                            //Node the edge leaves, MC_ROOT for a first step
+    uint8_t  key;                                                               //Keycode of the step, 0 = free slot
+    uint8_t  mods;                                                              //MC_MODS() of the step
+    uint16_t text;                                                              //Expansion (length byte, then the bytes) in text[], MC_NONE inside a trigger
+}mcNode_t;
+
+typedef struct{                                                                 //Step held back while a trigger is matched
+    uint8_t key;
+    uint8_t mods;                                                               //As typed, not folded
+}mcStep_t;
+
+typedef struct{
+    mcNode_t node[MC_SLOTS];
+    uint8_t  text[MC_TEXT];
+    uint16_t nodes;                                                             //Slots in use
+    uint16_t textUsed;
+    uint8_t  first[32];                                                         //Bit (k & 7) of byte k >> 3 set if keycode k starts a trigger
+    uint16_t state;                                                             //Node matched so far, MC_ROOT between triggers
+    mcStep_t held[MC_STEPS_MAX];
+    uint8_t  nHeld;
+    uint16_t hit;                                                               //Node of the trigger fired last
+    uint32_t fired;                                                             //Expansions posted, reported by macrobench
+    uint8_t  probeMax;                                                          //Longest probe run seen by a lookup
+
+    //HOST_OP_MACRO record being clocked in by the SPI ISR
+    uint8_t  rec[MC_REC_MAX];
+    uint8_t  recLen;                                                            //From byte 1
+    uint8_t  recIdx;                                                            //Bytes of it in
+    volatile uint8_t ready;                                                     //Record complete, mcService() applies it
+    volatile uint8_t status;                                                    //MC_xxx of the last record
+}mcMacros_t;
+
+/*----------------------------------------------------*/
+/* Function declarations                              */
+/*----------------------------------------------------*/
+void            mcInitialize(void);                                             //No macros
+uint8_t         mcMatch(uint8_t, uint8_t);                                      //One key make and its modifiers, returns mcMatches_t
+const uint8_t  *mcText(uint8_t *);                                              //Expansion of the trigger just fired, and its length
+void            mcCancel(void);                                                 //Forget a trigger half typed
+uint8_t         mcBusy(void);                                                   //Record waiting for mcService()
+void            mcService(void);                                                //Main loop: apply an uploaded record
+uint8_t         mcRxStart(void);                                                //SPI ISR: HOST_OP_MACRO opcode, returns the status byte
+uint8_t         mcRx(uint8_t);                                                  //SPI ISR: next record byte, 0 once no more are wanted
+
+#endif	/* MACRO_H */
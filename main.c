@@ -6,10 +6,13 @@
 /*----------------------------------------------------------------------------*/  
 /* Peripherals Used:                                                          */
 /* External interrupt 0 - PS2 clock line - interrupt on falling edge          */
-/* SPI1 - Connection to the host                                              */
+/* External interrupt 1 - PS2 mouse clock line (PS2_PORTS = 2)                */
+/* SPI1 - Connection to the host (slave, see host.c)                          */
+/* Timer2/3 - 32-bit timebase, its wrap also ends Idle (see power.c)          */
 /*----------------------------------------------------------------------------*/  
 /* External Devices:                                                          */
 /* PS2 keyboard - Rosewill F21SG                                              */
+/* PS2 mouse, optional, standard or IntelliMouse (see ps2ms.c)                */
 /*----------------------------------------------------------------------------*/  
 /* Pointers:                                                                  */
 /*        */
@@ -47,68 +50,107 @@
 /*----------------------------------*/
 /* Includes                         */
 /*----------------------------------*/
-#include "xc.h"
+#include "hal.h"
 #include "ps2kb.h"
-#include "sys.h"
+#include "kbcmd.h"
+#include "ps2ms.h"
+#include "host.h"
+#include "macro.h"
+#include "typematic.h"
+#include "power.h"
 #include "sup.h"
 
-/*----------------------------------*/
-/* Defines                          */
-/*----------------------------------*/
-#define KB_FLAG_A AD1PCFGbits.PCFG12                                            //Notification pin
-#define KB_FLAG_T TRISBbits.TRISB12
-#define KB_FLAG_L LATBbits.LATB12
-
 /*----------------------------------*/
 /*Globals from ps2kb.c              */
 /*----------------------------------*/
 extern kbFlags_t xFlags, *pFlags;
+extern kbEvent_t xEvent, *pEvent;
+extern unsigned char scanCode;
+extern ps2Port_t *pKbPort;
+
+#if PS2_MOUSE
+extern ps2Port_t *pMsPort;                                                      //ps2ms.c
+#elif PS2_PORTS > 1
+extern ps2Port_t xPorts[PS2_PORTS];                                             //ps2port.c
+#endif
 
 /*--------------------------------------------------------------*/
 /* Begin mainline processing                                    */
 /*--------------------------------------------------------------*/
 int main(void){
    
-   //Init notification pin
-   KB_FLAG_A = 1;                                                               //Set flag pin to digital
-   KB_FLAG_T = 0;                                                               //Set to output
-   KB_FLAG_L = 0;                                                               //Set low; Active high
-   
    //Initialize the keyboard interface
    int16_t rtnCode = kbInitialize(); 
    
    if(rtnCode)
       pFlags->errFlag = 1;
    
+#if PS2_MOUSE
+   //Mouse on the second port, negotiated from the main loop
+   msInitialize();
+#elif PS2_PORTS > 1
+   //Second PS2 port, nothing talks to its device but the command scheduler
+   ps2PortInit(&xPorts[PS2_AUX],PS2_AUX);
+#endif
+
+   //SPI1 link and notification pin to the master controller
+   hostInitialize();
+   
+   pmInitialize();                                                              //Idle and awake time from here on
+   
    SetUnusedPins();                                                             //Make digital and drive low                                                                       
    
    /*--------------------------------------------------*/
    /*Main control loop                                 */
    /*--------------------------------------------------*/
-   while(1){
+   while(HAL_RUNNING()){
       
 //      ClrWdt();
          
+      kbCmdService(pKbPort);                                                    //Start queued keyboard commands, time them out
+
       //Process scan codes from the keyboard
-      if(pFlags->scanFlag){                                                     //New scan code?
-         pFlags->scanFlag = 0;                                                  //Clear the scan code flag 
+      while(kbFlowControl() && kbNextCode()){                                   //Drain everything the ISR has queued
+         if(kbCmdReply(pKbPort,scanCode))                                       //Reply to an outstanding command
+            continue;
+         if(kbDecode(scanCode,pEvent) == KB_EV_NONE)                            //Prefix byte, wait for the rest
+            continue;
+         if(!tmEvent(pEvent))                                                   //Keyboard repeat the firmware makes itself
+            continue;
          kbCheckFlags();                                                        //Check for special conditions
    
-         if(pFlags->breakFlag)                                                  //Discard break sequences                                                            
-            pFlags->breakFlag--;
-         else if(pFlags->skipFlag)                                              //Flagged to discard
-            pFlags->skipFlag = 0;
-         else if(pFlags->capsFlag || pFlags->numsFlag){                         //Caps or num lock sequence?
+         if(pFlags->capsFlag || pFlags->numsFlag){                              //Caps or num lock released?
             kbSetLocks();                                                       //Yes.. set/clear the lock
             pFlags->capsFlag = 0;
             pFlags->numsFlag = 0;
          }
-         else{   
-            kbPostCode();                                                       //Translate scan code and add to the buffer
-            if(!KB_FLAG_L)                                                      //Notify the host
-               KB_FLAG_L = 1;
-         }              
+         if(pFlags->plugFlag){                                                  //Keyboard plugged in again?
+            kbPlug();                                                           //Yes.. give it our settings
+            pFlags->plugFlag = 0;
+         }
+         kbPostCode();                                                          //Translate scan code and add to the buffer
       }
+
+#if PS2_MOUSE
+      //Process packet bytes from the mouse
+      kbCmdService(pMsPort);                                                    //Negotiation commands
+      while(ps2NextCode(pMsPort,&scanCode)){
+         if(kbCmdReply(pMsPort,scanCode))
+            continue;
+         msDecode(scanCode);                                                    //Assemble packets, coalesce motion
+      }
+      msService();                                                              //Next negotiation step
+#elif PS2_PORTS > 1
+      kbCmdService(&xPorts[PS2_AUX]);                                           //Second port: commands only, other bytes dropped
+      while(ps2NextCode(&xPorts[PS2_AUX],&scanCode))
+         kbCmdReply(&xPorts[PS2_AUX],scanCode);
+#endif
+
+      kbOutService();                                                           //Output format switch, event clock
+      mcService();                                                              //Apply an uploaded macro
+      tmService();                                                              //Typematic settings, repeats made here
+      hostService();                                                            //Notify the host
+      pmIdle();                                                                 //Nothing left to do? Idle until an interrupt
    }
    return 0;
 }
\ No newline at end of file
@@ -0,0 +1,112 @@
+/*----------------------------------------------------------------------------*/
+/* Low power: the main loop waits in Idle                                     */
+/*                                                                            */
+/* At the end of every pass pmIdle() asks each module whether the main loop   */
+/* still has work: raw bytes or captured edges to decode, a command in        */
+/* flight (its timeout is polled), a record from the master to apply, a       */
+/* local typematic repeat to time, bytes the master has not been told about.  */
+/* If none has, the CPU executes PWRSAV #1 (Idle): the core stops, the clock, */
+/* the timebase and every peripheral keep running, and the first enabled      */
+/* interrupt wakes it. INT0/INT1 edges, the SPI1 and CN interrupts of the     */
+/* host link and the bus timers all are; every wake runs one whole pass.      */
+/*                                                                            */
+/* The check and PWRSAV run with the CPU priority at 7. An interrupt raised   */
+/* in between still wakes the CPU (or keeps it from sleeping) and its ISR     */
+/* runs once the priority drops after PWRSAV, so nothing an ISR hands over    */
+/* waits for the next interrupt. This is also all the latency Idle adds: an   */
+/* ISR is held back for at most the check and the wake up, PM_WAKE_CYC cycles */
+/* (PM_CYC_CHECK and PM_CYC_WAKE, charged by the simulator). Sleep is not     */
+/* used: it stops the FRC PLL, whose relock takes longer than the first       */
+/* bits of the frame that would wake it.                                      */
+/*                                                                            */
+/* The Timer2/3 timebase interrupts once per wrap (hal.c), so no nap is as    */
+/* long as the timebase and the time differences below stay exact.            */
+/*                                                                            */
+/* Time in Idle and awake, ISRs included, is summed in milliseconds and read  */
+/* with HOST_OP_DIAG. PM_IDLE 0 builds the loop that spins, as before.        */
+/*----------------------------------------------------------------------------*/
+#include "hal.h"
+#include "ps2kb.h"
+#include "kbcmd.h"
+#include "ps2ms.h"
+#include "host.h"
+#include "macro.h"
+#include "typematic.h"
+#include "power.h"
+#include <string.h>                                                             //For memset()
+
+/*------------------------------------------*/
+/* Global variables                         */
+/*------------------------------------------*/
+#if !PS2_MOUSE && PS2_PORTS > 1
+extern ps2Port_t xPorts[PS2_PORTS];                                             //ps2port.c
+#endif
+
+pmState_t xPower, *pPower;
+
+void pmInitialize(void){
+   pPower = &xPower;
+   memset(pPower,0x00,sizeof(xPower));
+   pPower->mark = halNow();
+}
+
+#if PM_IDLE
+/*------------------------------------------*/
+/* Anything left for the main loop          */
+/*------------------------------------------*/
+static uint8_t pmBusy(void){
+
+   if(kbBusy() || hostBusy() || mcBusy() || tmBusy())
+      return 1;
+#if PS2_MOUSE
+   return msBusy();
+#elif PS2_PORTS > 1
+   return kbCmdBusy(&xPorts[PS2_AUX]) || ps2RxPending(&xPorts[PS2_AUX]);
+#else
+   return 0;
+#endif
+}
+
+/*------------------------------------------*/
+/* Add ticks to a millisecond count, the    */
+/* remainder carried                        */
+/*------------------------------------------*/
+static void pmAdd(uint32_t *ms, uint32_t *rest, uint32_t ticks){
+
+   *rest += ticks;
+   if(*rest < HAL_US_TICKS(1000))
+      return;
+   *ms += *rest / HAL_US_TICKS(1000);
+   *rest %= HAL_US_TICKS(1000);
+}
+#endif
+
+/*------------------------------------------*/
+/* Main loop, end of a pass. Returns at     */
+/* once if there is work, else after the    */
+/* interrupt that woke the CPU has run      */
+/*------------------------------------------*/
+void pmIdle(void){
+#if PM_IDLE
+   pmState_t *s = pPower;
+   uint16_t ipl;
+   uint32_t slept, woke;
+
+   HAL_IDLE_LOCK(ipl);                                                          //Interrupts still wake the CPU, their ISRs wait
+   HAL_COST(PM_CYC_CHECK);
+   if(pmBusy()){
+      HAL_IDLE_UNLOCK(ipl);
+      return;
+   }
+   slept = halNow();
+   HAL_IDLE();
+   woke = halNow();
+   HAL_COST(PM_CYC_WAKE);
+   HAL_IDLE_UNLOCK(ipl);                                                        //The ISR that woke us runs here
+
+   s->naps++;
+   pmAdd(&s->awakeMs, &s->awakeTicks, slept - s->mark);
+   pmAdd(&s->idleMs, &s->idleTicks, woke - slept);
+   s->mark = woke;
+#endif
+}
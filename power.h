@@ -0,0 +1,40 @@
+/*
+ * File:   power.h
+ */
+
+#ifndef POWER_H
+#define	POWER_H
+
+#include <stdint.h>
+
+/*----------------------------------------------------*/
+/* Defines                                            */
+/*----------------------------------------------------*/
+#ifndef PM_IDLE
+#define PM_IDLE      1                                                          //1 = main loop waits in Idle when it has nothing to do, 0 = it spins
+#endif
+
+//Cycle estimates charged by the simulator (HAL_COST)
+#define PM_CYC_CHECK 64                                                         //pmBusy() with interrupts held back
+#define PM_CYC_WAKE  12                                                         //Leaving Idle to the unmask
+#define PM_WAKE_CYC  (PM_CYC_CHECK + PM_CYC_WAKE)                               //Most cycles pmIdle() holds an ISR back, 4.75us at 16MHz
+
+/*----------------------------------------------------*/
+/* Structures                                         */
+/*----------------------------------------------------*/
+typedef struct{
+    uint32_t idleMs;                                                            //Time spent in Idle
+    uint32_t awakeMs;                                                           //Time spent running, ISRs included
+    uint32_t naps;                                                              //Times the main loop went idle
+    uint32_t idleTicks;                                                         //Remainders under a millisecond, timebase ticks
+    uint32_t awakeTicks;
+    uint32_t mark;                                                              //halNow() when the CPU last went idle or woke
+}pmState_t;
+
+/*----------------------------------------------------*/
+/* Function declarations                              */
+/*----------------------------------------------------*/
+void            pmInitialize(void);
+void            pmIdle(void);                                                   //Main loop, end of a pass: Idle until an interrupt if nothing is left to do
+
+#endif	/* POWER_H */
@@ -21,6 +21,9 @@
 /* transmission and waits for the command. If the keyboard receives an        */
 /* invalid command, it responds with a "resend" (0xFE)                        */
 /*                                                                            */
+/* The bus itself (frames, sending, inhibit) is ps2port.c; this file is the   */
+/* keyboard on port PS2_KBD: commands, set 2 decoding and the output queue.   */
+/*                                                                            */
 /* Data sent from the device to the host is read on the falling edge of the   */ 
 /* clock signal. Data sent from the host to the device is read on the rising  */
 /* edge                                                                       */
@@ -39,127 +42,294 @@
 /*----------------------------------------------------------------------------*/
 /* 03/2023 Adam Hout    -Original source                                      */
 /*----------------------------------------------------------------------------*/
-#include "xc.h"
+#include "hal.h"
 #include "ps2kb.h"
-#include "sys.h"
+#include "kbcmd.h"
+#include "typematic.h"
+#include "power.h"
 #include <ctype.h>                                                              //For toupper()
 #include <string.h>                                                             //For memset()
-#include <libpic30.h>                                                           //For delay_us()
 #include <stdlib.h>                                                             //For malloc())
 
 /*------------------------------------------*/
 /* Global variables                         */
 /*------------------------------------------*/
-volatile unsigned char scanCode;                                                //Scan code from the keyboard
+unsigned char scanCode;                                                         //Scan code being processed by the main loop
 
 uint8_t capsLock = 0;                                                           //Caps lock status; 1 = On
 uint8_t numsLock = 0;
-uint8_t kbBitCnt;                                                               //Bit counter for incoming scan codes
-uint8_t kbParity;                                                               //Compute parity
 
 //FIFO buffer for translated output
 queue_t xOutBuf, *pOutBuf; 
 
+//Keyboard port
+extern ps2Port_t xPorts[PS2_PORTS];                                             //ps2port.c
+ps2Port_t *pKbPort;
+
+extern pmState_t *pPower;                                                       //power.c, for the diagnostics record
+
 //Keyboard flags
 kbFlags_t xFlags, *pFlags;
 
-//Enums
-ps2States_t ps2State;                                                           //Current state of operation
-kbErrors_t  kbError;                                                            //Keyboard errors
-
-//PS2 scan code lookup tables
-const char ScanCodes[128] = {0,F9,0,F5,F1,F3,F2,F12,
-                             0,F10,F8,F6,F4,TAB,'`',0,
-                             0,0,L_SHIFT,0,L_CTRL,'q','1',0,
-                             0,0,'z','s','a','w','2',0,
-                             0,'c','x','d','e','4','3',0,
-                             0,' ','v','f','t','r','5',0,
-                             0,'n','b','h','g','y','6',0,
-                             0,0,'m','j','u','7','8',0,
-                             0,',','k','i','o','0','9',0,
-                             0,'.','/','l',';','p','-',0,
-                             0,0,'\'',0,'[','=',0,0,
-                             CAPS,R_SHIFT,ENTER,']',0,0x5C,0,0,
-                             0,0,0,0,0,0,BKSP,0,
-                             0,'1',0,'4','7',0,0,0,
-                             0,'.','2','5','6','8',ESC,NUMLOCK,
-                             F11,'+','3','-','*','9',0,0};
-
-const char ShiftScanCodes[128] = {0,F9,0,F5,F1,F3,F2,F12,
-                                  0,F10,F8,F6,F4,TAB,'~',0,
-                                  0,0,L_SHIFT,0,L_CTRL,'Q','!',0,
-                                  0,0,'Z','S','A','W','@',0,
-                                  0,'C','X','D','E','$','#',0,
-                                  0,' ','V','F','T','R','%',0,
-                                  0,'N','B','H','G','Y','^',0,
-                                  0,0,'M','J','U','&','*',0,
-                                  0,'<','K','I','O',')','(',0,
-                                  0,'>','?','L',':','P','_',0,
-                                  0,0,'|',0,'{','+',0,0,
-                                  CAPS,R_SHIFT,ENTER,'}',0,'|',0,0,
-                                  0,0,0,0,0,0,BKSP,0,
-                                  0,'1',0,'4','7',0,0,0,
-                                  0,'.','2','5','6','8',ESC,NUMLOCK,
-                                  F11,'+','3','-','*','9',0,0};
+//Local functions
+static void kbPostEvent(void);
+static void kbTranslate(void);
+static void kbPutChar(uint8_t ch);
+static void kbPutBytes(const uint8_t *s, uint8_t n, uint8_t urgent);
+
+//Macros, macro.c
+extern mcMacros_t *pMacros;
+
+//Set 2 decoder and the event it produced last
+kbDecoder_t xDecoder, *pDecoder;
+kbEvent_t xEvent, *pEvent;
+
+//Every key held right now, by keycode
+kbKeyState_t xKeys, *pKeys;
+
+//Output format (KB_OUT_xxx) and the event record clock
+uint8_t kbOutMode;                                                              //Format posted now
+volatile uint8_t kbOutReq;                                                      //Format the master asked for, set by the SPI ISR
+uint32_t kbEvtLast;                                                             //Timebase the event clock has counted up to
+uint32_t kbEvtUnits;                                                            //KB_EVT_SHIFT units since the last record
+uint8_t kbEvtMods;                                                              //Modifier bits as of the last record
+
+//Key descriptor table generated from keymap.h, indexed by keycode
+#define KB_KEY_DESC(name, code, kind, plain, shifted) [code] = {plain, shifted, kind},
+const kbKeyDesc_t kbKeyMap[256] = {
+   KEYMAP(KB_KEY_DESC)
+};
+
+//Layout tables generated from layouts.h, indexed by KB_LAYOUT_xxx then SL_xxx
+#define KB_CAPS_BIT(key, plain, shifted, altgr, caps) | ((uint64_t)(caps) << SL_##key)
+#define KB_LAYOUT_KEY(key, plain, shifted, altgr, caps) [SL_##key] = {plain, shifted, altgr},
+#define KB_LAYOUT_DESC(name) {0 LAYOUT_##name(KB_CAPS_BIT), {LAYOUT_##name(KB_LAYOUT_KEY)}},
+const kbLayout_t kbLayouts[KB_LAYOUTS] = {
+   LAYOUTS(KB_LAYOUT_DESC)
+};
+
+#define KB_COMPOSE_DESC(accent, base, result) {accent, base, result},
+const kbCompose_t kbComposeMap[] = {
+   KB_COMPOSE(KB_COMPOSE_DESC)
+};
+const uint8_t kbSpacing[DK_LAST + 1] = KB_SPACING;
+
+//Layout in use, the one the master asked for and the dead key waiting for a character
+uint8_t kbLayout;
+volatile uint8_t kbLayoutReq;                                                   //Set by the SPI ISR
+uint8_t kbDead;                                                                 //DK_xxx, 0 = none
+
+//Keyboard plugged in again, see kbPlug()
+uint16_t kbPlugs;
+uint8_t kbBatResult;
 
 /*------------------------------------------*/
 /* Setup the keyboard                       */
 /*------------------------------------------*/
 int16_t kbInitialize(void){
    
-   //Init the PS2 data and clock pins
-   PS2DATA_D = 1;                                                               //Set PS2 data pin to open drain
-   PS2DATA_T = 0;                                                               //Set PS2 data pin to output (input can still be read)
-   PS2DATA_L = 1;                                                               //Allow data line to go high
-   PS2CLOCK_D = 1;                                                              //Set PS2 clock line to open drain
-   PS2CLOCK_T = 0;                                                              //Set PS2 clock pin to output (input can still be read)
-   PS2CLOCK_L = 1;                                                              //Allow clock line to pull up
-   ps2State = PS2START;                                                         //Set the machine state
+   halTimebaseSetup();                                                          //Command timeouts, frame timing
    
    //Setup circular buffer for translated characters   
    pOutBuf = &xOutBuf;                                                          //Ref character queue
-   pOutBuf->head = 0;                                                           //Initialize it
-   pOutBuf->tail = 0;
-   pOutBuf->count = 0;
-   memset(&pOutBuf->buffer,0x00,BUFSIZE);
-   
+   qInit(pOutBuf,QUEUE_POLICY);                                                 //Initialize it
+
+   //Setup the set 2 decoder
+   pDecoder = &xDecoder;
+   memset(pDecoder,0x00,sizeof(xDecoder));
+   pEvent = &xEvent;
+   pKeys = &xKeys;
+   memset(pKeys,0x00,sizeof(xKeys));
+   kbOutMode = kbOutReq = KB_OUT_ASCII;
+   kbLayout = kbLayoutReq = KB_LAYOUT;
+   kbDead = 0;
+   mcInitialize();
+   tmInitialize();
+
    //Setup the keyboard flags structure 
    pFlags = &xFlags;
    memset(pFlags,0x00,sizeof(xFlags));
- 
-   //External interrupt 0 connected to PS2 KB clock pin
-   INTCON2bits.INT0EP = 1;                                                      //Interrupt on falling edge
-   IFS0bits.INT0IF = 0;                                                         //Clear Ext Int 0 interrupt flag
-   IEC0bits.INT0IE = 1;                                                         //Enable external interrupt 0
-   
+
+   //Bring up the keyboard port, INT0 last
+   pKbPort = &xPorts[PS2_KBD];
+   ps2PortInit(pKbPort,PS2_KBD);                                                //Pins, Timer1, rings, counters and command scheduler
+
    //Send an echo to the keyboard
    return kbEcho();
 }
 
-void kbCheckFlags(void){
-   
-   static uint8_t prevCode=0;                                                   //Previous scan code
-   
-   if(scanCode == CAPS_S || scanCode == NUM_S)                                  //Caps or num lock?
-      pFlags->skipFlag = 1;                                                     //Yes.. set it on the break
-   else if(scanCode == L_SHIFT_S|| scanCode == R_SHIFT_S){                      //Shift key?
-      if(pFlags->breakFlag)                                                     //Break sequence?
-         pFlags->shiftFlag = 0;                                                 //Yes.. clear the shift flag
-      else{
-         pFlags->shiftFlag = 1;                                              
-         pFlags->skipFlag = 1;                                                  //Discard this code
+/*------------------------------------------*/
+/* Keep the pressed key bitmap in step. A   */
+/* make for a key already held is a         */
+/* typematic repeat and changes nothing;    */
+/* returns 1 for one                        */
+/*------------------------------------------*/
+static uint8_t kbKeyTrack(uint8_t key, uint8_t brk){
+
+   uint8_t *byte = &pKeys->down[key >> 3];
+   uint8_t bit = 1 << (key & 7);
+   uint8_t rep = 0;
+
+   HAL_SPI_LOCK();                                                              //HOST_OP_KEYS copies it from the SPI ISR
+   if(!brk){
+      if(!(*byte & bit)){
+         *byte |= bit;
+         pKeys->held++;
+         pKeys->seq++;
       }
-   }
-   else if(scanCode == BREAK_S){                                                //Break code?
-      if(prevCode == CAPS_S)                                                    //Caps lock break sequence?
-         pFlags->capsFlag = 1;                                                  //Yes.. set its flag
-      else if(prevCode == NUM_S)
-         pFlags->numsFlag = 1;
       else
-         pFlags->breakFlag = 2;                                                 //Discard the break sequence
+         rep = 1;
+   }
+   else if(*byte & bit){
+      *byte &= ~bit;
+      if(!--pKeys->held)
+         pKeys->flags = 0;                                                      //Nothing held, the bitmap is exact again
+      pKeys->seq++;
+   }
+   else{
+      pKeys->flags |= KS_STRAY;
+      pKeys->seq++;
+   }
+   HAL_SPI_UNLOCK();
+   return rep;
+}
+
+/*------------------------------------------*/
+/* Keyboard reset itself or lost track of   */
+/* its keys                                 */
+/*------------------------------------------*/
+static void kbKeyReset(uint8_t flags){
+
+   HAL_SPI_LOCK();
+   if(flags)
+      pKeys->flags |= flags;
+   else{                                                                        //BAT: nothing is held any more
+      memset(pKeys->down,0x00,sizeof(pKeys->down));
+      pKeys->held = 0;
+      pKeys->flags = 0;
+      pDecoder->mods = 0;
+   }
+   pKeys->seq++;
+   HAL_SPI_UNLOCK();
+}
+
+void kbKeysRead(kbKeyState_t *k){
+   *k = *pKeys;
+   k->mods = pDecoder->mods;
+}
+
+/*------------------------------------------*/
+/* Set 2 decoder. One raw byte in, at most  */
+/* one event out, a fixed amount of work    */
+/* per byte. E0 sets bit 7 of the keycode,  */
+/* F0 marks a release, E1 (Pause) swallows  */
+/* its 7 trailing bytes and reports one     */
+/* make. The fake shifts E0 12 / E0 59 that */
+/* wrap print screen and the nav keys are   */
+/* dropped. Every make and break also goes  */
+/* into the pressed key bitmap              */
+/*------------------------------------------*/
+uint8_t kbDecode(uint8_t code, kbEvent_t *ev){
+
+   uint8_t key, mod;
+
+   if(pDecoder->skip){                                                          //Inside the Pause sequence
+      if(--pDecoder->skip)
+         return KB_EV_NONE;
+      ev->type = KB_EV_KEY;
+      ev->key = KEY_PAUSE;                                                      //Pause has no break code
+      ev->brk = 0;
+      ev->rep = 0;
+      ev->mods = pDecoder->mods;
+      return KB_EV_KEY;
    }
+
+   switch(code){
+      case EXT_S:
+         pDecoder->ext = 0x80;
+         return KB_EV_NONE;
+      case BREAK_S:
+         pDecoder->brk = 1;
+         return KB_EV_NONE;
+      case PAUSE_S:
+         pDecoder->skip = 7;
+         return KB_EV_NONE;
+      case KB_ERR2:                                                             //Key detection error, keys may be missing
+         pDecoder->ext = pDecoder->brk = 0;
+         kbKeyReset(KS_OVERRUN);
+         return KB_EV_NONE;
+      case F7_S:
+         code = KEY_F7;
+         break;
+      default:
+         if(code & 0x80){                                                       //Response byte, not a key
+            pDecoder->ext = pDecoder->brk = 0;
+            if(code == KB_ERR)
+               kbKeyReset(KS_OVERRUN);
+            else if(code == KB_BAT)
+               kbKeyReset(0);
+            ev->type = KB_EV_RESP;
+            ev->key = code;
+            ev->brk = 0;
+            ev->rep = 0;
+            ev->mods = pDecoder->mods;
+            return KB_EV_RESP;
+         }
+   }
+
+   key = code | pDecoder->ext;
+   ev->brk = pDecoder->brk;
+   pDecoder->ext = pDecoder->brk = 0;
+
+   if(key == (0x80 | FAKE_LSH_S) || key == (0x80 | FAKE_RSH_S))
+      return KB_EV_NONE;
+   ev->rep = kbKeyTrack(key, ev->brk);
+
+   mod = kbKeyMap[key].kind == KC_MOD ? kbKeyMap[key].plain : 0;
+   if(ev->brk)
+      pDecoder->mods &= ~mod;
+   else
+      pDecoder->mods |= mod;
+
+   ev->type = KB_EV_KEY;
+   ev->key = key;
+   ev->mods = pDecoder->mods;
+   return KB_EV_KEY;
+}
+
+/*------------------------------------------*/
+/* Lock keys act on release, like before. A */
+/* BAT result that is no reply to a command */
+/* means the keyboard was plugged in again  */
+/*------------------------------------------*/
+void kbCheckFlags(void){
    
-   prevCode = scanCode;                                                         //Save this scan code to compare to the next one
+   const kbKeyDesc_t *desc;
+
+   if(pEvent->type == KB_EV_RESP && KB_BAT_DONE(pEvent->key))
+      pFlags->plugFlag = 1;
+   if(pEvent->type != KB_EV_KEY || !pEvent->brk)
+      return;
+
+   desc = &kbKeyMap[pEvent->key];
+   if(desc->kind != KC_LOCK)
+      return;
+   if(desc->plain == LK_CAPS)                                                   //Caps lock released?
+      pFlags->capsFlag = 1;                                                     //Yes.. set its flag
+   else if(desc->plain == LK_NUM)
+      pFlags->numsFlag = 1;
+}
+
+static uint8_t kbLeds(void){
+
+   if(capsLock && numsLock)                                                     //Caps and Nums lock?
+      return ARG_CAP_NUM;
+   else if(capsLock)                                                            //Just caps lock
+      return ARG_CAPS;
+   else if(numsLock)                                                            //Just nums lock
+      return ARG_NUM;
+   else
+      return ARG_NONE;                                                          //All led's off
 }
 
 void kbSetLocks(void){
@@ -169,236 +339,507 @@ void kbSetLocks(void){
    else
       numsLock = ~numsLock;
       
-   if(capsLock && numsLock)                                                     //Caps and Nums lock?
-      kbSendCmd(CMD_SET_LED,ARG_CAP_NUM);
-   else if(capsLock)                                                            //Just caps lock
-      kbSendCmd(CMD_SET_LED,ARG_CAPS);                              
-   else if(numsLock)                                                            //Just nums lock
-      kbSendCmd(CMD_SET_LED,ARG_NUM);
-   else
-      kbSendCmd(CMD_SET_LED,ARG_NONE);                                          //All led's off
-               
-   while(!pFlags->scanFlag);                                                    //Wait for the KB to ACK
-   pFlags->scanFlag = 0;
-   if(scanCode != KB_ACK){
-      kbError = ERR_LCK_NOACK;
-      pFlags->errFlag = 1;
-   }     
+   kbCmdQueue(pKbPort,CMD_SET_LED,kbLeds());                                    //The scheduler flags ERR_LCK_NOACK if it never gets an ACK
+}
+
+/*------------------------------------------*/
+/* Keyboard plugged in again (or power      */
+/* cycled on its own): it is back at its    */
+/* defaults, set 2, LEDs off. kbDecode()    */
+/* has forgotten the keys held. Queue only  */
+/* what differs from that, keys typed right */
+/* after it wait behind every command. A    */
+/* failed BAT is an error, nothing is sent  */
+/*------------------------------------------*/
+void kbPlug(void){
+
+   kbPlugs++;
+   kbBatResult = pEvent->key;
+   kbDead = 0;
+   mcCancel();
+   if(pEvent->key != KB_BAT){
+      ps2Error(pKbPort,ERR_BAT);
+      return;
+   }
+   if(kbLeds() != ARG_NONE)                                                     //Set 2 is the only one used, no CMD_CODE_SET
+      kbCmdQueue(pKbPort,CMD_SET_LED,kbLeds());
+   tmRestore();                                                                 //Typematic setting, if not the default
+}
+
+/*------------------------------------------*/
+/* Character for a layout dependent key.    */
+/* AltGr wins where the layout has an AltGr */
+/* character, then shift, then caps lock    */
+/* for the keys the layout marks            */
+/*------------------------------------------*/
+static uint8_t kbLayoutChar(uint8_t slot){
+
+   const kbLayout_t *lay = &kbLayouts[kbLayout];
+   const kbLayoutKey_t *k = &lay->keys[slot];
+
+   if((pEvent->mods & KM_RALT) && k->altgr)
+      return k->altgr;
+   if(pEvent->mods & KM_SHIFT)
+      return k->shifted;
+   if(capsLock && ((lay->caps >> slot) & 1))
+      return k->shifted;
+   return k->plain;
+}
+
+/*------------------------------------------*/
+/* A character after a dead key. Composed   */
+/* if KB_COMPOSE has it, the spacing accent */
+/* for space, else the spacing accent is    */
+/* posted first and the character follows   */
+/*------------------------------------------*/
+static uint8_t kbCompose(uint8_t ch){
+
+   uint8_t dk = kbDead, i;
+
+   kbDead = 0;
+   if(ch == ' ')
+      return kbSpacing[dk];
+   for(i = 0; i < sizeof(kbComposeMap) / sizeof(kbComposeMap[0]); i++)
+      if(kbComposeMap[i].accent == dk && kbComposeMap[i].base == ch)
+         return kbComposeMap[i].result;
+   kbPutChar(kbSpacing[dk]);
+   return ch;
+}
+
+/*------------------------------------------*/
+/* Translate the steps of a trigger that    */
+/* broke off, as they were typed            */
+/*------------------------------------------*/
+static void kbReplay(void){
+
+   kbEvent_t ev = *pEvent;
+   uint8_t i;
+
+   for(i = 0; i < pMacros->nHeld; i++){
+      pEvent->key = pMacros->held[i].key;
+      pEvent->mods = pMacros->held[i].mods;
+      kbTranslate();
+   }
+   pMacros->nHeld = 0;
+   *pEvent = ev;
+}
+
+/*------------------------------------------*/
+/* Run a key make past the macro triggers   */
+/* (macro.c). Returns 1 if a trigger took   */
+/* it; the key that breaks a trigger off is */
+/* tried again as the start of another      */
+/*------------------------------------------*/
+static uint8_t kbMacro(void){
+
+   const uint8_t *text;
+   uint8_t r, n, urgent;
+
+   r = mcMatch(pEvent->key, pEvent->mods);
+   if(r == MC_MISS && pMacros->nHeld){
+      kbReplay();
+      r = mcMatch(pEvent->key, pEvent->mods);
+   }
+   if(r == MC_FIRE){
+      kbDead = 0;
+      text = mcText(&n);
+      urgent = memchr(text, ENTER, n) || memchr(text, ESC, n);                  //Plain ASCII, never part of a UTF-8 sequence
+      kbPutBytes(text, n, urgent);                                              //The whole expansion in one go
+   }
+   return r != MC_MISS;
 }
 
 /*----------------------------------------------------*/
-/*Convert incoming scan codes via the translate tables*/
-/*and store them in the circular output buffer        */
+/*Convert the current key event via the key map and   */
+/*store it in the circular output buffer, or post it  */
+/*as an event record in KB_OUT_EVENTS                 */
 /*----------------------------------------------------*/
 void kbPostCode(void){
-   
-   //Return response bytes as is
-   if(scanCode == KB_BAT || scanCode == KB_ECHO ||
-      scanCode == KB_ACK || scanCode == KB_FAIL ||
-      scanCode == KB_FL2 || scanCode == KB_RSND ||
-      scanCode == KB_ERR)
-   {
-      pOutBuf->buffer[pOutBuf->head++] = scanCode;                              //No conversion
-   }
-   else{   
-      if (pFlags->shiftFlag)                                                    //Shift key prior code sent?
-         pOutBuf->buffer[pOutBuf->head++] = ShiftScanCodes[scanCode % 128];     //Yes.. use shift table
-      else{									
-         pOutBuf->buffer[pOutBuf->head++] = ScanCodes[scanCode % 128];          //Otherwise use standard table
-
-         if (capsLock && pOutBuf->buffer[pOutBuf->count] >= 'a' 
-            && pOutBuf->buffer[pOutBuf->count] <= 'z')
-             pOutBuf->buffer[pOutBuf->count] = 
-                                toupper(pOutBuf->buffer[pOutBuf->count]);       //Caps lock on, convert to upper case
-      }
-   }
 
-   pOutBuf->count++;
-   pOutBuf->head %= BUFSIZE;
-   
-   if(pOutBuf->head == pOutBuf->tail){
-      kbError = ERR_OVERFLOW;
-      pFlags->errFlag =1;
+   if(kbOutMode == KB_OUT_EVENTS){                                              //Binary records instead of characters
+      kbPostEvent();
+      return;
    }
+   if(pEvent->type == KB_EV_KEY && !pEvent->brk && kbKeyMap[pEvent->key].kind != KC_MOD &&
+      kbMacro())
+      return;
+   kbTranslate();
+}
+
+/*------------------------------------------*/
+/* Typematic repeat made by the firmware    */
+/* (typematic.c): the make of a held key    */
+/* posted again with the modifiers held now */
+/*------------------------------------------*/
+uint8_t kbRepeat(uint8_t key){
+
+   if(!(pKeys->down[key >> 3] & (1 << (key & 7))))
+      return 0;
+   pEvent->type = KB_EV_KEY;
+   pEvent->key = key;
+   pEvent->brk = 0;
+   pEvent->mods = pDecoder->mods;
+   pEvent->rep = 1;
+   kbPostCode();
+   return 1;
 }
 
-/*---------------------------------------------------------------------*/
-//         Send passed command to the keyboard     
-//1)   Bring the Clock line low for at least 100 microseconds.
-//2)   Bring the Data line low.
-//3)   Release the Clock line.
-//4)   Wait for the device to bring the Clock line low.
-//5)   Set/reset the Data line to send the first data bit
-//6)   Wait for the device to bring Clock high.
-//7)   Wait for the device to bring Clock low.
-//8)   Repeat steps 5-7 for the other seven data bits and the parity bit
-//9)   Release the Data line.
-//10) Wait for the device to bring Data low.
-//11) Wait for the device to bring Clock  low.
-//12) Wait for the device to release Data and Clock
-/*---------------------------------------------------------------------*/
-void kbSendCmd(uint8_t cmd, uint8_t arg)
-{
+/*------------------------------------------*/
+/* Translate the current event to a         */
+/* character and queue it                   */
+/*------------------------------------------*/
+static void kbTranslate(void){
    
-   IEC0bits.INT0IE = 0;                                                         //Disable external Int0 while in command mode
-   kbReqToSend();
-   kbWriteByte(cmd);                                                            //Send passed command to the keyboard
-
-   if (arg != NO_ARGS){                                                         //Send the command argument. 0xFF indicates no ARG
-      kbReqToSend();
-      kbWriteByte(arg);
-   }                                 
-      
-   IFS0bits.INT0IF = 0; 
-   IEC0bits.INT0IE = 1;                                                         //Enable ext int 0
+   const kbKeyDesc_t *desc;
+   uint8_t ch;
+
+   if(pEvent->type == KB_EV_RESP){                                              //Return response bytes as is
+      ch = pEvent->key;
+      if(KB_BAT_DONE(ch))                                                       //But say plainly that the keyboard is back
+         ch = ch == KB_BAT ? PLUG_OK : PLUG_FAIL;
+   }
+   else{
+      if(pEvent->brk)                                                           //Releases post nothing
+         return;
+
+      desc = &kbKeyMap[pEvent->key];
+      switch(desc->kind){
+         case KC_CHAR:
+         case KC_LAYOUT:
+            if(desc->kind == KC_LAYOUT)
+               ch = kbLayoutChar(desc->plain);
+            else if(pEvent->mods & KM_SHIFT)                                    //Shift key held?
+               ch = desc->shifted;                                              //Yes.. use the shifted character
+            else{
+               ch = desc->plain;
+               if(capsLock && ch >= 'a' && ch <= 'z')
+                  ch = toupper(ch);                                             //Caps lock on, convert to upper case
+            }
+            if(ch && ch <= DK_LAST){                                            //Dead key, wait for the next character
+               if(kbDead)
+                  kbPutChar(kbSpacing[kbDead]);                                 //Two in a row, the first one stands alone
+               kbDead = ch;
+               return;
+            }
+            if(ch && kbDead)
+               ch = kbCompose(ch);
+            if((pEvent->mods & KM_CTRL) && ((ch | 0x20) >= 'a' && (ch | 0x20) <= 'z'))
+               ch &= 0x1F;                                                      //Ctrl+letter, ASCII control code
+            break;
+         case KC_PAD:
+            kbDead = 0;                                                         //Any other key cancels a dead key
+            ch = numsLock ? desc->plain : desc->shifted;                        //Digits with num lock, nav keys without
+            break;
+         case KC_FUNC:
+            kbDead = 0;
+            ch = desc->plain;
+            break;
+         default:                                                               //Modifiers, locks and unmapped keys
+            ch = 0;
+            break;
+      }
+      if(!ch)
+         return;
+   }
+   kbPutChar(ch);
 }
 
 /*------------------------------------------*/
-/* Initiates a write to the keyboard        */
+/* Queue one translated character. In       */
+/* KB_OUT_UTF8 anything above 0x7F is a     */
+/* multi byte sequence. The private codes   */
+/* come out as U+0081-U+009F                */
 /*------------------------------------------*/
-void kbReqToSend(){
-   PS2CLOCK_L = 0;                                                              //Clock line needs pulled low for a minimum of 100us 
-   __delay_us(100);                                                             
-   PS2DATA_L = 0;                                                               //Pull data line low (start bit)
-   __delay_us(20);                                                              //Hold it for 20us
-   PS2CLOCK_L = 1;                                                              //Allow clock line to go high again
+static void kbPutChar(uint8_t ch){
+
+   uint8_t seq[KB_UTF8_MAX];
+   uint8_t n = 1;
+
+   seq[0] = ch;
+   if(kbOutMode == KB_OUT_UTF8 && ch >= 0x80){
+      if(ch == CH_EURO){                                                        //U+20AC
+         seq[0] = 0xE2;
+         seq[1] = 0x82;
+         seq[2] = 0xAC;
+         n = 3;
+      }
+      else{                                                                     //Latin-1 is U+0080-U+00FF
+         seq[0] = 0xC0 | (ch >> 6);
+         seq[1] = 0x80 | (ch & 0x3F);
+         n = 2;
+      }
+   }
+   kbPutBytes(seq, n, KB_URGENT(ch));
 }
 
 /*------------------------------------------*/
-/* Send a byte to the keyboard (only used   */
-/* by command function                      */
+/* Queue a character or an expansion. More  */
+/* than one byte goes in whole or not at    */
+/* all, and Q_DROP_OLDEST makes room a      */
+/* whole UTF-8 character at a time in       */
+/* KB_OUT_UTF8, so the master never gets    */
+/* half of one. Urgency is the caller's,    */
+/* from the character before encoding: a    */
+/* UTF-8 continuation byte can look like    */
+/* PLUG_OK                                  */
 /*------------------------------------------*/
-void kbWriteByte(uint8_t byte)
-{
-   int16_t ctr;
-   uint8_t parity=0;                                             
+static void kbPutBytes(const uint8_t *s, uint8_t n, uint8_t urgent){
 
-   /*----------------------------------*/
-   /* Shift in the passed command. The */
-   /* keyboard will control the clock. */
-   /* Pass data when clock line is low */
-   /*----------------------------------*/
-   for (ctr=0x01; ctr<=0x80; ctr*=2){
-      while(PS2CLOCK_P);                                                        //Wait for keyboard to pull clock line back low
+   uint16_t drops = pOutBuf->drops;
 
-      if (ctr & byte){                                                          //CMD bit high?
-         PS2DATA_L = 1;                                                         //Yes.. set data line high
-         parity++;
+   if(pOutBuf->policy == Q_DROP_OLDEST){                                        //Dropping moves tail, keep the SPI ISR out
+      HAL_SPI_LOCK();
+      while(qSpace(pOutBuf) < n){
+         if(kbOutMode == KB_OUT_UTF8)
+            qDropUtf8(pOutBuf);                                                 //Whole characters only
+         else
+            qDrop(pOutBuf, n - qSpace(pOutBuf));
       }
+      if(n == 1)
+         qPut(pOutBuf,s[0]);
       else
-         PS2DATA_L = 0;                                                         //Otherwise set data line low
+         qWrite(pOutBuf,s,n);
+      HAL_SPI_UNLOCK();
+   }
+   else if(n == 1)
+      qPut(pOutBuf,s[0]);
+   else
+      qWrite(pOutBuf,s,n);                                                      //All or nothing
+   if(pOutBuf->drops != drops){                                                 //New or oldest character lost?
+      ps2Error(pKbPort,ERR_OVERFLOW);
+      return;
+   }
+   if(urgent)
+      pFlags->urgent = 1;
+}
+
+/*------------------------------------------*/
+/* Advance the event clock in whole units,  */
+/* carrying the remainder in kbEvtLast      */
+/*------------------------------------------*/
+static void kbEvtClock(void){
+
+   uint32_t units = (halNow() - kbEvtLast) >> KB_EVT_SHIFT;
+
+   kbEvtLast += units << KB_EVT_SHIFT;
+   kbEvtUnits += units;
+}
+
+/*------------------------------------------*/
+/* Post the current event as a record       */
+/*                                          */
+/*   header   EVT_xxx, delta bits 3..0      */
+/*   0..4     more delta bits, 7 per byte,  */
+/*            bit 7 set if another follows  */
+/*   keycode  raw byte with EVT_RESP        */
+/*   mods     only with EVT_MODS            */
+/*                                          */
+/* The delta is the time since the last     */
+/* record in KB_EVT_SHIFT units. Keystrokes */
+/* take 3 bytes, 2 within 16ms of the one   */
+/* before, one more if the modifiers        */
+/* changed. A record that does not fit is   */
+/* dropped whole, its delta carried forward */
+/*------------------------------------------*/
+static void kbPostEvent(void){
+
+   uint8_t rec[KB_EVT_MAX];
+   uint8_t len = 1;
+   uint32_t delta;
+
+   kbEvtClock();
+   delta = kbEvtUnits;
+   rec[0] = delta & EVT_DELTA;
+   delta >>= 4;
+   if(delta)
+      rec[0] |= EVT_MORE;
+   while(delta){
+      rec[len] = delta & 0x7F;
+      delta >>= 7;
+      if(delta)
+         rec[len] |= 0x80;
+      len++;
+   }
+   rec[len++] = pEvent->key;
+   if(pEvent->type == KB_EV_RESP)
+      rec[0] |= EVT_RESP;
+   else{
+      if(pEvent->brk)
+         rec[0] |= EVT_BRK;
+      if(pEvent->mods != kbEvtMods){
+         rec[0] |= EVT_MODS;
+         rec[len++] = pEvent->mods;
+      }
+   }
 
-      while(!PS2CLOCK_P);                                                       //Wait for keyboard to release clock line high
+   if(!qWrite(pOutBuf,rec,len)){
+      ps2Error(pKbPort,ERR_OVERFLOW);
+      return;
    }
+   kbEvtUnits = 0;
+   if(rec[0] & EVT_MODS)
+      kbEvtMods = pEvent->mods;
+   if(pEvent->type == KB_EV_KEY && !pEvent->brk && kbKeyMap[pEvent->key].kind == KC_FUNC &&
+      KB_URGENT(kbKeyMap[pEvent->key].plain))                                   //KC_LAYOUT plain is a slot, not a character
+      pFlags->urgent = 1;
+   if(pEvent->type == KB_EV_RESP && KB_BAT_DONE(pEvent->key))                   //Keyboard plugged in
+      pFlags->urgent = 1;
+}
+
+/*------------------------------------------*/
+/* Main loop. The format changes only with  */
+/* the output queue empty, so queued bytes  */
+/* are always in kbOutMode (see host.c).    */
+/* A layout change takes effect at once and */
+/* drops a pending dead key.                */
+/* Running the event clock every pass keeps */
+/* long quiet spells clear of the timebase  */
+/* wrap                                     */
+/*------------------------------------------*/
+void kbOutService(void){
 
-   /*----------------------------------*/
-   /* PS2 uses odd parity. If even # of*/
-   /* 1's in command byte, then send 1 */
-   /* for parity, otherwise send a 0   */
-   /*----------------------------------*/
-   while(PS2CLOCK_P);                                                           //Wait for keyboard to pull clock line back low
+   uint8_t req = kbOutReq;
+   uint8_t lay = kbLayoutReq;
 
-   if ((parity % 2) == 0)                                                       //Remainder from division?
-      PS2DATA_L = 1;                                                            //No.. even nbr of 1's, set parity to 1
-   else 
-      PS2DATA_L = 0;                                                            //Yes.. odd nbr of 1's, set parity to 0
-
-   /*----------------------------------*/
-   /* Send the stop bit (always 1)     */
-   /*----------------------------------*/
-   while(!PS2CLOCK_P);                                                          //Wait for keyboard to clock in the parity bit
-   while(PS2CLOCK_P);                                                           //Wait for keyboard to pull clock line back low
-   PS2DATA_L = 1;                                                               //Stop bit
-   while(!PS2CLOCK_P);                                                          //Wait for keyboard to clock in the stop bit
-
-   /*----------------------------------*/
-   /* Get the ACK from the keyboard    */
-   /* ACK is sent when the clock line  */
-   /* is high                          */
-   /*----------------------------------*/
-   while (PS2DATA_P);                                                           //Wait for keyboard to pull data line low (ACK bit)
-   while (PS2CLOCK_P);                                                          //Wait for keyboard to pull clock line low
-   while (!PS2CLOCK_P);                                                         //Wait for keyboard to release clock line high
-   while (!PS2DATA_P);                                                          //Wait for the keyboard to release the data line high
-   return;
+   if(req != kbOutMode && !qCount(pOutBuf)){
+      kbOutMode = req;
+      mcCancel();                                                               //No macros in KB_OUT_EVENTS, and no mixed formats
+      kbEvtLast = halNow();                                                     //First delta counts from the switch
+      kbEvtUnits = 0;
+      kbEvtMods = 0;
+   }
+   if(lay != kbLayout && lay < KB_LAYOUTS){                                     //Unknown layouts are ignored
+      kbLayout = lay;
+      kbDead = 0;
+   }
+   if(kbOutMode == KB_OUT_EVENTS)
+      kbEvtClock();
 }
 
+/*------------------------------------------*/
+/* Back pressure for the Q_BLOCK policy.    */
+/* Above KB_Q_HIGH the keyboard is          */
+/* inhibited until the host drains the      */
+/* queue to KB_Q_LOW. The headroom above    */
+/* KB_Q_HIGH takes what is already in the   */
+/* raw ring; should the queue fill anyway   */
+/* the ring is left alone until there is    */
+/* room for whatever the next key can post  */
+/* (KB_POST_MAX, a macro expansion). While */
+/* a command waits for its ACK or reply     */
+/* the clock stays released, or the         */
+/* keyboard could not answer it             */
+/*------------------------------------------*/
+uint8_t kbFlowControl(void){
+   
+   uint16_t used;
+   uint8_t hold;
+
+   if(pOutBuf->policy != Q_BLOCK)
+      return 1;
+
+   used = qCount(pOutBuf);
+   if(used >= KB_Q_HIGH)
+      pFlags->hold = 1;
+   else if(used <= KB_Q_LOW)
+      pFlags->hold = 0;
+
+   hold = pFlags->hold && !kbCmdBusy(pKbPort);
+   if(hold != pKbPort->inhibit && !ps2TxBusy(pKbPort))                          //Clock line belongs to the transmitter while it is busy
+      ps2Inhibit(pKbPort,hold);
+   return BUFSIZE - used >= KB_POST_MAX;                                        //Room for the longest record or expansion
+}
+
+/*------------------------------------------*/
+/* Work the main loop has on the keyboard   */
+/* side, for pmIdle(). A queue held back is */
+/* work again once the master has drained   */
+/* it to KB_Q_LOW, and the raw ring only    */
+/* while kbFlowControl() lets it drain      */
+/*------------------------------------------*/
+uint8_t kbBusy(void){
+
+   uint16_t used = qCount(pOutBuf);
+
+   if(kbCmdBusy(pKbPort) || (kbOutReq != kbOutMode && !used) ||
+      (kbLayoutReq != kbLayout && kbLayoutReq < KB_LAYOUTS))
+      return 1;
+   if(pFlags->hold && used <= KB_Q_LOW)
+      return 1;
+   return ps2RxPending(pKbPort) && BUFSIZE - used >= KB_POST_MAX;
+}
 
+/*------------------------------------------*/
+/* Echo through the command scheduler at    */
+/* power up, before the main loop runs.     */
+/* Anything but the reply is dropped        */
+/*------------------------------------------*/
 int kbEcho(void){
    
-   uint8_t retryCnt = 0;                                                  
-   
-   do{
-      kbSendCmd(CMD_ECHO,NO_ARGS);                                              //Send an echo command
-      while(!pFlags->scanFlag);                                                 //Wait for the keyboard to reply
-      pFlags->scanFlag = 0;                                                     //Clear the flag
-   }while(scanCode != CMD_ECHO && retryCnt++ < 3);                              //Up to three attempts
+   kbCmdQueue(pKbPort,CMD_ECHO,NO_ARGS);                                        //Send an echo command
+   while(kbCmdBusy(pKbPort)){                                                   //Retries and timeouts are the scheduler's
+      if(kbNextCode())
+         kbCmdReply(pKbPort,scanCode);
+      kbCmdService(pKbPort);
+      HAL_SPIN();
+   }
    
-   if(scanCode != CMD_ECHO)                                                     //Success?
+   if(pKbPort->cmd.last.result != CMDR_OK)                                      //Success?
       return ERR_ECHO;                                                          //No, set error code
    else 
       return ERR_NONE;                                                          //Echo passed
 }
 
 /*------------------------------------------*/
-/* External Interrupt 0 ISR (PS2 Clock pin) */
-/* State machine to receive scan codes from */
-/* a PS2 keyboard                           */
+/* Take the oldest raw scan code off the    */
+/* keyboard port into scanCode. Returns 0   */
+/* if the ring is empty                     */
 /*------------------------------------------*/
-void __attribute ((interrupt, no_auto_psv)) _INT0Interrupt(void)
-{
-   switch (ps2State){	
-      case PS2START:                                                            //Start state
-         if (!PS2DATA_P){                                                       //Data pin low for the start bit  
-            kbBitCnt = 8;                                                       //Init bit counter	
-            kbParity = 0;                                                       //Init parity check
-            ps2State = PS2BIT;                                                  //Bump to the next state
-         }
-         break;
-         
-      case PS2BIT:                                                              //Data bit state
-         scanCode >>= 1;                                                        //Shift scan code bits
-			
-         if (PS2DATA_P)                                                         //Data line high?
-            scanCode += 0x80;                                                   //Yes.. turn on most significant bit in scan code buffer
-
-         kbParity ^= scanCode;                                                  //Update parity
-			
-         if (--kbBitCnt == 0)                                                   //If all scan code bits read
-            ps2State = PS2PARITY;                                               //Change state to parity
-         break;
-      
-      case PS2PARITY:                                                           //Parity state
-         if (PS2DATA_P)
-            kbParity ^= 0x80;					
-
-         if (kbParity & 0x80)                                                   //Continue if parity is odd
-            ps2State = PS2STOP;
-         else{
-            kbError = ERR_PARITY;                                               //Set parity error
-            pFlags->errFlag = 1;                                                //Flag it  
-            ps2State = PS2START;
-         }
-         break;
+uint8_t kbNextCode(void){
+   return ps2NextCode(pKbPort,&scanCode);
+}
 
-      case PS2STOP:                                                             //Stop state
-         if (PS2DATA_P){                                                        //Stop bit?
-            pFlags->scanFlag = 1;                                               //Good scan code
-            ps2State = PS2START;                                                //Reset to start state
-            break;  
-         }
-         else{                                                                  //Invalid stop bit
-            kbError = ERR_STOP;
-            pFlags->errFlag = 1;
-         }
-		
-      default:
-         kbError = ERR_INV_STATE;                                               //Should not get here
-         pFlags->errFlag = 1;
-         ps2State = PS2START;
-         break;
+/*------------------------------------------*/
+/* Copy the counters into a HOST_OP_DIAG    */
+/* record. Called from the SPI ISR, so a    */
+/* field INT0 is updating can be one count  */
+/* behind its neighbours                    */
+/*------------------------------------------*/
+void kbDiagRead(kbDiag_t *d){
+
+   memset(d,0x00,sizeof(*d));
+   d->version = KB_DIAG_VERSION;
+#if PS2_STATS
+   d->stats = 1;
+   if (pKbPort->stats.bitCnt){
+      d->bitMin = pKbPort->stats.bitMin;
+      d->bitMax = pKbPort->stats.bitMax;
+      d->bitMean = pKbPort->stats.bitSum / pKbPort->stats.bitCnt;
    }
-
-   IFS0bits.INT0IF = 0;                                                         //Reset int0 flag	
-   return;
+   d->frames = pKbPort->stats.frames;
+   d->isrMax = pKbPort->stats.isrMax;
+   memcpy(d->isrHist,pKbPort->stats.isrHist,sizeof(d->isrHist));
+#endif
+   d->err = pKbPort->err;
+   d->lastError = pKbPort->error;
+   d->rxDrops = pKbPort->rx.drops;
+#if PS2_CAPTURE
+   d->edgeDrops = pKbPort->edges.drops;
+#endif
+   d->outDrops = pOutBuf->drops;
+   d->outHwm = pOutBuf->hwm;
+   d->cmdFailures = pKbPort->cmd.failures;
+   d->holds = pKbPort->holds.count;
+   d->holdTicks = pKbPort->holds.ticks;
+   d->holdMax = pKbPort->holds.maxTicks;
+   d->plugs = kbPlugs;
+   d->batResult = kbBatResult;
+   d->idleMs = pPower->idleMs;
+   d->awakeMs = pPower->awakeMs;
+   d->naps = pPower->naps;
+#if PS2_PORTS > 1
+   d->auxErr = xPorts[PS2_AUX].err;                                             //Its own errors, never the keyboard's
+   d->auxLastError = xPorts[PS2_AUX].error;
+   d->auxCmdFailures = xPorts[PS2_AUX].cmd.failures;
+#endif
 }
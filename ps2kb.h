@@ -5,20 +5,40 @@
 #ifndef PS2KB_H
 #define	PS2KB_H
 
+#include "queue.h"
+#include "layouts.h"
+#include "keymap.h"
+#include "ps2port.h"
+#include "macro.h"
+
 /*----------------------------------------------------*/
 /* Defines                                            */
 /*----------------------------------------------------*/
-#define PS2DATA_D   ODCBbits.ODB6                                               //Open drain control for PS2 data line
-#define PS2DATA_T   TRISBbits.TRISB6                                            //Tris control for the data line
-#define PS2DATA_L   LATBbits.LATB6                                              //Lat control for writing to the data line (command mode only)
-#define PS2DATA_P   PORTBbits.RB6                                               //Port control for reading the data line
+#define QUEUE_POLICY Q_BLOCK                                                    //Output queue overflow policy, see qPolicy_t
+#define KB_Q_HIGH   (BUFSIZE - 32 - KB_POST_MAX)                                //Q_BLOCK: inhibit the keyboard at this many characters queued
+#define KB_Q_LOW    (BUFSIZE - 192)                                             //Q_BLOCK: release it again at this many
+#define KB_DIAG_VERSION 5                                                       //kbDiag_t layout
+//Characters that notify the host right away (see host.h)
+#define KB_URGENT(ch)   ((ch) == ENTER || (ch) == ESC || (ch) == PLUG_OK || (ch) == PLUG_FAIL)
 
-#define PS2CLOCK_D	ODCBbits.ODB7	                                            //Open drain control for PS2 clock line
-#define PS2CLOCK_T	TRISBbits.TRISB7                                            //Tris register control for PS2 clock line
-#define PS2CLOCK_L	LATBbits.LATB7                                              //Lat control for controling the clock line (command mode only)
-#define PS2CLOCK_P	PORTBbits.RB7                                               //External interrupt 0 for PS2 clock line
+//Output format, picked by the master with HOST_OP_ASCII / HOST_OP_EVENTS / HOST_OP_UTF8
+#define KB_OUT_ASCII    0                                                       //Translated characters (Latin-1), response bytes as is
+#define KB_OUT_EVENTS   1                                                       //Event records, one per make, break or response
+#define KB_OUT_UTF8     2                                                       //Translated characters as UTF-8, response bytes as U+0000-U+00FF
+#define KB_UTF8_MAX     3                                                       //Longest sequence posted, CH_EURO
+#define KB_EVT_SHIFT    14                                                      //Record time unit, 2^14 timebase ticks (1.024ms at 16MHz)
+#define KB_EVT_MAX      7                                                       //Longest record: header, 4 delta bytes, keycode, mods
+#define KB_POST_MAX     (MC_LEN_MAX + (MC_STEPS_MAX - 1) * 2 * KB_UTF8_MAX)     //Most bytes one key posts: held macro steps, each with a spacing accent, then an expansion
+#ifndef KB_LAYOUT
+#define KB_LAYOUT       KB_LAYOUT_US                                            //Layout at power up, the master picks another with HOST_OP_LAYOUT
+#endif
 
-#define BUFSIZE     512                                                         //FIFO/circular buffer size in bytes
+//Event record header, first byte of every record (see kbPostEvent())
+#define EVT_BRK     0x80                                                        //Key released
+#define EVT_RESP    0x40                                                        //Keyboard response byte instead of a keycode
+#define EVT_MODS    0x20                                                        //Modifier byte follows the keycode
+#define EVT_MORE    0x10                                                        //Delta continues in 7 bit groups, bit 7 = more
+#define EVT_DELTA   0x0F                                                        //Delta bits 3..0, in KB_EVT_SHIFT units
 
 //ASCII values for look-up table constants
 #define BKSP        0x08                                                        //Backspace
@@ -30,18 +50,56 @@
 #define R_SHIFT		0x59                                                        //Right shift key
 #define L_CTRL		0x00                                                        //Left control key (not defined at this time)
 #define NUMLOCK		0x00                                                        //Number lock key (not defined at this time)
-#define F1			0x00                                                        //F1 function key (not defined at this time)
-#define F2			0x00                                                        //F2 function key (not defined at this time)
-#define F3			0x00                                                        //F3 function key (not defined at this time)
-#define F4			0x00                                                        //F4 function key (not defined at this time)
-#define F5			0x00                                                        //F5 function key (not defined at this time)
-#define F6			0x00                                                        //F6 function key (not defined at this time)
-#define F7			0x00                                                        //F7 function key (not defined at this time)
-#define F8			0x00                                                        //F8 function key (not defined at this time)
-#define F9			0x00                                                        //F9 function key (not defined at this time)
-#define F10			0x00                                                        //F10 function key (not defined at this time)
-#define F11			0x00                                                        //F11 function key (not defined at this time)
-#define F12			0x00                                                        //F12 function key (not defined at this time)
+
+//Private codes posted for keys without an ASCII value (0x81-0x9F, 0x80 is CH_EURO)
+#define F1          0x81                                                        //Function keys F1..F12 = 0x81..0x8C
+#define F2          0x82
+#define F3          0x83
+#define F4          0x84
+#define F5          0x85
+#define F6          0x86
+#define F7          0x87
+#define F8          0x88
+#define F9          0x89
+#define F10         0x8A
+#define F11         0x8B
+#define F12         0x8C
+#define PLUG_OK     0x8E                                                        //Keyboard plugged in, passed BAT, settings sent again (kbPlug())
+#define PLUG_FAIL   0x8F                                                        //Keyboard plugged in, failed BAT
+#define ARROW_UP    0x90                                                        //Cursor keys
+#define ARROW_DN    0x91
+#define ARROW_LT    0x92
+#define ARROW_RT    0x93
+#define HOME        0x94
+#define END         0x95
+#define PG_UP       0x96
+#define PG_DN       0x97
+#define INSERT      0x98
+#define PRT_SCR     0x99                                                        //Print screen
+#define PAUSE       0x9A                                                        //Pause/Break
+#define APPS        0x9C                                                        //Menu key
+#define POWER       0x9D                                                        //ACPI keys
+#define SLEEP       0x9E
+#define WAKE        0x9F
+#define DEL         0x7F                                                        //Delete (ASCII DEL)
+
+//Modifier bits in kbEvent_t.mods (USB HID order)
+#define KM_LCTRL    0x01
+#define KM_LSHIFT   0x02
+#define KM_LALT     0x04
+#define KM_LGUI     0x08
+#define KM_RCTRL    0x10
+#define KM_RSHIFT   0x20
+#define KM_RALT     0x40
+#define KM_RGUI     0x80
+#define KM_CTRL     (KM_LCTRL | KM_RCTRL)
+#define KM_SHIFT    (KM_LSHIFT | KM_RSHIFT)
+#define KM_ALT      (KM_LALT | KM_RALT)
+
+//Lock keys
+#define LK_CAPS     1
+#define LK_NUM      2
+#define LK_SCROLL   3
 
 //PS2 scan code constants
 #define TAB_S       0x0D                                                        //Tab key	
@@ -53,6 +111,11 @@
 #define ESC_S       0x76                                                        //Escape key
 #define NUM_S       0x77                                                        //Num Lock key
 #define BREAK_S     0XF0                                                        //Break code
+#define EXT_S       0xE0                                                        //Extended key prefix
+#define PAUSE_S     0xE1                                                        //Pause prefix, 7 more bytes follow
+#define F7_S        0x83                                                        //Only make code above 0x7F
+#define FAKE_LSH_S  0x12                                                        //E0 12 / E0 59 are fake shifts around
+#define FAKE_RSH_S  0x59                                                        //print screen and the nav keys
 
 //Keyboard commands
 #define CMD_ECHO     0xEE                                                       //Keyboard responds with echo (0xEE)
@@ -62,6 +125,7 @@
 #define CMD_CODE_SET 0xF0                                                       //Requests scan code set. Keyboard responds with ack (0xFA) the waits for a 1 byte
                                                                                 //argument of 0x01, 0x02, 0x03 to set the scan code table used. If 0x00 is passed
                                                                                 //the keyboard responds with ack followed by the current scan code sent
+#define CMD_TYPEMATIC 0xF3                                                      //Followed with a 1 byte argument, bits 6..5 repeat delay and 4..0 rate
 #define CMD_SET_LED  0xED                                                       //Followed with a 1 byte argument that defines the state of the keyboard LED's. 
                                                                                 //Always Always Always Always Always Caps  Num  Scroll 
                                                                                 //  0      0      0      0      0    Lock  Lock Lock
@@ -85,60 +149,156 @@
 #define KB_FL2  0xFD                                                            //Keyboard BAT failed (not sure why there are two codes)
 #define KB_RSND 0xFE                                                            //Resend (keyboard wants controller to repeat last command it sent)
 #define KB_ERR  0xFF                                                            //Key detection error or internal buffer overrun
+#define KB_ERR2 0x00                                                            //Same, scan code sets 2 and 3
+#define KB_BAT_DONE(c)  ((c) == KB_BAT || (c) == KB_FAIL || (c) == KB_FL2)      //BAT result, passed or failed
+
+//kbKeyState_t.flags
+#define KS_OVERRUN  0x01                                                        //Keyboard reported a key detection error (ghosting, too many keys)
+#define KS_STRAY    0x02                                                        //Break for a key not held, its make was lost
+                                                                                //Both stay set until no key is held, down[] may be incomplete until then
 
 /*----------------------------------------------------*/
 /* Enumerations                                       */
 /*----------------------------------------------------*/
 typedef enum{
-    PS2START,                                                                   //Start bit
-    PS2BIT,                                                                     //Data bit(s)
-    PS2PARITY,                                                                  //Parity bit
-    PS2STOP                                                                     //Stop bit 
-}ps2States_t;       
-
-typedef enum {
-    ERR_NONE = 0x00,
-    ERR_ECHO = 0xE0,                                                            //Echo failed
-    ERR_INV_STATE,                                                              //Invalid machine state
-    ERR_PARITY,                                                                 //Invalid scan code parity
-    ERR_STOP,                                                                   //Invalid stop bit
-    ERR_OVERFLOW,                                                               //Buffer overflow
-    ERR_LCK_NOACK                                                               //setLocks() - no ack from keyboard
-            
-}kbErrors_t;
-    
+    KC_NONE,                                                                    //Key kinds, see keymap.h
+    KC_CHAR,
+    KC_PAD,
+    KC_FUNC,
+    KC_MOD,
+    KC_LOCK,
+    KC_LAYOUT
+}kbKinds_t;
+
+#define KB_LAYOUT_ENUM(name) KB_LAYOUT_##name,
+typedef enum{
+    LAYOUTS(KB_LAYOUT_ENUM)
+    KB_LAYOUTS
+}kbLayouts_t;
+
+#define KB_SLOT_ENUM(key, plain, shifted, altgr, caps) SL_##key,
+typedef enum{                                                                   //Layout dependent keys, see layouts.h
+    LAYOUT_US(KB_SLOT_ENUM)
+    KB_SLOTS
+}kbSlots_t;
+
+typedef enum{
+    KB_EV_NONE,                                                                 //Prefix byte swallowed, nothing yet
+    KB_EV_KEY,                                                                  //Key made or broken
+    KB_EV_RESP                                                                  //Keyboard response or unknown byte, passed through
+}kbEvTypes_t;
+
+#define KB_KEY_ENUM(name, code, kind, plain, shifted) KEY_##name = code,
+typedef enum{
+    KEYMAP(KB_KEY_ENUM)
+}kbKeys_t;
+
 /*----------------------------------------------------*/
 /* Structures                                         */
 /*----------------------------------------------------*/
-typedef struct{                                                                 //FIFO queue typedef
-    int16_t head;                                                               //Head subscript
-    int16_t tail;                                                               //Tail subscript
-    int16_t count;                                                              //Queued item count
-    uint8_t buffer[BUFSIZE]; 
-}queue_t;
+typedef struct{
+    uint8_t plain;                                                              //Meaning depends on kind, see keymap.h
+    uint8_t shifted;
+    uint8_t kind;                                                               //kbKinds_t
+}kbKeyDesc_t;
+
+typedef struct{                                                                 //One layout dependent key
+    uint8_t plain;
+    uint8_t shifted;
+    uint8_t altgr;                                                              //0 = AltGr ignored
+}kbLayoutKey_t;
+
+typedef struct{                                                                 //One layout, built from layouts.h
+    uint64_t caps;                                                              //Bit SL_xxx set: caps lock selects the shifted character
+    kbLayoutKey_t keys[KB_SLOTS];
+}kbLayout_t;
+
+typedef struct{                                                                 //Dead key composition, from KB_COMPOSE
+    uint8_t accent;                                                             //DK_xxx
+    uint8_t base;
+    uint8_t result;
+}kbCompose_t;
+
+typedef struct kbEvent{
+    uint8_t type;                                                               //kbEvTypes_t
+    uint8_t key;                                                                //Keycode (KEY_xxx), raw byte for KB_EV_RESP
+    uint8_t brk;                                                                //1 = key released
+    uint8_t mods;                                                               //Modifier bits after this event
+    uint8_t rep;                                                                //1 = make for a key already held, a typematic repeat
+}kbEvent_t;
+
+typedef struct{                                                                 //Set 2 prefix state, one byte in, at most one event out
+    uint8_t ext;                                                                //0x80 after E0
+    uint8_t brk;                                                                //1 after F0
+    uint8_t skip;                                                               //Bytes of the E1 (Pause) sequence still to swallow
+    uint8_t mods;                                                               //Modifier keys held
+}kbDecoder_t;
+
+typedef struct{                                                                 //Pressed keys, also the HOST_OP_KEYS record
+    uint8_t down[32];                                                           //Bit (k & 7) of byte k >> 3 set while keycode k is held
+    uint8_t mods;                                                               //Modifier bits, left and right apart
+    uint8_t held;                                                               //Keys set in down[]
+    uint8_t flags;                                                              //KS_xxx
+    uint8_t seq;                                                                //Bumped on every change
+}kbKeyState_t;
+
+typedef struct{                                                                 //HOST_OP_DIAG record, little endian, same layout on PIC24 and host
+    uint8_t  version;                                                           //KB_DIAG_VERSION
+    uint8_t  stats;                                                             //1 = PS2_STATS built in, else the fields up to isrHist are 0
+    uint16_t bitMin;                                                            //Bit period in cycles
+    uint16_t bitMax;
+    uint16_t bitMean;
+    uint32_t frames;
+    uint16_t isrMax;                                                            //Cycles, ISR entry and exit not included
+    uint16_t isrHist[KB_STAT_BINS];
+    kbErrCounts_t err;
+    uint16_t lastError;                                                         //Keyboard port's last error when read
+    uint16_t rxDrops;                                                           //Frames lost to a full raw ring
+    uint16_t edgeDrops;                                                         //Edges lost to a full capture ring (PS2_CAPTURE)
+    uint16_t outDrops;                                                          //Characters lost to a full output queue
+    uint16_t outHwm;                                                            //Most characters ever queued
+    uint16_t cmdFailures;                                                       //Commands given up on
+    uint16_t holds;                                                             //Keyboard inhibits for back pressure
+    uint32_t holdTicks;                                                         //Total time held
+    uint32_t holdMax;                                                           //Longest single hold
+    uint16_t plugs;                                                             //BAT results without a reset of ours, keyboard plugged in again
+    uint8_t  batResult;                                                         //Last of them, KB_BAT, KB_FAIL or KB_FL2
+    uint8_t  spare;
+    uint32_t idleMs;                                                            //CPU in Idle (power.c)
+    uint32_t awakeMs;                                                           //CPU running, ISRs included
+    uint32_t naps;                                                              //Times the main loop went idle
+    kbErrCounts_t auxErr;                                                       //Second port (PS2_PORTS = 2), else 0
+    uint16_t auxLastError;
+    uint16_t auxCmdFailures;
+}kbDiag_t;
 
 typedef struct{
-    uint16_t scanFlag:  1;                                                      //Scan code flag
     uint16_t capsFlag:  1;                                                      //Caps lock flag
     uint16_t numsFlag:  1;                                                      //Nums lock flag
-    uint16_t skipFlag:  1;                                                      //Flag to ignore this scan code
-    uint16_t shiftFlag: 1;                                                      //Left or right shift key flag
-    uint16_t breakFlag: 3;                                                      //Break code (0xF0) flag
     
     uint16_t errFlag:   1;                                                      //Error flag
-    uint16_t spares:    7;
+    uint16_t hold:      1;                                                      //Queue went over KB_Q_HIGH and not yet back to KB_Q_LOW
+    uint16_t urgent:    1;                                                      //KB_URGENT character queued, skip notify moderation
+    uint16_t plugFlag:  1;                                                      //BAT result seen, keyboard plugged in again
+    uint16_t spares:   10;
 }kbFlags_t;
 
 /*----------------------------------------------------*/
 /* Function declarations                              */
 /*----------------------------------------------------*/
-void            kbCheckFlags(void);
-int             kbEcho(void);                                                   //Send an echo command to the keyboard
-int             kbInitialize(void);                                             //Init INT0 and I/O
-void            kbPostCode(void);                                               //Translate and post scan codes
-void            kbReqToSend(void);                                              //Generates request to send (start bit)to the keyboard
-void            kbSendCmd(uint8_t, uint8_t);                                    //Send commands to the keyboard
+uint8_t         kbBusy(void);                                                   //Keyboard bytes, commands or a switch for the main loop
+void            kbCheckFlags(void);                                             //Flag lock key releases
+uint8_t         kbDecode(uint8_t, kbEvent_t *);                                 //Feed one raw byte, returns the event type
+void            kbDiagRead(kbDiag_t *);                                         //Snapshot the counters for the host
+int             kbEcho(void);                                                   //Echo the keyboard, waits for the reply
+uint8_t         kbFlowControl(void);                                            //Apply Q_BLOCK back pressure, 0 = leave codes in the ring
+void            kbKeysRead(kbKeyState_t *);                                     //Snapshot the pressed keys for the host
+void            kbOutService(void);                                             //Switch output format once drained or layout, run the event clock
+int16_t         kbInitialize(void);                                             //Init INT0 and I/O
+uint8_t         kbNextCode(void);                                               //Pop the next raw scan code into scanCode
+void            kbPlug(void);                                                   //Keyboard plugged in: send the settings again
+void            kbPostCode(void);                                               //Translate the current event and post it
+uint8_t         kbRepeat(uint8_t);                                              //Post a held key again, 0 = not held
 void            kbSetLocks(void);
-void 		   	kbWriteByte(uint8_t);                           
 
 #endif	/* PS2KB_H */
\ No newline at end of file
@@ -0,0 +1,198 @@
+/*----------------------------------------------------------------------------*/
+/* PS2 mouse on the second port (PS2_AUX)                                     */
+/*                                                                            */
+/* Negotiation runs through the port's command scheduler, so the keyboard     */
+/* keeps typing while it is in progress. The mouse is reset, then sent the    */
+/* IntelliMouse knock (sample rates 200, 100, 80) and asked for its ID: 0x03  */
+/* means it has a wheel and sends four byte packets, 0x00 is a plain three    */
+/* byte mouse. Then the sample rate and resolution are set and streaming is   */
+/* enabled. Anything else answering is taken as no mouse.                     */
+/*                                                                            */
+/* Packet byte 0 always has bit 3 set and that is the only framing there is.  */
+/* A byte expected to start a packet without it is dropped, so after a lost   */
+/* frame the decoder slips forward until it lands on a byte 0 again. A wheel  */
+/* byte outside -8..7 means the same, and a packet left incomplete for        */
+/* MS_PKT_GAP_US is thrown away.                                              */
+/*                                                                            */
+/* Packets are coalesced: while the newest unread report has the same         */
+/* buttons, motion is summed into it, so the host gets one up to date delta   */
+/* per read however fast the mouse moves. A button change starts a new        */
+/* report so clicks are not lost between reads. The host takes the oldest     */
+/* report with HOST_OP_MOUSE (see host.c).                                    */
+/*----------------------------------------------------------------------------*/
+#include "hal.h"
+#include "ps2kb.h"
+#include "ps2ms.h"
+#include <string.h>                                                             //For memset()
+
+#if PS2_MOUSE
+
+/*------------------------------------------*/
+/* Global variables                         */
+/*------------------------------------------*/
+extern ps2Port_t xPorts[PS2_PORTS];                                             //ps2port.c
+
+ps2Port_t *pMsPort;                                                             //Mouse port
+msMouse_t xMouse, *pMouse;
+
+void msInitialize(void){
+
+   pMouse = &xMouse;
+   memset(pMouse,0x00,sizeof(xMouse));
+
+   pMsPort = &xPorts[PS2_AUX];
+   ps2PortInit(pMsPort,PS2_AUX);                                                //Pins, Timer4, rings and command scheduler
+   pMsPort->cmd.mouse = 1;                                                      //One ID byte, also after BAT
+
+   kbCmdQueue(pMsPort,CMD_RESET,NO_ARGS);
+   kbCmdQueue(pMsPort,MS_CMD_RATE,200);                                         //IntelliMouse knock
+   kbCmdQueue(pMsPort,MS_CMD_RATE,100);
+   kbCmdQueue(pMsPort,MS_CMD_RATE,80);
+   kbCmdQueue(pMsPort,CMD_DEVID,NO_ARGS);
+   pMouse->state = MS_IDENT;
+}
+
+/*------------------------------------------*/
+/* Negotiation failed, leave the port alone */
+/*------------------------------------------*/
+static void msAbsent(void){
+   pMouse->state = MS_ABSENT;
+   pMouse->pktLen = 0;
+   ps2Error(pMsPort,ERR_MOUSE);                                                 //The mouse port's error, not the keyboard's
+}
+
+/*------------------------------------------*/
+/* Main loop. Each step starts once the     */
+/* commands of the one before are done      */
+/*------------------------------------------*/
+void msService(void){
+
+   kbCmdDone_t *last = &pMsPort->cmd.last;
+
+   if(kbCmdBusy(pMsPort))
+      return;
+
+   switch(pMouse->state){
+      case MS_IDENT:
+         if(last->cmd != CMD_DEVID || last->result != CMDR_OK ||
+            (last->reply[0] != MS_ID_STD && last->reply[0] != MS_ID_WHEEL)){
+            msAbsent();
+            return;
+         }
+         pMouse->pktLen = last->reply[0] == MS_ID_WHEEL ? 4 : 3;                //Setup ACKs are taken by the scheduler,
+         kbCmdQueue(pMsPort,MS_CMD_RATE,MS_RATE);                               //so packets may start right after enable
+         kbCmdQueue(pMsPort,MS_CMD_RES,MS_RES);
+         kbCmdQueue(pMsPort,MS_CMD_ENABLE,NO_ARGS);
+         pMouse->state = MS_SETUP;
+         break;
+
+      case MS_SETUP:
+         if(last->cmd != MS_CMD_ENABLE || last->result != CMDR_OK){
+            msAbsent();
+            return;
+         }
+         pMouse->state = MS_STREAM;
+         break;
+
+      default:
+         break;
+   }
+}
+
+static int16_t msClamp(int32_t v){
+   return v > INT16_MAX ? INT16_MAX : v < INT16_MIN ? INT16_MIN : v;
+}
+
+/*------------------------------------------*/
+/* A whole packet is in, sum it into the    */
+/* newest report or start a new one         */
+/*------------------------------------------*/
+static void msPost(void){
+
+   uint8_t *pk = pMouse->pkt;
+   uint8_t buttons = pk[0] & MB_ALL;
+   int16_t dx = pk[1] - ((pk[0] & MS_XSIGN) << 4);                              //9 bit two's complement
+   int16_t dy = pk[2] - ((pk[0] & MS_YSIGN) << 3);
+   int16_t dz = pMouse->pktLen == 4 ? (int8_t)pk[3] : 0;
+   msReport_t *r = &pMouse->rep[(uint8_t)(pMouse->head - 1) & (MS_REPORTS - 1)];
+
+   HAL_SPI_LOCK();                                                              //HOST_OP_MOUSE takes reports from the SPI ISR
+   if(pMouse->head == pMouse->tail || r->buttons != buttons){                   //Nothing unread, or a click
+      if((uint8_t)(pMouse->head - pMouse->tail) < MS_REPORTS){
+         r = &pMouse->rep[pMouse->head & (MS_REPORTS - 1)];
+         memset(r,0x00,sizeof(*r));
+         pMouse->head++;
+      }
+      else
+         r->flags |= MR_LOST;
+   }
+   r->buttons = buttons;
+   r->dx = msClamp((int32_t)r->dx + dx);
+   r->dy = msClamp((int32_t)r->dy + dy);
+   r->dz = msClamp((int32_t)r->dz + dz);
+   if(r->packets < UINT8_MAX)
+      r->packets++;
+   if(pk[0] & (MS_XOVF | MS_YOVF))
+      r->flags |= MR_OVERFLOW;
+   pMouse->buttons = buttons;
+   HAL_SPI_UNLOCK();
+}
+
+uint8_t msBusy(void){
+   return kbCmdBusy(pMsPort) || ps2RxPending(pMsPort);
+}
+
+/*------------------------------------------*/
+/* One byte from the mouse that was not a   */
+/* command reply                            */
+/*------------------------------------------*/
+void msDecode(uint8_t code){
+
+   uint32_t now = halNow();
+
+   if(!pMouse->pktLen)                                                          //Not streaming, nothing to frame
+      return;
+   if(pMouse->idx && now - pMouse->lastByte > HAL_US_TICKS(MS_PKT_GAP_US)){     //Stale partial packet
+      pMouse->resyncs += pMouse->idx;
+      pMouse->idx = 0;
+   }
+   pMouse->lastByte = now;
+
+   if(!pMouse->idx && !(code & MS_SYNC)){                                       //Not a byte 0, slip forward
+      pMouse->resyncs++;
+      return;
+   }
+   pMouse->pkt[pMouse->idx++] = code;
+   if(pMouse->idx < pMouse->pktLen)
+      return;
+   pMouse->idx = 0;
+   if(pMouse->pktLen == 4 && (uint8_t)(pMouse->pkt[3] + 8) >= 16){              //Wheel byte out of range, misaligned
+      pMouse->resyncs += 4;
+      return;
+   }
+   msPost();
+}
+
+/*------------------------------------------*/
+/* Oldest report into a HOST_OP_MOUSE       */
+/* record. Called from the SPI ISR. With    */
+/* nothing unread the record has the        */
+/* buttons and no motion                    */
+/*------------------------------------------*/
+void msRead(msReport_t *r){
+
+   if(pMouse->head == pMouse->tail){
+      memset(r,0x00,sizeof(*r));
+      r->buttons = pMouse->buttons;
+   }
+   else
+      *r = pMouse->rep[pMouse->tail++ & (MS_REPORTS - 1)];
+   r->more = pMouse->head - pMouse->tail;
+   r->resyncs = pMouse->resyncs;
+   if(pMouse->state == MS_STREAM)
+      r->flags |= MR_READY;
+   if(pMouse->pktLen == 4)
+      r->flags |= MR_WHEEL;
+}
+
+#endif	/* PS2_MOUSE */
@@ -0,0 +1,95 @@
+/*
+ * File:   ps2ms.h
+ */
+
+#ifndef PS2MS_H
+#define	PS2MS_H
+
+#include <stdint.h>
+#include "ps2port.h"
+
+/*----------------------------------------------------*/
+/* Defines                                            */
+/*----------------------------------------------------*/
+#ifndef PS2_MOUSE
+#define PS2_MOUSE   (PS2_PORTS > 1)                                             //1 = mouse on port PS2_AUX, 0 = second port runs commands only
+#endif
+#define MS_REPORTS  4                                                           //Unread reports, a new one per button change, must be a power of two
+#ifndef MS_RATE
+#define MS_RATE     100                                                         //Samples/s asked for after negotiation
+#endif
+#define MS_RES      0x03                                                        //Resolution argument, 8 counts/mm
+#define MS_PKT_GAP_US 50000                                                     //Silence inside a packet that means the rest was lost
+
+//Mouse commands, the shared ones (CMD_RESET, CMD_DEVID) are in ps2kb.h
+#define MS_CMD_RES      0xE8                                                    //Set resolution, one argument
+#define MS_CMD_RATE     0xF3                                                    //Set sample rate, one argument
+#define MS_CMD_ENABLE   0xF4                                                    //Start streaming packets
+
+//Device IDs, reply to CMD_DEVID and sent after BAT
+#define MS_ID_STD   0x00                                                        //Three byte packets
+#define MS_ID_WHEEL 0x03                                                        //IntelliMouse: four byte packets, the fourth is the wheel
+
+//Packet byte 0
+#define MB_LEFT     0x01                                                        //Buttons, also msReport_t.buttons
+#define MB_RIGHT    0x02
+#define MB_MIDDLE   0x04
+#define MB_ALL      0x07
+#define MS_SYNC     0x08                                                        //Always set, the only way to find byte 0
+#define MS_XSIGN    0x10                                                        //Bit 8 of the 9 bit X delta
+#define MS_YSIGN    0x20
+#define MS_XOVF     0x40
+#define MS_YOVF     0x80
+
+//msReport_t.flags
+#define MR_READY    0x01                                                        //Negotiated and streaming
+#define MR_WHEEL    0x02                                                        //IntelliMouse, dz is valid
+#define MR_OVERFLOW 0x10                                                        //A packet in this report had X or Y overflow
+#define MR_LOST     0x20                                                        //Report queue was full, a button change was merged into this report
+
+/*----------------------------------------------------*/
+/* Enumerations                                       */
+/*----------------------------------------------------*/
+typedef enum{
+    MS_IDENT,                                                                   //Reset, IntelliMouse knock and ID queued
+    MS_SETUP,                                                                   //Rate, resolution and enable queued
+    MS_STREAM,                                                                  //Packets flowing
+    MS_ABSENT                                                                   //No mouse answered, or it would not stream
+}msStates_t;
+
+/*----------------------------------------------------*/
+/* Structures                                         */
+/*----------------------------------------------------*/
+typedef struct{                                                                 //HOST_OP_MOUSE record, little endian, same layout on PIC24 and host
+    uint8_t  flags;                                                             //MR_xxx
+    uint8_t  buttons;                                                           //MB_xxx as of the last packet summed
+    uint8_t  more;                                                              //Reports still queued after this one
+    uint8_t  packets;                                                           //Packets summed (saturates), 0 = nothing new since the last read
+    int16_t  dx;                                                                //Summed motion, right is positive
+    int16_t  dy;                                                                //Up is positive
+    int16_t  dz;                                                                //Wheel, toward the user is positive
+    uint16_t resyncs;                                                           //Bytes dropped finding packet starts, since power up
+}msReport_t;
+
+typedef struct{
+    uint8_t state;                                                              //msStates_t
+    uint8_t pktLen;                                                             //3 or 4 once identified, 0 = not streaming yet
+    uint8_t pkt[4];                                                             //Packet being assembled
+    uint8_t idx;                                                                //Bytes of it received
+    uint32_t lastByte;                                                          //Timebase at the last packet byte
+    uint8_t buttons;                                                            //As of the last packet
+    uint16_t resyncs;
+    msReport_t rep[MS_REPORTS];                                                 //Unread reports, oldest at tail
+    uint8_t head, tail;                                                         //Free running
+}msMouse_t;
+
+/*----------------------------------------------------*/
+/* Function declarations                              */
+/*----------------------------------------------------*/
+void            msDecode(uint8_t);                                              //Feed one byte from the mouse port
+void            msInitialize(void);                                             //Bring up port PS2_AUX and start negotiating
+void            msRead(msReport_t *);                                           //Take the oldest report for the host
+uint8_t         msBusy(void);                                                   //Mouse bytes or commands for the main loop
+void            msService(void);                                                //Main loop: next negotiation step
+
+#endif	/* PS2MS_H */
@@ -0,0 +1,551 @@
+/*----------------------------------------------------------------------------*/
+/* PS2 ports: frame receive, host to device send and inhibit                  */
+/*                                                                            */
+/* Everything a port owns lives in its ps2Port_t: frame decoder state, raw    */
+/* ring, captured edges, error counters, the bytes being sent, hold           */
+/* statistics and its command scheduler. Port n drives its own pins, external */
+/* interrupt and bus timer (hal.h), so the keyboard port (INT0, Timer1) and   */
+/* the second port (INT1, Timer4, PS2_PORTS = 2) run at the same time without */
+/* sharing any state. Errors too: each port keeps its last error code, only   */
+/* the keyboard's raise the keyboard error flag. INT0, INT1 and both timers   */
+/* are at the same priority and never preempt each other; each ISR is a few   */
+/* microseconds, well inside the 30us a device holds the clock low.           */
+/*                                                                            */
+/* The ISRs hand a constant port number to the inline edge handler, so pin    */
+/* and interrupt macros fold to the port's own registers. Main loop entry     */
+/* points take the port and pick its registers at run time.                   */
+/*                                                                            */
+/* Sending is interrupt driven: the port timer times the request to send,     */
+/* then the same INTx state machine that receives frames shifts the command   */
+/* out on the device's falling edges. The timer also bounds the whole byte,   */
+/* so a missing device ends in TX_TIMEOUT instead of a hang.                  */
+/*                                                                            */
+/* Receiving is built one of two ways. By default INTx runs the frame decoder */
+/* on every edge. With PS2_CAPTURE=1 INTx only stores the timebase and data   */
+/* level in a ring and ps2NextCode() decodes whole frames from it in the main */
+/* loop, which keeps INTx to a few instructions. Both use ps2RxEdge().        */
+/*----------------------------------------------------------------------------*/
+#include "hal.h"
+#include "ps2port.h"
+#include "ps2kb.h"
+#include <string.h>                                                             //For memset()
+
+/*------------------------------------------*/
+/* Global variables                         */
+/*------------------------------------------*/
+ps2Port_t xPorts[PS2_PORTS];
+
+extern kbFlags_t xFlags, *pFlags;
+
+//Local functions
+static void ps2TxNext(ps2Port_t *p);
+static void ps2TxEnd(ps2Port_t *p, kbTxStat_t status);
+static void ps2RxDrain(ps2Port_t *p);
+static void ps2HoldEnd(ps2Port_t *p);
+
+/*------------------------------------------*/
+/* Set up port n and start receiving        */
+/*------------------------------------------*/
+void ps2PortInit(ps2Port_t *p, uint8_t n){
+
+   memset(p,0x00,sizeof(*p));
+   p->id = n;
+   p->state = PS2START;                                                         //Set the machine state
+   p->txStatus = TX_IDLE;
+   p->bitTimeout = HAL_US_TICKS(KB_BIT_TIMEOUT_US);                             //Until the first good frame
+#if PS2_STATS
+   p->stats.bitMin = 0xFFFF;
+#endif
+   halPs2Setup(n);                                                              //Open drain lines released, bus timer, INTx on falling edges
+   kbCmdInitialize(p);
+
+   HAL_PS2_INT_CLEAR(n);                                                        //Clear the external interrupt flag
+   HAL_PS2_INT_ENABLE(n);                                                       //Enable it
+}
+
+/*------------------------------------------*/
+/* Record an error on port p. pFlags        */
+/* belongs to the keyboard, so the second   */
+/* port only keeps its code and counts      */
+/*------------------------------------------*/
+void ps2Error(ps2Port_t *p, kbErrors_t e){
+
+   p->error = e;
+   if(p->id == PS2_KBD)
+      pFlags->errFlag = 1;
+}
+
+/*------------------------------------------*/
+/* A hold is over, by release or by a       */
+/* request to send                          */
+/*------------------------------------------*/
+static void ps2HoldEnd(ps2Port_t *p){
+
+   uint32_t held;
+
+   if(!p->inhibit)
+      return;
+   p->inhibit = 0;
+   held = halNow() - p->holdStart;
+   p->holds.ticks += held;
+   if(held > p->holds.maxTicks)
+      p->holds.maxTicks = held;
+}
+
+/*------------------------------------------*/
+/* Holding clock low makes the device       */
+/* buffer its output. A frame cut short     */
+/* before its 10th clock is resent by the   */
+/* device, so the partial frame is thrown   */
+/* away on release                          */
+/*------------------------------------------*/
+void ps2Inhibit(ps2Port_t *p, uint8_t on){
+
+   uint8_t n = p->id;
+
+   if(on){
+      HAL_PS2_INT_DISABLE(n);                                                   //Our own falling edge is not a data bit
+      ps2RxDrain(p);                                                            //Decode what came in before the hold
+      HAL_PS2_CLOCK(n,0);
+      p->inhibit = 1;
+      p->holdStart = halNow();
+      p->holds.count++;
+   }
+   else{
+      p->state = PS2START;                                                      //Drop any partial frame
+      HAL_PS2_CLOCK(n,1);
+      HAL_PS2_INT_CLEAR(n);
+      HAL_PS2_INT_ENABLE(n);
+      ps2HoldEnd(p);
+   }
+}
+
+/*---------------------------------------------------------------------*/
+//         Send passed command to the device
+//1)   Bring the Clock line low for at least 100 microseconds.  (timer)
+//2)   Bring the Data line low.                                  (timer)
+//3)   Release the Clock line.                                   (timer)
+//4)   Wait for the device to bring the Clock line low.
+//5)   Set/reset the Data line to send the first data bit        (INTx)
+//6)   Wait for the device to bring Clock high.
+//7)   Wait for the device to bring Clock low.
+//8)   Repeat steps 5-7 for the other seven data bits and the parity bit
+//9)   Release the Data line.                                    (INTx)
+//10) Wait for the device to bring Data low.
+//11) Wait for the device to bring Clock  low.                   (INTx)
+//12) Wait for the device to release Data and Clock              (timer)
+//
+// Returns as soon as step 1 is under way. The argument, if any, follows
+// the command once it is ACKed at line level and step 12 is seen.
+/*---------------------------------------------------------------------*/
+uint8_t ps2SendCmd(ps2Port_t *p, uint8_t cmd, uint8_t arg)
+{
+   if(ps2TxBusy(p))                                                             //One command at a time
+      return 0;
+
+   p->txBuf[0] = cmd;
+   p->txBuf[1] = arg;
+   p->txLen = (arg != NO_ARGS) ? 2 : 1;                                         //0xFF indicates no ARG
+   p->txIdx = 0;
+   p->txStatus = TX_BUSY;
+   ps2HoldEnd(p);                                                               //Request to send replaces any hold
+   ps2TxNext(p);
+   return 1;
+}
+
+uint8_t ps2TxBusy(ps2Port_t *p){
+   return p->txStatus == TX_BUSY;
+}
+
+/*------------------------------------------*/
+/* Start the request to send for the next   */
+/* byte. A frame the device was sending     */
+/* is cut short; it will send it again      */
+/*------------------------------------------*/
+static void ps2TxNext(ps2Port_t *p){
+
+   uint8_t n = p->id;
+
+   HAL_PS2_INT_DISABLE(n);                                                      //Our own clock edges are not data
+   ps2RxDrain(p);                                                               //Frames captured before the request to send
+   p->txShift = p->txBuf[p->txIdx];
+   HAL_PS2_CLOCK(n,0);                                                          //Clock line needs pulled low for a minimum of 100us
+   p->state = PS2TX_RTS;
+   HAL_PS2_TMR_START(n,HAL_PS2_TICKS(KB_RTS_US));
+}
+
+/*------------------------------------------*/
+/* Give the bus back to the device          */
+/*------------------------------------------*/
+static void ps2TxEnd(ps2Port_t *p, kbTxStat_t status){
+
+   uint8_t n = p->id;
+
+   HAL_PS2_TMR_STOP(n);
+   HAL_PS2_DATA(n,1);
+   HAL_PS2_CLOCK(n,1);
+   p->state = PS2START;
+   p->txStatus = status;
+   if(status == TX_NOACK || status == TX_TIMEOUT){
+      if(status == TX_NOACK){
+         ps2Error(p,ERR_TX_NOACK);
+         p->err.txNoAck++;
+      }
+      else{
+         ps2Error(p,ERR_TX_TIMEOUT);
+         p->err.txTimeout++;
+      }
+   }
+   HAL_PS2_INT_CLEAR(n);
+   HAL_PS2_INT_ENABLE(n);
+}
+
+/*------------------------------------------*/
+/* Take the oldest raw byte off the ring.   */
+/* Returns 0 if the ring is empty           */
+/*------------------------------------------*/
+uint8_t ps2NextCode(ps2Port_t *p, uint8_t *code){
+
+   uint8_t tail;
+
+   ps2RxDrain(p);
+   tail = p->rx.tail;
+   if(tail == p->rx.head)                                                       //Nothing new from the ISR
+      return 0;
+   *code = p->rx.buffer[tail & (RXSIZE - 1)];
+   p->rx.tail = tail + 1;                                                       //Hand the slot back to the ISR
+   return 1;
+}
+
+/*------------------------------------------*/
+/* Anything the ISR has left for the main   */
+/* loop. With PS2_CAPTURE the edges of a    */
+/* frame not decoded yet count too          */
+/*------------------------------------------*/
+uint8_t ps2RxPending(ps2Port_t *p){
+#if PS2_CAPTURE
+   if(p->edges.tail != p->edges.head)
+      return 1;
+#endif
+   return p->rx.tail != p->rx.head;
+}
+
+/*------------------------------------------*/
+/* Frame decoder, one falling clock edge at */
+/* a time. level is the data line sampled   */
+/* at the edge, stamp the timebase low word.*/
+/* A missed edge shows up as a gap longer   */
+/* than about 1.5 bit times, measured from  */
+/* the last good frame, in the middle of a  */
+/* frame; the frame is dropped and its      */
+/* remaining edges are skipped so the next  */
+/* start bit lines up again. A gap longer   */
+/* than any lost edge explains means the    */
+/* device gave up on the frame, and this    */
+/* edge is the next start bit. So is any    */
+/* edge INTx saw after idle past            */
+/* KB_IDLE_GAP_US: the 16-bit gap wraps     */
+/* every 4ms and can land back under the    */
+/* bit timeout. Runs in the INTx ISR, or in */
+/* the main loop from the captured edges    */
+/* with PS2_CAPTURE                         */
+/*------------------------------------------*/
+static inline void ps2RxEdge(ps2Port_t *p, uint8_t level, uint16_t stamp, uint8_t idle)
+{
+   uint16_t gap = idle ? 0xFFFF : stamp - p->lastEdge;
+
+   p->lastEdge = stamp;
+   HAL_COST(KB_CYC_RX_EDGE);
+   if (gap > p->bitTimeout &&                                                   //Longer than a bit time mid-frame?
+       p->state >= PS2BIT && p->state <= PS2RESYNC){
+      if (p->state != PS2RESYNC){                                               //Yes.. an edge went missing, the frame is lost
+         ps2Error(p,ERR_FRAMING);
+         p->err.framing++;
+      }
+      if (gap > HAL_US_TICKS(KB_IDLE_GAP_US))                                   //Frame cut short, the bus went idle
+         p->state = PS2START;
+      else if (p->state == PS2BIT){                                             //Skip what is left of the frame, this edge included
+         p->bitCnt += 1;
+         p->state = PS2RESYNC;
+      }
+      else if (p->state == PS2PARITY){                                          //This edge is the stop bit
+         p->bitCnt = 1;
+         p->state = PS2RESYNC;
+      }
+      else if (p->state == PS2STOP)
+         p->state = PS2START;                                                   //Lost the stop bit, this may be a new start
+   }
+#if PS2_STATS
+   else if (p->state >= PS2BIT && p->state <= PS2STOP){                         //One bit period
+      if (gap < p->stats.bitMin)
+         p->stats.bitMin = gap;
+      if (gap > p->stats.bitMax)
+         p->stats.bitMax = gap;
+      p->stats.bitSum += gap;
+      p->stats.bitCnt++;
+   }
+#endif
+
+   switch (p->state){
+      case PS2START:                                                            //Start state
+         if (!level){                                                           //Data pin low for the start bit
+            p->bitCnt = 8;                                                      //Init bit counter
+            p->parity = 0;                                                      //Init parity check
+            p->frameStart = stamp;
+            p->state = PS2BIT;                                                  //Bump to the next state
+         }
+         break;
+
+      case PS2BIT:                                                              //Data bit state
+         p->shift >>= 1;                                                        //Shift scan code bits
+
+         if (level)                                                             //Data line high?
+            p->shift += 0x80;                                                   //Yes.. turn on most significant bit in scan code buffer
+
+         p->parity ^= p->shift;                                                 //Update parity
+
+         if (--p->bitCnt == 0)                                                  //If all scan code bits read
+            p->state = PS2PARITY;                                               //Change state to parity
+         break;
+
+      case PS2PARITY:                                                           //Parity state
+         if (level)
+            p->parity ^= 0x80;
+
+         if (p->parity & 0x80)                                                  //Continue if parity is odd
+            p->state = PS2STOP;
+         else{
+            ps2Error(p,ERR_PARITY);                                             //Set and flag parity error
+            p->err.parity++;
+            p->state = PS2START;
+         }
+         break;
+
+      case PS2RESYNC:                                                           //Rest of a broken frame
+         if (--p->bitCnt == 0)
+            p->state = PS2START;
+         break;
+
+      case PS2STOP:                                                             //Stop state
+         if (level){                                                            //Stop bit?
+            p->frameTicks = stamp - p->frameStart;                              //Ten bit times, start to stop
+            if (p->frameTicks >= HAL_US_TICKS(KB_FRAME_MIN_US) &&
+                p->frameTicks <= HAL_US_TICKS(KB_FRAME_MAX_US))
+               p->bitTimeout = (p->frameTicks >> 3) + (p->frameTicks >> 5);     //0.156 of ten bits, 1.56 bit times without a divide
+#if PS2_STATS
+            p->stats.frames++;
+#endif
+            if((uint8_t)(p->rx.head - p->rx.tail) < RXSIZE){                    //Room in the ring?
+               p->rx.buffer[p->rx.head & (RXSIZE - 1)] = p->shift;              //Yes.. store the good scan code
+               p->rx.head++;                                                    //Publish it to the main loop
+            }
+            else
+               p->rx.drops++;                                                   //No.. count the lost frame
+            p->state = PS2START;                                                //Reset to start state
+            break;
+         }
+         else{                                                                  //Invalid stop bit
+            ps2Error(p,ERR_STOP);
+            p->err.stop++;
+            p->state = PS2START;
+            break;
+         }
+
+      default:
+         ps2Error(p,ERR_INV_STATE);                                             //Should not get here
+         p->err.state++;
+         p->state = PS2START;
+         break;
+   }
+}
+
+/*------------------------------------------*/
+/* Feed the captured edges to the frame     */
+/* decoder. Nothing to do when INTx decodes */
+/* them itself                              */
+/*------------------------------------------*/
+static void ps2RxDrain(ps2Port_t *p){
+#if PS2_CAPTURE
+   uint8_t tail = p->edges.tail;
+   uint16_t edge;
+
+   while(tail != p->edges.head){
+      edge = p->edges.edge[tail & (EDGESIZE - 1)];
+      p->edges.tail = ++tail;                                                   //Hand the slot back to the ISR
+      ps2RxEdge(p, edge & EDGE_LEVEL, edge & EDGE_STAMP, (edge & EDGE_IDLE) != 0);
+   }
+#else
+   (void)p;
+#endif
+}
+
+/*------------------------------------------*/
+/* Falling clock edge on port n, the body   */
+/* of INT0 and INT1. Receiving, the edge is */
+/* decoded here or, with PS2_CAPTURE, only  */
+/* timestamped for the main loop. Sending,  */
+/* the next command bit goes on the data    */
+/* line                                     */
+/*------------------------------------------*/
+static inline void ps2ClockEdge(ps2Port_t *p, const uint8_t n)
+{
+#if PS2_STATS
+   uint16_t isrStart = HAL_TICK16();
+#endif
+
+   if (p->state < PS2TX_RTS){                                                   //Device to host?
+      uint32_t now = halNow();
+      uint8_t idle = now - p->edgeAt > HAL_US_TICKS(KB_IDLE_GAP_US);
+
+      p->edgeAt = now;
+      HAL_COST(KB_CYC_STAMP);
+#if PS2_CAPTURE
+      uint8_t head = p->edges.head;
+
+      HAL_COST(KB_CYC_CAPTURE);
+      if ((uint8_t)(head - p->edges.tail) < EDGESIZE){                          //Room in the ring?
+         p->edges.edge[head & (EDGESIZE - 1)] = ((uint16_t)now & EDGE_STAMP) |
+                                                (idle ? EDGE_IDLE : 0) | HAL_PS2_DATA_P(n);
+         p->edges.head = head + 1;
+      }
+      else
+         p->edges.drops++;                                                      //No.. the decoder sees a gap and resyncs
+#else
+      ps2RxEdge(p, HAL_PS2_DATA_P(n), (uint16_t)now, idle);
+#endif
+   }
+   else switch (p->state){
+      case PS2TX_BIT:                                                           //Device wants the next data bit
+         HAL_PS2_DATA(n,p->txShift & 0x01);
+         p->parity ^= p->txShift & 0x01;
+         p->txShift >>= 1;
+         if (--p->bitCnt == 0)
+            p->state = PS2TX_PARITY;
+         break;
+
+      case PS2TX_PARITY:                                                        //Odd parity: 1 if the data had an even nbr of 1's
+         HAL_PS2_DATA(n,p->parity ^ 0x01);
+         p->state = PS2TX_STOP;
+         break;
+
+      case PS2TX_STOP:                                                          //Release data for the stop bit
+         HAL_PS2_DATA(n,1);
+         p->state = PS2TX_ACK;
+         break;
+
+      case PS2TX_ACK:                                                           //Device holds data low to ACK
+         if (HAL_PS2_DATA_P(n))
+            ps2TxEnd(p, TX_NOACK);
+         else if (++p->txIdx < p->txLen){                                       //Argument next?
+            HAL_PS2_INT_DISABLE(n);                                             //Device is still driving the ACK, let it finish
+            p->bitCnt = KB_ACK_GAP_POLLS;
+            p->state = PS2TX_GAP;
+            HAL_PS2_TMR_START(n,HAL_PS2_TICKS(KB_ACK_GAP_US));
+         }
+         else
+            ps2TxEnd(p, TX_DONE);
+         break;
+
+      default:
+         ps2Error(p,ERR_INV_STATE);                                             //Should not get here
+         p->err.state++;
+         p->state = PS2START;
+         break;
+   }
+
+   HAL_PS2_INT_CLEAR(n);                                                        //Reset the INTx flag
+#if PS2_STATS
+   {
+      uint16_t cyc, bin;
+
+      HAL_COST(KB_CYC_STATS);
+      cyc = HAL_TICK16() - isrStart;
+      bin = cyc / KB_STAT_BIN_CYC;
+      p->stats.isrHist[bin < KB_STAT_BINS ? bin : KB_STAT_BINS - 1]++;
+      if (cyc > p->stats.isrMax)
+         p->stats.isrMax = cyc;
+   }
+#endif
+}
+
+/*------------------------------------------*/
+/* Bus timer match on port n, the body of   */
+/* the Timer1 and Timer4 ISRs: host to      */
+/* device bus timing                        */
+/*------------------------------------------*/
+static inline void ps2TimerMatch(ps2Port_t *p, const uint8_t n)
+{
+   HAL_PS2_TMR_CLEAR(n);
+
+   switch (p->state){
+      case PS2TX_RTS:                                                           //Clock has been low long enough
+         HAL_PS2_DATA(n,0);                                                     //Pull data line low (start bit)
+         p->state = PS2TX_START;
+         HAL_PS2_TMR_START(n,HAL_PS2_TICKS(KB_START_US));
+         break;
+
+      case PS2TX_START:                                                         //Hand the clock to the device
+         p->bitCnt = 8;
+         p->parity = 0;
+         p->state = PS2TX_BIT;
+         HAL_PS2_CLOCK(n,1);
+         HAL_PS2_INT_CLEAR(n);                                                  //Drop the edge we made ourselves
+         HAL_PS2_INT_ENABLE(n);
+         HAL_PS2_TMR_START(n,HAL_PS2_TICKS(KB_TX_TIMEOUT_US));
+         break;
+
+      case PS2TX_BIT:
+      case PS2TX_PARITY:
+      case PS2TX_STOP:
+      case PS2TX_ACK:
+         ps2TxEnd(p, TX_TIMEOUT);                                               //Device stopped clocking
+         break;
+
+      case PS2TX_GAP:                                                           //Bus released after the ACK?
+         if (HAL_PS2_CLOCK_P(n) && HAL_PS2_DATA_P(n))
+            ps2TxNext(p);
+         else if (--p->bitCnt == 0)
+            ps2TxEnd(p, TX_TIMEOUT);
+         else
+            HAL_PS2_TMR_START(n,HAL_PS2_TICKS(KB_ACK_GAP_US));
+         break;
+
+      default:
+         HAL_PS2_TMR_STOP(n);                                                   //Nothing to time
+         break;
+   }
+}
+
+/*------------------------------------------*/
+/* External Interrupt 0 ISR (keyboard       */
+/* clock line) and Timer1 ISR               */
+/*------------------------------------------*/
+void HAL_ISR _INT0Interrupt(void)
+{
+   ps2ClockEdge(&xPorts[PS2_KBD], PS2_KBD);
+   return;
+}
+
+void HAL_ISR _T1Interrupt(void)
+{
+   ps2TimerMatch(&xPorts[PS2_KBD], PS2_KBD);
+   return;
+}
+
+#if PS2_PORTS > 1
+/*------------------------------------------*/
+/* External Interrupt 1 ISR (second port    */
+/* clock line) and Timer4 ISR               */
+/*------------------------------------------*/
+void HAL_ISR _INT1Interrupt(void)
+{
+   ps2ClockEdge(&xPorts[PS2_AUX], PS2_AUX);
+   return;
+}
+
+void HAL_ISR _T4Interrupt(void)
+{
+   ps2TimerMatch(&xPorts[PS2_AUX], PS2_AUX);
+   return;
+}
+#endif
@@ -0,0 +1,187 @@
+/*
+ * File:   ps2port.h
+ */
+
+#ifndef PS2PORT_H
+#define	PS2PORT_H
+
+#include <stdint.h>
+#include "kbcmd.h"
+
+/*----------------------------------------------------*/
+/* Defines                                            */
+/*----------------------------------------------------*/
+#ifndef PS2_PORTS
+#define PS2_PORTS   1                                                           //Ports serviced: 1 = keyboard only, 2 = second device on INT1
+#endif
+#define PS2_KBD     0                                                           //Keyboard port: RB6/RB7, INT0, Timer1
+#define PS2_AUX     1                                                           //Second port (mouse, ps2ms.c): RB8/RB9, INT1, Timer4
+
+#define RXSIZE      16                                                          //Raw scan code ring size, must be a power of two
+#ifndef PS2_CAPTURE
+#define PS2_CAPTURE 0                                                           //1 = INTx only timestamps edges, the main loop decodes frames
+#endif
+#define EDGESIZE    64                                                          //Captured edge ring size (PS2_CAPTURE), must be a power of two
+#define EDGE_LEVEL  0x0001                                                      //Captured edge: data level
+#define EDGE_IDLE   0x0002                                                      //Captured edge: bus idle past KB_IDLE_GAP_US before it
+#define EDGE_STAMP  0xFFFC                                                      //Captured edge: timebase low word, 4 tick steps
+
+//Cycle estimates charged by the simulator (HAL_COST), from the PIC24 listing
+#define KB_CYC_RX_EDGE  40                                                      //Gap check, state dispatch and the longest state (stop bit)
+#define KB_CYC_CAPTURE  12                                                      //Timestamp, data level and ring store
+#define KB_CYC_STAMP    10                                                      //32-bit timebase read and idle check, both ways
+#define KB_CYC_STATS    14                                                      //INTx histogram update (PS2_STATS)
+
+//Instrumentation, read by the host with HOST_OP_DIAG
+#ifndef PS2_STATS
+#define PS2_STATS   0                                                           //1 = INTx cycle histogram, bit period and frame counts
+#endif
+#define KB_STAT_BINS    8                                                       //INTx histogram bins, the last one is open ended
+#define KB_STAT_BIN_CYC 16                                                      //Cycles per bin
+
+//Host to device timing
+#define KB_RTS_US       100                                                     //Clock held low before the start bit
+#define KB_START_US     20                                                      //Data low before the clock is released
+#define KB_TX_TIMEOUT_US 20000                                                  //Device must clock the byte in by then (15ms + 2ms spec)
+#define KB_ACK_GAP_US   100                                                     //After the ACK edge, one bit time at 10kHz, before clock and data are checked
+#define KB_ACK_GAP_POLLS 20                                                     //Checks before the argument is given up on
+#define KB_BIT_TIMEOUT_US 110                                                   //Edge gap that means a lost edge until a good frame has measured the bit period
+#define KB_FRAME_MIN_US 500                                                     //Ten bit times a good frame may take: 16.7kHz = 600us
+#define KB_FRAME_MAX_US 1200                                                    //10kHz = 1000us
+#define KB_IDLE_GAP_US  250                                                     //Edge gap no lost pulse explains (10kHz, one missed = 200us): the frame was cut short and this edge starts a new one
+
+/*----------------------------------------------------*/
+/* Enumerations                                       */
+/*----------------------------------------------------*/
+typedef enum{
+    PS2START,                                                                   //Start bit
+    PS2BIT,                                                                     //Data bit(s)
+    PS2PARITY,                                                                  //Parity bit
+    PS2STOP,                                                                    //Stop bit
+    PS2RESYNC,                                                                  //Lost an edge, skipping the rest of the frame
+    PS2TX_RTS,                                                                  //Host to device: clock held low (port timer)
+    PS2TX_START,                                                                //Data low, clock about to be released (port timer)
+    PS2TX_BIT,                                                                  //Data bit(s), set on each falling edge
+    PS2TX_PARITY,                                                               //Parity bit
+    PS2TX_STOP,                                                                 //Stop bit (data released)
+    PS2TX_ACK,                                                                  //Device pulls data low
+    PS2TX_GAP                                                                   //ACKed, argument next once the device lets go of the bus (port timer)
+}ps2States_t;
+
+typedef enum{
+    TX_IDLE,                                                                    //Nothing sent yet
+    TX_BUSY,                                                                    //Bytes on the wire
+    TX_DONE,                                                                    //All bytes ACKed at line level
+    TX_NOACK,                                                                   //No line level ACK
+    TX_TIMEOUT                                                                  //Device never clocked the byte in
+}kbTxStat_t;
+
+typedef enum {
+    ERR_NONE = 0x00,
+    ERR_ECHO = 0xE0,                                                            //Echo failed
+    ERR_INV_STATE,                                                              //Invalid machine state
+    ERR_PARITY,                                                                 //Invalid scan code parity
+    ERR_STOP,                                                                   //Invalid stop bit
+    ERR_OVERFLOW,                                                               //Buffer overflow
+    ERR_LCK_NOACK,                                                              //setLocks() - no ack from keyboard
+    ERR_TX_NOACK,                                                               //Keyboard did not ACK a host byte
+    ERR_TX_TIMEOUT,                                                             //Keyboard did not clock a host byte in
+    ERR_CMD_FAIL,                                                               //Command not ACKed after all retries, or queue full
+    ERR_FRAMING,                                                                //Frame cut short by an inter-bit timeout
+    ERR_MOUSE,                                                                  //No mouse on the second port, or it would not stream
+    ERR_BAT                                                                     //Keyboard plugged in and failed its self test
+
+}kbErrors_t;
+
+/*----------------------------------------------------*/
+/* Structures                                         */
+/*----------------------------------------------------*/
+typedef struct{                                                                 //Single producer (frame decoder) single consumer (main loop) ring
+    volatile uint8_t head;                                                      //Free running write index, only the frame decoder writes it
+    volatile uint8_t tail;                                                      //Free running read index, only the main loop writes it
+    volatile uint16_t drops;                                                    //Completed frames lost to a full ring
+    uint8_t buffer[RXSIZE];
+}rxRing_t;
+
+typedef struct{                                                                 //Clock edges from INTx to the frame decoder (PS2_CAPTURE)
+    volatile uint8_t head;                                                      //Free running write index, only the ISR writes it
+    volatile uint8_t tail;                                                      //Free running read index, only the main loop writes it
+    volatile uint16_t drops;                                                    //Edges lost to a full ring
+    uint16_t edge[EDGESIZE];                                                    //EDGE_STAMP | EDGE_IDLE | EDGE_LEVEL
+}edgeRing_t;
+
+typedef struct{                                                                 //Errors by class, counted since the port was set up
+    uint16_t parity;
+    uint16_t stop;
+    uint16_t framing;                                                           //Inter-bit timeouts, frame resynchronized
+    uint16_t state;                                                             //Invalid ISR state
+    uint16_t txNoAck;
+    uint16_t txTimeout;
+}kbErrCounts_t;
+
+typedef struct{                                                                 //PS2_STATS counters, timebase ticks are FCY cycles
+    uint32_t frames;                                                            //Good frames received
+    uint32_t bitSum;                                                            //Sum of in-frame edge gaps
+    uint32_t bitCnt;                                                            //Number of in-frame edge gaps
+    uint16_t bitMin;
+    uint16_t bitMax;
+    uint16_t isrMax;                                                            //Longest INTx body
+    uint16_t isrHist[KB_STAT_BINS];                                             //INTx body lengths, KB_STAT_BIN_CYC wide bins
+}kbStats_t;
+
+typedef struct{                                                                 //Device inhibits for output queue back pressure (Q_BLOCK)
+    uint16_t count;
+    uint32_t ticks;                                                             //Total time held, timebase ticks
+    uint32_t maxTicks;                                                          //Longest single hold
+}kbHoldStats_t;
+
+typedef struct ps2Port{                                                         //Everything one PS2 port owns
+    uint8_t id;                                                                 //PS2_KBD, PS2_AUX: picks the pins, INTx and timer (hal.h)
+
+    //Frame decoder, runs in INTx (or the main loop with PS2_CAPTURE)
+    ps2States_t state;                                                          //Current state of operation
+    uint8_t shift;                                                              //Shift register for the frame on the wire
+    uint8_t bitCnt;                                                             //Bits left in the frame
+    uint8_t parity;                                                             //Running parity
+    uint16_t lastEdge;                                                          //Timebase (low word) at the last clock edge
+    uint32_t edgeAt;                                                            //Full timebase at the last edge INTx saw, the low word wraps every 4ms
+    uint16_t frameStart;                                                        //Timebase at the start bit of the frame on the wire
+    uint16_t frameTicks;                                                        //Start to stop bit of the last good frame (10 bit times)
+    uint16_t bitTimeout;                                                        //Edge gap that means a lost edge, about 1.5 bit periods of the device
+    rxRing_t rx;                                                                //Good frames for the main loop
+#if PS2_CAPTURE
+    edgeRing_t edges;                                                           //Clock edges for the deferred frame decoder
+#endif
+    kbErrCounts_t err;
+    kbErrors_t error;                                                           //Last error on this port, ERR_NONE if none yet
+#if PS2_STATS
+    kbStats_t stats;
+#endif
+
+    //Host to device bytes, shifted out by the ISRs
+    uint8_t txBuf[2];                                                           //Command and optional argument
+    uint8_t txLen;
+    uint8_t txIdx;
+    uint8_t txShift;                                                            //Byte on the wire
+    volatile kbTxStat_t txStatus;
+
+    //Back pressure holds
+    uint8_t inhibit;                                                            //Clock held low, device told to hold its output
+    uint32_t holdStart;                                                         //Timebase when the current hold began
+    kbHoldStats_t holds;
+
+    kbCmdEngine_t cmd;                                                          //Command scheduler (kbcmd.c)
+}ps2Port_t;
+
+/*----------------------------------------------------*/
+/* Function declarations                              */
+/*----------------------------------------------------*/
+void            ps2Error(ps2Port_t *, kbErrors_t);                              //Record the port's last error, flag it for the keyboard port
+void            ps2Inhibit(ps2Port_t *, uint8_t);                               //Hold (1) or release (0) the device via the clock line
+uint8_t         ps2NextCode(ps2Port_t *, uint8_t *);                            //Pop the next raw byte, 0 if the ring is empty
+uint8_t         ps2RxPending(ps2Port_t *);                                      //Bytes (or PS2_CAPTURE edges) the main loop has not taken yet
+void            ps2PortInit(ps2Port_t *, uint8_t);                              //Pins, INTx, timer, rings and counters for port n
+uint8_t         ps2SendCmd(ps2Port_t *, uint8_t, uint8_t);                      //Start sending a command (and argument), 0 = transmitter busy
+uint8_t         ps2TxBusy(ps2Port_t *);                                         //Command bytes still on the wire
+
+#endif	/* PS2PORT_H */
@@ -0,0 +1,166 @@
+/*----------------------------------------------------------------------------*/
+/* Byte FIFO for translated output                                            */
+/*                                                                            */
+/* head and tail are free running 16 bit indexes; the slot is the index       */
+/* masked with BUFMASK and the fill level is simply head - tail, so there is  */
+/* no divide and no separate count to keep in step. The producer (main loop)  */
+/* only writes head and the consumer (host link) only writes tail, which lets */
+/* the two run at different interrupt levels without masking.                 */
+/*                                                                            */
+/* The one exception is Q_DROP_OLDEST: the producer has to advance tail to    */
+/* make room, so the consumer must not be running at the same time.           */
+/*----------------------------------------------------------------------------*/
+#include "queue.h"
+#include <string.h>                                                             //For memcpy()
+
+void qInit(queue_t *q, qPolicy_t policy){
+   q->head = 0;
+   q->tail = 0;
+   q->hwm = 0;
+   q->drops = 0;
+   q->policy = policy;
+}
+
+uint16_t qCount(queue_t *q){
+   return (uint16_t)(q->head - q->tail);
+}
+
+uint16_t qSpace(queue_t *q){
+   return BUFSIZE - qCount(q);
+}
+
+uint8_t qPut(queue_t *q, uint8_t byte){
+
+   uint16_t head = q->head;
+   uint16_t count = (uint16_t)(head - q->tail);
+
+   if(count >= BUFSIZE){                                                        //Full?
+      q->drops++;
+      if(q->policy != Q_DROP_OLDEST)                                            //Yes.. refuse the new byte
+         return 0;
+      q->tail++;                                                                //Or make room by discarding the oldest
+      count--;
+   }
+
+   q->buffer[head & BUFMASK] = byte;
+   q->head = head + 1;                                                          //Publish after the byte is in place
+
+   if(++count > q->hwm)
+      q->hwm = count;
+   return 1;
+}
+
+uint8_t qGet(queue_t *q, uint8_t *byte){
+
+   uint16_t tail = q->tail;
+
+   if(tail == q->head)                                                          //Empty?
+      return 0;
+   *byte = q->buffer[tail & BUFMASK];
+   q->tail = tail + 1;                                                          //Hand the slot back to the producer
+   return 1;
+}
+
+uint8_t qPeek(queue_t *q, uint8_t *byte){
+
+   uint16_t tail = q->tail;
+
+   if(tail == q->head)
+      return 0;
+   *byte = q->buffer[tail & BUFMASK];
+   return 1;
+}
+
+/*------------------------------------------*/
+/* Copy out up to n bytes in at most two    */
+/* memcpy()s (before and after the wrap)    */
+/*------------------------------------------*/
+uint16_t qRead(queue_t *q, uint8_t *dst, uint16_t n){
+
+   uint16_t tail = q->tail;
+   uint16_t count = (uint16_t)(q->head - tail);
+   uint16_t slot = tail & BUFMASK;
+   uint16_t first;
+
+   if(n > count)
+      n = count;
+   first = BUFSIZE - slot;                                                      //Bytes before the wrap
+   if(first > n)
+      first = n;
+   memcpy(dst, &q->buffer[slot], first);
+   memcpy(dst + first, q->buffer, n - first);
+   q->tail = tail + n;
+   return n;
+}
+
+/*------------------------------------------*/
+/* Copy in n bytes, all of them or none.    */
+/* Queued bytes are never discarded here,   */
+/* whatever the policy, so a multi byte     */
+/* record cannot lose its start. Returns 0  */
+/* if refused                               */
+/*------------------------------------------*/
+uint8_t qWrite(queue_t *q, const uint8_t *src, uint16_t n){
+
+   uint16_t head = q->head;
+   uint16_t count = (uint16_t)(head - q->tail);
+   uint16_t slot = head & BUFMASK;
+   uint16_t first;
+
+   if(n > BUFSIZE - count){                                                     //Not enough room?
+      q->drops += n;
+      return 0;
+   }
+   first = BUFSIZE - slot;
+   if(first > n)
+      first = n;
+   memcpy(&q->buffer[slot], src, first);
+   memcpy(q->buffer, src + first, n - first);
+   q->head = head + n;                                                          //Publish after the bytes are in place
+
+   count += n;
+   if(count > q->hwm)
+      q->hwm = count;
+   return 1;
+}
+
+/*------------------------------------------*/
+/* Discard the n oldest bytes, or as many   */
+/* as there are, and count them as drops.   */
+/* Producer side, same rule as              */
+/* Q_DROP_OLDEST in qPut()                  */
+/*------------------------------------------*/
+uint16_t qDrop(queue_t *q, uint16_t n){
+
+   uint16_t count = (uint16_t)(q->head - q->tail);
+
+   if(n > count)
+      n = count;
+   q->tail += n;
+   q->drops += n;
+   return n;
+}
+
+/*------------------------------------------*/
+/* Discard the oldest character of a queue  */
+/* holding UTF-8: the lead byte and the     */
+/* continuation bytes after it, so what is  */
+/* left still starts on a character. Counts */
+/* every byte as a drop. Producer side,     */
+/* same rule as Q_DROP_OLDEST in qPut()     */
+/*------------------------------------------*/
+uint8_t qDropUtf8(queue_t *q){
+
+   uint16_t tail = q->tail;
+   uint8_t n = 0;
+
+   while(tail != q->head){
+      tail++;
+      n++;
+      if(tail == q->head || (q->buffer[tail & BUFMASK] & 0xC0) != 0x80)         //Next one is not a continuation byte
+         break;
+   }
+   q->tail = tail;
+   q->drops += n;
+   return n;
+}
@@ -0,0 +1,51 @@
+/*
+ * File:   queue.h
+ */
+
+#ifndef QUEUE_H
+#define	QUEUE_H
+
+#include <stdint.h>
+
+/*----------------------------------------------------*/
+/* Defines                                            */
+/*----------------------------------------------------*/
+#define BUFSIZE     512                                                         //FIFO/circular buffer size in bytes, must be a power of two
+#define BUFMASK     (BUFSIZE - 1)
+
+/*----------------------------------------------------*/
+/* Enumerations                                       */
+/*----------------------------------------------------*/
+typedef enum{
+    Q_DROP_NEWEST,                                                              //Full queue refuses the new byte
+    Q_DROP_OLDEST,                                                              //Full queue discards its oldest byte
+    Q_BLOCK                                                                     //Full queue refuses, producer inhibits the keyboard until there is room
+}qPolicy_t;
+
+/*----------------------------------------------------*/
+/* Structures                                         */
+/*----------------------------------------------------*/
+typedef struct{                                                                 //FIFO queue typedef
+    volatile uint16_t head;                                                     //Free running write index, producer only
+    volatile uint16_t tail;                                                     //Free running read index, consumer only
+    uint16_t hwm;                                                               //High-water mark (most bytes ever queued)
+    uint16_t drops;                                                             //Bytes lost to overflow
+    qPolicy_t policy;                                                           //What to do when full
+    uint8_t buffer[BUFSIZE];
+}queue_t;
+
+/*----------------------------------------------------*/
+/* Function declarations                              */
+/*----------------------------------------------------*/
+void            qInit(queue_t *, qPolicy_t);                                    //Empty the queue and set its overflow policy
+uint16_t        qCount(queue_t *);                                              //Bytes waiting
+uint16_t        qSpace(queue_t *);                                              //Free slots
+uint8_t         qPut(queue_t *, uint8_t);                                       //Enqueue one byte, 0 if it was refused
+uint8_t         qGet(queue_t *, uint8_t *);                                     //Dequeue one byte, 0 if empty
+uint8_t         qPeek(queue_t *, uint8_t *);                                    //Look at the oldest byte without removing it
+uint16_t        qRead(queue_t *, uint8_t *, uint16_t);                          //Dequeue up to n bytes into a buffer
+uint8_t         qWrite(queue_t *, const uint8_t *, uint16_t);                   //Enqueue n bytes or none, 0 if refused
+uint16_t        qDrop(queue_t *, uint16_t);                                     //Discard the n oldest bytes, returns how many there were
+uint8_t         qDropUtf8(queue_t *);                                           //Discard the oldest UTF-8 character, returns its bytes
+
+#endif	/* QUEUE_H */
@@ -0,0 +1,258 @@
+/*----------------------------------------------------------------------------*/
+/* Two PS2 ports at full clock, firmware built with PS2_PORTS=2               */
+/*                                                                            */
+/* A keyboard on port 0 (INT0, Timer1) types letters back to back with the    */
+/* odd caps lock, so LED commands go out on port 0 mid stream. A second       */
+/* device on port 1 (INT1, Timer4) streams random bytes back to back and the  */
+/* harness queues an echo to it every few milliseconds. Both run at 16.7kHz   */
+/* with random frame gaps so their edges slide past each other.               */
+/*                                                                            */
+/* Every main loop pass both raw rings are copied and compared exactly with   */
+/* the frames each device completed, and the typed text with what the         */
+/* keyboard layer posted. Each setup (keyboard alone, second device alone,    */
+/* both) reports frames/s per port and the worst INT0/INT1 flag to dispatch   */
+/* latency and ISR length. A run fails on any lost, extra or wrong frame,     */
+/* wrong text, failed echo, timeout, or an INTx latency of half a clock       */
+/* period or more: the data line is only valid while clock is low.            */
+/*                                                                            */
+/* usage: dualbench [-n runs] [-k keys] [-c clock_hz] [-s seed]               */
+/*----------------------------------------------------------------------------*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "sim.h"
+#include "simkbd.h"
+#include "ps2kb.h"
+
+#define ECHO_US     10000                                                       //Echo to port 1 this often
+#define RAW_MAX     16384
+
+static const uint8_t letterCodes[26] = {                                        //Set 2 make codes for a..z
+   0x1C,0x32,0x21,0x23,0x24,0x2B,0x34,0x33,0x43,0x3B,0x42,0x4B,0x3A,
+   0x31,0x44,0x4D,0x15,0x2D,0x1B,0x2C,0x3C,0x2A,0x1D,0x22,0x35,0x1A
+};
+
+typedef struct{                                                                 //One port as seen from the wire and the ring
+    simKbd_t dev;
+    uint8_t  sent[RAW_MAX];                                                     //Frames the device completed
+    uint8_t  got[RAW_MAX];                                                      //Frames the ISR stored
+    uint32_t nSent, nGot;
+    uint8_t  seen;                                                              //Ring head already copied
+    uint64_t first, last;                                                       //First start bit, last frame end
+}port_t;
+
+typedef struct{
+    const char *name;
+    uint8_t kbd;                                                                //Port 0 types
+    uint8_t aux;                                                                //Port 1 streams
+}setup_t;
+
+extern queue_t xOutBuf;
+extern ps2Port_t xPorts[PS2_PORTS];
+extern uint8_t capsLock, numsLock;
+int fwMain(void);
+
+static port_t ports[PS2_PORTS];
+static char expect[4096], got[4096];
+static uint32_t nExpect, nGot;
+static uint32_t nLocks, nEchoes;
+static uint64_t nextEcho;
+static uint8_t echoOn;
+
+static void onFrame(simKbd_t *kb, uint8_t code, uint8_t tag, uint64_t start){
+
+   port_t *p = &ports[kb->bus];
+
+   (void)tag;
+   if(!p->nSent)
+      p->first = start;
+   p->last = simNow;
+   if(p->nSent < RAW_MAX)
+      p->sent[p->nSent++] = code;
+}
+
+static void loopHook(void){
+
+   port_t *p;
+   uint8_t ch;
+   int n;
+
+   for(n = 0; n < PS2_PORTS; n++){                                              //Frames the ISRs stored since the last pass
+      p = &ports[n];
+      while(p->seen != xPorts[n].rx.head){
+         if(p->nGot < RAW_MAX)
+            p->got[p->nGot++] = xPorts[n].rx.buffer[p->seen & (RXSIZE - 1)];
+         p->seen++;
+      }
+   }
+   while(qGet(&xOutBuf, &ch))                                                   //Stand in for the master, no back pressure
+      if(nGot < sizeof(got))
+         got[nGot++] = ch;
+   if(echoOn && simNow >= nextEcho && !kbCmdBusy(&xPorts[PS2_AUX])){            //Host to device traffic on port 1
+      kbCmdQueue(&xPorts[PS2_AUX], CMD_ECHO, NO_ARGS);
+      nEchoes++;
+      nextEcho = simNow + SIM_US(ECHO_US);
+   }
+}
+
+static int doneHook(void){
+
+   uint64_t idle = ports[0].dev.idleSince > ports[1].dev.idleSince ?
+                   ports[0].dev.idleSince : ports[1].dev.idleSince;
+
+   if(!simKbdIdle(&ports[0].dev) || !simKbdIdle(&ports[1].dev) ||
+      kbCmdBusy(&xPorts[PS2_KBD]) || kbCmdBusy(&xPorts[PS2_AUX]))
+      return 0;
+   echoOn = 0;
+   return simNow - idle > SIM_US(2000);
+}
+
+static uint64_t buildKbd(uint32_t keys, uint64_t t){
+
+   uint32_t i, k;
+   uint8_t caps = 0;
+   simKbd_t *kb = &ports[PS2_KBD].dev;
+
+   for(i = 0; i < keys; i++){
+      if(rand() % 20 == 0){                                                     //Caps lock, LED command follows
+         simKbdScript(kb, t, 0x58, 0);
+         simKbdScript(kb, t, 0xF0, 0);
+         simKbdScript(kb, t, 0x58, 0);
+         caps ^= 1;
+         nLocks++;
+      }
+      k = rand() % 26;
+      simKbdScript(kb, t, letterCodes[k], 0);
+      simKbdScript(kb, t, 0xF0, 0);
+      simKbdScript(kb, t, letterCodes[k], 0);
+      expect[nExpect++] = caps ? 'A' + k : 'a' + k;
+   }
+   return t;
+}
+
+static void buildAux(uint32_t bytes, uint64_t t){
+
+   uint32_t i;
+   uint8_t b;
+
+   for(i = 0; i < bytes; i++){
+      do                                                                        //Nothing the command scheduler would take as a reply
+         b = rand();
+      while(b == KB_ECHO || b == KB_ACK || b == KB_RSND);
+      simKbdScript(&ports[PS2_AUX].dev, t, b, 0);
+   }
+}
+
+static int runOnce(const setup_t *su, uint32_t keys, uint32_t halfUs){
+
+   uint64_t start = SIM_US(5000);                                               //Leave room for kbInitialize()
+   port_t *p;
+   int n, r;
+
+   simReset();
+   for(n = 0; n < PS2_PORTS; n++){
+      p = &ports[n];
+      simKbdInit(&p->dev, halfUs);
+      p->dev.bus = n;
+      p->dev.gapUs = 20 + rand() % 60;                                          //Slide the two ports' edges past each other
+      p->dev.onFrame = onFrame;
+      p->nSent = p->nGot = p->seen = 0;
+   }
+   capsLock = numsLock = 0;
+   nExpect = nGot = nLocks = nEchoes = 0;
+   nextEcho = start;
+   echoOn = su->aux;
+   if(su->kbd)
+      buildKbd(keys, start);
+   if(su->aux)
+      buildAux(keys * 3, start);
+   simLoopHook = loopHook;
+   simDoneHook = doneHook;
+   simDeadline = start + (uint64_t)(ports[0].dev.scriptHead + ports[1].dev.scriptHead) *
+                 SIM_US(2 * (22 * halfUs + 100)) + SIM_US(50000);                //Room for every command and echo
+   if(simRun(fwMain))
+      return -1;
+
+   r = nGot != nExpect || memcmp(got, expect, nExpect);
+   for(n = 0; n < PS2_PORTS; n++){
+      p = &ports[n];
+      r |= p->nGot != p->nSent || memcmp(p->got, p->sent, p->nSent);
+      r |= xPorts[n].rx.drops != 0 || xPorts[n].cmd.failures != 0;
+   }
+   r |= ports[PS2_AUX].dev.cmdsRcvd != nEchoes;
+   return r;
+}
+
+int main(int argc, char **argv){
+
+   static const setup_t setups[] = {
+      {"kbd",  1, 0},
+      {"aux",  0, 1},
+      {"both", 1, 1},
+   };
+   uint32_t runs = 20, keys = 100, hz = 16700, seed = 1, halfUs;
+   uint32_t i, n, bad, timeouts, failed = 0;
+   uint64_t frames[PS2_PORTS], busy[PS2_PORTS], lat[PS2_PORTS], cyc[PS2_PORTS];
+   static const int edgeIrq[PS2_PORTS] = {SIM_IRQ_INT0, SIM_IRQ_INT1};
+   double t0;
+   int opt, r, k;
+
+   while((opt = getopt(argc, argv, "n:k:c:s:")) != -1){
+      switch(opt){
+         case 'n': runs = strtoul(optarg, NULL, 0); break;
+         case 'k': keys = strtoul(optarg, NULL, 0); break;
+         case 'c': hz = strtoul(optarg, NULL, 0); break;
+         case 's': seed = strtoul(optarg, NULL, 0); break;
+         default:
+            fprintf(stderr, "usage: %s [-n runs] [-k keys] [-c clock_hz] [-s seed]\n", argv[0]);
+            return 2;
+      }
+   }
+   if(keys > 1000)
+      keys = 1000;
+   halfUs = (500000 + hz / 2) / hz;
+   srand(seed);
+   t0 = simWallSec();
+
+   printf("%u runs per setup, %u keys / %u bytes, %u Hz clock on both ports\n",
+          runs, keys, keys * 3, hz);
+   printf("%-6s %9s %9s %9s %9s %9s %9s  %s\n", "setup", "kbd fr/s", "aux fr/s",
+          "INT0 lat", "INT1 lat", "INT0 cyc", "INT1 cyc", "result");
+   for(i = 0; i < sizeof(setups) / sizeof(setups[0]); i++){
+      bad = timeouts = 0;
+      memset(frames, 0, sizeof(frames));
+      memset(busy, 0, sizeof(busy));
+      memset(lat, 0, sizeof(lat));
+      memset(cyc, 0, sizeof(cyc));
+      for(n = 0; n < runs; n++){
+         r = runOnce(&setups[i], keys, halfUs);
+         if(r < 0)
+            timeouts++;
+         else if(r)
+            bad++;
+         for(k = 0; k < PS2_PORTS; k++){
+            if(k == PS2_KBD ? setups[i].kbd : setups[i].aux){                   //Streaming port, not just a command reply
+               frames[k] += ports[k].nSent;
+               busy[k] += ports[k].last - ports[k].first;
+            }
+            if(simIrq[edgeIrq[k]].latMax > lat[k])
+               lat[k] = simIrq[edgeIrq[k]].latMax;
+            if(simIrq[edgeIrq[k]].cycMax > cyc[k])
+               cyc[k] = simIrq[edgeIrq[k]].cycMax;
+         }
+      }
+      r = bad || timeouts || SIM_TO_US(lat[0]) >= halfUs || SIM_TO_US(lat[1]) >= halfUs;
+      failed += r;
+      printf("%-6s %9.0f %9.0f %7.2fus %7.2fus %9u %9u  %s", setups[i].name,
+             busy[0] ? frames[0] * 1e6 / SIM_TO_US(busy[0]) : 0.0,
+             busy[1] ? frames[1] * 1e6 / SIM_TO_US(busy[1]) : 0.0,
+             SIM_TO_US(lat[0]), SIM_TO_US(lat[1]), (uint32_t)cyc[0], (uint32_t)cyc[1],
+             r ? "FAIL" : "ok");
+      if(bad || timeouts)
+         printf(" (%u mismatches, %u timeouts)", bad, timeouts);
+      printf("\n");
+   }
+   printf("wall             %.2f s\n", simWallSec() - t0);
+   return failed != 0;
+}
@@ -0,0 +1,199 @@
+/*----------------------------------------------------------------------------*/
+/* Main loop in Idle (power.c) against the main loop that spins               */
+/*                                                                            */
+/* The same scenarios run on the firmware as built (idlebench) and with       */
+/* PM_IDLE=0 (idlebench-spin), the master following KB_FLAG throughout:       */
+/*                                                                            */
+/* quiet       nothing typed for a second                                     */
+/* slow        a key every 200ms, each one after a silence                    */
+/* typing      30 cps                                                         */
+/* burst       keys back to back at full clock                                */
+/*                                                                            */
+/* Reports per scenario the share of time the CPU spent in Idle, the naps     */
+/* per second, the worst INT0 flag to dispatch latency and what it may be at  */
+/* most: PM_WAKE_CYC plus the longest dispatch of any other source, since     */
+/* they share its priority. Keystroke latency is timed from the make code     */
+/* start bit to the end of the SPI byte that carried it to the master, and    */
+/* should read the same on both builds. A scenario fails on wrong text, a     */
+/* timeout, an INT0 latency over that bound, or a diagnostics record whose    */
+/* idle, awake and nap counts differ from the firmware's.                     */
+/*                                                                            */
+/* usage: idlebench [-n runs] [-c clock_hz] [-s seed]                         */
+/*----------------------------------------------------------------------------*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "sim.h"
+#include "simkbd.h"
+#include "simspi.h"
+#include "ps2kb.h"
+#include "host.h"
+#include "power.h"
+
+#define TAG_NONE    0
+#define TAG_CHAR    1
+
+#define SCK_HZ      1000000
+#define GAP_US      10
+#define START_US    5000                                                        //Leave room for kbInitialize()
+
+static const uint8_t letterCodes[26] = {                                        //Set 2 make codes for a..z
+   0x1C,0x32,0x21,0x23,0x24,0x2B,0x34,0x33,0x43,0x3B,0x42,0x4B,0x3A,
+   0x31,0x44,0x4D,0x15,0x2D,0x1B,0x2C,0x3C,0x2A,0x1D,0x22,0x35,0x1A
+};
+
+typedef struct{
+    const char *name;
+    uint32_t keys;
+    uint32_t gapUs;                                                             //Make code to make code, 0 = back to back
+    uint32_t spanUs;                                                            //Length of the run from START_US
+}scenario_t;
+
+static const scenario_t scenarios[] = {
+   {"quiet",    0,      0, 1000000},
+   {"slow",    10, 200000, 2000000},
+   {"typing",  60,  33333, 2000000},
+   {"burst",  100,      0,  200000},
+};
+#define NSCEN (sizeof(scenarios) / sizeof(scenarios[0]))
+
+extern queue_t xOutBuf;
+extern uint8_t capsLock, numsLock;
+extern pmState_t *pPower;
+int fwMain(void);
+
+static simKbd_t kbd;
+static simSpi_t spi;
+static char expect[BUFSIZE], got[BUFSIZE];
+static uint32_t nExpect, nGot;
+static uint64_t stamps[BUFSIZE];
+static uint32_t stampHead, stampTail;
+static uint64_t endAt;
+static simStat_t latency;
+
+static void onFrame(simKbd_t *kb, uint8_t code, uint8_t tag, uint64_t start){
+   (void)kb; (void)code;
+   if(tag == TAG_CHAR)
+      stamps[stampHead++ % BUFSIZE] = start;
+}
+
+static void onByte(simSpi_t *m, uint8_t b){
+   (void)m;
+   if(nGot < sizeof(got))
+      got[nGot++] = b;
+   if(stampTail != stampHead)
+      simStatAdd(&latency, (uint32_t)(simNow - stamps[stampTail++ % BUFSIZE]));
+}
+
+static int doneHook(void){
+   return simNow >= endAt && simKbdIdle(&kbd) && simSpiIdle(&spi) &&
+          !simNotifyLat && !qCount(&xOutBuf);
+}
+
+static void build(const scenario_t *sc){
+
+   uint64_t t = SIM_US(START_US);
+   uint32_t i, k;
+
+   for(i = 0; i < sc->keys; i++){
+      k = rand() % 26;
+      simKbdScript(&kbd, t, letterCodes[k], TAG_CHAR);
+      simKbdScript(&kbd, t, 0xF0, TAG_NONE);
+      simKbdScript(&kbd, t, letterCodes[k], TAG_NONE);
+      expect[nExpect++] = 'a' + k;
+      t += SIM_US(sc->gapUs);
+   }
+}
+
+/*------------------------------------------*/
+/* One run; returns -1 on a timeout, 1 on   */
+/* wrong text or diagnostics, else 0        */
+/*------------------------------------------*/
+static int runOnce(const scenario_t *sc, uint32_t hz){
+
+   kbDiag_t d;
+
+   simReset();
+   simKbdInit(&kbd, (500000 + hz / 2) / hz);
+   kbd.onFrame = onFrame;
+   simSpiInit(&spi, SCK_HZ, GAP_US);
+   spi.onByte = onByte;
+   capsLock = numsLock = 0;
+   nExpect = nGot = 0;
+   stampHead = stampTail = 0;
+   build(sc);
+   endAt = SIM_US(START_US + sc->spanUs);
+   simDoneHook = doneHook;
+   simDeadline = endAt + (uint64_t)kbd.scriptHead * SIM_US(22 * kbd.halfUs + kbd.gapUs) +
+                 SIM_US(50000);
+   if(simRun(fwMain))
+      return -1;
+
+   memset(&d, 0, sizeof(d));
+   simSpiRecord(HOST_OP_DIAG, SCK_HZ, GAP_US, (uint8_t *)&d, sizeof(d));
+   return nGot != nExpect || memcmp(got, expect, nExpect) || d.version != KB_DIAG_VERSION ||
+          d.idleMs != pPower->idleMs || d.awakeMs != pPower->awakeMs || d.naps != pPower->naps;
+}
+
+int main(int argc, char **argv){
+
+   uint32_t runs = 3, hz = 12500, seed = 1;
+   uint32_t i, n, bad, timeouts, failed = 0;
+   uint64_t idle, awake, naps, span, lat, bound, cyc;
+   double t0;
+   int opt, r, k;
+
+   while((opt = getopt(argc, argv, "n:c:s:")) != -1){
+      switch(opt){
+         case 'n': runs = strtoul(optarg, NULL, 0); break;
+         case 'c': hz = strtoul(optarg, NULL, 0); break;
+         case 's': seed = strtoul(optarg, NULL, 0); break;
+         default:
+            fprintf(stderr, "usage: %s [-n runs] [-c clock_hz] [-s seed]\n", argv[0]);
+            return 2;
+      }
+   }
+   srand(seed);
+   t0 = simWallSec();
+
+   printf("PM_IDLE=%d, %u runs per scenario, %u Hz clock, SCK %u Hz\n", PM_IDLE, runs, hz, SCK_HZ);
+   printf("%-9s %7s %8s %9s %9s %9s %9s  %s\n", "scenario", "idle", "naps/s",
+          "INT0 lat", "bound", "key p50", "key max", "result");
+   for(i = 0; i < NSCEN; i++){
+      bad = timeouts = 0;
+      idle = awake = naps = span = lat = 0;
+      bound = PM_WAKE_CYC;
+      for(n = 0; n < runs; n++){
+         r = runOnce(&scenarios[i], hz);
+         if(r < 0)
+            timeouts++;
+         else if(r)
+            bad++;
+         idle += pPower->idleMs * HAL_US_TICKS(1000) + pPower->idleTicks;
+         awake += pPower->awakeMs * HAL_US_TICKS(1000) + pPower->awakeTicks;
+         naps += pPower->naps;
+         span += simNow;
+         if(simIrq[SIM_IRQ_INT0].latMax > lat)
+            lat = simIrq[SIM_IRQ_INT0].latMax;
+         for(k = 0; k < SIM_IRQ_COUNT; k++){                                    //Whatever ran when the edge came in
+            cyc = k == SIM_IRQ_INT0 ? 0 : PM_WAKE_CYC + simIrq[k].cycMax;
+            if(cyc > bound)
+               bound = cyc;
+         }
+      }
+      r = bad || timeouts || lat > bound;
+      failed += r;
+      printf("%-9s %6.2f%% %8.0f %7.2fus %7.2fus %7.1fus %7.1fus  %s", scenarios[i].name,
+             idle + awake ? 100.0 * idle / (idle + awake) : 0.0,
+             span ? naps * 1e6 / SIM_TO_US(span) : 0.0, SIM_TO_US(lat), SIM_TO_US(bound),
+             SIM_TO_US(simStatPct(&latency, 50)), SIM_TO_US(simStatPct(&latency, 100)),
+             r ? "FAIL" : "ok");
+      if(bad || timeouts)
+         printf(" (%u mismatches, %u timeouts)", bad, timeouts);
+      printf("\n");
+      simStatFree(&latency);
+   }
+   printf("wall             %.2f s\n", simWallSec() - t0);
+   return failed != 0;
+}
@@ -0,0 +1,161 @@
+/*----------------------------------------------------------------------------*/
+/* INT0 receive cost: state machine ISR against edge capture (PS2_CAPTURE)    */
+/*                                                                            */
+/* The same source is linked against both builds of the firmware (isrbench    */
+/* and isrbench-cap). The keyboard types back to back while the SPI master    */
+/* drains the queue as fast as KB_FLAG allows, so INT0 competes with the SPI  */
+/* and CN interrupts the whole time. Reported per build:                      */
+/*                                                                            */
+/*   INT0 cycles per edge (mean, max) and its share of the CPU                */
+/*   longest flag-to-dispatch delay of the SPI1 and CN interrupts             */
+/*   SPI under/overruns, character latency, measured keyboard clock           */
+/*                                                                            */
+/* The typed text is checked at the master in every run.                      */
+/*                                                                            */
+/* usage: isrbench [-n runs] [-k keys] [-c clock_hz] [-f sck_hz] [-b gap_us]  */
+/*                 [-s seed]                                                  */
+/*----------------------------------------------------------------------------*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "sim.h"
+#include "simkbd.h"
+#include "simspi.h"
+#include "ps2kb.h"
+
+#define TAG_NONE    0
+#define TAG_CHAR    1
+
+static const uint8_t letterCodes[26] = {                                        //Set 2 make codes for a..z
+   0x1C,0x32,0x21,0x23,0x24,0x2B,0x34,0x33,0x43,0x3B,0x42,0x4B,0x3A,
+   0x31,0x44,0x4D,0x15,0x2D,0x1B,0x2C,0x3C,0x2A,0x1D,0x22,0x35,0x1A
+};
+
+extern uint8_t capsLock, numsLock;
+extern ps2Port_t xPorts[PS2_PORTS];
+int fwMain(void);
+
+static simKbd_t kbd;
+static simSpi_t spi;
+static char expect[BUFSIZE], got[BUFSIZE];
+static uint32_t nExpect, nGot;
+static uint64_t stamps[BUFSIZE];
+static uint32_t stampHead, stampTail;
+static simStat_t latency;
+
+static void onFrame(simKbd_t *kb, uint8_t code, uint8_t tag, uint64_t start){
+   (void)kb; (void)code;
+   if(tag == TAG_CHAR)
+      stamps[stampHead++ % BUFSIZE] = start;
+}
+
+static void onByte(simSpi_t *m, uint8_t b){
+   (void)m;
+   if(nGot < sizeof(got))
+      got[nGot++] = b;
+   if(stampTail != stampHead)
+      simStatAdd(&latency, (uint32_t)(simNow - stamps[stampTail++ % BUFSIZE]));
+}
+
+static int doneHook(void){
+   return simKbdIdle(&kbd) && simSpiIdle(&spi) && !simNotifyLat &&
+          simNow - kbd.idleSince > SIM_US(2000);
+}
+
+static int runOnce(uint32_t keys, uint32_t hz, uint32_t sckHz, uint32_t gapUs){
+
+   uint64_t t = SIM_US(5000);                                                   //Leave room for kbInitialize()
+   uint32_t i, k;
+
+   simReset();
+   simKbdInit(&kbd, (500000 + hz / 2) / hz);
+   kbd.onFrame = onFrame;
+   simSpiInit(&spi, sckHz, gapUs);
+   spi.jitterCyc = SIM_US(22 * kbd.halfUs + kbd.gapUs);                         //Slide transactions across the PS2 frames
+   spi.onByte = onByte;
+   capsLock = numsLock = 0;
+   nExpect = nGot = 0;
+   stampHead = stampTail = 0;
+   for(i = 0; i < keys; i++){                                                   //All due at once, frames go back to back
+      k = rand() % 26;
+      simKbdScript(&kbd, t, letterCodes[k], TAG_CHAR);
+      simKbdScript(&kbd, t, 0xF0, TAG_NONE);
+      simKbdScript(&kbd, t, letterCodes[k], TAG_NONE);
+      expect[nExpect++] = 'a' + k;
+   }
+   simDoneHook = doneHook;
+   simDeadline = t + (uint64_t)(kbd.scriptHead) * SIM_US(22 * kbd.halfUs + kbd.gapUs) +
+                 SIM_US(50000);
+   if(simRun(fwMain))
+      return -1;
+   return nGot != nExpect || memcmp(got, expect, nExpect);
+}
+
+int main(int argc, char **argv){
+
+   uint32_t runs = 100, keys = 100, hz = 16700, sckHz = 1000000, gapUs = 4, seed = 1;
+   uint32_t n, bad = 0, timeouts = 0, under = 0, over = 0;
+   uint64_t edges = 0, isrCyc = 0, isrMax = 0, spiLat = 0, cnLat = 0, virt = 0;
+   double t0, frameHz = 0;
+   int opt, r;
+
+   while((opt = getopt(argc, argv, "n:k:c:f:b:s:")) != -1){
+      switch(opt){
+         case 'n': runs = strtoul(optarg, NULL, 0); break;
+         case 'k': keys = strtoul(optarg, NULL, 0); break;
+         case 'c': hz = strtoul(optarg, NULL, 0); break;
+         case 'f': sckHz = strtoul(optarg, NULL, 0); break;
+         case 'b': gapUs = strtoul(optarg, NULL, 0); break;
+         case 's': seed = strtoul(optarg, NULL, 0); break;
+         default:
+            fprintf(stderr, "usage: %s [-n runs] [-k keys] [-c clock_hz] [-f sck_hz] "
+                            "[-b gap_us] [-s seed]\n", argv[0]);
+            return 2;
+      }
+   }
+   if(keys > BUFSIZE)
+      keys = BUFSIZE;
+   srand(seed);
+   t0 = simWallSec();
+
+   for(n = 0; n < runs; n++){
+      r = runOnce(keys, hz, sckHz, gapUs);
+      if(r < 0)
+         timeouts++;
+      else if(r)
+         bad++;
+      edges += simIrq[SIM_IRQ_INT0].count;
+      isrCyc += simIrq[SIM_IRQ_INT0].cycles;
+      if(simIrq[SIM_IRQ_INT0].cycMax > isrMax)
+         isrMax = simIrq[SIM_IRQ_INT0].cycMax;
+      if(simIrq[SIM_IRQ_SPI1].latMax > spiLat)
+         spiLat = simIrq[SIM_IRQ_SPI1].latMax;
+      if(simIrq[SIM_IRQ_CN].latMax > cnLat)
+         cnLat = simIrq[SIM_IRQ_CN].latMax;
+      under += simSpiUnderruns;
+      over += simSpiOverruns;
+      virt += simNow;
+      if(xPorts[PS2_KBD].frameTicks)
+         frameHz = 10.0 * FCY / xPorts[PS2_KBD].frameTicks;
+   }
+
+   printf("receive          %s\n", PS2_CAPTURE ? "edge capture, decoded in the main loop" :
+                                                 "state machine in the INT0 ISR");
+   printf("runs             %u of %u keys, %u Hz clock, SCK %u Hz, %u us between bytes\n",
+          runs, keys, hz, sckHz, gapUs);
+   printf("mismatches       %u\n", bad);
+   printf("timeouts         %u\n", timeouts);
+   printf("INT0 cycles      mean %.1f  max %llu per edge\n",
+          edges ? (double)isrCyc / edges : 0.0, (unsigned long long)isrMax);
+   printf("INT0 load        %.2f %%\n", virt ? 100.0 * isrCyc / virt : 0.0);
+   printf("max dispatch     SPI1 %.2f us  CN %.2f us\n", SIM_TO_US(spiLat), SIM_TO_US(cnLat));
+   printf("under/overruns   %u/%u\n", under, over);
+   printf("char latency us  p50 %.1f  p99 %.1f  max %.1f\n",
+          SIM_TO_US(simStatPct(&latency, 50)), SIM_TO_US(simStatPct(&latency, 99)),
+          SIM_TO_US(simStatPct(&latency, 100)));
+   printf("measured clock   %.0f Hz (last frame)\n", frameHz);
+   printf("wall             %.2f s\n", simWallSec() - t0);
+   simStatFree(&latency);
+   return bad || timeouts;
+}
@@ -0,0 +1,352 @@
+/*----------------------------------------------------------------------------*/
+/* Pressed key state against a reference model, read over HOST_OP_KEYS        */
+/*                                                                            */
+/* The keyboard presses and releases keys at random with up to 10 held at     */
+/* once: letters, digits, all eight modifiers, E0 navigation keys (some of    */
+/* them wrapped in the fake shifts real keyboards send) and F7. Held keys     */
+/* repeat now and then. Some steps instead send a key detection error (00) or */
+/* a break for a key that is not held. Once the frames of each step are       */
+/* decoded the harness reads the kbKeyState_t record over SPI and compares    */
+/* the bitmap, held count, modifiers and KS_xxx flags with its own model.     */
+/* A few steps send BAT (AA), which clears everything.                        */
+/*                                                                            */
+/* Every other run switches the output to KB_OUT_EVENTS first and decodes the */
+/* records as they are queued: keycode, make/break, response tag and          */
+/* modifiers must match the model event for event, and each timestamp must    */
+/* fall between its step and the time it was read. Reports bytes per record.  */
+/*                                                                            */
+/* usage: keysim [-n runs] [-k steps] [-c clock_hz] [-e error_pct] [-s seed]  */
+/*----------------------------------------------------------------------------*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "sim.h"
+#include "simkbd.h"
+#include "simspi.h"
+#include "ps2kb.h"
+#include "host.h"
+
+#define TAG_NONE    0
+
+#define KS_MAXHELD  10
+#define KS_STEPS    4096
+#define KS_STEP_US  5000                                                        //Between steps, frames of one step take under 3ms
+#define KS_QUIET_US 1000                                                        //After the last frame of a step, then read
+#define KS_EVENTS   (KS_STEPS + KS_MAXHELD)
+
+typedef struct{
+    uint8_t code;                                                               //Set 2 make code
+    uint8_t ext;                                                                //E0 prefixed
+    uint8_t key;                                                                //Keycode the firmware should report
+    uint8_t mod;                                                                //KM_xxx for modifiers
+}refKey_t;
+
+static const refKey_t refKeys[] = {
+   {0x1C,0,0x1C,0},{0x32,0,0x32,0},{0x21,0,0x21,0},{0x23,0,0x23,0},{0x24,0,0x24,0},
+   {0x2B,0,0x2B,0},{0x34,0,0x34,0},{0x1D,0,0x1D,0},{0x1B,0,0x1B,0},{0x29,0,0x29,0},
+   {0x16,0,0x16,0},{0x1E,0,0x1E,0},{0x26,0,0x26,0},{0x45,0,0x45,0},
+   {0x12,0,0x12,KM_LSHIFT},{0x59,0,0x59,KM_RSHIFT},{0x14,0,0x14,KM_LCTRL},
+   {0x11,0,0x11,KM_LALT},{0x14,1,0x94,KM_RCTRL},{0x11,1,0x91,KM_RALT},
+   {0x1F,1,0x9F,KM_LGUI},{0x27,1,0xA7,KM_RGUI},
+   {0x75,1,0xF5,0},{0x72,1,0xF2,0},{0x6B,1,0xEB,0},{0x74,1,0xF4,0},
+   {0x70,1,0xF0,0},{0x71,1,0xF1,0},{0x6C,1,0xEC,0},{0x69,1,0xE9,0},
+   {F7_S,0,KEY_F7,0}
+};
+#define NREFKEYS (sizeof(refKeys) / sizeof(refKeys[0]))
+
+typedef struct{                                                                 //Expected state after a step
+    uint32_t scriptEnd;                                                         //Script index just past the step
+    kbKeyState_t st;
+}step_t;
+
+typedef struct{                                                                 //Expected event record
+    uint64_t at;                                                                //Step time
+    uint8_t key;                                                                //Keycode or response byte
+    uint8_t hdr;                                                                //EVT_BRK, EVT_RESP
+    uint8_t mods;                                                               //Modifier bits after the event
+}event_t;
+
+extern queue_t xOutBuf;
+int fwMain(void);
+
+static simKbd_t kbd;
+static step_t steps[KS_STEPS];
+static uint32_t nSteps, nChecked;
+static uint64_t lastFrame;
+static uint32_t checks, bad, badDown, badMods, badFlags;
+static simStat_t readCyc;
+static event_t events[KS_EVENTS];
+static uint32_t nEvents, nDecoded;
+static uint8_t evMode, evOn, evMods;                                           //Run in KB_OUT_EVENTS, switch confirmed, mods as of the last record
+static uint64_t evClock;                                                        //Reconstructed event time
+static uint32_t evRecords, evBytes, evBad, evLate, evBadKey, evBadMods;
+
+static void onFrame(simKbd_t *kb, uint8_t code, uint8_t tag, uint64_t start){
+   (void)kb; (void)code; (void)tag; (void)start;
+   lastFrame = simNow;
+}
+
+static void compare(const kbKeyState_t *want, const kbKeyState_t *got){
+
+   uint8_t wrong = 0;
+
+   checks++;
+   if(memcmp(want->down, got->down, sizeof(want->down)) || want->held != got->held){
+      badDown++;
+      wrong = 1;
+   }
+   if(want->mods != got->mods){
+      badMods++;
+      wrong = 1;
+   }
+   if(want->flags != got->flags){
+      badFlags++;
+      wrong = 1;
+   }
+   bad += wrong;
+}
+
+/*------------------------------------------*/
+/* Decode the records queued so far and     */
+/* check them against the model             */
+/*------------------------------------------*/
+static void decodeEvents(void){
+
+   const event_t *want;
+   uint8_t b, hdr, key, shift;
+   uint32_t delta;
+
+   while(qGet(&xOutBuf, &hdr)){                                                 //Records are queued whole
+      evBytes++;
+      delta = hdr & EVT_DELTA;
+      if(hdr & EVT_MORE)
+         for(shift = 4; qGet(&xOutBuf, &b); shift += 7){
+            evBytes++;
+            delta |= (uint32_t)(b & 0x7F) << shift;
+            if(!(b & 0x80))
+               break;
+         }
+      qGet(&xOutBuf, &key);
+      evBytes++;
+      if(hdr & EVT_MODS){
+         qGet(&xOutBuf, &evMods);
+         evBytes++;
+      }
+      evRecords++;
+      evClock += (uint64_t)delta << KB_EVT_SHIFT;
+      if(nDecoded >= nEvents){
+         evBad++;
+         continue;
+      }
+      want = &events[nDecoded++];
+      if(key != want->key || (hdr & (EVT_BRK | EVT_RESP)) != want->hdr)
+         evBadKey++;
+      else if(!(hdr & EVT_RESP) && evMods != want->mods)
+         evBadMods++;
+      else if(evClock + SIM_US(1100) < want->at ||                              //Not before its step,
+              evClock > simNow)                                                 //not after it was read
+         evLate++;
+      else
+         continue;
+      evBad++;
+   }
+}
+
+/*------------------------------------------*/
+/* Once per main loop pass: play the        */
+/* master, read the key state once a step   */
+/* is in                                    */
+/*------------------------------------------*/
+static void loopHook(void){
+
+   kbKeyState_t got;
+   uint64_t t;
+   uint8_t ch, fmt;
+
+   if(evMode && !evOn){                                                         //Ask until the switch is confirmed
+      if(!evClock)
+         evClock = simNow;                                                      //The firmware switches a pass later
+      simSpiDrain(HOST_OP_EVENTS, 1000000, 10, &fmt, NULL, 0);
+      evOn = fmt == KB_OUT_EVENTS;
+      return;
+   }
+   if(evOn)
+      decodeEvents();
+   else
+      while(qGet(&xOutBuf, &ch))                                                //Characters are not what this checks
+         ;
+   if(nChecked >= nSteps || kbd.scriptTail < steps[nChecked].scriptEnd ||
+      simNow - lastFrame < SIM_US(KS_QUIET_US))
+      return;
+   while(nChecked + 1 < nSteps && kbd.scriptTail >= steps[nChecked + 1].scriptEnd)
+      nChecked++;                                                               //Only the latest step that is in
+   t = simNow;
+   memset(&got, 0, sizeof(got));
+   if(simSpiRecord(HOST_OP_KEYS, 1000000, 10, (uint8_t *)&got, sizeof(got)) != sizeof(got))
+      bad++;
+   simStatAdd(&readCyc, (uint32_t)(simNow - t));
+   compare(&steps[nChecked].st, &got);
+   nChecked++;
+}
+
+static int doneHook(void){
+   return simKbdIdle(&kbd) && nChecked >= nSteps;
+}
+
+static void expect(uint64_t t, uint8_t key, uint8_t hdr, uint8_t mods){
+   if(nEvents < KS_EVENTS){
+      events[nEvents].at = t;
+      events[nEvents].key = key;
+      events[nEvents].hdr = hdr;
+      events[nEvents].mods = mods;
+      nEvents++;
+   }
+}
+
+static void send(uint64_t t, const refKey_t *k, uint8_t brk, uint8_t fake){
+   if(fake && !brk){                                                            //E0 12 before the make
+      simKbdScript(&kbd, t, EXT_S, TAG_NONE);
+      simKbdScript(&kbd, t, FAKE_LSH_S, TAG_NONE);
+   }
+   if(k->ext)
+      simKbdScript(&kbd, t, EXT_S, TAG_NONE);
+   if(brk)
+      simKbdScript(&kbd, t, BREAK_S, TAG_NONE);
+   simKbdScript(&kbd, t, k->code, TAG_NONE);
+   if(fake && brk){                                                             //E0 F0 12 after the break
+      simKbdScript(&kbd, t, EXT_S, TAG_NONE);
+      simKbdScript(&kbd, t, BREAK_S, TAG_NONE);
+      simKbdScript(&kbd, t, FAKE_LSH_S, TAG_NONE);
+   }
+}
+
+static uint64_t buildScript(uint32_t n, uint32_t errPct){
+
+   uint64_t t = SIM_US(5000);                                                   //Leave room for kbInitialize()
+   kbKeyState_t st;
+   const refKey_t *k;
+   uint8_t fake[NREFKEYS];
+   uint32_t i, r;
+
+   memset(&st, 0, sizeof(st));
+   memset(fake, 0, sizeof(fake));
+   for(nSteps = 0; nSteps < n; nSteps++, t += SIM_US(KS_STEP_US)){
+      if(evMode && nSteps == n / 2)                                             //One pause over 2.1s, two byte delta
+         t += SIM_US(2100000 + rand() % 500000);
+      r = rand() % NREFKEYS;
+      k = &refKeys[r];
+      if((uint32_t)(rand() % 100) < errPct){
+         r = rand() % 3;
+         if(r == 0){                                                            //Key detection error
+            simKbdScript(&kbd, t, KB_ERR2, TAG_NONE);
+            st.flags |= KS_OVERRUN;
+         }
+         else if(r == 1){                                                       //Keyboard reset itself
+            simKbdScript(&kbd, t, KB_BAT, TAG_NONE);
+            memset(&st, 0, sizeof(st));
+            expect(t, KB_BAT, EVT_RESP, 0);
+         }
+         else if(!(st.down[k->key >> 3] & (1 << (k->key & 7)))){                //Break for a key not held
+            send(t, k, 1, 0);
+            st.flags |= KS_STRAY;
+            expect(t, k->key, EVT_BRK, st.mods);
+         }
+      }
+      else if(st.down[k->key >> 3] & (1 << (k->key & 7))){                      //Held: repeat or release
+         if(rand() % 3 == 0){
+            send(t, k, 0, 0);
+            expect(t, k->key, 0, st.mods);
+         }
+         else{
+            send(t, k, 1, fake[r]);
+            st.down[k->key >> 3] &= ~(1 << (k->key & 7));
+            st.mods &= ~k->mod;
+            if(!--st.held)
+               st.flags = 0;
+            expect(t, k->key, EVT_BRK, st.mods);
+         }
+      }
+      else if(st.held < KS_MAXHELD){
+         fake[r] = k->ext && !k->mod && rand() % 5 == 0;
+         send(t, k, 0, fake[r]);
+         st.down[k->key >> 3] |= 1 << (k->key & 7);
+         st.mods |= k->mod;
+         st.held++;
+         expect(t, k->key, 0, st.mods);
+      }
+      steps[nSteps].scriptEnd = kbd.scriptHead;
+      steps[nSteps].st = st;
+   }
+   for(i = 0; i < NREFKEYS; i++)                                                //Let go of everything
+      if(st.down[refKeys[i].key >> 3] & (1 << (refKeys[i].key & 7))){
+         send(t, &refKeys[i], 1, fake[i]);
+         st.mods &= ~refKeys[i].mod;
+         expect(t, refKeys[i].key, EVT_BRK, st.mods);
+      }
+   memset(&st, 0, sizeof(st));
+   steps[nSteps].scriptEnd = kbd.scriptHead;
+   steps[nSteps].st = st;
+   nSteps++;
+   return t;
+}
+
+int main(int argc, char **argv){
+
+   uint32_t runs = 20, keys = 400, hz = 12500, errPct = 2, seed = 1;
+   uint32_t n, timeouts = 0;
+   uint64_t end;
+   double t0;
+   int opt;
+
+   while((opt = getopt(argc, argv, "n:k:c:e:s:")) != -1){
+      switch(opt){
+         case 'n': runs = strtoul(optarg, NULL, 0); break;
+         case 'k': keys = strtoul(optarg, NULL, 0); break;
+         case 'c': hz = strtoul(optarg, NULL, 0); break;
+         case 'e': errPct = strtoul(optarg, NULL, 0); break;
+         case 's': seed = strtoul(optarg, NULL, 0); break;
+         default:
+            fprintf(stderr, "usage: %s [-n runs] [-k steps] [-c clock_hz] [-e error_pct] "
+                            "[-s seed]\n", argv[0]);
+            return 2;
+      }
+   }
+   if(keys > KS_STEPS - 1)
+      keys = KS_STEPS - 1;
+   srand(seed);
+   t0 = simWallSec();
+
+   for(n = 0; n < runs; n++){
+      simReset();
+      simKbdInit(&kbd, (500000 + hz / 2) / hz);
+      kbd.onFrame = onFrame;
+      nChecked = nEvents = nDecoded = 0;
+      lastFrame = 0;
+      evMode = n & 1;
+      evOn = evMods = 0;
+      evClock = 0;
+      end = buildScript(keys, errPct);
+      simLoopHook = loopHook;
+      simDoneHook = doneHook;
+      simDeadline = end + SIM_US(100000);
+      if(simRun(fwMain))
+         timeouts++;
+      if(evMode && nDecoded != nEvents)                                         //Records missing at the end
+         evBad += nEvents - nDecoded;
+   }
+
+   printf("runs             %u of %u steps, %u Hz clock, %u%% errors\n", runs, keys, hz, errPct);
+   printf("reads            %u\n", checks);
+   printf("mismatches       %u (bitmap %u, mods %u, flags %u)\n", bad, badDown, badMods, badFlags);
+   printf("event records    %u, %.2f bytes each, %u wrong (key/tag %u, mods %u, time %u)\n",
+          evRecords, evRecords ? (double)evBytes / evRecords : 0.0, evBad, evBadKey, evBadMods,
+          evLate);
+   printf("timeouts         %u\n", timeouts);
+   printf("read us          p50 %.1f  max %.1f (%u byte record)\n",
+          SIM_TO_US(simStatPct(&readCyc, 50)), SIM_TO_US(simStatPct(&readCyc, 100)),
+          (unsigned)sizeof(kbKeyState_t));
+   printf("wall             %.2f s\n", simWallSec() - t0);
+   simStatFree(&readCyc);
+   return bad || evBad || timeouts;
+}
@@ -0,0 +1,334 @@
+/*----------------------------------------------------------------------------*/
+/* Keystroke latency suite: make code start bit to host notification          */
+/*                                                                            */
+/* Time starts when the keyboard has the make code ready, which is its first  */
+/* start bit unless the bus is busy (host command, inhibit); the wait for the */
+/* bus is part of the latency.                                                */
+/*                                                                            */
+/* A character counts as delivered when it is in the output queue with       */
+/* KB_FLAG high. If its post raised KB_FLAG that is the exact rise time; if   */
+/* KB_FLAG was already up it is the main loop pass that queued it. The SPI    */
+/* master follows KB_FLAG throughout, so KB_FLAG falls between characters     */
+/* whenever the queue drains.                                                 */
+/*                                                                            */
+/* steady      random letters, one every 50ms                                 */
+/* typematic   one key auto-repeating at 30 cps, several bursts               */
+/* caps        30 cps typing with caps lock toggled mid burst; the key right  */
+/*             behind it waits for the LED command to finish                  */
+/* queuefull   30 cps typing while the master drains a nearly full queue one  */
+/*             byte every 2ms, staying under the inhibit watermark            */
+/* backpress   the same typing with the queue at KB_Q_HIGH and the master one */
+/*             byte every 5ms: the keyboard is held off (Q_BLOCK) until the   */
+/*             queue is down to KB_Q_LOW, nothing may be lost                 */
+/* backcaps    backpress with caps lock toggled as the hold starts, standing  */
+/*             in for a caps lock already in the raw ring: the LED command    */
+/*             must get its ACK through the hold and leave no failure         */
+/* replug      caps lock on, then every 100ms the keyboard is plugged in      */
+/*             again and a key follows its BAT result right away. PLUG_OK and */
+/*             the key are both timed from the BAT start bit: the key waits   */
+/*             for the LED command kbPlug() sends first                       */
+/*                                                                            */
+/* Each scenario reports p50/p99/max and fails if p99 or max is over budget   */
+/* or the master did not receive exactly the typed text. The exit status is   */
+/* non-zero if any scenario failed.                                           */
+/*                                                                            */
+/* usage: latbench [-n runs] [-c clock_hz] [-s seed]                          */
+/*                 [-b scenario=p99_us[,max_us]] ...                          */
+/*----------------------------------------------------------------------------*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "sim.h"
+#include "simkbd.h"
+#include "simspi.h"
+#include "ps2kb.h"
+
+#define TAG_NONE    0
+#define TAG_CHAR    1
+
+#define SC_QFREE    24                                                          //Room under KB_Q_HIGH left by the queuefull prefill
+
+static const uint8_t letterCodes[26] = {                                        //Set 2 make codes for a..z
+   0x1C,0x32,0x21,0x23,0x24,0x2B,0x34,0x33,0x43,0x3B,0x42,0x4B,0x3A,
+   0x31,0x44,0x4D,0x15,0x2D,0x1B,0x2C,0x3C,0x2A,0x1D,0x22,0x35,0x1A
+};
+
+typedef struct scenario{
+    const char *name;
+    uint32_t keys;                                                              //Characters per run
+    uint32_t p99Us;                                                             //Budgets
+    uint32_t maxUs;
+    uint64_t (*build)(const struct scenario *, uint64_t t);                     //Script from t, returns the last key time
+    uint32_t spiGapUs;                                                          //Master pause between bytes
+    uint16_t prefill;                                                           //Characters queued before typing
+}scenario_t;
+
+extern queue_t xOutBuf;
+extern uint8_t capsLock, numsLock;
+extern kbFlags_t xFlags;
+extern ps2Port_t xPorts[PS2_PORTS];
+int fwMain(void);
+
+static simKbd_t kbd;
+static simSpi_t spi;
+static char expect[BUFSIZE * 2], got[BUFSIZE * 2];
+static uint32_t nExpect, nGot;
+static uint32_t nLocks;
+static uint32_t nPlugs;
+static uint64_t stamps[BUFSIZE * 2];
+static uint32_t stampHead, stampTail;
+static uint16_t lastHead;                                                       //Output queue head already timed
+static uint64_t lastPass;
+static uint8_t  filled;
+static uint8_t  holdCaps;                                                       //Caps lock still to toggle once the hold is up
+static const scenario_t *cur;
+static simStat_t latency;
+
+static void onByte(simSpi_t *m, uint8_t b){
+   (void)m;
+   if(nGot < sizeof(got))
+      got[nGot++] = b;
+}
+
+/*------------------------------------------*/
+/* Once per main loop pass: time whatever   */
+/* was queued since the last pass           */
+/*------------------------------------------*/
+static void loopHook(void){
+
+   uint64_t at;
+   uint32_t i;
+
+   if(cur->prefill && !filled){                                                 //Stand in for earlier typing
+      for(i = 0; i < cur->prefill; i++)
+         qPut(&xOutBuf, '.');
+      filled = 1;
+      lastHead = xOutBuf.head;
+   }
+   if(holdCaps && xFlags.hold){                                                 //As main.c does for a caps lock release
+      xFlags.capsFlag = 1;
+      kbSetLocks();
+      xFlags.capsFlag = 0;
+      holdCaps = 0;
+   }
+   if(simNotifyLat && xOutBuf.head != lastHead){
+      at = simNotifyRise > lastPass ? simNotifyRise : simNow;                   //Raised this pass, or already up
+      for(; lastHead != xOutBuf.head; lastHead++)
+         if(stampTail != stampHead)
+            simStatAdd(&latency, (uint32_t)(at - stamps[stampTail++ % (BUFSIZE * 2)]));
+   }
+   lastPass = simNow;
+}
+
+static int doneHook(void){
+   return simKbdIdle(&kbd) && simSpiIdle(&spi) && !simNotifyLat &&
+          simNow - kbd.idleSince > SIM_US(2000);
+}
+
+static void make(uint64_t t, uint8_t k){
+   simKbdScript(&kbd, t, letterCodes[k], TAG_CHAR);
+   stamps[stampHead++ % (BUFSIZE * 2)] = t;                                     //Characters come out in script order
+}
+
+static void key(uint64_t t, uint8_t k){
+   make(t, k);
+   simKbdScript(&kbd, t, 0xF0, TAG_NONE);
+   simKbdScript(&kbd, t, letterCodes[k], TAG_NONE);
+   expect[nExpect++] = (capsLock ^ (nLocks & 1)) ? 'A' + k : 'a' + k;
+}
+
+static uint64_t buildSteady(const scenario_t *sc, uint64_t t){
+
+   uint32_t i;
+
+   for(i = 0; i < sc->keys; i++, t += SIM_US(50000))
+      key(t, rand() % 26);
+   return t;
+}
+
+static uint64_t buildTypematic(const scenario_t *sc, uint64_t t){
+
+   uint32_t i, k = rand() % 26;
+
+   for(i = 0; i < sc->keys; i++){
+      if(i && !(i % 10)){                                                       //Release, pause, next key
+         simKbdScript(&kbd, t, 0xF0, TAG_NONE);
+         simKbdScript(&kbd, t, letterCodes[k], TAG_NONE);
+         t += SIM_US(200000);
+         k = rand() % 26;
+      }
+      make(t, k);                                                               //Repeats are make codes only
+      expect[nExpect++] = 'a' + k;
+      t += SIM_US(33333);
+   }
+   simKbdScript(&kbd, t, 0xF0, TAG_NONE);
+   simKbdScript(&kbd, t, letterCodes[k], TAG_NONE);
+   return t;
+}
+
+static uint64_t buildCaps(const scenario_t *sc, uint64_t t){
+
+   uint32_t i;
+
+   for(i = 0; i < sc->keys; i++){
+      if(i % 4 == 2){                                                           //Caps lock, next key right behind it
+         simKbdScript(&kbd, t, 0x58, TAG_NONE);
+         simKbdScript(&kbd, t, 0xF0, TAG_NONE);
+         simKbdScript(&kbd, t, 0x58, TAG_NONE);
+         nLocks++;
+      }
+      key(t, rand() % 26);
+      t += SIM_US(33333);
+   }
+   return t;
+}
+
+static uint64_t buildFull(const scenario_t *sc, uint64_t t){
+
+   uint32_t i;
+
+   for(i = 0; i < sc->prefill; i++)
+      expect[nExpect++] = '.';
+   for(i = 0; i < sc->keys; i++, t += SIM_US(33333))
+      key(t, rand() % 26);
+   return t;
+}
+
+static uint64_t buildHoldCaps(const scenario_t *sc, uint64_t t){
+
+   holdCaps = 1;
+   nLocks++;                                                                    //Toggled before the first key gets through
+   return buildFull(sc, t);
+}
+
+static uint64_t buildReplug(const scenario_t *sc, uint64_t t){
+
+   uint32_t i;
+
+   simKbdScript(&kbd, t, 0x58, TAG_NONE);                                       //Caps lock, so there is an LED state to restore
+   simKbdScript(&kbd, t, 0xF0, TAG_NONE);
+   simKbdScript(&kbd, t, 0x58, TAG_NONE);
+   nLocks++;
+   for(i = 0, t += SIM_US(50000); i < sc->keys; i += 2, t += SIM_US(100000)){
+      simKbdScript(&kbd, t, KB_BAT, TAG_CHAR);
+      stamps[stampHead++ % (BUFSIZE * 2)] = t;
+      expect[nExpect++] = (char)PLUG_OK;
+      key(t, rand() % 26);                                                      //Stamped at the BAT too
+      nPlugs++;
+   }
+   return t;
+}
+
+static scenario_t scenarios[] = {                                               //Budgets hold down to a 10kHz keyboard clock
+   {"steady",    40,  1100,  1200, buildSteady,    10,   0},
+   {"typematic", 40,  1100,  1200, buildTypematic, 10,   0},
+   {"caps",      40, 10000, 10500, buildCaps,      10,   0},
+   {"queuefull", 20,  1100,  1200, buildFull,      2000, KB_Q_HIGH - SC_QFREE},
+   {"backpress", 40, 600000, 650000, buildFull,     5000, KB_Q_HIGH},
+   {"backcaps",  40, 600000, 650000, buildHoldCaps, 5000, KB_Q_HIGH},
+   {"replug",    40,  8000,  8500, buildReplug,    10,   0},
+};
+#define NSCENARIOS (sizeof(scenarios) / sizeof(scenarios[0]))
+
+static int runOnce(const scenario_t *sc, uint32_t hz){
+
+   uint64_t end;
+
+   simReset();
+   simKbdInit(&kbd, (500000 + hz / 2) / hz);
+   simSpiInit(&spi, 1000000, sc->spiGapUs);
+   spi.onByte = onByte;
+   capsLock = numsLock = 0;
+   nExpect = nGot = nLocks = nPlugs = 0;
+   stampHead = stampTail = 0;
+   lastHead = 0;
+   lastPass = 0;
+   filled = 0;
+   holdCaps = 0;
+   cur = sc;
+   end = sc->build(sc, SIM_US(5000));                                           //Leave room for kbInitialize()
+   simLoopHook = loopHook;
+   simDoneHook = doneHook;
+   simDeadline = end + (uint64_t)(kbd.scriptHead) * SIM_US(22 * kbd.halfUs + kbd.gapUs) +
+                 (uint64_t)(nLocks + nPlugs) * SIM_US(2 * (120 + 22 * kbd.halfUs + kbd.respUs)) +
+                 (uint64_t)nExpect * SIM_US(sc->spiGapUs + 8) + SIM_US(50000);
+   if(simRun(fwMain))
+      return -1;
+   if(sc->build == buildHoldCaps &&
+      (holdCaps || xPorts[PS2_KBD].cmd.failures || kbd.leds != ARG_CAPS))       //Never held, or the LED command failed
+      return 1;
+   return nGot != nExpect || memcmp(got, expect, nExpect);
+}
+
+static int setBudget(const char *arg){
+
+   char name[32];
+   uint32_t p99, max = 0;
+   uint32_t i;
+
+   if(sscanf(arg, "%31[^=]=%u,%u", name, &p99, &max) < 2)
+      return -1;
+   for(i = 0; i < NSCENARIOS; i++)
+      if(!strcmp(scenarios[i].name, name)){
+         scenarios[i].p99Us = p99;
+         if(max)
+            scenarios[i].maxUs = max;
+         return 0;
+      }
+   return -1;
+}
+
+int main(int argc, char **argv){
+
+   uint32_t runs = 10, hz = 12500, seed = 1;
+   uint32_t i, n, bad, timeouts, failed = 0;
+   double p50, p99, max, t0;
+   int opt, r;
+
+   while((opt = getopt(argc, argv, "n:c:s:b:")) != -1){
+      switch(opt){
+         case 'n': runs = strtoul(optarg, NULL, 0); break;
+         case 'c': hz = strtoul(optarg, NULL, 0); break;
+         case 's': seed = strtoul(optarg, NULL, 0); break;
+         case 'b':
+            if(!setBudget(optarg))
+               break;
+            fprintf(stderr, "bad budget '%s'\n", optarg);
+            return 2;
+         default:
+            fprintf(stderr, "usage: %s [-n runs] [-c clock_hz] [-s seed] "
+                            "[-b scenario=p99_us[,max_us]] ...\n", argv[0]);
+            return 2;
+      }
+   }
+   srand(seed);
+   t0 = simWallSec();
+
+   printf("%u runs per scenario, %u Hz clock, start bit to notify in us\n", runs, hz);
+   printf("%-10s %8s %8s %8s %8s %8s  %s\n", "scenario", "p50", "p99", "max",
+          "budget99", "budgetmx", "result");
+   for(i = 0; i < NSCENARIOS; i++){
+      bad = timeouts = 0;
+      for(n = 0; n < runs; n++){
+         r = runOnce(&scenarios[i], hz);
+         if(r < 0)
+            timeouts++;
+         else if(r)
+            bad++;
+      }
+      p50 = SIM_TO_US(simStatPct(&latency, 50));
+      p99 = SIM_TO_US(simStatPct(&latency, 99));
+      max = SIM_TO_US(simStatPct(&latency, 100));
+      r = bad || timeouts || p99 > scenarios[i].p99Us || max > scenarios[i].maxUs;
+      failed += r;
+      printf("%-10s %8.1f %8.1f %8.1f %8u %8u  %s", scenarios[i].name, p50, p99, max,
+             scenarios[i].p99Us, scenarios[i].maxUs, r ? "FAIL" : "ok");
+      if(bad || timeouts)
+         printf(" (%u mismatches, %u timeouts)", bad, timeouts);
+      printf("\n");
+      simStatFree(&latency);
+   }
+   printf("wall             %.2f s\n", simWallSec() - t0);
+   return failed != 0;
+}
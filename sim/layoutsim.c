@@ -0,0 +1,477 @@
+/*----------------------------------------------------------------------------*/
+/* Keyboard layouts against a reference map, picked over HOST_OP_LAYOUT       */
+/*                                                                            */
+/* One run per layout. The harness selects the layout over SPI and waits for  */
+/* byte 1 to confirm it, then types every layout dependent key plain, with    */
+/* shift, with caps lock on and with AltGr, each followed by a space. The     */
+/* characters queued must match the reference rows below, which are written   */
+/* out by hand from the layouts and do not use layouts.h: a dead key followed */
+/* by space posts its spacing accent, a key with nothing to post leaves only  */
+/* the space. A few sequences per layout then check dead key composition,     */
+/* two dead keys in a row, a dead key cancelled by Enter and Ctrl+letter.     */
+/* A last run leaves a dead key pending across a switch from DE to US.        */
+/*                                                                            */
+/* Every layout is run twice, the second time in KB_OUT_UTF8 (HOST_OP_UTF8):  */
+/* the queued bytes are decoded as UTF-8, which must be well formed and       */
+/* shortest form, and the code points compared with the same reference, the  */
+/* euro sign as U+20AC.                                                       */
+/*                                                                            */
+/* Reports the flash each layout takes and the RAM the layouts share.         */
+/*                                                                            */
+/* usage: layoutsim [-c clock_hz] [-v]                                        */
+/*----------------------------------------------------------------------------*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "sim.h"
+#include "simkbd.h"
+#include "simspi.h"
+#include "ps2kb.h"
+#include "host.h"
+
+#define STROKE_US   5000                                                        //Between keystrokes
+#define CAPS_US     30000                                                       //After caps lock, leaves room for the LED command
+#define QUIET_US    50000                                                       //After the last frame, then compare
+#define MAX_OUT     4096
+#define MAX_CASES   512
+
+#define M_SHIFT     0x01                                                        //Stroke modifiers
+#define M_ALTGR     0x02
+#define M_CTRL      0x04
+
+#define S_LSHIFT    0x12                                                        //Set 2 make codes
+#define S_RALT      0x11                                                        //E0 prefixed
+#define S_LCTRL     0x14
+#define S_CAPS      0x58
+#define S_SPACE     0x29
+#define S_ENTER     0x5A
+
+//Set 2 make codes of the layout dependent keys, in the order of the rows below
+static const uint8_t slotCodes[48] = {
+   0x0E,0x16,0x1E,0x26,0x25,0x2E,0x36,0x3D,0x3E,0x46,0x45,0x4E,0x55,
+   0x15,0x1D,0x24,0x2D,0x2C,0x35,0x3C,0x43,0x44,0x4D,0x54,0x5B,0x5D,
+   0x1C,0x1B,0x23,0x2B,0x34,0x33,0x3B,0x42,0x4B,0x4C,0x52,
+   0x61,0x1A,0x22,0x21,0x2A,0x32,0x31,0x3A,0x41,0x49,0x4A
+};
+
+typedef struct{                                                                 //Reference, one character per key; ' ' = nothing,
+    const char *name;                                                           //in the altgr row = as without AltGr; \1-\5 dead
+    const char *plain;
+    const char *shifted;
+    const char *altgr;
+    const char *caps;                                                           //'1' = caps lock gives the shifted character
+}refLayout_t;
+
+static const refLayout_t refs[] = {
+   {"US",
+    "`1234567890-=" "qwertyuiop[]\\" "asdfghjkl;'" "\\zxcvbnm,./",
+    "~!@#$%^&*()_+" "QWERTYUIOP{}|" "ASDFGHJKL:\"" "|ZXCVBNM<>?",
+    "             " "             " "           " "           ",
+    "0000000000000" "1111111111000" "11111111100" "01111111000"},
+   {"UK",
+    "`1234567890-=" "qwertyuiop[]#" "asdfghjkl;'" "\\zxcvbnm,./",
+    "\254!\"\243$%^&*()_+" "QWERTYUIOP{}~" "ASDFGHJKL:@" "|ZXCVBNM<>?",
+    "\246   \200        " "  \351   \372\355\363    " "\341          " "           ",
+    "0000000000000" "1111111111000" "11111111100" "01111111000"},
+   {"DE",
+    "\0031234567890\337\002" "qwertzuiop\374+#" "asdfghjkl\366\344" "<yxcvbnm,.-",
+    "\260!\"\247$%&/()=?\001" "QWERTZUIOP\334*'" "ASDFGHJKL\326\304" ">YXCVBNM;:_",
+    "  \262\263   {[]}\\ " "@ \200        ~ " "           " "|      \265   ",
+    "0000000000000" "1111111111100" "11111111111" "01111111000"},
+   {"FR",
+    "\262&\351\"'(-\350_\347\340)=" "azertyuiop\003$*" "qsdfghjklm\371" "<wxcvbn,;:!",
+    " 1234567890\260+" "AZERTYUIOP\004\243\265" "QSDFGHJKLM%" ">WXCVBN?./\247",
+    "  \005#{[|\001\\^@]}" "  \200        \244 " "           " "           ",
+    "0000000000000" "1111111111000" "11111111110" "01111110000"}
+};
+#define NREFS (sizeof(refs) / sizeof(refs[0]))
+
+static const char refSpacing[] = {0, '`', '\264', '^', '\250', '~'};
+
+typedef struct{                                                                 //Stroke: key index into slotCodes, or a code | 0x100
+    uint16_t key;
+    uint8_t mods;
+}stroke_t;
+
+#define K(i)        (i)                                                         //Slot by row index
+#define RAW(code)   ((code) | 0x100)
+#define SPACE       RAW(S_SPACE)
+#define ENTER_K     RAW(S_ENTER)
+#define SEQ_END     0xFFFF
+
+typedef struct{                                                                 //Extra sequence for one layout
+    uint8_t layout;
+    const char *what;
+    stroke_t strokes[6];
+    const char *want;
+}seq_t;
+
+//Slot indices used below
+#define I_GRAVE 0
+#define I_2     2
+#define I_7     7
+#define I_EQUAL 12
+#define I_Q     13
+#define I_E     15
+#define I_Y     18
+#define I_U     19
+#define I_I     20
+#define I_O     21
+#define I_LB    23
+#define I_A     26
+#define I_X     39
+#define I_N     43
+
+static const seq_t seqs[] = {
+   {2, "circumflex e",     {{K(I_GRAVE),0},{K(I_E),0},{SEQ_END,0}},                     "\352"},
+   {2, "acute shift E",    {{K(I_EQUAL),0},{K(I_E),M_SHIFT},{SEQ_END,0}},               "\311"},
+   {2, "grave a",          {{K(I_EQUAL),M_SHIFT},{K(I_A),0},{SEQ_END,0}},               "\340"},
+   {2, "circumflex x",     {{K(I_GRAVE),0},{K(I_X),0},{SEQ_END,0}},                     "^x"},
+   {2, "dead twice",       {{K(I_GRAVE),0},{K(I_GRAVE),0},{SPACE,0},{SEQ_END,0}},       "^^"},
+   {2, "dead then Enter",  {{K(I_GRAVE),0},{ENTER_K,0},{K(I_E),0},{SEQ_END,0}},         "\re"},
+   {2, "Ctrl+Z key",       {{K(I_Y),M_CTRL},{SEQ_END,0}},                               "\032"},
+   {3, "circumflex i",     {{K(I_LB),0},{K(I_I),0},{SEQ_END,0}},                        "\356"},
+   {3, "diaeresis y",      {{K(I_LB),M_SHIFT},{K(I_Y),0},{SEQ_END,0}},                  "\377"},
+   {3, "tilde n",          {{K(I_2),M_ALTGR},{K(I_N),0},{SEQ_END,0}},                   "\361"},
+   {3, "tilde shift N",    {{K(I_2),M_ALTGR},{K(I_N),M_SHIFT},{SEQ_END,0}},             "\321"},
+   {3, "grave u",          {{K(I_7),M_ALTGR},{K(I_U),0},{SEQ_END,0}},                   "\371"},
+   {3, "diaeresis o",      {{K(I_LB),M_SHIFT},{K(I_O),0},{SEQ_END,0}},                  "\366"},
+   {3, "Ctrl+A key",       {{K(I_Q),M_CTRL},{SEQ_END,0}},                               "\001"},
+   {1, "AltGr a",          {{K(I_A),M_ALTGR},{SEQ_END,0}},                              "\341"},
+   {0, "AltGr ignored",    {{K(I_A),M_ALTGR},{K(I_Q),M_ALTGR},{SEQ_END,0}},             "aq"}
+};
+#define NSEQS (sizeof(seqs) / sizeof(seqs[0]))
+#define CNT_COMPOSE(accent, base, result) + 1
+
+typedef struct{                                                                 //Expected output of one keystroke group
+    const char *what;
+    uint8_t slot;
+    char want[4];
+    uint8_t len;
+}case_t;
+
+enum{
+    PH_FORMAT,                                                                  //UTF-8 runs: asking for KB_OUT_UTF8 until it is confirmed
+    PH_SELECT,                                                                  //Asking for the layout until it is confirmed
+    PH_TYPE,
+    PH_SWITCH,                                                                  //Last run: dead key typed, switch to US
+    PH_AFTER,                                                                   //Last run: key after the switch
+    PH_DONE
+};
+
+extern queue_t xOutBuf;
+extern uint8_t kbLayout, kbDead;
+extern volatile uint8_t kbLayoutReq;
+int fwMain(void);
+
+static simKbd_t kbd;
+static uint8_t phase, want, switchRun, utf8;
+static uint64_t lastFrame;
+static uint16_t out[MAX_OUT];                                                   //Characters, code points on UTF-8 runs
+static uint32_t nOut;
+static uint16_t cp;                                                             //UTF-8 decoder
+static uint8_t need, seqLen;
+static uint32_t badUtf8, utf8Bytes, utf8Chars;
+static case_t cases[MAX_CASES];
+static uint32_t nCases;
+static uint64_t at;
+static simStat_t selUs;
+
+static void onFrame(simKbd_t *kb, uint8_t code, uint8_t tag, uint64_t start){
+   (void)kb; (void)code; (void)tag; (void)start;
+   lastFrame = simNow;
+}
+
+static void script(uint8_t code, uint8_t ext, uint8_t brk){
+   if(ext)
+      simKbdScript(&kbd, at, 0xE0, 0);
+   if(brk)
+      simKbdScript(&kbd, at, 0xF0, 0);
+   simKbdScript(&kbd, at, code, 0);
+}
+
+static void stroke(const stroke_t *s){
+
+   uint8_t code = s->key & 0x100 ? s->key & 0xFF : slotCodes[s->key];
+
+   if(s->mods & M_SHIFT) script(S_LSHIFT, 0, 0);
+   if(s->mods & M_ALTGR) script(S_RALT, 1, 0);
+   if(s->mods & M_CTRL)  script(S_LCTRL, 0, 0);
+   script(code, 0, 0);
+   script(code, 0, 1);
+   if(s->mods & M_CTRL)  script(S_LCTRL, 0, 1);
+   if(s->mods & M_ALTGR) script(S_RALT, 1, 1);
+   if(s->mods & M_SHIFT) script(S_LSHIFT, 0, 1);
+   at += SIM_US(STROKE_US);
+}
+
+static void caps(void){
+   script(S_CAPS, 0, 0);
+   script(S_CAPS, 0, 1);
+   at += SIM_US(CAPS_US);
+}
+
+static void put(uint16_t c){
+   if(nOut < MAX_OUT)
+      out[nOut++] = c;
+}
+
+/*------------------------------------------*/
+/* One byte from the queue. On UTF-8 runs   */
+/* sequences are decoded, anything          */
+/* malformed or overlong is counted and     */
+/* dropped                                  */
+/*------------------------------------------*/
+static void take(uint8_t b){
+
+   if(!utf8){
+      put(b);
+      return;
+   }
+   utf8Bytes++;
+   if(need && (b & 0xC0) != 0x80){                                              //Sequence cut short, b starts the next
+      badUtf8++;
+      need = 0;
+   }
+   if(need){
+      cp = (cp << 6) | (b & 0x3F);
+      if(--need)
+         return;
+      if((seqLen == 2 && cp < 0x80) || (seqLen == 3 && cp < 0x800))
+         badUtf8++;
+      else{
+         utf8Chars++;
+         put(cp);
+      }
+      return;
+   }
+   if(b < 0x80){
+      utf8Chars++;
+      put(b);
+   }
+   else if((b & 0xE0) == 0xC0){
+      cp = b & 0x1F;
+      need = 1;
+      seqLen = 2;
+   }
+   else if((b & 0xF0) == 0xE0){
+      cp = b & 0x0F;
+      need = 2;
+      seqLen = 3;
+   }
+   else
+      badUtf8++;
+}
+
+static uint16_t wantChar(char c){
+   return utf8 && (uint8_t)c == 0x80 ? 0x20AC : (uint8_t)c;
+}
+
+static case_t *expect(const char *what, uint8_t slot){
+
+   case_t *c = &cases[nCases < MAX_CASES ? nCases++ : MAX_CASES - 1];
+
+   c->what = what;
+   c->slot = slot;
+   c->len = 0;
+   return c;
+}
+
+/*------------------------------------------*/
+/* Every key in every mode, then the        */
+/* sequences for this layout                */
+/*------------------------------------------*/
+static void buildType(const refLayout_t *r){
+
+   static const char *modes[] = {"plain", "shift", "caps", "altgr"};
+   stroke_t s = {0, 0}, sp = {SPACE, 0};
+   uint8_t mode, i, ch;
+   const stroke_t *st;
+   case_t *c;
+
+   at = simNow;
+   for(mode = 0; mode < 4; mode++){
+      if(mode == 2)
+         caps();
+      for(i = 0; i < 48; i++){
+         s.key = K(i);
+         s.mods = mode == 1 ? M_SHIFT : mode == 3 ? M_ALTGR : 0;
+         ch = mode == 0 ? r->plain[i] : mode == 1 ? r->shifted[i] :
+              mode == 2 ? (r->caps[i] == '1' ? r->shifted : r->plain)[i] :
+              r->altgr[i] != ' ' ? r->altgr[i] : r->plain[i];
+         c = expect(modes[mode], i);
+         if(ch >= 1 && ch <= 5)
+            c->want[c->len++] = refSpacing[ch];                                 //Dead key, then space
+         else{
+            if(ch != ' ')
+               c->want[c->len++] = ch;
+            c->want[c->len++] = ' ';
+         }
+         stroke(&s);
+         stroke(&sp);
+      }
+      if(mode == 2)
+         caps();
+   }
+   for(i = 0; i < NSEQS; i++){
+      if(&refs[seqs[i].layout] != r)
+         continue;
+      c = expect(seqs[i].what, 0xFF);
+      c->len = strlen(seqs[i].want);
+      memcpy(c->want, seqs[i].want, c->len);
+      for(st = seqs[i].strokes; st->key != SEQ_END; st++)
+         stroke(st);
+   }
+}
+
+/*------------------------------------------*/
+/* Once per main loop pass: take the queued */
+/* characters, play the master              */
+/*------------------------------------------*/
+static void loopHook(void){
+
+   uint8_t ch, fmt, buf[255], i, n;
+   stroke_t s = {K(I_GRAVE), 0};
+   case_t *c;
+
+   while(qGet(&xOutBuf, &ch))
+      take(ch);
+
+   switch(phase){
+      case PH_FORMAT:
+         n = simSpiDrain(HOST_OP_UTF8, 1000000, 10, &fmt, buf, sizeof(buf));
+         for(i = 0; i < n; i++)
+            take(buf[i]);
+         if(fmt == KB_OUT_UTF8)
+            phase = PH_SELECT;
+         return;
+      case PH_SELECT:
+         if(simSpiArg(HOST_OP_LAYOUT, want, 1000000, 10) != want)
+            return;
+         simStatAdd(&selUs, (uint32_t)SIM_TO_US(simNow));
+         if(switchRun){
+            at = simNow;
+            stroke(&s);                                                         //DE circumflex, left pending
+            phase = PH_SWITCH;
+         }
+         else{
+            buildType(&refs[want]);
+            phase = PH_TYPE;
+         }
+         return;
+      case PH_SWITCH:
+         if(!simKbdIdle(&kbd) || simNow - lastFrame < SIM_US(QUIET_US))
+            return;
+         if(simSpiArg(HOST_OP_LAYOUT, KB_LAYOUT_US, 1000000, 10) != KB_LAYOUT_US)
+            return;
+         at = simNow;
+         s.key = K(I_A);
+         stroke(&s);
+         c = expect("dead key across a switch", 0xFF);
+         c->want[c->len++] = 'a';
+         phase = PH_AFTER;
+         return;
+      default:
+         if(phase != PH_DONE && simKbdIdle(&kbd) && simNow - lastFrame >= SIM_US(QUIET_US))
+            phase = PH_DONE;
+         return;
+   }
+}
+
+static int doneHook(void){
+   return phase == PH_DONE;
+}
+
+/*------------------------------------------*/
+/* Walk the output case by case. Returns    */
+/* the cases that did not match             */
+/*------------------------------------------*/
+static uint32_t check(const char *name, int verbose){
+
+   uint32_t i, j, pos = 0, bad = 0;
+   const case_t *c;
+
+   for(i = 0; i < nCases; i++){
+      c = &cases[i];
+      for(j = 0; j < c->len && pos + j < nOut && out[pos + j] == wantChar(c->want[j]); j++)
+         ;
+      if(j == c->len){
+         pos += c->len;
+         continue;
+      }
+      if(verbose || bad < 4){
+         printf("  %s%s %s", name, utf8 ? " UTF-8" : "", c->what);
+         if(c->slot != 0xFF)
+            printf(" key %u", c->slot);
+         printf(": want");
+         for(j = 0; j < c->len; j++)
+            printf(" %02X", wantChar(c->want[j]));
+         printf(", got");
+         for(j = pos; j < pos + c->len + 1 && j < nOut; j++)
+            printf(" %02X", out[j]);
+         printf("\n");
+      }
+      bad++;
+      break;                                                                    //Everything after is out of step
+   }
+   if(!bad && pos != nOut)
+      bad++;
+   return bad;
+}
+
+int main(int argc, char **argv){
+
+   uint32_t hz = 12500, halfUs, n, bad = 0, timeouts = 0, checked = 0;
+   int verbose = 0, opt;
+   double t0;
+
+   while((opt = getopt(argc, argv, "c:v")) != -1){
+      switch(opt){
+         case 'c': hz = strtoul(optarg, NULL, 0); break;
+         case 'v': verbose = 1; break;
+         default:
+            fprintf(stderr, "usage: %s [-c clock_hz] [-v]\n", argv[0]);
+            return 2;
+      }
+   }
+   halfUs = (500000 + hz / 2) / hz;
+   t0 = simWallSec();
+
+   for(n = 0; n <= 2 * NREFS; n++){
+      switchRun = n == 2 * NREFS;
+      utf8 = !switchRun && n >= NREFS;
+      want = switchRun ? KB_LAYOUT_DE : n % NREFS;
+      simReset();
+      simKbdInit(&kbd, halfUs);
+      kbd.onFrame = onFrame;
+      nOut = nCases = 0;
+      need = 0;
+      phase = utf8 ? PH_FORMAT : PH_SELECT;
+      simLoopHook = loopHook;
+      simDoneHook = doneHook;
+      simDeadline = SIM_US(30000000);
+      if(simRun(fwMain)){
+         timeouts++;
+         continue;
+      }
+      bad += check(switchRun ? "switch" : refs[n % NREFS].name, verbose);
+      checked += nCases;
+   }
+
+   printf("layouts          %u, %u keys each, Latin-1 and UTF-8, %u cases checked at %u Hz clock\n",
+          KB_LAYOUTS, KB_SLOTS, checked, hz);
+   printf("selected in      %.1f ms p50\n", simStatPct(&selUs, 50) / 1000.0);
+   printf("flash            %u bytes per layout, %u compose entries %u bytes, spacing %u bytes\n",
+          (unsigned)sizeof(kbLayout_t), (unsigned)(0 KB_COMPOSE(CNT_COMPOSE)),
+          (unsigned)((0 KB_COMPOSE(CNT_COMPOSE)) * sizeof(kbCompose_t)), DK_LAST + 1);
+   printf("ram              %u bytes shared: layout, request, pending dead key\n",
+          (unsigned)(sizeof(kbLayout) + sizeof(kbLayoutReq) + sizeof(kbDead)));
+   printf("utf-8            %u bytes for %u characters, %.2f bytes each, %u malformed\n",
+          utf8Bytes, utf8Chars, utf8Chars ? (double)utf8Bytes / utf8Chars : 0.0, badUtf8);
+   printf("mismatches       %u\n", bad);
+   printf("timeouts         %u\n", timeouts);
+   printf("wall             %.2f s\n", simWallSec() - t0);
+   simStatFree(&selUs);
+   return bad || badUtf8 || timeouts;
+}
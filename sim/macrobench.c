@@ -0,0 +1,523 @@
+/*----------------------------------------------------------------------------*/
+/* Macro triggers: the cost of a keystroke as the macro table grows          */
+/*                                                                            */
+/* Firmware built with MC_SLOTS=512, room for 320 trigger steps. Macros are   */
+/* uploaded over SPI with HOST_OP_MACRO and keys are fed straight to          */
+/* kbPostCode() from the main loop hook, as in utf8bench.                     */
+/*                                                                            */
+/* First a script: chords, sequences, a sequence broken off and restarted,    */
+/* left and right modifiers, a UTF-8 expansion, clashing and malformed        */
+/* records, an upload while the one before is still pending, and a clear.     */
+/*                                                                            */
+/* Then the table is filled in steps up to 288 macros, a mix of chords        */
+/* (Ctrl+Alt+key and the like) and two key sequences (F key, then a key).     */
+/* At each size the firmware output for a random stream of keys is checked    */
+/* against a reference model of the triggers, then timed: "text" is plain     */
+/* typing on the main block, "mixed" hits and misses triggers at every key.   */
+/* Reported per size: host nanoseconds per key for both, the longest probe    */
+/* run and the expansions per key. Last the table is filled until it reports  */
+/* MC_FULL.                                                                   */
+/*                                                                            */
+/* usage: macrobench [-k keystrokes] [-s seed]                                */
+/*----------------------------------------------------------------------------*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "sim.h"
+#include "simkbd.h"
+#include "simspi.h"
+#include "ps2kb.h"
+#include "host.h"
+
+#define SCK_HZ      1000000
+#define GAP_US      10
+#define VERIFY_KEYS 20000                                                       //Checked against the reference per size
+#define MAX_CANDS   1024
+#define MAX_OUT     (MC_LEN_MAX + 16)                                           //Bytes one key can post here
+#define NCOMBOS     8
+#define STREAM      65536                                                       //Keys drawn before timing, replayed in a loop
+
+enum{
+    OP_UPLOAD,                                                                  //Send rec, its status is status
+    OP_BUSY,                                                                    //Send rec twice in one pass, the second must see MC_BUSY
+    OP_LONG,                                                                    //Record length over MC_REC_MAX
+    OP_TEXT,                                                                    //Trigger in rec, padded with text to len bytes
+    OP_TYPE                                                                     //Type keys, expect out
+};
+
+enum{
+    PH_SCRIPT,
+    PH_PLAIN,                                                                   //Record what every key posts without macros
+    PH_UPLOAD,
+    PH_MEASURE,
+    PH_FULL,
+    PH_DONE
+};
+
+typedef struct{
+    uint8_t op;
+    const char *what;
+    uint8_t rec[24];                                                            //OP_UPLOAD record, or key/mods pairs for OP_TYPE
+    uint8_t len;
+    uint8_t status;                                                             //OP_UPLOAD
+    const char *out;                                                            //OP_TYPE
+}scriptOp_t;
+
+typedef struct{                                                                 //One candidate macro
+    uint8_t steps;
+    uint8_t key[2];
+    uint8_t mods[2];
+    char text[16];
+}cand_t;
+
+typedef struct{                                                                 //Bytes posted by one key
+    uint8_t n;
+    uint8_t b[MAX_OUT];
+}out_t;
+
+#define CA  (KM_LCTRL | KM_LALT)
+
+static const scriptOp_t script[] = {
+   {OP_UPLOAD, "chord",           {1, KEY_F1, CA, 's','t','a','t','u','s','\r'}, 10, MC_OK},
+   {OP_UPLOAD, "sequence",        {2, KEY_F12, 0, KEY_1, 0, 'l','s',' ','-','l','\r'}, 11, MC_OK},
+   {OP_UPLOAD, "utf-8 text",      {2, KEY_F12, 0, KEY_2, 0, 0xC3,0xA9,'t',0xC3,0xA9}, 10, MC_OK},
+   {OP_UPLOAD, "prefix",          {1, KEY_F12, 0, 'x'}, 4, MC_CLASH},
+   {OP_UPLOAD, "extension",       {3, KEY_F12, 0, KEY_1, 0, KEY_3, 0, 'y'}, 8, MC_CLASH},
+   {OP_UPLOAD, "right mods",      {1, KEY_F1, KM_RCTRL | KM_RALT, 'z'}, 4, MC_CLASH},
+   {OP_UPLOAD, "modifier step",   {1, KEY_LSHIFT, 0, 'q'}, 4, MC_BAD},
+   {OP_UPLOAD, "unknown key",     {1, 0x00, 0, 'q'}, 4, MC_BAD},
+   {OP_UPLOAD, "too many steps",  {5, KEY_A,0, KEY_B,0, KEY_C,0, KEY_D,0, KEY_E,0, 'q'}, 12, MC_BAD},
+   {OP_UPLOAD, "no text",         {1, KEY_A, 0}, 3, MC_BAD},
+   {OP_UPLOAD, "clear with text", {0, 'q'}, 2, MC_BAD},
+   {OP_LONG,   "too long",        {0}, MC_REC_MAX + 1, MC_BAD},
+   {OP_TEXT,   "text too long",   {1, KEY_F4, 0}, 3 + MC_LEN_MAX + 1, MC_BAD},
+   {OP_TEXT,   "longest text",    {1, KEY_F4, 0}, 3 + MC_LEN_MAX, MC_OK},
+   {OP_BUSY,   "busy",            {1, KEY_F2, 0, 'b'}, 4, MC_OK},
+   {OP_TYPE,   "chord",           {KEY_F1, CA}, 2, 0, "status\r"},
+   {OP_TYPE,   "chord right",     {KEY_F1, KM_RCTRL | KM_RALT}, 2, 0, "status\r"},
+   {OP_TYPE,   "chord lctrl ralt",{KEY_F1, KM_LCTRL | KM_RALT}, 2, 0, "status\r"},
+   {OP_TYPE,   "ctrl only",       {KEY_F1, KM_LCTRL}, 2, 0, "\x81"},
+   {OP_TYPE,   "sequence",        {KEY_F12, 0, KEY_1, 0}, 4, 0, "ls -l\r"},
+   {OP_TYPE,   "modifier between",{KEY_F12, 0, KEY_LSHIFT, KM_LSHIFT, KEY_1, 0}, 6, 0, "ls -l\r"},
+   {OP_TYPE,   "utf-8 text",      {KEY_F12, 0, KEY_2, 0}, 4, 0, "\xC3\xA9t\xC3\xA9"},
+   {OP_TYPE,   "broken off",      {KEY_F12, 0, KEY_X, 0}, 4, 0, "\x8C" "x"},
+   {OP_TYPE,   "shifted step",    {KEY_F12, 0, KEY_1, KM_LSHIFT}, 4, 0, "\x8C" "!"},
+   {OP_TYPE,   "restarted",       {KEY_F12, 0, KEY_F12, 0, KEY_1, 0}, 6, 0, "\x8C" "ls -l\r"},
+   {OP_TYPE,   "before busy",     {KEY_F2, 0}, 2, 0, "b"},
+   {OP_TYPE,   "ignored when busy",{KEY_F3, 0}, 2, 0, "\x83"},
+   {OP_TYPE,   "plain",           {KEY_A, 0, KEY_1, 0}, 4, 0, "a1"},
+   {OP_UPLOAD, "clear",           {0}, 1, MC_OK},
+   {OP_TYPE,   "cleared",         {KEY_F1, CA, KEY_F12, 0, KEY_1, 0}, 6, 0, "\x81\x8C" "1"},
+};
+#define NSCRIPT (sizeof(script) / sizeof(script[0]))
+
+static const uint8_t busy[] = {1, KEY_F3, 0, 'c'};                              //Sent right after OP_BUSY
+
+static const uint16_t sizes[] = {0, 32, 96, 160, 224, 288};
+#define NSIZES (sizeof(sizes) / sizeof(sizes[0]))
+
+static const uint8_t combos[NCOMBOS] = {                                        //Chord modifiers, left side
+   KM_LCTRL | KM_LALT, KM_LCTRL | KM_LSHIFT, KM_LALT | KM_LSHIFT, KM_LCTRL | KM_LALT | KM_LSHIFT,
+   KM_LGUI, KM_LCTRL | KM_LGUI, KM_LALT | KM_LGUI, KM_LSHIFT | KM_LGUI
+};
+static const uint8_t fkeys[12] = {
+   KEY_F1, KEY_F2, KEY_F3, KEY_F4, KEY_F5, KEY_F6, KEY_F7, KEY_F8, KEY_F9, KEY_F10, KEY_F11, KEY_F12
+};
+
+extern queue_t xOutBuf;
+extern kbEvent_t xEvent;
+extern mcMacros_t xMacros;
+extern const kbKeyDesc_t kbKeyMap[256];
+int fwMain(void);
+
+static simKbd_t kbd;
+static uint8_t keys[KB_SLOTS];                                                  //Main block keycodes
+static cand_t cand[MAX_CANDS];
+static uint32_t nCands, defined, nKeys;
+static out_t plain[256][256];                                                   //Without macros, by keycode and mods as typed
+static uint8_t phase, step, sizeIdx, want, checking;
+static uint32_t bad, badStatus, badVerify;
+
+/*------------------------------------------*/
+/* Send one HOST_OP_MACRO and check the     */
+/* status it returns, which is that of the  */
+/* record sent before. len 0 only reads it  */
+/*------------------------------------------*/
+static void upload(const uint8_t *rec, uint8_t len, uint8_t status, const char *what){
+
+   uint8_t got = simSpiUpload(HOST_OP_MACRO, rec, len, SCK_HZ, GAP_US);
+
+   if(checking && got != want){
+      printf("status           %s: got %u, want %u\n", what, got, want);
+      badStatus++;
+   }
+   want = status;
+   checking = len != 0;
+}
+
+static void candRecord(const cand_t *c, uint8_t *rec, uint8_t *len){
+
+   uint8_t i, n = 0;
+
+   rec[n++] = c->steps;
+   for(i = 0; i < c->steps; i++){
+      rec[n++] = c->key[i];
+      rec[n++] = c->mods[i];
+   }
+   memcpy(&rec[n], c->text, strlen(c->text));
+   *len = n + strlen(c->text);
+}
+
+/*------------------------------------------*/
+/* Post one key make, return what it queued */
+/*------------------------------------------*/
+static void press(uint8_t key, uint8_t mods, out_t *o){
+
+   xEvent.type = KB_EV_KEY;
+   xEvent.key = key;
+   xEvent.brk = 0;
+   xEvent.mods = mods;
+   kbPostCode();
+   o->n = qRead(&xOutBuf, o->b, sizeof(o->b));
+}
+
+/*------------------------------------------*/
+/* Reference model of the first n macros.   */
+/* Returns 2 if seq is a trigger (its       */
+/* macro in *hit), 1 if it starts one       */
+/*------------------------------------------*/
+static int refLookup(const uint8_t *key, const uint8_t *mods, uint8_t len, uint32_t *hit){
+
+   uint32_t i;
+   uint8_t j;
+   int r = 0;
+
+   for(i = 0; i < defined; i++){
+      if(cand[i].steps < len)
+         continue;
+      for(j = 0; j < len; j++)
+         if(cand[i].key[j] != key[j] || cand[i].mods[j] != MC_MODS(mods[j]))
+            break;
+      if(j < len)
+         continue;
+      if(cand[i].steps == len){
+         *hit = i;
+         return 2;
+      }
+      r = 1;
+   }
+   return r;
+}
+
+static void refAppend(out_t *o, const uint8_t *b, uint8_t n){
+   memcpy(&o->b[o->n], b, n);
+   o->n += n;
+}
+
+static uint8_t refKey[MC_STEPS_MAX], refMods[MC_STEPS_MAX], refHeld;
+
+static void refPress(uint8_t key, uint8_t mods, out_t *o){
+
+   uint32_t hit;
+   uint8_t i;
+   int r;
+
+   o->n = 0;
+   refKey[refHeld] = key;
+   refMods[refHeld] = mods;
+   r = refLookup(refKey, refMods, refHeld + 1, &hit);
+   if(!r && refHeld){                                                           //Broken off: held keys as typed, try again
+      for(i = 0; i < refHeld; i++)
+         refAppend(o, plain[refKey[i]][refMods[i]].b, plain[refKey[i]][refMods[i]].n);
+      refHeld = 0;
+      refKey[0] = key;
+      refMods[0] = mods;
+      r = refLookup(refKey, refMods, 1, &hit);
+   }
+   if(r == 2){
+      refAppend(o, (const uint8_t *)cand[hit].text, strlen(cand[hit].text));
+      refHeld = 0;
+   }
+   else if(r == 1)
+      refHeld++;
+   else
+      refAppend(o, plain[key][mods].b, plain[key][mods].n);
+}
+
+/*------------------------------------------*/
+/* Next key of the mixed stream: half       */
+/* chords, a quarter F keys, a quarter main */
+/* block keys, modifiers left or right      */
+/*------------------------------------------*/
+static void mixedKey(uint8_t *key, uint8_t *mods){
+
+   int r = rand() % 4;
+
+   *mods = 0;
+   if(r < 2){
+      *key = keys[rand() % KB_SLOTS];
+      *mods = combos[rand() % NCOMBOS];
+      if(rand() & 1)
+         *mods <<= 4;
+   }
+   else if(r == 2)
+      *key = fkeys[rand() % 12];
+   else
+      *key = keys[rand() % KB_SLOTS];
+}
+
+static uint8_t mixedKeys[STREAM], mixedMods[STREAM];
+static uint8_t textKeys[STREAM], textMods[STREAM];
+
+static void makeStreams(void){
+
+   uint32_t i;
+
+   for(i = 0; i < STREAM; i++){
+      mixedKey(&mixedKeys[i], &mixedMods[i]);
+      textKeys[i] = keys[(i * 7) % KB_SLOTS];
+      textMods[i] = 0;
+   }
+}
+
+/*------------------------------------------*/
+/* Time n keys of one stream, draining the  */
+/* queue whenever it is half full           */
+/*------------------------------------------*/
+static double timed(uint32_t n, const uint8_t *key, const uint8_t *mods){
+
+   static uint8_t sink[BUFSIZE];
+   uint32_t i;
+   double t0 = simWallSec();
+
+   for(i = 0; i < n; i++){
+      xEvent.type = KB_EV_KEY;
+      xEvent.brk = 0;
+      xEvent.key = key[i % STREAM];
+      xEvent.mods = mods[i % STREAM];
+      kbPostCode();
+      if(qCount(&xOutBuf) >= BUFSIZE / 2)
+         qRead(&xOutBuf, sink, BUFSIZE);
+   }
+   qRead(&xOutBuf, sink, BUFSIZE);
+   return (simWallSec() - t0) * 1e9 / n;
+}
+
+/*------------------------------------------*/
+/* One table size: check a stream against   */
+/* the reference, then time both streams    */
+/*------------------------------------------*/
+static void measure(void){
+
+   out_t got, ref;
+   uint32_t i, diffs = 0;
+   uint32_t fired;
+   uint8_t key, mods;
+   double text, mixed;
+
+   mcCancel();                                                                  //Both sides start between triggers
+   refHeld = 0;
+   for(i = 0; i < VERIFY_KEYS; i++){
+      mixedKey(&key, &mods);
+      press(key, mods, &got);
+      refPress(key, mods, &ref);
+      if(got.n != ref.n || memcmp(got.b, ref.b, got.n))
+         diffs++;
+   }
+   badVerify += diffs;
+
+   xMacros.probeMax = 0;
+   fired = xMacros.fired;
+   text = timed(nKeys, textKeys, textMods);
+   mixed = timed(nKeys, mixedKeys, mixedMods);
+   printf("%6u %6u %9.1f %9.1f %6u %9.3f %7u\n", defined, xMacros.nodes, text, mixed,
+          xMacros.probeMax, (double)(xMacros.fired - fired) / nKeys, diffs);
+}
+
+/*------------------------------------------*/
+/* Once per main loop pass, one step: the   */
+/* main loop applies an upload between two  */
+/* passes                                   */
+/*------------------------------------------*/
+static void loopHook(void){
+
+   const scriptOp_t *s;
+   out_t o;
+   uint8_t rec[MC_REC_MAX + 1], len, i, k;
+   uint8_t got;
+
+   switch(phase){
+      case PH_SCRIPT:
+         if(step == NSCRIPT){
+            upload(NULL, 0, 0, script[NSCRIPT - 1].what);
+            phase = PH_PLAIN;
+            return;
+         }
+         s = &script[step++];
+         if(s->op == OP_UPLOAD)
+            upload(s->rec, s->len, s->status, s->what);
+         else if(s->op == OP_LONG){
+            memset(rec, 0, sizeof(rec));
+            upload(rec, s->len, s->status, s->what);
+         }
+         else if(s->op == OP_TEXT){
+            memset(rec, 'a', sizeof(rec));
+            memcpy(rec, s->rec, 3);
+            upload(rec, s->len, s->status, s->what);
+         }
+         else if(s->op == OP_BUSY){
+            upload(s->rec, s->len, s->status, s->what);
+            got = simSpiUpload(HOST_OP_MACRO, busy, sizeof(busy), SCK_HZ, GAP_US);  //Main loop has not run yet
+            if(got != MC_BUSY){
+               printf("status           %s: got %u, want %u\n", s->what, got, MC_BUSY);
+               badStatus++;
+            }
+         }
+         else{
+            upload(NULL, 0, 0, s[-1].what);                                     //Status of the record before
+            for(i = 0, len = 0; i < s->len; i += 2){
+               press(s->rec[i], s->rec[i + 1], &o);
+               memcpy(&rec[len], o.b, o.n);
+               len += o.n;
+            }
+            if(len != strlen(s->out) || memcmp(rec, s->out, len)){
+               printf("script           %s: got", s->what);
+               for(i = 0; i < len; i++)
+                  printf(" %02X", rec[i]);
+               printf("\n");
+               bad++;
+            }
+         }
+         return;
+
+      case PH_PLAIN:                                                            //Every key and modifier set the streams use
+         for(k = 0; k < KB_SLOTS; k++){
+            press(keys[k], 0, &plain[keys[k]][0]);
+            for(i = 0; i < NCOMBOS; i++){
+               press(keys[k], combos[i], &plain[keys[k]][combos[i]]);
+               press(keys[k], combos[i] << 4, &plain[keys[k]][combos[i] << 4]);
+            }
+         }
+         for(k = 0; k < 12; k++)
+            press(fkeys[k], 0, &plain[fkeys[k]][0]);
+         printf("macros  nodes text ns/k mixed ns/k probe  fired/k  errors\n");
+         phase = PH_UPLOAD;
+         return;
+
+      case PH_UPLOAD:
+         if(defined < sizes[sizeIdx]){
+            candRecord(&cand[defined++], rec, &len);
+            upload(rec, len, MC_OK, "sweep");
+            return;
+         }
+         upload(NULL, 0, 0, "sweep");
+         phase = PH_MEASURE;
+         return;
+
+      case PH_MEASURE:
+         measure();
+         phase = ++sizeIdx < NSIZES ? PH_UPLOAD : PH_FULL;
+         return;
+
+      case PH_FULL:                                                             //One at a time until MC_FULL
+         upload(NULL, 0, 0, "full");
+         got = xMacros.status;
+         if(got == MC_FULL || defined == nCands){
+            printf("full             %u macros, %u of %u nodes, %u text bytes\n", defined - 1,
+                   xMacros.nodes, MC_SLOTS, xMacros.textUsed);
+            if(got != MC_FULL || xMacros.nodes < MC_FILL / 4 * 3)               //Refused within MC_PROBE_MAX well before MC_FILL?
+               bad++;
+            phase = PH_DONE;
+            return;
+         }
+         candRecord(&cand[defined++], rec, &len);
+         simSpiUpload(HOST_OP_MACRO, rec, len, SCK_HZ, GAP_US);
+         checking = 0;
+         return;
+   }
+}
+
+static int doneHook(void){
+   return phase == PH_DONE;
+}
+
+/*------------------------------------------*/
+/* Every chord and sequence the sweep can   */
+/* pick, shuffled                           */
+/*------------------------------------------*/
+static void makeCands(void){
+
+   cand_t t;
+   uint32_t i, j;
+
+   for(i = 0; i < KB_SLOTS; i++)
+      for(j = 0; j < NCOMBOS; j++){
+         cand[nCands].steps = 1;
+         cand[nCands].key[0] = keys[i];
+         cand[nCands].mods[0] = combos[j];
+         nCands++;
+      }
+   for(i = 0; i < 12; i++)
+      for(j = 0; j < KB_SLOTS; j++){
+         cand[nCands].steps = 2;
+         cand[nCands].key[0] = fkeys[i];
+         cand[nCands].key[1] = keys[j];
+         nCands++;
+      }
+   for(i = nCands - 1; i > 0; i--){
+      j = rand() % (i + 1);
+      t = cand[i];
+      cand[i] = cand[j];
+      cand[j] = t;
+   }
+   for(i = 0; i < nCands; i++)
+      snprintf(cand[i].text, sizeof(cand[i].text), "<%u>", i);
+}
+
+int main(int argc, char **argv){
+
+   uint32_t k, n = 0, seed = 1;
+   double t0;
+   int opt;
+
+   nKeys = 1000000;
+   while((opt = getopt(argc, argv, "k:s:")) != -1){
+      switch(opt){
+         case 'k': nKeys = strtoul(optarg, NULL, 0); break;
+         case 's': seed = strtoul(optarg, NULL, 0); break;
+         default:
+            fprintf(stderr, "usage: %s [-k keystrokes] [-s seed]\n", argv[0]);
+            return 2;
+      }
+   }
+   if(!nKeys)
+      nKeys = 1;
+   for(k = 0; k < 256; k++)
+      if(kbKeyMap[k].kind == KC_LAYOUT)
+         keys[kbKeyMap[k].plain] = k, n++;
+   if(n != KB_SLOTS){
+      fprintf(stderr, "%u layout keys in keymap.h, %u slots\n", n, KB_SLOTS);
+      return 1;
+   }
+   srand(seed);
+   makeCands();
+   makeStreams();
+   t0 = simWallSec();
+
+   simReset();
+   simKbdInit(&kbd, 40);
+   simLoopHook = loopHook;
+   simDoneHook = doneHook;
+   simDeadline = SIM_US(10000000);
+   if(simRun(fwMain)){
+      printf("timeout\n");
+      return 1;
+   }
+   printf("ram              %u bytes: %u slots of %u, %u text bytes\n", (unsigned)sizeof(xMacros),
+          MC_SLOTS, (unsigned)sizeof(mcNode_t), MC_TEXT);
+   printf("mismatches       %u script, %u status, %u against the reference\n", bad, badStatus,
+          badVerify);
+   printf("wall             %.2f s\n", simWallSec() - t0);
+   return bad || badStatus || badVerify;
+}
@@ -0,0 +1,292 @@
+/*----------------------------------------------------------------------------*/
+/* PS2 mouse on the second port, read over HOST_OP_MOUSE                      */
+/*                                                                            */
+/* Firmware built with PS2_PORTS=2. A keyboard sits idle on port 0 and a      */
+/* simulated mouse on port 1, plain or with a wheel on alternate runs. Once   */
+/* the firmware has negotiated and enabled streaming the mouse sends packets  */
+/* every 10ms with random motion and the odd button change, while the         */
+/* harness plays a master polling at random 5 to 45ms intervals, so several   */
+/* packets land in each report. Every other pair of runs sends some packet    */
+/* bytes with bad parity, which the port drops, so the decoder loses its      */
+/* place in the stream.                                                       */
+/*                                                                            */
+/* Clean runs must report exactly the motion and packet count sent and the    */
+/* same sequence of button states. Every run then sends two packets without   */
+/* motion, well inside MS_PKT_GAP_US, and a clean tail that must come through */
+/* exactly: the bit 3 check alone has to have the decoder back in step. Last  */
+/* comes half a packet, a quiet spell longer than MS_PKT_GAP_US and a second  */
+/* exact tail, for the stale packet timeout. Reports the negotiation time,    */
+/* reads and packets per report.                                              */
+/*                                                                            */
+/* Last HOST_OP_DIAG must put the parity errors of noisy runs on the second   */
+/* port only: the keyboard port shows no error at all.                        */
+/*                                                                            */
+/* usage: mousesim [-n runs] [-p packets] [-c clock_hz] [-e pct] [-s seed]    */
+/*----------------------------------------------------------------------------*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "sim.h"
+#include "simkbd.h"
+#include "simspi.h"
+#include "ps2kb.h"
+#include "ps2ms.h"
+#include "host.h"
+
+#define PKT_US      10000                                                       //Between packets, MS_RATE
+#define POLL_MIN_US 5000
+#define POLL_MAX_US 45000
+#define SETTLE_US   20000                                                       //Quiet before the next phase, under MS_PKT_GAP_US
+#define QUIET_US    (MS_PKT_GAP_US + 10000)                                     //After the cut packet, long enough to drop it
+#define TAIL        32                                                          //Clean packets after the main stream
+#define SYNC        2                                                           //Packets without motion before the first tail
+#define MAX_PACKETS 4000
+#define MAX_CHANGES (MAX_PACKETS + TAIL)
+
+enum{
+    PH_NEGOTIATE,                                                               //Waiting for the mouse to be enabled
+    PH_MAIN,
+    PH_SYNC,                                                                    //Packets without motion, not checked
+    PH_TAIL,
+    PH_CUT,                                                                     //Half a packet, then silence
+    PH_TAIL2,
+    PH_DONE
+};
+
+typedef struct{                                                                 //What was sent or read in one phase
+    int32_t dx, dy, dz;
+    uint32_t packets;
+    uint8_t btn[MAX_CHANGES];                                                   //Button states, repeats left out
+    uint32_t nBtn;
+    uint8_t last;
+}tally_t;
+
+int fwMain(void);
+
+static simKbd_t kbd, mouse;
+static uint8_t wheel, phase;
+static uint32_t errPct, nPackets;
+static tally_t sent[4], got[4];                                                 //Main stream, tails, the rest
+static uint64_t nextPoll, lastFrame;
+static uint32_t reads, reports, packets, maxPer, lost, badRecord;
+static simStat_t negUs;
+
+static void onFrame(simKbd_t *kb, uint8_t code, uint8_t tag, uint64_t start){
+   (void)kb; (void)code; (void)tag; (void)start;
+   lastFrame = simNow;
+}
+
+static void button(tally_t *t, uint8_t b){
+   if(b != t->last && t->nBtn < MAX_CHANGES)
+      t->btn[t->nBtn++] = b;
+   t->last = b;
+}
+
+static tally_t *tally(tally_t *t){
+   return &t[phase == PH_MAIN ? 0 : phase == PH_TAIL ? 1 : phase == PH_TAIL2 ? 2 : 3];
+}
+
+static void packet(uint64_t t, uint8_t buttons, int dx, int dy, int dz, uint32_t pct){
+
+   tally_t *s = tally(sent);
+   uint8_t b[4];
+   int i;
+
+   b[0] = MS_SYNC | buttons | (dx < 0 ? MS_XSIGN : 0) | (dy < 0 ? MS_YSIGN : 0);
+   b[1] = dx;
+   b[2] = dy;
+   b[3] = dz;
+   for(i = 0; i < (wheel ? 4 : 3); i++)
+      if((uint32_t)(rand() % 100) < pct)
+         simKbdScriptFault(&mouse, t, b[i], 0, SIMKBD_BAD_PARITY, 0);
+      else
+         simKbdScript(&mouse, t, b[i], 0);
+   s->dx += dx;
+   s->dy += dy;
+   s->dz += wheel ? dz : 0;
+   s->packets++;
+   button(s, buttons);
+}
+
+static void buildStream(uint64_t t, uint32_t n, uint32_t pct){
+
+   uint8_t buttons = 0;
+   uint32_t i;
+
+   for(i = 0; i < n; i++, t += SIM_US(PKT_US)){
+      if(rand() % 10 == 0)
+         buttons = rand() & MB_ALL;
+      packet(t, buttons, rand() % 512 - 256, rand() % 512 - 256, rand() % 16 - 8, pct);
+   }
+}
+
+/*------------------------------------------*/
+/* Read one report like the master. Returns */
+/* 1 while there was something to read      */
+/*------------------------------------------*/
+static int poll(void){
+
+   msReport_t r;
+   tally_t *g = tally(got);
+
+   memset(&r, 0, sizeof(r));
+   if(simSpiRecord(HOST_OP_MOUSE, 1000000, 10, (uint8_t *)&r, sizeof(r)) != sizeof(r) ||
+      !(r.flags & MR_READY) || !(r.flags & MR_WHEEL) != !wheel)
+      badRecord++;
+   reads++;
+   if(r.packets){
+      g->dx += r.dx;
+      g->dy += r.dy;
+      g->dz += r.dz;
+      g->packets += r.packets;
+      button(g, r.buttons);
+      reports++;
+      packets += r.packets;
+      if(r.packets > maxPer)
+         maxPer = r.packets;
+   }
+   if(r.flags & MR_LOST)
+      lost++;
+   return r.packets || r.more;
+}
+
+/*------------------------------------------*/
+/* Once per main loop pass: start the       */
+/* stream once the mouse is enabled, poll,  */
+/* and once a phase has been sent, settled  */
+/* and read to the end start the next       */
+/*------------------------------------------*/
+static void loopHook(void){
+
+   int i;
+
+   if(phase == PH_NEGOTIATE){
+      if(!mouse.reporting)
+         return;
+      simStatAdd(&negUs, (uint32_t)SIM_TO_US(simNow));
+      phase = PH_MAIN;
+      buildStream(simNow + SIM_US(PKT_US), nPackets, errPct);
+      nextPoll = simNow + SIM_US(PKT_US);                                       //The enable ACK is still on its way
+      return;
+   }
+   if(phase == PH_DONE)
+      return;
+   if(simNow >= nextPoll)
+      nextPoll = poll() ? simNow : simNow + SIM_US(POLL_MIN_US + rand() % (POLL_MAX_US - POLL_MIN_US));
+
+   if(!simKbdIdle(&mouse) ||
+      simNow - lastFrame < SIM_US(phase == PH_CUT ? QUIET_US : SETTLE_US))
+      return;
+   while(poll())                                                                //What is left of this phase
+      ;
+   phase++;
+   switch(phase){
+      case PH_SYNC:
+         for(i = 0; i < SYNC; i++)
+            packet(simNow + i * SIM_US(PKT_US), 0, 0, 0, 0, 0);
+         break;
+      case PH_TAIL:
+      case PH_TAIL2:
+         buildStream(simNow, TAIL, 0);
+         break;
+      case PH_CUT:
+         simKbdScript(&mouse, simNow, MS_SYNC, 0);
+         simKbdScript(&mouse, simNow, 0x55, 0);
+         break;
+   }
+}
+
+static int doneHook(void){
+   return phase == PH_DONE;
+}
+
+static int same(const tally_t *a, const tally_t *b, uint8_t buttons){
+   return a->dx == b->dx && a->dy == b->dy && a->dz == b->dz && a->packets == b->packets &&
+          (!buttons || (a->nBtn == b->nBtn && !memcmp(a->btn, b->btn, a->nBtn)));
+}
+
+int main(int argc, char **argv){
+
+   uint32_t runs = 8, hz = 12500, seed = 1, halfUs, pct = 2;
+   uint32_t n, noisy, bad = 0, badTail = 0, badCut = 0, timeouts = 0, wheels = 0, resyncs = 0;
+   uint32_t lostBefore, badDiag = 0;
+   msReport_t r;
+   kbDiag_t d;
+   double t0;
+   int opt;
+
+   nPackets = 300;
+   while((opt = getopt(argc, argv, "n:p:c:e:s:")) != -1){
+      switch(opt){
+         case 'n': runs = strtoul(optarg, NULL, 0); break;
+         case 'p': nPackets = strtoul(optarg, NULL, 0); break;
+         case 'c': hz = strtoul(optarg, NULL, 0); break;
+         case 'e': pct = strtoul(optarg, NULL, 0); break;
+         case 's': seed = strtoul(optarg, NULL, 0); break;
+         default:
+            fprintf(stderr, "usage: %s [-n runs] [-p packets] [-c clock_hz] [-e pct] "
+                            "[-s seed]\n", argv[0]);
+            return 2;
+      }
+   }
+   if(nPackets > MAX_PACKETS)
+      nPackets = MAX_PACKETS;
+   halfUs = (500000 + hz / 2) / hz;
+   srand(seed);
+   t0 = simWallSec();
+
+   for(n = 0; n < runs; n++){
+      wheel = n & 1;
+      noisy = (n >> 1) & 1;
+      errPct = noisy ? pct : 0;
+      simReset();
+      simKbdInit(&kbd, halfUs);
+      simKbdInit(&mouse, halfUs);
+      mouse.bus = PS2_AUX;
+      mouse.mouse = 1;
+      mouse.wheel = wheel;
+      mouse.batUs = 20000;                                                      //A real BAT is 500ms, only wall time
+      mouse.onFrame = onFrame;
+      memset(sent, 0, sizeof(sent));
+      memset(got, 0, sizeof(got));
+      phase = PH_NEGOTIATE;
+      lostBefore = lost;
+      simLoopHook = loopHook;
+      simDoneHook = doneHook;
+      simDeadline = SIM_US(1000000) + (uint64_t)(nPackets + 2 * TAIL) * SIM_US(PKT_US);
+      if(simRun(fwMain)){
+         timeouts++;
+         continue;
+      }
+      wheels += wheel;
+      if(!noisy && !same(&sent[0], &got[0], lost == lostBefore))
+         bad++;
+      if(!same(&sent[1], &got[1], 1))
+         badTail++;
+      if(!same(&sent[2], &got[2], 1))
+         badCut++;
+      simSpiRecord(HOST_OP_MOUSE, 1000000, 10, (uint8_t *)&r, sizeof(r));
+      resyncs += r.resyncs;
+      memset(&d, 0, sizeof(d));
+      simSpiRecord(HOST_OP_DIAG, 1000000, 10, (uint8_t *)&d, sizeof(d));
+      if(d.version != KB_DIAG_VERSION || d.lastError != ERR_NONE || d.err.parity ||  //Nothing on the keyboard's side
+         !d.auxErr.parity != !noisy || (d.auxLastError == ERR_PARITY) != !!noisy)
+         badDiag++;
+   }
+
+   printf("runs             %u of %u packets, %u Hz clock, %u%% bad parity bytes on noisy runs\n",
+          runs, nPackets, hz, pct);
+   printf("negotiated       %u wheel, %u plain, %.1f ms p50\n", wheels, runs - timeouts - wheels,
+          simStatPct(&negUs, 50) / 1000.0);
+   printf("reads            %u, %u reports, %.2f packets each, max %u\n", reads, reports,
+          reports ? (double)packets / reports : 0.0, maxPer);
+   printf("mismatches       %u clean streams, %u tails after sync, %u after a cut packet, "
+          "%u bad records\n", bad, badTail, badCut, badRecord);
+   printf("resyncs          %u bytes dropped, %u button changes merged\n", resyncs, lost);
+   printf("diag             %u runs with errors on the wrong port\n", badDiag);
+   printf("timeouts         %u\n", timeouts);
+   printf("wall             %.2f s\n", simWallSec() - t0);
+   simStatFree(&negUs);
+   return bad || badTail || badCut || badRecord || badDiag || timeouts;
+}
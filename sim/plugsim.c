@@ -0,0 +1,213 @@
+/*----------------------------------------------------------------------------*/
+/* Keyboard plugged in again: BAT result at any time (kbPlug())               */
+/*                                                                            */
+/* Each case sets the firmware up over the keyboard and SPI (lock keys,       */
+/* HOST_OP_REPEAT), then plays a keyboard that was unplugged and plugged in   */
+/* again: the model goes back to its defaults, LEDs off and no typematic      */
+/* rate of ours, and sends its BAT result with two keys typed right behind    */
+/* it. The firmware must post PLUG_OK (PLUG_FAIL and ERR_BAT for a failed     */
+/* BAT), send the keyboard the settings that differ from its defaults and     */
+/* nothing else, let the keys through and forget any key held before.         */
+/*                                                                            */
+/* Reports per case the command bytes the keyboard took, the time from the    */
+/* BAT start bit to the last of them ACKed (restore) and to the first key     */
+/* typed after it in the output queue (key). The diagnostics record must      */
+/* count every BAT and hold the last result.                                  */
+/*                                                                            */
+/* usage: plugsim [-v]                                                        */
+/*----------------------------------------------------------------------------*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "sim.h"
+#include "simkbd.h"
+#include "simspi.h"
+#include "ps2kb.h"
+#include "kbcmd.h"
+#include "host.h"
+#include "typematic.h"
+
+#define SCK_HZ      1000000
+#define GAP_US      10
+#define SETTLE_US   60000                                                       //After the setup, room for its commands and ACKs
+#define QUIET_US    50000                                                       //After the plug, then check
+#define MAX_OUT     64
+
+#define S_A         0x1C                                                        //Set 2 make codes
+#define S_B         0x32
+#define S_CAPS      0x58
+#define S_NUM       0x77
+
+enum{
+    PH_SETUP,
+    PH_SETTLE,
+    PH_RUN,
+    PH_DONE
+};
+
+typedef struct{
+    const char *what;
+    uint8_t  caps;                                                              //Lock state before the unplug
+    uint8_t  nums;
+    uint8_t  mode;                                                              //TM_KEYBOARD or TM_LOCAL
+    uint8_t  held;                                                              //A held down at the unplug
+    uint8_t  bat;                                                               //Result the keyboard sends
+    uint8_t  keys;                                                              //Type ab behind it
+    uint8_t  leds;                                                              //Keyboard LEDs after, ARG_xxx
+    uint8_t  arg;                                                               //CMD_TYPEMATIC argument after
+    uint8_t  cmds;                                                              //Command bytes sent to the keyboard
+    const char *out;                                                            //Output queue after the plug
+}case_t;
+
+static const case_t cases[] = {
+   {"defaults",     0, 0, TM_KEYBOARD, 0, KB_BAT,  1, ARG_NONE,    TM_ARG_RESET, 0, "\x8E" "ab"},
+   {"caps num",     1, 1, TM_KEYBOARD, 0, KB_BAT,  1, ARG_CAP_NUM, TM_ARG_RESET, 2, "\x8E" "AB"},
+   {"caps local",   1, 0, TM_LOCAL,    0, KB_BAT,  1, ARG_CAPS,    TM_ARG_SLOW,  4, "\x8E" "AB"},
+   {"held local",   0, 1, TM_LOCAL,    1, KB_BAT,  0, ARG_NUM,     TM_ARG_SLOW,  4, "\x8E"},
+   {"local only",   0, 0, TM_LOCAL,    0, KB_BAT,  1, ARG_NONE,    TM_ARG_SLOW,  2, "\x8E" "ab"},
+   {"BAT failed",   0, 0, TM_KEYBOARD, 0, KB_FAIL, 0, ARG_NONE,    TM_ARG_RESET, 0, "\x8F"},
+   {"BAT failed 2", 0, 0, TM_KEYBOARD, 0, KB_FL2,  0, ARG_NONE,    TM_ARG_RESET, 0, "\x8F"},
+   {"again",        0, 0, TM_KEYBOARD, 0, KB_BAT,  1, ARG_NONE,    TM_ARG_RESET, 0, "\x8E" "ab"},
+};
+#define NCASES (sizeof(cases) / sizeof(cases[0]))
+
+extern queue_t xOutBuf;
+extern ps2Port_t *pKbPort;
+extern uint8_t capsLock, numsLock;
+int fwMain(void);
+
+static simKbd_t kbd;
+static uint8_t phase, idx, verbose;
+static uint64_t t0, phaseAt, restoreAt, keyAt;
+static uint8_t out[MAX_OUT];
+static uint32_t nOut, cmds0, bad;
+
+static void key(uint8_t code, uint8_t brk){
+   if(brk)
+      simKbdScript(&kbd, simNow, 0xF0, 0);
+   simKbdScript(&kbd, simNow, code, 0);
+}
+
+static void tap(uint8_t code){
+   key(code, 0);
+   key(code, 1);
+}
+
+/*------------------------------------------*/
+/* Case over: compare and report            */
+/*------------------------------------------*/
+static void check(const case_t *c){
+
+   kbKeyState_t ks;
+   uint32_t cmds = kbd.cmdsRcvd - cmds0, i;
+   uint8_t ok;
+
+   memset(&ks, 0, sizeof(ks));
+   simSpiRecord(HOST_OP_KEYS, SCK_HZ, GAP_US, (uint8_t *)&ks, sizeof(ks));
+   ok = nOut == strlen(c->out) && !memcmp(out, c->out, nOut) && cmds == c->cmds &&
+        kbd.leds == c->leds && kbd.typematic == c->arg && !ks.held &&
+        kbd.codeSet == 2 && (c->bat == KB_BAT ? !c->cmds || restoreAt : pKbPort->error == ERR_BAT);
+   printf("%-13s %02X  %5u %02X %02X %10.2f %8.2f  %s\n", c->what, c->bat, cmds, kbd.leds,
+          kbd.typematic, restoreAt ? SIM_TO_US(restoreAt - t0) / 1000 : 0.0,
+          keyAt ? SIM_TO_US(keyAt - t0) / 1000 : 0.0, ok ? "ok" : "FAIL");
+   if(!ok)
+      bad++;
+   for(i = 0; verbose && i < nOut; i++)
+      printf("  %02X\n", out[i]);
+}
+
+static void loopHook(void){
+
+   const case_t *c = &cases[idx];
+   uint8_t rec;
+   uint16_t n, i;
+
+   n = qRead(&xOutBuf, &out[nOut], MAX_OUT - nOut);                             //Take the characters as they are posted
+   for(i = 0; i < n; i++)
+      if(!keyAt && out[nOut + i] != PLUG_OK && out[nOut + i] != PLUG_FAIL)
+         keyAt = simNow;
+   nOut += n;
+
+   switch(phase){
+      case PH_SETUP:
+         if(!capsLock != !c->caps)                                              //Locks act on release, 0xFF when on
+            tap(S_CAPS);
+         if(!numsLock != !c->nums)
+            tap(S_NUM);
+         rec = c->mode;
+         simSpiUpload(HOST_OP_REPEAT, &rec, 1, SCK_HZ, GAP_US);
+         if(c->held)
+            key(S_A, 0);
+         phase = PH_SETTLE;
+         phaseAt = simNow;
+         return;
+
+      case PH_SETTLE:
+         if(!simKbdIdle(&kbd) || kbCmdBusy(pKbPort) || simNow - phaseAt < SIM_US(SETTLE_US))
+            return;
+         kbd.leds = 0;                                                          //Unplugged, plugged in again: back at its defaults
+         kbd.typematic = TM_ARG_RESET;
+         cmds0 = kbd.cmdsRcvd;
+         pKbPort->error = ERR_NONE;
+         nOut = 0;
+         restoreAt = keyAt = 0;
+         t0 = simNow;
+         simKbdScript(&kbd, simNow, c->bat, 0);
+         if(c->keys){
+            tap(S_A);
+            tap(S_B);
+         }
+         phase = PH_RUN;
+         return;
+
+      case PH_RUN:
+         if(!restoreAt && kbd.cmdsRcvd - cmds0 == c->cmds && c->cmds && !kbCmdBusy(pKbPort))
+            restoreAt = simNow;
+         if(!simKbdIdle(&kbd) || simNow - t0 < SIM_US(QUIET_US))
+            return;
+         check(c);
+         if(++idx == NCASES)
+            phase = PH_DONE;
+         else
+            phase = PH_SETUP;
+         return;
+   }
+}
+
+static int doneHook(void){
+   return phase == PH_DONE;
+}
+
+int main(int argc, char **argv){
+
+   kbDiag_t d;
+   int opt;
+
+   while((opt = getopt(argc, argv, "v")) != -1){
+      switch(opt){
+         case 'v': verbose = 1; break;
+         default:
+            fprintf(stderr, "usage: %s [-v]\n", argv[0]);
+            return 2;
+      }
+   }
+
+   simReset();
+   simKbdInit(&kbd, 40);
+   simLoopHook = loopHook;
+   simDoneHook = doneHook;
+   simDeadline = SIM_US(10000000);
+   printf("case          BAT  cmds LD TM restore ms   key ms\n");
+   if(simRun(fwMain)){
+      printf("timeout\n");
+      return 1;
+   }
+   memset(&d, 0, sizeof(d));
+   simSpiRecord(HOST_OP_DIAG, SCK_HZ, GAP_US, (uint8_t *)&d, sizeof(d));
+   printf("diag             version %u, %u plugs, last BAT 0x%02X\n", d.version, d.plugs, d.batResult);
+   if(d.version != KB_DIAG_VERSION || d.plugs != NCASES || d.batResult != cases[NCASES - 1].bat)
+      bad++;
+   printf("mismatches       %u\n", bad);
+   return bad != 0;
+}
@@ -0,0 +1,350 @@
+/*----------------------------------------------------------------------------*/
+/* Receive path stress test at a 16.7kHz keyboard clock                       */
+/*                                                                            */
+/* Each run sends bursts of random bytes mixed with sequences that trouble    */
+/* the decoder (F0 with nothing after it, 0xAA mid-stream, a partial E1       */
+/* Pause, FA/FE/EE, lock keys that make the firmware send LED commands) and   */
+/* with broken frames: bad parity, stop bit low, clock stopping part way      */
+/* through, one data pulse missing. A broken frame is followed by at least    */
+/* 300us of idle, as a keyboard that gave up on a frame would leave. The      */
+/* master drains the output queue with random stalls so it also fills up.     */
+/*                                                                            */
+/* Checked in every run:                                                      */
+/*                                                                            */
+/*   every whole frame reaches the raw ring, in order, unless the ring        */
+/*   counted it as a drop; no broken frame gets through as a scan code        */
+/*   the ISR is back in PS2START (or sending) once a burst ends on a good     */
+/*   frame                                                                    */
+/*   decoder prefix state and output queue fill stay in range                 */
+/*                                                                            */
+/* Then a keyboard unplugged mid-frame: a frame cut short after 1, 5 or 9     */
+/* pulses and a BAT (0xAA) whose start bit comes 1 or 2 wraps of the 16-bit   */
+/* timebase (4.096ms) after the last pulse, give or take up to 200us. The BAT */
+/* must reach the raw ring every time.                                        */
+/*                                                                            */
+/* Last, a command sent with its argument in one ps2SendCmd(): the argument's */
+/* request to send must wait for the keyboard to release the bus after the    */
+/* command's ACK, and the keyboard must take both bytes.                      */
+/*                                                                            */
+/* Out of bounds writes are left to the sanitizers the Makefile builds this   */
+/* with. Reports sustained good frames per second and the drop rate; the exit */
+/* status is non-zero if any check failed.                                    */
+/*                                                                            */
+/* usage: ps2fuzz [-n runs] [-f frames] [-c clock_hz] [-p fault_pct] [-s seed]*/
+/*----------------------------------------------------------------------------*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "sim.h"
+#include "simkbd.h"
+#include "ps2kb.h"
+#include "kbcmd.h"
+
+#define TAG_NONE    0
+#define TAG_BAD     1                                                           //Frame sent broken
+
+#define FZ_MAXFRAMES 8192                                                       //Script frames per run
+#define FZ_IDLE_US   1000                                                       //Quiet time that ends a burst
+#define FZ_WRAP_US   4096                                                       //HAL_TICK16() wraps, 65536 cycles
+#define FZ_ARG_LEDS  0x05                                                       //Argument of the two byte command
+
+extern queue_t xOutBuf;
+extern ps2Port_t xPorts[PS2_PORTS];
+extern kbDecoder_t xDecoder;
+extern uint8_t capsLock, numsLock;
+int fwMain(void);
+
+static simKbd_t kbd;
+static uint8_t rawSent[FZ_MAXFRAMES * 2], rawGot[FZ_MAXFRAMES * 2];            //Whole frames on the wire, frames the ISR accepted
+static uint32_t nRawSent, nRawGot;
+static uint8_t rawSeen;
+static uint64_t lastFrame;                                                      //Last frame off the wire, whole or broken
+static uint8_t lastBad;
+static uint64_t stallUntil;
+static uint32_t badState, badDecoder, badQueue;
+static uint8_t argSent;
+
+static void onFrame(simKbd_t *kb, uint8_t code, uint8_t tag, uint64_t start){
+   (void)tag; (void)start;
+   lastFrame = simNow;
+   lastBad = kb->fault != SIMKBD_OK;
+   if(!lastBad && nRawSent < sizeof(rawSent))
+      rawSent[nRawSent++] = code;
+}
+
+/*------------------------------------------*/
+/* Once per main loop pass: copy the raw    */
+/* ring, play the master, check invariants  */
+/*------------------------------------------*/
+static void loopHook(void){
+
+   uint8_t ch;
+
+   if((uint8_t)(xPorts[PS2_KBD].rx.head - rawSeen) > RXSIZE)                    //kbEcho() took them before the first pass, slots reused
+      rawSeen = xPorts[PS2_KBD].rx.head - RXSIZE;
+   while(rawSeen != xPorts[PS2_KBD].rx.head){
+      if(nRawGot < sizeof(rawGot))
+         rawGot[nRawGot++] = xPorts[PS2_KBD].rx.buffer[rawSeen & (RXSIZE - 1)];
+      rawSeen++;
+   }
+   if(simNow >= stallUntil){
+      while(qGet(&xOutBuf, &ch))
+         ;
+      if(!(rand() % 64))                                                        //Master busy elsewhere for a while
+         stallUntil = simNow + SIM_US(rand() % 20000);
+   }
+
+   if(!lastBad && lastFrame && kbd.txStart < lastFrame &&                       //Quiet since a good frame?
+      simNow - lastFrame > SIM_US(FZ_IDLE_US) &&
+      xPorts[PS2_KBD].state != PS2START && xPorts[PS2_KBD].state < PS2TX_RTS)
+      badState++;
+   if(xDecoder.skip > 7 || (xDecoder.ext & ~0x80) || xDecoder.brk > 1)
+      badDecoder++;
+   if(qCount(&xOutBuf) > BUFSIZE)
+      badQueue++;
+}
+
+static int doneHook(void){
+   return simKbdIdle(&kbd) && simNow - kbd.idleSince > SIM_US(2 * FZ_IDLE_US);
+}
+
+static void good(uint64_t t, uint8_t code){
+   simKbdScript(&kbd, t, code, TAG_NONE);
+}
+
+/*------------------------------------------*/
+/* One random item: a byte, a troublesome   */
+/* sequence or a broken frame               */
+/*------------------------------------------*/
+static void item(uint64_t t, uint32_t faultPct){
+
+   static const uint8_t locks[] = {0x58, 0x77, 0x7E};
+   static const uint8_t resps[] = {0xAA, 0xFA, 0xFE, 0xEE, 0xFC};
+   uint8_t fault, arg, k;
+
+   if((uint32_t)(rand() % 100) < faultPct){
+      fault = SIMKBD_BAD_PARITY + rand() % 4;
+      arg = fault == SIMKBD_TRUNCATE ? 1 + rand() % 10 :
+            fault == SIMKBD_NO_PULSE ? 1 + rand() % 9 : 0;
+      simKbdScriptFault(&kbd, t, rand() & 0xFF, TAG_BAD, fault, arg);
+      return;
+   }
+   switch(rand() % 8){
+      case 0:                                                                   //Release prefix left hanging
+         good(t, 0xF0);
+         break;
+      case 1:                                                                   //Response bytes in the key stream
+         good(t, resps[rand() % sizeof(resps)]);
+         break;
+      case 2:                                                                   //Pause cut short
+         good(t, 0xE1);
+         for(k = rand() % 7; k; k--)
+            good(t, rand() & 0x7F);
+         break;
+      case 3:                                                                   //Lock key, the firmware answers with LEDs
+         k = locks[rand() % sizeof(locks)];
+         good(t, k);
+         good(t, 0xF0);
+         good(t, k);
+         break;
+      case 4:
+         good(t, 0xE0);
+         break;
+      default:
+         good(t, rand() & 0xFF);
+         break;
+   }
+}
+
+static uint64_t buildScript(uint32_t frames, uint32_t faultPct){
+
+   uint64_t t = SIM_US(5000);                                                   //Leave room for kbInitialize()
+   uint32_t n;
+
+   while(kbd.scriptHead < frames){
+      for(n = 1 + rand() % 16; n; n--)                                          //Burst, due at once
+         item(t, faultPct);
+      good(t, rand() & 0x7F);                                                   //Ends on a good frame
+      t += SIM_US(FZ_IDLE_US + rand() % 2000);
+   }
+   return t;
+}
+
+/*------------------------------------------*/
+/* A frame cut short after cut pulses, then */
+/* a BAT whose start bit falls wraps * 4ms  */
+/* plus offUs after the last pulse. Returns */
+/* 1 if the BAT never reached the raw ring  */
+/*------------------------------------------*/
+static int wrapCase(uint32_t hz, uint8_t cut, uint32_t wraps, uint32_t offUs){
+
+   uint32_t i;
+
+   simReset();
+   simKbdInit(&kbd, (500000 + hz / 2) / hz);
+   kbd.onFrame = onFrame;
+   kbd.faultGapUs = wraps * FZ_WRAP_US + offUs - kbd.halfUs - kbd.setupUs;     //Last fall, rise, idle, setup, start bit
+   capsLock = numsLock = 0;
+   nRawSent = nRawGot = rawSeen = 0;
+   lastFrame = stallUntil = 0;
+   lastBad = 0;
+   simKbdScriptFault(&kbd, SIM_US(5000), 0x1C, TAG_BAD, SIMKBD_TRUNCATE, cut);
+   good(SIM_US(5000), KB_BAT);
+   simLoopHook = loopHook;
+   simDoneHook = doneHook;
+   simDeadline = SIM_US(5000 + 10000 + wraps * FZ_WRAP_US);
+   if(simRun(fwMain))
+      return 1;
+   for(i = 0; i < nRawGot; i++)
+      if(rawGot[i] == KB_BAT)
+         return 0;
+   return 1;
+}
+
+/*------------------------------------------*/
+/* Set LEDs, command and argument in one    */
+/* call once kbInitialize() is done         */
+/*------------------------------------------*/
+static void argHook(void){
+   if(!argSent && simNow > SIM_US(5000) && simKbdIdle(&kbd) && !kbCmdBusy(&xPorts[PS2_KBD]))
+      argSent = ps2SendCmd(&xPorts[PS2_KBD], CMD_SET_LED, FZ_ARG_LEDS);
+}
+
+static int argDone(void){
+   return argSent && !ps2TxBusy(&xPorts[PS2_KBD]) && simKbdIdle(&kbd) &&
+          simNow - kbd.idleSince > SIM_US(FZ_IDLE_US);
+}
+
+/*------------------------------------------*/
+/* Returns 1 if the argument went out on    */
+/* top of the ACK or the keyboard missed it */
+/*------------------------------------------*/
+static int argCase(uint32_t hz){
+
+   simReset();
+   simKbdInit(&kbd, (500000 + hz / 2) / hz);
+   capsLock = numsLock = 0;
+   argSent = 0;
+   simLoopHook = argHook;
+   simDoneHook = argDone;
+   simDeadline = SIM_US(100000);
+   if(simRun(fwMain))
+      return 1;
+   return xPorts[PS2_KBD].txStatus != TX_DONE || kbd.leds != FZ_ARG_LEDS ||
+          kbd.cmdErrors || kbd.ackInhibits;
+}
+
+/*------------------------------------------*/
+/* Whole frames accepted in order (longest  */
+/* common subsequence). Returns the frames  */
+/* accepted that were never sent, *lost the */
+/* ones sent but never accepted             */
+/*------------------------------------------*/
+static uint32_t unmatched(const uint8_t *in, uint32_t nIn, const uint8_t *ref, uint32_t nRef,
+                          uint32_t *lost){
+
+   static uint32_t row[2][FZ_MAXFRAMES * 2 + 1];
+   uint32_t i, k, *prev = row[0], *cur = row[1], *t;
+
+   memset(prev, 0, (nRef + 1) * sizeof(uint32_t));
+   for(i = 0; i < nIn; i++){
+      cur[0] = 0;
+      for(k = 0; k < nRef; k++)
+         cur[k + 1] = in[i] == ref[k] ? prev[k] + 1 :
+                      prev[k + 1] > cur[k] ? prev[k + 1] : cur[k];
+      t = prev; prev = cur; cur = t;
+   }
+   *lost = nRef - prev[nRef];
+   return nIn - prev[nRef];
+}
+
+int main(int argc, char **argv){
+
+   uint32_t runs = 200, frames = 400, hz = 16700, faultPct = 20, seed = 1;
+   uint32_t n, l, lost = 0, extra = 0, drops = 0, unexplained = 0, timeouts = 0;
+   uint32_t sent = 0, faults = 0, aborts = 0, failed;
+   static const uint8_t cuts[] = {1, 5, 9};
+   static const uint32_t offs[] = {0, 30, 60, 100, 200};
+   uint32_t c, w, o, wrapCases = 0, wrapLost = 0, argBad;
+   kbErrCounts_t errs = {0};
+   uint64_t virt = 0, end;
+   double t0, wall;
+   int opt;
+
+   while((opt = getopt(argc, argv, "n:f:c:p:s:")) != -1){
+      switch(opt){
+         case 'n': runs = strtoul(optarg, NULL, 0); break;
+         case 'f': frames = strtoul(optarg, NULL, 0); break;
+         case 'c': hz = strtoul(optarg, NULL, 0); break;
+         case 'p': faultPct = strtoul(optarg, NULL, 0); break;
+         case 's': seed = strtoul(optarg, NULL, 0); break;
+         default:
+            fprintf(stderr, "usage: %s [-n runs] [-f frames] [-c clock_hz] [-p fault_pct] "
+                            "[-s seed]\n", argv[0]);
+            return 2;
+      }
+   }
+   if(frames > FZ_MAXFRAMES - 32)
+      frames = FZ_MAXFRAMES - 32;
+   srand(seed);
+   badState = badDecoder = badQueue = 0;
+
+   t0 = simWallSec();
+   for(n = 0; n < runs; n++){
+      simReset();
+      simKbdInit(&kbd, (500000 + hz / 2) / hz);
+      kbd.onFrame = onFrame;
+      kbd.faultGapUs = 300;
+      capsLock = numsLock = 0;
+      nRawSent = nRawGot = rawSeen = 0;
+      lastFrame = stallUntil = 0;
+      lastBad = 0;
+      end = buildScript(frames, faultPct);
+      simLoopHook = loopHook;
+      simDoneHook = doneHook;
+      simDeadline = end + (uint64_t)(kbd.scriptHead) * SIM_US(22 * kbd.halfUs + 300) +
+                    SIM_US(1000000);                                            //Room for LED commands and master stalls
+      if(simRun(fwMain))
+         timeouts++;
+      if(xPorts[PS2_KBD].state != PS2START)                                     //Script ends on a good frame and idle
+         badState++;
+      extra += unmatched(rawGot, nRawGot, rawSent, nRawSent, &l);
+      lost += l;
+      if(l > xPorts[PS2_KBD].rx.drops)
+         unexplained += l - xPorts[PS2_KBD].rx.drops;
+      drops += xPorts[PS2_KBD].rx.drops;
+      sent += nRawSent;
+      faults += kbd.faults;
+      aborts += kbd.aborts;
+      errs.parity += xPorts[PS2_KBD].err.parity;
+      errs.stop += xPorts[PS2_KBD].err.stop;
+      errs.framing += xPorts[PS2_KBD].err.framing;
+      errs.state += xPorts[PS2_KBD].err.state;
+      virt += simNow;
+   }
+   wall = simWallSec() - t0;
+   for(c = 0; c < sizeof(cuts); c++)
+      for(w = 1; w <= 2; w++)
+         for(o = 0; o < sizeof(offs) / sizeof(offs[0]); o++, wrapCases++)
+            wrapLost += wrapCase(hz, cuts[c], w, offs[o]);
+   argBad = argCase(hz);
+   failed = timeouts + extra + unexplained + badState + badDecoder + badQueue + wrapLost + argBad;
+
+   printf("runs             %u (%u frames each, %u Hz clock, %u%% broken)\n",
+          runs, frames, hz, faultPct);
+   printf("frames           %u good, %u broken, %u inhibited and resent\n", sent, faults, aborts);
+   printf("fw errors        parity %u  stop %u  framing %u  state %u\n",
+          errs.parity, errs.stop, errs.framing, errs.state);
+   printf("good frames lost %u (%u ring drops, %u unexplained)\n", lost, drops, unexplained);
+   printf("bad frames in    %u\n", extra);
+   printf("drop rate        %.4f %%\n", sent ? 100.0 * lost / sent : 0.0);
+   printf("bat after wrap   %u of %u lost\n", wrapLost, wrapCases);
+   printf("command + arg    %s\n", argBad ? "FAIL" : "ok");
+   printf("invariants       state %u  decoder %u  queue %u  timeouts %u\n",
+          badState, badDecoder, badQueue, timeouts);
+   printf("frames/s         %.0f virtual, %.0f wall\n",
+          virt ? sent / (SIM_TO_US(virt) * 1e-6) : 0.0, sent / wall);
+   printf("result           %s\n", failed ? "FAIL" : "ok");
+   return failed != 0;
+}
@@ -0,0 +1,279 @@
+/*----------------------------------------------------------------------------*/
+/* Keystroke script replay against the host build of the firmware             */
+/*                                                                            */
+/* Each script is a burst of random typing (letters, digits, space, with and  */
+/* without shift, optionally caps lock toggles) sent by the simulated         */
+/* keyboard. The firmware runs from power-on through kbInitialize() and its   */
+/* main loop; every character it posts is checked against the expected text   */
+/* and timed from the start bit of the make code that produced it.            */
+/*                                                                            */
+/* With -e the keyboard drops one clock pulse from that percentage of its     */
+/* frames. Lost characters are then expected; what matters is how many wrong  */
+/* ones get through (spurious) and how the firmware classified the errors.    */
+/*                                                                            */
+/* With -d the diagnostics record is read over SPI (HOST_OP_DIAG) after the   */
+/* last script and printed; build with STATS=1 for the timing fields.         */
+/*                                                                            */
+/* usage: ps2sim [-n scripts] [-k keys] [-c clock_hz] [-g key_gap_us]         */
+/*               [-l caps_pct] [-e glitch_pct] [-d] [-s seed]                 */
+/*----------------------------------------------------------------------------*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "sim.h"
+#include "simkbd.h"
+#include "simspi.h"
+#include "ps2kb.h"
+#include "host.h"
+
+#define TAG_NONE    0
+#define TAG_CHAR    1                                                           //Make code that posts a character
+
+typedef struct{
+    uint8_t code;
+    char    plain;
+    char    shifted;
+}refKey_t;
+
+static const refKey_t refKeys[] = {                                             //Reference set 2 map, kept apart from the firmware tables
+   {0x1C,'a','A'},{0x32,'b','B'},{0x21,'c','C'},{0x23,'d','D'},{0x24,'e','E'},
+   {0x2B,'f','F'},{0x34,'g','G'},{0x33,'h','H'},{0x43,'i','I'},{0x3B,'j','J'},
+   {0x42,'k','K'},{0x4B,'l','L'},{0x3A,'m','M'},{0x31,'n','N'},{0x44,'o','O'},
+   {0x4D,'p','P'},{0x15,'q','Q'},{0x2D,'r','R'},{0x1B,'s','S'},{0x2C,'t','T'},
+   {0x3C,'u','U'},{0x2A,'v','V'},{0x1D,'w','W'},{0x22,'x','X'},{0x35,'y','Y'},
+   {0x1A,'z','Z'},{0x45,'0',')'},{0x16,'1','!'},{0x1E,'2','@'},{0x26,'3','#'},
+   {0x25,'4','$'},{0x2E,'5','%'},{0x36,'6','^'},{0x3D,'7','&'},{0x3E,'8','*'},
+   {0x46,'9','('},{0x29,' ',' '}
+};
+#define NREFKEYS (sizeof(refKeys) / sizeof(refKeys[0]))
+
+extern queue_t xOutBuf;
+extern ps2Port_t xPorts[PS2_PORTS];
+extern uint8_t capsLock, numsLock;
+int fwMain(void);
+
+static simKbd_t kbd;
+static char expect[8192], got[8192];
+static uint32_t nExpect, nGot;
+static uint32_t nLocks;                                                         //Caps toggles, each one sends an LED command
+static uint64_t stamps[8192];
+static uint32_t stampHead, stampTail;
+static simStat_t latency;
+static uint8_t rawSent[16384], rawGot[16384];                                   //Frames on the wire and frames the ISR accepted
+static uint32_t nRawSent, nRawGot;
+static uint8_t rawSeen;                                                         //Ring head already copied
+
+static void onFrame(simKbd_t *kb, uint8_t code, uint8_t tag, uint64_t start){
+   (void)kb;
+   if(nRawSent < sizeof(rawSent))
+      rawSent[nRawSent++] = code;
+   if(tag == TAG_CHAR)
+      stamps[stampHead++ % 8192] = start;
+}
+
+static void loopHook(void){                                                     //Consume what kbPostCode() wrote
+   uint8_t ch;
+   if((uint8_t)(xPorts[PS2_KBD].rx.head - rawSeen) > RXSIZE)                    //kbEcho() took them before the first pass, slots reused
+      rawSeen = xPorts[PS2_KBD].rx.head - RXSIZE;
+   while(rawSeen != xPorts[PS2_KBD].rx.head){                                   //Frames the ISR stored since the last pass
+      if(nRawGot < sizeof(rawGot))
+         rawGot[nRawGot++] = xPorts[PS2_KBD].rx.buffer[rawSeen & (RXSIZE - 1)];
+      rawSeen++;
+   }
+   while(qGet(&xOutBuf, &ch)){
+      if(nGot < sizeof(got))
+         got[nGot++] = ch;
+      if(stampTail != stampHead)
+         simStatAdd(&latency, (uint32_t)(simNow - stamps[stampTail++ % 8192]));
+   }
+}
+
+static int doneHook(void){
+   return simKbdIdle(&kbd) && simNow - kbd.idleSince > SIM_US(2000);
+}
+
+static uint64_t buildScript(uint32_t keys, uint32_t gapUs, uint32_t capsPct){
+
+   uint64_t t = SIM_US(5000);                                                   //Leave room for kbInitialize()
+   const refKey_t *k;
+   uint8_t shift, caps = 0;
+   uint32_t i;
+
+   for(i = 0; i < keys; i++){
+      if((uint32_t)(rand() % 100) < capsPct){                                   //Caps lock press and release
+         simKbdScript(&kbd, t, 0x58, TAG_NONE);
+         simKbdScript(&kbd, t, 0xF0, TAG_NONE);
+         simKbdScript(&kbd, t, 0x58, TAG_NONE);
+         caps ^= 1;
+         nLocks++;
+         t += SIM_US(gapUs);
+         continue;
+      }
+      k = &refKeys[rand() % NREFKEYS];
+      shift = (rand() % 4) == 0;
+      if(shift)
+         simKbdScript(&kbd, t, 0x12, TAG_NONE);
+      simKbdScript(&kbd, t, k->code, TAG_CHAR);
+      simKbdScript(&kbd, t, 0xF0, TAG_NONE);
+      simKbdScript(&kbd, t, k->code, TAG_NONE);
+      if(shift){
+         simKbdScript(&kbd, t, 0xF0, TAG_NONE);
+         simKbdScript(&kbd, t, 0x12, TAG_NONE);
+      }
+      if(shift || (caps && k->plain >= 'a' && k->plain <= 'z'))
+         expect[nExpect++] = k->shifted;
+      else
+         expect[nExpect++] = k->plain;
+      t += SIM_US(gapUs);
+   }
+   return t;
+}
+
+/*------------------------------------------*/
+/* In-order match of what arrived against   */
+/* what was sent (longest common            */
+/* subsequence). Returns the items that     */
+/* matched nothing, *lost the ones sent but */
+/* never matched                            */
+/*------------------------------------------*/
+static uint32_t spurious(const char *in, uint32_t nIn, const char *ref, uint32_t nRef,
+                         uint32_t *lost){
+
+   static uint32_t row[2][16385];
+   uint32_t i, k, *prev = row[0], *cur = row[1], *t;
+
+   if(nRef > 16384)
+      nRef = 16384;
+   memset(prev, 0, (nRef + 1) * sizeof(uint32_t));
+   for(i = 0; i < nIn; i++){
+      cur[0] = 0;
+      for(k = 0; k < nRef; k++)
+         cur[k + 1] = in[i] == ref[k] ? prev[k] + 1 :
+                      prev[k + 1] > cur[k] ? prev[k + 1] : cur[k];
+      t = prev; prev = cur; cur = t;
+   }
+   *lost = nRef - prev[nRef];
+   return nIn - prev[nRef];
+}
+
+/*------------------------------------------*/
+/* Read HOST_OP_DIAG the way the master     */
+/* would and print it                       */
+/*------------------------------------------*/
+static void printDiag(void){
+
+   kbDiag_t d;
+   uint8_t len;
+   int i;
+
+   memset(&d, 0, sizeof(d));
+   len = simSpiRecord(HOST_OP_DIAG, 1000000, 10, (uint8_t *)&d, sizeof(d));
+   printf("diag             %u bytes, version %u%s\n", len, d.version,
+          d.stats ? "" : " (built without PS2_STATS)");
+   if(d.stats){
+      printf("  frames         %u\n", d.frames);
+      printf("  bit cycles     min %u  max %u  mean %u (%.0f Hz)\n", d.bitMin, d.bitMax,
+             d.bitMean, d.bitMean ? (double)FCY / d.bitMean : 0.0);
+      printf("  INT0 cycles    max %u, by %u:", d.isrMax, KB_STAT_BIN_CYC);
+      for(i = 0; i < KB_STAT_BINS; i++)
+         printf(" %u", d.isrHist[i]);
+      printf("\n");
+   }
+   printf("  errors         parity %u  stop %u  framing %u  state %u  tx %u/%u  last 0x%02X\n",
+          d.err.parity, d.err.stop, d.err.framing, d.err.state, d.err.txNoAck,
+          d.err.txTimeout, d.lastError);
+   printf("  drops          rx %u  edge %u  out %u, queue hwm %u, cmd failures %u\n",
+          d.rxDrops, d.edgeDrops, d.outDrops, d.outHwm, d.cmdFailures);
+   printf("  plugs          %u, last BAT 0x%02X\n", d.plugs, d.batResult);
+   printf("  power          idle %u ms, awake %u ms, %u naps\n", d.idleMs, d.awakeMs, d.naps);
+   printf("  holds          %u, %.1f ms total, longest %.1f ms\n", d.holds,
+          d.holdTicks * 1e3 / FCY, d.holdMax * 1e3 / FCY);
+}
+
+int main(int argc, char **argv){
+
+   uint32_t scripts = 1000, keys = 20, hz = 12500, gapUs = 6000, capsPct = 0, seed = 1;
+   uint32_t glitchPct = 0, glitches = 0, extra = 0, lost = 0, rawExtra = 0, l, diag = 0;
+   uint32_t n, bad = 0, timeouts = 0, frames = 0, drops = 0;
+   kbErrCounts_t errs = {0};
+   uint64_t virt = 0, end;
+   double t0, wall;
+   int opt;
+
+   while((opt = getopt(argc, argv, "n:k:c:g:l:e:ds:")) != -1){
+      switch(opt){
+         case 'n': scripts = strtoul(optarg, NULL, 0); break;
+         case 'k': keys = strtoul(optarg, NULL, 0); break;
+         case 'c': hz = strtoul(optarg, NULL, 0); break;
+         case 'g': gapUs = strtoul(optarg, NULL, 0); break;
+         case 'l': capsPct = strtoul(optarg, NULL, 0); break;
+         case 'e': glitchPct = strtoul(optarg, NULL, 0); break;
+         case 'd': diag = 1; break;
+         case 's': seed = strtoul(optarg, NULL, 0); break;
+         default:
+            fprintf(stderr, "usage: %s [-n scripts] [-k keys] [-c clock_hz] "
+                            "[-g key_gap_us] [-l caps_pct] [-e glitch_pct] [-d] [-s seed]\n", argv[0]);
+            return 2;
+      }
+   }
+   if(keys > 1000)
+      keys = 1000;
+   srand(seed);
+
+   t0 = simWallSec();
+   for(n = 0; n < scripts; n++){
+      simReset();
+      simKbdInit(&kbd, (500000 + hz / 2) / hz);
+      kbd.onFrame = onFrame;
+      kbd.glitchPct = glitchPct;
+      capsLock = numsLock = 0;                                                  //Power-on state, kbInitialize() leaves them alone
+      nExpect = nGot = nLocks = 0;
+      nRawSent = nRawGot = rawSeen = 0;
+      stampHead = stampTail = 0;
+      end = buildScript(keys, gapUs, capsPct);
+      simLoopHook = loopHook;
+      simDoneHook = doneHook;
+      simDeadline = end + (uint64_t)(kbd.scriptHead) * SIM_US(22 * kbd.halfUs + kbd.gapUs) +
+                    (uint64_t)nLocks * SIM_US(2 * (120 + 22 * kbd.halfUs + kbd.respUs)) +
+                    SIM_US(10000);                                              //Worst case every frame queues behind the last
+      if(simRun(fwMain))
+         timeouts++;
+      if(nGot != nExpect || memcmp(got, expect, nExpect))
+         bad++;
+      extra += spurious(got, nGot, expect, nExpect, &l);
+      lost += l;
+      rawExtra += spurious((char *)rawGot, nRawGot, (char *)rawSent, nRawSent, &l);
+      frames += kbd.framesSent;
+      glitches += kbd.glitches;
+      drops += xPorts[PS2_KBD].rx.drops;
+      errs.parity += xPorts[PS2_KBD].err.parity;
+      errs.stop += xPorts[PS2_KBD].err.stop;
+      errs.framing += xPorts[PS2_KBD].err.framing;
+      errs.state += xPorts[PS2_KBD].err.state;
+      virt += simNow;
+   }
+   wall = simWallSec() - t0;
+
+   printf("scripts          %u (%u keys each, %u Hz clock)\n", scripts, keys, hz);
+   printf("mismatches       %u\n", bad);
+   printf("timeouts         %u\n", timeouts);
+   printf("rx ring drops    %u\n", drops);
+   if(glitchPct){
+      printf("glitched frames  %u of %u\n", glitches, frames);
+      printf("fw errors        parity %u  stop %u  framing %u  state %u\n",
+             errs.parity, errs.stop, errs.framing, errs.state);
+      printf("bad frames in    %u (accepted, but not what was sent)\n", rawExtra);
+      printf("chars            %u lost, %u spurious\n", lost, extra);
+   }
+   printf("scripts/s        %.0f\n", scripts / wall);
+   printf("frames/s         %.0f\n", frames / wall);
+   printf("virtual/wall     %.1fx\n", SIM_TO_US(virt) * 1e-6 / wall);
+   printf("latency us       p50 %.1f  p99 %.1f  max %.1f\n",
+          SIM_TO_US(simStatPct(&latency, 50)), SIM_TO_US(simStatPct(&latency, 99)),
+          SIM_TO_US(simStatPct(&latency, 100)));
+   if(diag)
+      printDiag();
+   simStatFree(&latency);
+   return (bad && !glitchPct) || timeouts;
+}
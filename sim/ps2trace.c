@@ -0,0 +1,908 @@
+/*----------------------------------------------------------------------------*/
+/* Logic analyzer capture replay through the firmware receive path            */
+/*                                                                            */
+/* Reads a capture of the keyboard clock and data lines and plays it on bus 0 */
+/* of the virtual-time engine, so the INT0 ISR frame decoder, kbDecode(),     */
+/* kbCheckFlags() and kbPostCode() see what the unit in the field saw.        */
+/* Prints every key event with the bytes it posted, host to device frames and */
+/* each receive error as the firmware counts it, then a summary.              */
+/*                                                                            */
+/*   csv  one row per sample, or one per change with a time column in         */
+/*        seconds (-t). -c and -d pick the clock and data columns (0 and 1).  */
+/*        Rows of samples are -r Hz apart. Comments and a header are skipped. */
+/*   vcd  scalar wires; -c and -d name the clock and data signals (the        */
+/*        first two 1-bit wires).                                             */
+/*                                                                            */
+/* The file is memory mapped and read once, front to back. Most rows of a     */
+/* sampled CSV repeat the row before; those runs are found by comparing the   */
+/* file with itself one row back, 32 bytes a pass, and only rows where a line */
+/* changes are parsed. A VCD only holds changes.                              */
+/*                                                                            */
+/* The data line is set as it changes and clock edges are played at their     */
+/* time, so the ISR samples data after its latency as on the part. Clock held */
+/* low past TR_INHIBIT_US is the unit holding the bus: the partial frame is   */
+/* dropped through ps2Inhibit() as the unit did, and if data is low when the  */
+/* clock is let go the host frame that follows is decoded here rather than by */
+/* the ISR. The next FA, FE or EE answers it and is not posted, as            */
+/* kbCmdReply() does on the unit. Lock keys toggle the lock state; the LED    */
+/* commands the unit sent are on the capture, so the replay sends none.       */
+/*                                                                            */
+/* -b writes a capture of the firmware typing to a simulated keyboard (shift, */
+/* caps lock with its LED commands, broken frames) as a sampled CSV and as a  */
+/* VCD, decodes both and checks the posted bytes and error counts against the */
+/* run that made them. Reports decode throughput.                             */
+/*                                                                            */
+/* usage: ps2trace [-f csv|vcd] [-c clock] [-d data] [-t time_col] [-r hz]    */
+/*                 [-u] [-l layout] [-o posted_file] [-q] capture             */
+/*        ps2trace -b [-k keys] [-r hz] [-s seed]                             */
+/*----------------------------------------------------------------------------*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "sim.h"
+#include "simkbd.h"
+#include "ps2kb.h"
+#include "typematic.h"
+#include "kbcmd.h"
+
+#define TR_INHIBIT_US   80                                                      //Clock low longer than a device holds it (50us)
+#define TR_HOST_CLOCKS  11                                                      //Host frame: 8 data, parity, stop, line ACK
+#define TR_HOST_GAP_US  2000                                                    //Clock gap that ends a host frame cut short
+#define TR_REPLIES      4                                                       //Host bytes waiting for an answer, at most
+#define TR_OUT_MAX      (1 << 20)                                               //Posted bytes kept for -b
+#define TR_BENCH_KEYS   1500
+#define TR_BENCH_RATE   4000000
+#define TAG_NONE        0
+
+#define KEY_NAME(name, code, kind, plain, shifted) [code] = #name,
+#define LAYOUT_NAME(name) #name,
+
+enum{
+    FMT_CSV,
+    FMT_VCD
+};
+
+typedef struct{
+    int fmt;
+    const char *clock;                                                          //Column number or signal name
+    const char *data;
+    int timeCol;                                                                //-1 = rows are samples
+    double rate;                                                                //Sample rate without a time column
+}trOpts_t;
+
+typedef struct{                                                                 //One line change, -b recording
+    uint64_t at;                                                                //Cycles
+    uint8_t clock;
+    uint8_t data;
+}trEdge_t;
+
+typedef struct{
+    uint64_t base;                                                              //simNow at capture time 0
+    uint8_t  clock, data;                                                       //Levels last played
+    uint64_t fallAt;                                                            //Capture cycles of the last falling clock edge
+    uint8_t  host;                                                              //Host frame clocks seen + 1, 0 = device talking
+    uint16_t hostShift;
+    uint8_t  hostAck;
+    uint64_t hostLast;                                                          //Last host frame edge
+    uint8_t  replies;                                                           //Host bytes not answered yet
+    uint8_t  quiet;
+    FILE    *out;                                                               //-o
+    kbErrCounts_t err0;                                                         //Counts before the capture
+    kbErrCounts_t err;                                                          //Counts already reported
+    uint16_t drops;
+    uint64_t edges, hostFrames, events, posted, end;
+    uint8_t *keep;                                                              //-b: posted bytes
+    uint32_t nKeep;
+}trReplay_t;
+
+extern queue_t xOutBuf;
+extern kbEvent_t xEvent, *pEvent;
+extern kbFlags_t xFlags, *pFlags;
+extern unsigned char scanCode;
+extern ps2Port_t xPorts[PS2_PORTS], *pKbPort;
+extern uint8_t capsLock, numsLock;
+extern volatile uint8_t kbOutReq, kbLayoutReq;
+int fwMain(void);
+
+static const char *keyNames[256] = { KEYMAP(KEY_NAME) };
+static const char *layoutNames[KB_LAYOUTS] = { LAYOUTS(LAYOUT_NAME) };
+static trReplay_t tr;
+
+static double trSec(uint64_t cyc){
+   return (double)cyc / FCY;
+}
+
+static void trLog(uint64_t at, const char *fmt, ...){
+
+   va_list ap;
+
+   if(tr.quiet)
+      return;
+   printf("%12.6f  ", trSec(at));
+   va_start(ap, fmt);
+   vprintf(fmt, ap);
+   va_end(ap);
+   printf("\n");
+}
+
+/*------------------------------------------*/
+/* Fresh firmware with no keyboard on the   */
+/* bus: its echo times out, which leaves    */
+/* the port receiving                       */
+/*------------------------------------------*/
+static void trInit(uint8_t mode, uint8_t layout, uint8_t quiet){
+
+   simReset();
+   capsLock = numsLock = 0;
+   kbInitialize();
+   kbOutReq = mode;
+   kbLayoutReq = layout;
+   kbOutService();
+   memset(&tr, 0, sizeof(tr));
+   tr.base = simNow + SIM_US(1000);
+   tr.clock = tr.data = 1;
+   tr.err0 = tr.err = pKbPort->err;                                             //The echo timeouts are ours, not the capture's
+   tr.drops = pKbPort->rx.drops;
+   tr.quiet = quiet;
+}
+
+static void trAdvance(uint64_t cyc){
+   cyc += tr.base;
+   if(cyc > simNow)
+      simAdvance(cyc - simNow);
+}
+
+static void trError(uint64_t at, const char *what, uint16_t now, uint16_t *seen){
+   for(; *seen != now; (*seen)++)
+      trLog(at, "error  %s", what);
+}
+
+/*------------------------------------------*/
+/* Report what the receive path counted     */
+/* since the last edge                      */
+/*------------------------------------------*/
+static void trErrors(uint64_t at){
+   trError(at, "parity", pKbPort->err.parity, &tr.err.parity);
+   trError(at, "stop", pKbPort->err.stop, &tr.err.stop);
+   trError(at, "framing", pKbPort->err.framing, &tr.err.framing);
+   trError(at, "state", pKbPort->err.state, &tr.err.state);
+   trError(at, "ring full", pKbPort->rx.drops, &tr.drops);
+}
+
+/*------------------------------------------*/
+/* One decoded event and what it posted     */
+/*------------------------------------------*/
+static void trEvent(uint64_t at, const uint8_t *b, uint16_t n){
+
+   char text[4 * BUFSIZE + 3], *t = text;
+   char what[40];
+   uint16_t i;
+
+   tr.events++;
+   tr.posted += n;
+   if(tr.out)
+      fwrite(b, 1, n, tr.out);
+   if(tr.keep && tr.nKeep + n <= TR_OUT_MAX){
+      memcpy(tr.keep + tr.nKeep, b, n);
+      tr.nKeep += n;
+   }
+   if(tr.quiet)
+      return;
+
+   if(n){
+      *t++ = '"';
+      for(i = 0; i < n; i++)
+         if(b[i] >= 0x20 && b[i] < 0x7F && b[i] != '"' && b[i] != '\\')
+            *t++ = b[i];
+         else
+            t += sprintf(t, "\\x%02X", b[i]);
+      *t++ = '"';
+   }
+   *t = 0;
+   if(pEvent->type == KB_EV_RESP)
+      snprintf(what, sizeof(what), "resp   %02X          ", pEvent->key);
+   else
+      snprintf(what, sizeof(what), "%-6s %-11s %02X", pEvent->brk ? "break" : "make",
+               keyNames[pEvent->key] ? keyNames[pEvent->key] : "?", pEvent->mods);
+   trLog(at, "%s%s%s", what, n ? "  " : "", text);
+}
+
+/*------------------------------------------*/
+/* The main loop's keyboard block, less the */
+/* command scheduler                        */
+/*------------------------------------------*/
+static void trDrain(uint64_t at){
+
+   uint8_t b[BUFSIZE];
+   uint16_t n;
+
+   while(kbNextCode()){
+      if(tr.replies && (scanCode == KB_ACK || scanCode == KB_RSND || scanCode == KB_ECHO)){
+         tr.replies--;                                                          //kbCmdReply() takes it on the unit
+         trLog(at, "reply  %02X", scanCode);
+         continue;
+      }
+      if(kbDecode(scanCode,pEvent) == KB_EV_NONE || !tmEvent(pEvent))
+         continue;
+      kbCheckFlags();
+      if(pFlags->capsFlag || pFlags->numsFlag){
+         kbSetLocks();
+         pKbPort->cmd.tail = pKbPort->cmd.head;                                 //Its LED command is on the capture
+         pFlags->capsFlag = 0;
+         pFlags->numsFlag = 0;
+      }
+      if(pFlags->plugFlag){
+         kbPlug();
+         pKbPort->cmd.tail = pKbPort->cmd.head;                                 //So are the settings sent after a BAT
+         pFlags->plugFlag = 0;
+      }
+      kbPostCode();
+      n = qRead(&xOutBuf, b, sizeof(b));
+      trEvent(at, b, n);
+   }
+}
+
+/*------------------------------------------*/
+/* Host frame over: report it and give the  */
+/* clock back to the ISR                    */
+/*------------------------------------------*/
+static void trHostEnd(uint64_t at, uint8_t whole){
+
+   uint8_t parity = 0, i;
+
+   for(i = 0; i < 9; i++)
+      parity ^= (tr.hostShift >> i) & 1;
+   if(!whole)
+      trLog(at, "host   cut after %u clocks", tr.host - 1);
+   else
+      trLog(at, "host   %02X%s", tr.hostShift & 0xFF,
+            !parity ? "  parity" : !(tr.hostShift & 0x200) ? "  stop" : !tr.hostAck ? "  no ack" : "");
+   if(whole && tr.replies < TR_REPLIES)
+      tr.replies++;
+   tr.hostFrames++;
+   tr.host = 0;
+   trAdvance(at);
+   simDevData[0] = tr.data;
+   simDevClock[0] = tr.clock;
+   simAdvance(0);
+}
+
+/*------------------------------------------*/
+/* Host to device: the device samples data  */
+/* on the rising edges and pulls it low for */
+/* the ACK on the last clock                */
+/*------------------------------------------*/
+static void trHostEdge(uint64_t at, uint8_t fell, uint8_t rose){
+
+   uint8_t bit = tr.host - 1;
+
+   tr.hostLast = at;
+   if(fell && bit == TR_HOST_CLOCKS - 1)
+      tr.hostAck = !tr.data;
+   if(!rose)
+      return;
+   if(bit < TR_HOST_CLOCKS - 1)
+      tr.hostShift |= (uint16_t)tr.data << bit;
+   tr.host++;
+   if(bit == TR_HOST_CLOCKS - 1)
+      trHostEnd(at, 1);
+}
+
+/*------------------------------------------*/
+/* Play one change of either line at        */
+/* capture time at (cycles)                 */
+/*------------------------------------------*/
+static void trLine(uint64_t at, uint8_t clock, uint8_t data){
+
+   uint8_t fell = tr.clock && !clock;
+   uint8_t rose = !tr.clock && clock;
+
+   if(tr.host && (fell || rose) &&                                              //Device stopped clocking a host frame?
+      at - tr.hostLast > SIM_US(tr.host > 1 ? TR_HOST_GAP_US : KB_TX_TIMEOUT_US))
+      trHostEnd(tr.hostLast, 0);
+   tr.clock = clock;
+   tr.data = data;
+   tr.end = at;
+   if(tr.host){
+      trHostEdge(at, fell, rose);
+      return;
+   }
+
+   simDevData[0] = data;                                                        //Sampled by the ISR after its latency
+   if(fell){
+      tr.fallAt = at;
+      tr.edges++;
+      trAdvance(at);
+      simDevClock[0] = 0;
+      simAdvance(0);
+      trDrain(at);
+      trErrors(at);
+   }
+   else if(rose){
+      if(at - tr.fallAt < SIM_US(TR_INHIBIT_US)){                               //Only falls raise INT0, the engine sees it at the next one
+         simDevClock[0] = 1;
+         return;
+      }
+      trAdvance(at);                                                            //The unit held the bus
+      ps2Inhibit(pKbPort,1);
+      ps2Inhibit(pKbPort,0);                                                    //Drops a partial frame, as it did there
+      if(!data){                                                                //Request to send
+         tr.host = 1;
+         tr.hostShift = 0;
+         tr.hostAck = 0;
+         tr.hostLast = at;
+         return;                                                                //Clock stays low for the ISR
+      }
+      simDevClock[0] = 1;
+      simAdvance(0);
+   }
+}
+
+/*------------------------------------------*/
+/* First byte from p on that differs from   */
+/* the byte len before it. Eight bytes a    */
+/* load, four loads a pass                  */
+/*------------------------------------------*/
+static const char *trSame(const char *p, const char *end, size_t len){
+
+   uint64_t a[4], b[4], x;
+   int i;
+
+   while(end - p >= 32){
+      memcpy(a, p, 32);
+      memcpy(b, p - len, 32);
+      if((a[0] ^ b[0]) | (a[1] ^ b[1]) | (a[2] ^ b[2]) | (a[3] ^ b[3]))
+         break;
+      p += 32;
+   }
+   while(end - p >= 8){
+      memcpy(&a[0], p, 8);
+      memcpy(&b[0], p - len, 8);
+      x = a[0] ^ b[0];
+      if(x){
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+         i = __builtin_clzll(x) >> 3;
+#else
+         i = __builtin_ctzll(x) >> 3;
+#endif
+         return p + i;
+      }
+      p += 8;
+   }
+   while(p < end && *p == p[-len])
+      p++;
+   return p;
+}
+
+/*------------------------------------------*/
+/* Clock, data and time of one CSV row.     */
+/* Returns 0 for a comment or header        */
+/*------------------------------------------*/
+static int trRow(const char *p, const char *eol, int clockCol, int dataCol, int timeCol,
+                 uint8_t *clock, uint8_t *data, double *t){
+
+   int col, got = 0, want = timeCol < 0 ? 2 : 3;
+   char *e;
+
+   if(*p == ';' || *p == '#')
+      return 0;
+   for(col = 0; p < eol && got < want; col++){
+      while(p < eol && (*p == ' ' || *p == '\t'))
+         p++;
+      if(col == clockCol || col == dataCol){
+         if(p == eol || (*p != '0' && *p != '1'))
+            return 0;
+         if(col == clockCol)
+            *clock = *p - '0';
+         if(col == dataCol)
+            *data = *p - '0';
+         got += 1 + (clockCol == dataCol);
+      }
+      if(col == timeCol){
+         *t = strtod(p, &e);
+         if(e == p)
+            return 0;
+         got++;
+      }
+      p = memchr(p, ',', eol - p);
+      if(!p)
+         break;
+      p++;
+   }
+   return got == want;
+}
+
+static void trCsv(const char *p, const char *end, const trOpts_t *o){
+
+   int clockCol = atoi(o->clock), dataCol = atoi(o->data);
+   double cps = o->rate > 0 ? FCY / o->rate : 0;                                //Cycles per sample
+   uint64_t n = 0, rows;
+   size_t len = 0;
+   const char *eol, *q;
+   uint8_t clock = 1, data = 1;
+   double t = 0;
+
+   while(p < end){
+      if(len){                                                                  //Rows that repeat the one before
+         q = trSame(p, end, len);
+         rows = (q - p) / len;
+         p += rows * len;
+         n += rows;
+         if(p >= end)
+            break;
+      }
+      eol = memchr(p, '\n', end - p);
+      if(!eol)
+         eol = end;
+      if(!trRow(p, eol, clockCol, dataCol, o->timeCol, &clock, &data, &t)){
+         len = 0;
+         p = eol + 1;
+         continue;
+      }
+      if(clock != tr.clock || data != tr.data)
+         trLine(o->timeCol < 0 ? (uint64_t)(n * cps + 0.5) : (uint64_t)(t * FCY + 0.5), clock, data);
+      n++;
+      len = eol + 1 - p;
+      p = eol + 1;
+   }
+   if(o->timeCol < 0)
+      tr.end = (uint64_t)(n * cps + 0.5);
+}
+
+/*------------------------------------------*/
+/* Next whitespace separated VCD token      */
+/*------------------------------------------*/
+static const char *trToken(const char **pp, const char *end, size_t *len){
+
+   const char *p = *pp, *s;
+
+   while(p < end && *p <= ' ')
+      p++;
+   s = p;
+   while(p < end && *p > ' ')
+      p++;
+   *pp = p;
+   *len = p - s;
+   return s;
+}
+
+static int trIs(const char *s, size_t len, const char *word){
+   return len == strlen(word) && !memcmp(s, word, len);
+}
+
+static int trVcd(const char *p, const char *end, const trOpts_t *o){
+
+   char id[2][16];
+   size_t idLen[2] = {0, 0};
+   const char *s, *ref;
+   size_t len, refLen;
+   double scale = 1e-9, cpt;
+   uint64_t now = 0;
+   uint8_t level[2] = {1, 1}, pending = 0, done = 0;
+   char num[32];
+   int i, vars = 0;
+   size_t k;
+
+   while(!done){                                                                //Header, sections up to $enddefinitions
+      s = trToken(&p, end, &len);
+      if(!len)
+         return -1;
+      if(*s != '$')
+         continue;
+      if(trIs(s, len, "$timescale")){
+         num[0] = 0;
+         while((s = trToken(&p, end, &len)), len && !trIs(s, len, "$end"))
+            if(strlen(num) + len < sizeof(num))
+               strncat(num, s, len);
+         scale = strtod(num, (char **)&s);
+         if(scale <= 0)
+            scale = 1;
+         switch(*s){
+            case 'm': scale *= 1e-3; break;
+            case 'u': scale *= 1e-6; break;
+            case 'n': scale *= 1e-9; break;
+            case 'p': scale *= 1e-12; break;
+            case 'f': scale *= 1e-15; break;
+         }
+         continue;
+      }
+      if(trIs(s, len, "$var")){                                                 //$var type size id name [range] $end
+         trToken(&p, end, &len);
+         s = trToken(&p, end, &len);
+         i = trIs(s, len, "1");
+         s = trToken(&p, end, &len);
+         ref = trToken(&p, end, &refLen);
+         if(i && len < sizeof(id[0])){
+            if(o->clock ? refLen == strlen(o->clock) && !memcmp(ref, o->clock, refLen) : vars == 0)
+               i = 0;
+            else if(o->data ? refLen == strlen(o->data) && !memcmp(ref, o->data, refLen) : vars == 1)
+               i = 1;
+            else
+               i = -1;
+            if(i >= 0 && !idLen[i]){
+               memcpy(id[i], s, len);
+               idLen[i] = len;
+            }
+            vars++;
+         }
+      }
+      done = trIs(s, len, "$enddefinitions");
+      while(!trIs(s, len, "$end")){                                             //Rest of the section
+         s = trToken(&p, end, &len);
+         if(!len)
+            return -1;
+      }
+   }
+   if(!idLen[0] || !idLen[1])
+      return -1;
+   cpt = scale * FCY;                                                           //Cycles per tick
+
+   for(;;){                                                                     //Value changes
+      s = trToken(&p, end, &len);
+      if(!len)
+         break;
+      switch(*s){
+         case '#':                                                              //Changes so far happened at now
+            if(pending && (level[0] != tr.clock || level[1] != tr.data))
+               trLine((uint64_t)(now * cpt + 0.5), level[0], level[1]);
+            pending = 0;
+            for(now = 0, k = 1; k < len; k++)
+               now = now * 10 + (s[k] - '0');
+            break;
+         case '0': case '1': case 'x': case 'X': case 'z': case 'Z':
+            for(i = 0; i < 2; i++)
+               if(len - 1 == idLen[i] && !memcmp(s + 1, id[i], idLen[i])){
+                  level[i] = *s != '0';                                         //Undriven lines float high
+                  pending = 1;
+               }
+            break;
+         case 'b': case 'B': case 'r': case 'R':                                //Vector, its id is the next token
+            trToken(&p, end, &len);
+            break;
+         case '$':
+            if(trIs(s, len, "$comment"))
+               while((s = trToken(&p, end, &len)), len && !trIs(s, len, "$end"));
+            break;
+      }
+   }
+   if(pending && (level[0] != tr.clock || level[1] != tr.data))
+      trLine((uint64_t)(now * cpt + 0.5), level[0], level[1]);
+   tr.end = (uint64_t)(now * cpt + 0.5);
+   return 0;
+}
+
+/*------------------------------------------*/
+/* Map the capture and play it. Returns     */
+/* non-zero if it can not be read           */
+/*------------------------------------------*/
+static int trFile(const char *path, const trOpts_t *o, uint64_t *size){
+
+   struct stat st;
+   const char *m;
+   int fd, r = 0;
+
+   fd = open(path, O_RDONLY);
+   if(fd < 0 || fstat(fd, &st)){
+      perror(path);
+      return 1;
+   }
+   *size = st.st_size;
+   if(!st.st_size){
+      fprintf(stderr, "%s: empty\n", path);
+      close(fd);
+      return 1;
+   }
+   m = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+   close(fd);
+   if(m == MAP_FAILED){
+      perror(path);
+      return 1;
+   }
+   madvise((void *)m, st.st_size, MADV_SEQUENTIAL);
+   if(o->fmt == FMT_VCD)
+      r = trVcd(m, m + st.st_size, o);
+   else
+      trCsv(m, m + st.st_size, o);
+   munmap((void *)m, st.st_size);
+   if(r)
+      fprintf(stderr, "%s: no $enddefinitions, or no clock and data wires\n", path);
+   return r;
+}
+
+/*------------------------------------------*/
+/* -b: record the bus while the firmware    */
+/* talks to a simulated keyboard            */
+/*------------------------------------------*/
+static const uint8_t letterCodes[26] = {                                        //Set 2 make codes for a..z
+   0x1C,0x32,0x21,0x23,0x24,0x2B,0x34,0x33,0x43,0x3B,0x42,0x4B,0x3A,
+   0x31,0x44,0x4D,0x15,0x2D,0x1B,0x2C,0x3C,0x2A,0x1D,0x22,0x35,0x1A
+};
+static const uint8_t digitCodes[10] = {
+   0x45,0x16,0x1E,0x26,0x25,0x2E,0x36,0x3D,0x3E,0x46
+};
+
+static simKbd_t kbd;
+static simAgent_t recAgent;
+static trEdge_t *rec;
+static uint32_t nRec, capRec;
+static uint8_t want[TR_OUT_MAX], got[TR_OUT_MAX];
+static uint32_t nWant;
+
+static void recLines(simAgent_t *a){
+
+   uint8_t clock = simWireClock(0), data = simWireData(0);
+
+   (void)a;
+   if(nRec && rec[nRec - 1].clock == clock && rec[nRec - 1].data == data)
+      return;
+   if(nRec == capRec){
+      capRec = capRec ? capRec * 2 : 65536;
+      rec = realloc(rec, capRec * sizeof(*rec));
+   }
+   rec[nRec].at = simNow;
+   rec[nRec].clock = clock;
+   rec[nRec].data = data;
+   nRec++;
+}
+
+static void genLoop(void){
+
+   uint32_t room = TR_OUT_MAX - nWant;
+
+   nWant += qRead(&xOutBuf, want + nWant, room < BUFSIZE ? room : BUFSIZE);
+}
+
+static int genDone(void){
+   return simKbdIdle(&kbd) && !kbCmdBusy(pKbPort) && simNow - kbd.idleSince > SIM_US(5000);
+}
+
+static void genKey(uint64_t t, uint8_t code){
+   simKbdScript(&kbd, t, code, TAG_NONE);
+   simKbdScript(&kbd, t, 0xF0, TAG_NONE);
+   simKbdScript(&kbd, t, code, TAG_NONE);
+}
+
+static int generate(uint32_t keys){
+
+   uint64_t t = SIM_US(20000);                                                  //After the echo
+   uint32_t i, r;
+
+   simReset();
+   simKbdInit(&kbd, 30);
+   kbd.faultGapUs = 300;
+   recAgent.lines = recLines;
+   simAttach(&recAgent);
+   nRec = nWant = 0;
+   recLines(&recAgent);
+   capsLock = numsLock = 0;
+   for(i = 0; i < keys; i++){
+      t += SIM_US(rand() % 8000);
+      r = rand() % 100;
+      if(r < 3)                                                                 //Broken frame
+         simKbdScriptFault(&kbd, t, letterCodes[rand() % 26], TAG_NONE,
+                           SIMKBD_BAD_PARITY + rand() % 3, 3 + rand() % 7);
+      else if(r < 5)                                                            //Caps lock, the firmware sends ED xx
+         genKey(t, 0x58);
+      else if(r < 10){
+         simKbdScript(&kbd, t, 0x12, TAG_NONE);
+         genKey(t, letterCodes[rand() % 26]);
+         simKbdScript(&kbd, t, 0xF0, TAG_NONE);
+         simKbdScript(&kbd, t, 0x12, TAG_NONE);
+      }
+      else if(r < 20)
+         genKey(t, digitCodes[rand() % 10]);
+      else if(r < 25)
+         genKey(t, 0x29);
+      else
+         genKey(t, letterCodes[rand() % 26]);
+   }
+   simLoopHook = genLoop;
+   simDoneHook = genDone;
+   simDeadline = t + SIM_US(1000000);
+   return simRun(fwMain);
+}
+
+/*------------------------------------------*/
+/* Sampled CSV without a time column, rows  */
+/* at rate Hz, 10ms of idle at the end      */
+/*------------------------------------------*/
+static int writeCsv(const char *path, uint32_t rate){
+
+   static char block[4][1024 * 4];
+   FILE *f = fopen(path, "w");
+   uint64_t k = 0, next, endAt;
+   uint32_t i, lv, m;
+
+   if(!f)
+      return 1;
+   for(lv = 0; lv < 4; lv++)
+      for(i = 0; i < 1024; i++)
+         memcpy(&block[lv][i * 4], lv == 0 ? "0,0\n" : lv == 1 ? "0,1\n" : lv == 2 ? "1,0\n" : "1,1\n", 4);
+   fputs("clock,data\n", f);
+   for(i = 0; i < nRec; i++){
+      endAt = i + 1 < nRec ? rec[i + 1].at : rec[i].at + SIM_US(10000);
+      next = (endAt * rate + FCY - 1) / FCY;                                    //First sample at or past the next change
+      lv = rec[i].clock * 2 + rec[i].data;
+      for(; k < next; k += m){
+         m = next - k > 1024 ? 1024 : next - k;
+         fwrite(block[lv], 4, m, f);
+      }
+   }
+   return fclose(f);
+}
+
+static int writeVcd(const char *path){
+
+   FILE *f = fopen(path, "w");
+   uint32_t i;
+
+   if(!f)
+      return 1;
+   fprintf(f, "$date ps2trace -b $end\n$timescale 1 ns $end\n$scope module ps2 $end\n"
+              "$var wire 1 ! clock $end\n$var wire 1 \" data $end\n$upscope $end\n"
+              "$enddefinitions $end\n#0\n$dumpvars\n1!\n1\"\n$end\n");
+   for(i = 1; i < nRec; i++){
+      fprintf(f, "#%llu\n", (unsigned long long)((rec[i].at * 1000000000ULL + FCY / 2) / FCY));
+      if(rec[i].clock != rec[i - 1].clock)
+         fprintf(f, "%u!\n", rec[i].clock);
+      if(rec[i].data != rec[i - 1].data)
+         fprintf(f, "%u\"\n", rec[i].data);
+   }
+   return fclose(f);
+}
+
+static int benchOne(const char *path, const trOpts_t *o, const char *what, const kbErrCounts_t *e){
+
+   uint64_t size;
+   double t0, dt;
+   int bad;
+
+   trInit(KB_OUT_ASCII, KB_LAYOUT, 1);
+   tr.keep = got;
+   t0 = simWallSec();
+   if(trFile(path, o, &size))
+      return 1;
+   dt = simWallSec() - t0;
+   bad = tr.nKeep != nWant || memcmp(got, want, nWant) ||
+         pKbPort->err.parity - tr.err0.parity != e->parity ||
+         pKbPort->err.stop - tr.err0.stop != e->stop ||
+         pKbPort->err.framing - tr.err0.framing != e->framing ||
+         pKbPort->err.state - tr.err0.state != e->state;
+   printf("%-4s %9.1f %9.2f %8llu %6llu %9u %9.1f  %s\n", what, size / 1e6, trSec(tr.end),
+          (unsigned long long)tr.edges, (unsigned long long)tr.hostFrames, tr.nKeep,
+          size / 1e6 / dt, bad ? "MISMATCH" : "ok");
+   if(bad)
+      printf("     posted %u, want %u; parity %u stop %u framing %u, want %u %u %u\n", tr.nKeep, nWant,
+             pKbPort->err.parity - tr.err0.parity, pKbPort->err.stop - tr.err0.stop,
+             pKbPort->err.framing - tr.err0.framing, e->parity, e->stop, e->framing);
+   return bad;
+}
+
+static int bench(uint32_t keys, uint32_t rate){
+
+   char csv[] = "/tmp/ps2traceXXXXXX", vcd[] = "/tmp/ps2traceXXXXXX";
+   trOpts_t oc = {FMT_CSV, "0", "1", -1, rate}, ov = {FMT_VCD, NULL, NULL, -1, 0};
+   kbErrCounts_t e;
+   int fc, fv, bad = 0;
+   double t0 = simWallSec();
+
+   if(keys > SIMKBD_SCRIPT / 5)
+      keys = SIMKBD_SCRIPT / 5;
+   if(generate(keys)){
+      printf("timeout\n");
+      return 1;
+   }
+   e = xPorts[PS2_KBD].err;
+   fc = mkstemp(csv);
+   fv = mkstemp(vcd);
+   if(fc < 0 || fv < 0 || writeCsv(csv, rate) || writeVcd(vcd)){
+      perror("/tmp");
+      return 1;
+   }
+   close(fc);
+   close(fv);
+   printf("capture          %u keys, %u line changes, %u host bytes, %u broken frames, %u bytes posted\n",
+          keys, nRec, kbd.cmdsRcvd, kbd.faults, nWant);
+   printf("errors           parity %u  stop %u  framing %u\n", e.parity, e.stop, e.framing);
+   printf("fmt         MB  captured    edges  host    posted      MB/s\n");
+   bad |= benchOne(csv, &oc, "csv", &e);
+   bad |= benchOne(vcd, &ov, "vcd", &e);
+   unlink(csv);
+   unlink(vcd);
+   printf("wall             %.2f s\n", simWallSec() - t0);
+   return bad;
+}
+
+static void usage(const char *name){
+   fprintf(stderr, "usage: %s [-f csv|vcd] [-c clock] [-d data] [-t time_col] [-r hz]\n"
+                   "          [-u] [-l layout] [-o posted_file] [-q] capture\n"
+                   "       %s -b [-k keys] [-r hz] [-s seed]\n", name, name);
+}
+
+int main(int argc, char **argv){
+
+   trOpts_t o = {FMT_CSV, NULL, NULL, -1, 1000000};
+   const char *path, *outPath = NULL;
+   uint32_t keys = TR_BENCH_KEYS, seed = 1, rate = 0;
+   uint8_t mode = KB_OUT_ASCII, layout = KB_LAYOUT, quiet = 0;
+   int fmtSet = 0, doBench = 0, opt, i;
+   uint64_t size;
+   double t0, dt;
+
+   while((opt = getopt(argc, argv, "f:c:d:t:r:ul:o:qbk:s:")) != -1){
+      switch(opt){
+         case 'f': o.fmt = !strcmp(optarg, "vcd") ? FMT_VCD : FMT_CSV; fmtSet = 1; break;
+         case 'c': o.clock = optarg; break;
+         case 'd': o.data = optarg; break;
+         case 't': o.timeCol = atoi(optarg); break;
+         case 'r': rate = strtoul(optarg, NULL, 0); break;
+         case 'u': mode = KB_OUT_UTF8; break;
+         case 'l':
+            for(i = 0; i < KB_LAYOUTS && strcasecmp(optarg, layoutNames[i]); i++);
+            if(i == KB_LAYOUTS){
+               fprintf(stderr, "unknown layout %s\n", optarg);
+               return 2;
+            }
+            layout = i;
+            break;
+         case 'o': outPath = optarg; break;
+         case 'q': quiet = 1; break;
+         case 'b': doBench = 1; break;
+         case 'k': keys = strtoul(optarg, NULL, 0); break;
+         case 's': seed = strtoul(optarg, NULL, 0); break;
+         default:
+            usage(argv[0]);
+            return 2;
+      }
+   }
+   srand(seed);
+   if(doBench)
+      return bench(keys, rate ? rate : TR_BENCH_RATE);
+   if(optind != argc - 1){
+      usage(argv[0]);
+      return 2;
+   }
+   path = argv[optind];
+   if(!fmtSet)
+      o.fmt = strlen(path) > 4 && !strcasecmp(path + strlen(path) - 4, ".vcd") ? FMT_VCD : FMT_CSV;
+   if(o.fmt == FMT_CSV){
+      if(!o.clock)
+         o.clock = "0";
+      if(!o.data)
+         o.data = "1";
+   }
+   if(rate)
+      o.rate = rate;
+
+   trInit(mode, layout, quiet);
+   if(outPath && !(tr.out = fopen(outPath, "wb"))){
+      perror(outPath);
+      return 1;
+   }
+   t0 = simWallSec();
+   if(trFile(path, &o, &size))
+      return 1;
+   dt = simWallSec() - t0;
+   if(tr.host)
+      trHostEnd(tr.hostLast, 0);
+   if(tr.out)
+      fclose(tr.out);
+
+   printf("input            %s, %s, %.1f MB, %.6f s captured\n", path, o.fmt == FMT_VCD ? "vcd" : "csv",
+          size / 1e6, trSec(tr.end));
+   printf("edges            %llu falling clock edges to INT0, %llu host frames\n",
+          (unsigned long long)tr.edges, (unsigned long long)tr.hostFrames);
+   printf("events           %llu, %llu bytes posted\n", (unsigned long long)tr.events,
+          (unsigned long long)tr.posted);
+   printf("errors           parity %u  stop %u  framing %u  state %u  ring full %u\n",
+          pKbPort->err.parity - tr.err0.parity, pKbPort->err.stop - tr.err0.stop,
+          pKbPort->err.framing - tr.err0.framing, pKbPort->err.state - tr.err0.state,
+          pKbPort->rx.drops);
+   printf("decode           %.3f s, %.1f MB/s\n", dt, size / 1e6 / dt);
+   return 0;
+}
@@ -0,0 +1,361 @@
+/*----------------------------------------------------------------------------*/
+/* Typematic repeat, by the keyboard and by the firmware (HOST_OP_REPEAT)     */
+/*                                                                            */
+/* Each case uploads a tmConfig_t record over SPI, checks the CMD_TYPEMATIC   */
+/* argument the keyboard ends up with, then holds a key for a while. The      */
+/* keyboard model repeats the key it made last at the rate it was given,      */
+/* until its break, the way a set 2 keyboard does. The harness takes every    */
+/* character off the output queue with the time it was posted and counts      */
+/* them against the delay and period asked for; for TM_LOCAL it also checks   */
+/* the time from the make to the first repeat and between repeats.            */
+/*                                                                            */
+/* Cases: both modes at the keyboard's default and fastest rates, local       */
+/* repeats well beyond 30 per second, an E0 key, a key taken out of keys[], a */
+/* second key taking the repeat over, a modifier stopping it, a record that   */
+/* only switches the mode, and a BAT from a keyboard plugged in again, after  */
+/* which the firmware must slow it down again. Reports the frames the         */
+/* keyboard sent per second held in each case.                                */
+/*                                                                            */
+/* usage: repeatsim [-v]                                                      */
+/*----------------------------------------------------------------------------*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "sim.h"
+#include "simkbd.h"
+#include "simspi.h"
+#include "ps2kb.h"
+#include "host.h"
+#include "typematic.h"
+
+#define SCK_HZ      1000000
+#define GAP_US      10
+#define SETTLE_US   60000                                                       //After an upload, room for CMD_TYPEMATIC and its ACKs
+#define QUIET_US    100000                                                      //After the release, then count
+#define ACT_MS      1000                                                        //When a case's action happens
+#define JITTER_US   1500                                                        //Local repeats: most a repeat may be off, one frame plus a pass
+#define MAX_OUT     2048
+
+#define S_A         0x1C                                                        //Set 2 make codes
+#define S_B         0x32
+#define S_LSHIFT    0x12
+#define S_LEFT      0x6B                                                        //E0 prefixed
+
+enum{
+    ACT_NONE,
+    ACT_SECOND,                                                                 //Press B at ACT_MS, release it at twice that
+    ACT_SHIFT,                                                                  //Press left shift at ACT_MS
+    ACT_BAT                                                                     //Keyboard sends BAT at ACT_MS, back at its defaults
+};
+
+enum{
+    PH_BUSY,
+    PH_UPLOAD,
+    PH_SETTLE,
+    PH_HOLD,
+    PH_QUIET,
+    PH_DONE
+};
+
+typedef struct{
+    const char *what;
+    uint8_t  len;                                                               //Bytes of the record sent
+    tmConfig_t cfg;                                                             //mode, spare, delay, period
+    uint8_t  off;                                                               //Keycode cleared in keys[], 0 = none
+    uint8_t  code;                                                              //Key held
+    uint8_t  ext;
+    uint8_t  act;                                                               //ACT_xxx
+    uint32_t holdMs;
+    uint8_t  arg;                                                               //CMD_TYPEMATIC argument the keyboard must have
+    uint8_t  ch;                                                                //Character the key posts
+    uint32_t want;                                                              //Characters of the held key
+    uint32_t want2;                                                             //Of B (ACT_SECOND)
+}case_t;
+
+static case_t cases[] = {
+   {"keyboard 10.9/s", 6, {TM_KEYBOARD, 0, 500, 92},  0, S_A, 0, ACT_NONE, 3000, 0x2B, 'a'},
+   {"keyboard 30/s",   6, {TM_KEYBOARD, 0, 250, 33},  0, S_A, 0, ACT_NONE, 3000, 0x00, 'a'},
+   {"local 30/s",      6, {TM_LOCAL, 0, 250, 33},     0, S_A, 0, ACT_NONE, 3000, 0x7F, 'a'},
+   {"local 100/s",     6, {TM_LOCAL, 0, 250, 10},     0, S_A, 0, ACT_NONE, 3000, 0x7F, 'a'},
+   {"local 200/s",     6, {TM_LOCAL, 0, 200, 5},      0, S_A, 0, ACT_NONE, 3000, 0x7F, 'a'},
+   {"local E0 key",    6, {TM_LOCAL, 0, 300, 20},     0, S_LEFT, 1, ACT_NONE, 2000, 0x7F, ARROW_LT},
+   {"local second key",6, {TM_LOCAL, 0, 250, 25},     0, S_A, 0, ACT_SECOND, 3000, 0x7F, 'a'},
+   {"local shift",     6, {TM_LOCAL, 0, 250, 25},     0, S_A, 0, ACT_SHIFT, 3000, 0x7F, 'a'},
+   {"mode only",       1, {TM_KEYBOARD},              0, S_A, 0, ACT_NONE, 2000, 0x00, 'a'},
+   {"local after BAT", 1, {TM_LOCAL},                 0, S_A, 0, ACT_BAT, 3000, 0x7F, 'a'},
+   {"local key off",   6, {TM_LOCAL, 0, 250, 20}, KEY_A, S_A, 0, ACT_NONE, 2000, 0x7F, 'a'},
+};                                                                              //Key off last, later records would keep it off
+#define NCASES (sizeof(cases) / sizeof(cases[0]))
+
+extern queue_t xOutBuf;
+extern tmState_t xTypematic;
+int fwMain(void);
+
+static simKbd_t kbd;
+static uint8_t phase, idx, verbose;
+static uint64_t t0, phaseAt, kbRepAt;
+static uint8_t kbHeld, kbHeldExt;                                               //Key the keyboard model repeats, 0 = none
+static uint8_t out[MAX_OUT];
+static uint64_t outAt[MAX_OUT];
+static uint32_t nOut, frames0, bad;
+static uint32_t dropped0;
+static uint8_t acted;                                                           //Action done, 2 = B released again
+
+/*------------------------------------------*/
+/* Keyboard model: delay and period of its  */
+/* typematic byte                           */
+/*------------------------------------------*/
+static uint64_t kbDelay(void){
+   return SIM_US(((kbd.typematic >> 5 & 3) + 1) * 250000);
+}
+
+static uint64_t kbPeriod(void){
+   return SIM_US((uint32_t)((8 + (kbd.typematic & 7)) << (kbd.typematic >> 3 & 3)) * 4170);
+}
+
+static void script(uint8_t code, uint8_t ext, uint8_t brk){
+   if(ext)
+      simKbdScript(&kbd, simNow, 0xE0, 0);
+   if(brk)
+      simKbdScript(&kbd, simNow, 0xF0, 0);
+   simKbdScript(&kbd, simNow, code, 0);
+}
+
+static void make(uint8_t code, uint8_t ext){
+   script(code, ext, 0);
+   kbHeld = code;                                                               //The keyboard repeats the key made last
+   kbHeldExt = ext;
+   kbRepAt = simNow + kbDelay();
+}
+
+static void release(uint8_t code, uint8_t ext){
+   script(code, ext, 1);
+   if(kbHeld == code)
+      kbHeld = 0;
+}
+
+/*------------------------------------------*/
+/* Repeats in the first ms after a make     */
+/*------------------------------------------*/
+static uint32_t reps(uint32_t ms, uint16_t delay, uint16_t period){
+   return ms < delay ? 0 : (ms - delay) / period + 1;
+}
+
+/*------------------------------------------*/
+/* Local repeats of ch: first one delay     */
+/* after the make, then every period. Worst */
+/* error in microseconds                    */
+/*------------------------------------------*/
+static uint32_t jitter(uint8_t ch, uint16_t delay, uint16_t period){
+
+   uint64_t last = 0, want;
+   uint32_t i, n = 0, worst = 0, err;
+
+   for(i = 0; i < nOut; i++){
+      if(out[i] != ch)
+         continue;
+      if(n){
+         want = SIM_US((uint32_t)(n == 1 ? delay : period) * 1000);
+         err = (uint32_t)SIM_TO_US(outAt[i] - last > want ? outAt[i] - last - want : want - (outAt[i] - last));
+         if(err > worst)
+            worst = err;
+      }
+      last = outAt[i];
+      n++;
+   }
+   return worst;
+}
+
+static uint32_t count(uint8_t ch){
+
+   uint32_t i, n = 0;
+
+   for(i = 0; i < nOut; i++)
+      n += out[i] == ch;
+   return n;
+}
+
+static uint8_t near(uint32_t got, uint32_t want){
+   return got + 1 >= want && got <= want + 1;
+}
+
+/*------------------------------------------*/
+/* Case over: compare and report            */
+/*------------------------------------------*/
+static void check(const case_t *c){
+
+   uint32_t got = count(c->ch), got2 = count('b'), bat = c->act == ACT_BAT ? count(PLUG_OK) : 0;
+   uint32_t other = nOut - got - got2 - bat;
+   uint32_t frames = kbd.framesSent - frames0;
+   uint32_t worst = 0, i;
+   uint8_t ok;
+
+   ok = kbd.typematic == c->arg && near(got, c->want) && !other &&
+        (c->act == ACT_SECOND ? near(got2, c->want2) : !got2);
+   if(xTypematic.cfg.mode == TM_LOCAL && c->want > 1){
+      worst = jitter(c->ch, xTypematic.cfg.delay, xTypematic.cfg.period);
+      if(worst > JITTER_US)
+         ok = 0;
+   }
+   printf("%-17s %02X   %6u %8.1f %6u %6u %6u %8u %s\n", c->what, kbd.typematic, frames,
+          frames * 1000.0 / c->holdMs, got + got2, c->want + c->want2,
+          xTypematic.dropped - dropped0, worst, ok ? "ok" : "FAIL");
+   if(!ok)
+      bad++;
+   for(i = 0; verbose && i < nOut; i++)
+      printf("  %02X at %.1f ms\n", out[i], SIM_TO_US(outAt[i] - t0) / 1000);
+}
+
+/*------------------------------------------*/
+/* Expected counts, from what was uploaded  */
+/*------------------------------------------*/
+static void expect(case_t *c){
+
+   const tmConfig_t *m = &xTypematic.cfg;
+   uint32_t hold = c->holdMs;
+
+   if(m->mode != TM_LOCAL){                                                     //What the keyboard model will send
+      c->want = 1 + reps(hold, (uint16_t)(kbDelay() / SIM_US(1000)),
+                         (uint16_t)(kbPeriod() / SIM_US(1000)));
+      return;
+   }
+   if(c->off)
+      c->want = 1;
+   else if(c->act == ACT_SECOND){
+      c->want = 1 + reps(ACT_MS, m->delay, m->period);
+      c->want2 = 1 + reps(ACT_MS, m->delay, m->period);
+   }
+   else if(c->act == ACT_SHIFT || c->act == ACT_BAT)
+      c->want = 1 + reps(ACT_MS, m->delay, m->period);
+   else
+      c->want = 1 + reps(hold, m->delay, m->period);
+}
+
+static void loopHook(void){
+
+   case_t *c = &cases[idx];
+   uint8_t rec[sizeof(tmConfig_t)], got, i;
+   uint16_t n;
+
+   n = qRead(&xOutBuf, &out[nOut], MAX_OUT - nOut);                             //Take the characters as they are posted
+   for(i = 0; i < n; i++)
+      outAt[nOut++] = simNow;
+
+   switch(phase){
+      case PH_BUSY:                                                             //Second record before the first is applied
+         memcpy(rec, &xTypematic.cfg, sizeof(rec));
+         simSpiUpload(HOST_OP_REPEAT, rec, sizeof(rec), SCK_HZ, GAP_US);
+         got = simSpiUpload(HOST_OP_REPEAT, rec, sizeof(rec), SCK_HZ, GAP_US);
+         if(got != (TM_KEYBOARD | TM_BUSY)){
+            printf("busy             got %02X\n", got);
+            bad++;
+         }
+         printf("case              arg  frames frames/s  chars   want  dropped  jit us\n");
+         phase = PH_UPLOAD;
+         return;
+
+      case PH_UPLOAD:
+         memcpy(rec, &c->cfg, sizeof(rec));
+         if(c->off){
+            memcpy(rec, &xTypematic.cfg, sizeof(rec));
+            memcpy(rec, &c->cfg, 6);
+            rec[6 + (c->off >> 3)] &= ~(1 << (c->off & 7));
+         }
+         simSpiUpload(HOST_OP_REPEAT, rec, c->off ? sizeof(rec) : c->len, SCK_HZ, GAP_US);
+         phase = PH_SETTLE;
+         phaseAt = simNow;
+         return;
+
+      case PH_SETTLE:
+         if(simNow - phaseAt < SIM_US(SETTLE_US))
+            return;
+         got = simSpiUpload(HOST_OP_REPEAT, NULL, 0, SCK_HZ, GAP_US);
+         if(got != xTypematic.cfg.mode){
+            printf("%-17s mode %02X\n", c->what, got);
+            bad++;
+         }
+         expect(c);
+         nOut = 0;
+         frames0 = kbd.framesSent;
+         dropped0 = xTypematic.dropped;
+         acted = 0;
+         t0 = simNow;
+         make(c->code, c->ext);
+         phase = PH_HOLD;
+         return;
+
+      case PH_HOLD:
+         if(kbHeld && simNow >= kbRepAt){                                       //Keyboard model repeat
+            script(kbHeld, kbHeldExt, 0);
+            kbRepAt += kbPeriod();
+         }
+         if(c->act && !acted && simNow >= t0 + SIM_US(ACT_MS * 1000)){
+            acted = 1;
+            if(c->act == ACT_SECOND)
+               make(S_B, 0);
+            else if(c->act == ACT_SHIFT)
+               make(S_LSHIFT, 0);
+            else{
+               simKbdScript(&kbd, simNow, KB_BAT, 0);
+               kbd.typematic = TM_ARG_RESET;
+               kbHeld = 0;                                                      //Keyboard came back with nothing held
+            }
+         }
+         if(c->act == ACT_SECOND && acted == 1 && simNow >= t0 + SIM_US(2 * ACT_MS * 1000)){
+            release(S_B, 0);
+            acted = 2;
+         }
+         if(simNow < t0 + SIM_US(c->holdMs * 1000))
+            return;
+         release(c->code, c->ext);
+         if(c->act == ACT_SHIFT)
+            release(S_LSHIFT, 0);
+         phase = PH_QUIET;
+         phaseAt = simNow;
+         return;
+
+      case PH_QUIET:
+         if(!simKbdIdle(&kbd) || simNow - phaseAt < SIM_US(QUIET_US))
+            return;
+         check(c);
+         if(++idx == NCASES)
+            phase = PH_DONE;
+         else
+            phase = PH_UPLOAD;
+         return;
+   }
+}
+
+static int doneHook(void){
+   return phase == PH_DONE;
+}
+
+int main(int argc, char **argv){
+
+   int opt;
+
+   while((opt = getopt(argc, argv, "v")) != -1){
+      switch(opt){
+         case 'v': verbose = 1; break;
+         default:
+            fprintf(stderr, "usage: %s [-v]\n", argv[0]);
+            return 2;
+      }
+   }
+
+   simReset();
+   simKbdInit(&kbd, 40);
+   kbd.typematic = TM_ARG_RESET;
+   simLoopHook = loopHook;
+   simDoneHook = doneHook;
+   simDeadline = SIM_US(60000000);
+   if(simRun(fwMain)){
+      printf("timeout\n");
+      return 1;
+   }
+   printf("repeats          %u posted by the firmware, %u skipped, %u keyboard repeats dropped\n",
+          xTypematic.repeats, xTypematic.skipped, xTypematic.dropped);
+   printf("mismatches       %u\n", bad);
+   return bad != 0;
+}
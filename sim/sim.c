@@ -0,0 +1,464 @@
+/*----------------------------------------------------------------------------*/
+/* Virtual-time engine for the host build of the firmware                     */
+/*                                                                            */
+/* The firmware only ever sees time pass through the HAL: every pin read,     */
+/* delay, busy-wait pass and main loop pass charges a fixed number of cycles. */
+/* While time advances, due agent events are fired in order, the bus lines    */
+/* are re-resolved and a falling clock edge latches INT0 or INT1 for bus 0 or */
+/* 1 (an SS1 edge latches CN). Enabled sources are dispatched synchronously   */
+/* by priority like the PIC24 interrupt controller: an ISR is only preempted  */
+/* by a higher level, and a flag raised again before the ISR clears it is     */
+/* lost exactly as it would be on the part. Idle skips ahead from agent event */
+/* to agent event until an enabled flag is up.                                */
+/*----------------------------------------------------------------------------*/
+#include <stdlib.h>
+#include <string.h>
+#include <setjmp.h>
+#include <time.h>
+#include "sim.h"
+
+/*------------------------------------------*/
+/* Global variables                         */
+/*------------------------------------------*/
+uint64_t simNow;
+uint64_t simDeadline = SIM_NEVER;
+uint8_t  simDataLat[SIM_BUSES] = {1, 1};
+uint8_t  simClockLat[SIM_BUSES] = {1, 1};
+uint8_t  simNotifyLat;
+uint8_t  simPinCfg;
+uint8_t  simDevClock[SIM_BUSES] = {1, 1};
+uint8_t  simDevData[SIM_BUSES] = {1, 1};
+uint64_t simNotifyRise;
+uint8_t  simSsLat = 1;
+simIrq_t simIrq[SIM_IRQ_COUNT];
+uint32_t simSpiUnderruns;
+uint32_t simSpiOverruns;
+void (*simLoopHook)(void);
+int  (*simDoneHook)(void);
+
+static uint8_t wireClock[SIM_BUSES] = {1, 1};                                   //Resolved bus levels
+static uint8_t wireData[SIM_BUSES] = {1, 1};
+static uint8_t curIpl;                                                          //Level of the running ISR, 0 in the main loop
+static uint8_t lastNotify;
+static uint8_t lastSs = 1;
+static uint8_t spiRx;                                                           //SPI1BUF receive side
+static uint8_t spiTx;                                                           //SPI1BUF transmit side
+static uint8_t spiTxFull;
+static simAgent_t *agents;
+static simAgent_t tmrAgent[SIM_BUSES];                                          //Timer1 and Timer4 period match
+static uint64_t tmrPeriod[SIM_BUSES];
+static const int tmrIrq[SIM_BUSES] = {SIM_IRQ_T1, SIM_IRQ_T4};
+static const int edgeIrq[SIM_BUSES] = {SIM_IRQ_INT0, SIM_IRQ_INT1};
+static jmp_buf runJmp;
+static uint8_t running;
+
+static void tmrFire(simAgent_t *a){                                             //Free running, rolls over at PRx
+
+   int n = a - tmrAgent;
+
+   simIrqRaise(tmrIrq[n]);
+   simSchedule(a, simNow + tmrPeriod[n]);
+}
+
+/*------------------------------------------*/
+/* Second port sources for firmware built   */
+/* with one port; never enabled there       */
+/*------------------------------------------*/
+__attribute__((weak)) void _INT1Interrupt(void){
+}
+
+__attribute__((weak)) void _T4Interrupt(void){
+}
+
+void simReset(void){
+
+   int n;
+
+   simNow = 0;
+   simDeadline = SIM_NEVER;
+   for(n = 0; n < SIM_BUSES; n++){
+      simDataLat[n] = simClockLat[n] = 1;
+      simDevData[n] = simDevClock[n] = 1;
+      wireClock[n] = wireData[n] = 1;
+   }
+   simNotifyLat = lastNotify = 0;
+   simNotifyRise = 0;
+   simSsLat = lastSs = 1;
+   spiRx = spiTx = spiTxFull = 0;
+   simSpiUnderruns = simSpiOverruns = 0;
+   memset(simIrq, 0, sizeof(simIrq));
+   simIrq[SIM_IRQ_INT0].ipl = 4;                                                //Reset priority, SPI/CN get theirs in halSpiSetup()
+   simIrq[SIM_IRQ_INT0].isr = _INT0Interrupt;
+   simIrq[SIM_IRQ_T1].ipl = 4;
+   simIrq[SIM_IRQ_T1].isr = _T1Interrupt;
+   simIrq[SIM_IRQ_SPI1].ipl = 4;
+   simIrq[SIM_IRQ_SPI1].isr = _SPI1Interrupt;
+   simIrq[SIM_IRQ_CN].ipl = 4;
+   simIrq[SIM_IRQ_CN].isr = _CNInterrupt;
+   simIrq[SIM_IRQ_INT1].ipl = 4;
+   simIrq[SIM_IRQ_INT1].isr = _INT1Interrupt;
+   simIrq[SIM_IRQ_T4].ipl = 4;
+   simIrq[SIM_IRQ_T4].isr = _T4Interrupt;
+   curIpl = 0;
+   simLoopHook = NULL;
+   simDoneHook = NULL;
+   agents = NULL;
+   for(n = 0; n < SIM_BUSES; n++){
+      tmrAgent[n].fire = tmrFire;
+      simAttach(&tmrAgent[n]);
+   }
+}
+
+void simAttach(simAgent_t *agent){
+   agent->at = SIM_NEVER;
+   agent->next = agents;
+   agents = agent;
+}
+
+void simSchedule(simAgent_t *agent, uint64_t at){
+   agent->at = at;
+}
+
+uint8_t simWireClock(uint8_t bus){
+   return wireClock[bus];
+}
+
+uint8_t simWireData(uint8_t bus){
+   return wireData[bus];
+}
+
+void simIrqRaise(int irq){
+   if(!simIrq[irq].flag)                                                        //A second raise before dispatch is lost
+      simIrq[irq].raisedAt = simNow;
+   simIrq[irq].flag = 1;
+}
+
+/*------------------------------------------*/
+/* Resolve the open-collector buses, latch  */
+/* INTx on a falling clock edge and CN on   */
+/* an SS1 edge, and tell the agents the     */
+/* lines (or KB_FLAG) moved                 */
+/*------------------------------------------*/
+static void simLines(void){
+
+   simAgent_t *a;
+   uint8_t clock, data;
+   uint8_t moved = 0;
+   int n;
+
+   for(n = 0; n < SIM_BUSES; n++){
+      clock = simClockLat[n] & simDevClock[n];
+      data = simDataLat[n] & simDevData[n];
+      if(clock != wireClock[n] || data != wireData[n]){
+         if(wireClock[n] && !clock)
+            simIrqRaise(edgeIrq[n]);
+         wireClock[n] = clock;
+         wireData[n] = data;
+         moved = 1;
+      }
+   }
+   if(simSsLat != lastSs){
+      lastSs = simSsLat;
+      simIrqRaise(SIM_IRQ_CN);
+   }
+   if(simNotifyLat != lastNotify){
+      if(simNotifyLat)
+         simNotifyRise = simNow;
+      lastNotify = simNotifyLat;
+      moved = 1;
+   }
+   if(!moved)
+      return;
+   for(a = agents; a; a = a->next)
+      if(a->lines)
+         a->lines(a);
+}
+
+/*------------------------------------------*/
+/* Run every pending, enabled source above  */
+/* the current level, highest first         */
+/*------------------------------------------*/
+static void simDispatch(void){
+
+   int i, best;
+   uint8_t saved;
+   uint64_t start, lat;
+
+   for(;;){
+      best = -1;
+      for(i = 0; i < SIM_IRQ_COUNT; i++)
+         if(simIrq[i].ie && simIrq[i].flag && simIrq[i].ipl > curIpl
+               && (best < 0 || simIrq[i].ipl > simIrq[best].ipl))
+            best = i;
+      if(best < 0)
+         return;
+      saved = curIpl;
+      curIpl = simIrq[best].ipl;
+      start = simNow;
+      lat = start - simIrq[best].raisedAt;
+      if(lat > simIrq[best].latMax)
+         simIrq[best].latMax = lat;
+      simAdvance(SIM_CYC_ISR_ENTRY);
+      simIrq[best].isr();
+      simAdvance(SIM_CYC_ISR_EXIT);
+      if(simNow - start > simIrq[best].cycMax)
+         simIrq[best].cycMax = simNow - start;
+      simIrq[best].cycles += simNow - start;
+      simIrq[best].count++;
+      curIpl = saved;
+   }
+}
+
+void simAdvance(uint64_t cycles){
+
+   uint64_t end = simNow + cycles;
+   simAgent_t *a, *due;
+
+   simLines();
+   simDispatch();
+   for(;;){
+      due = NULL;
+      for(a = agents; a; a = a->next)
+         if(a->at <= end && (!due || a->at < due->at))
+            due = a;
+      if(!due)
+         break;
+      if(due->at > simNow)
+         simNow = due->at;
+      due->at = SIM_NEVER;
+      due->fire(due);
+      simLines();
+      simDispatch();
+   }
+   if(simNow < end)
+      simNow = end;
+   simLines();
+   simDispatch();
+}
+
+static void simCheckDeadline(void){
+   if(running && simNow > simDeadline)
+      longjmp(runJmp, 1);
+}
+
+int simRun(int (*entry)(void)){
+
+   if(setjmp(runJmp)){
+      running = 0;
+      return 1;
+   }
+   running = 1;
+   entry();
+   running = 0;
+   return 0;
+}
+
+/*------------------------------------------*/
+/* HAL entry points                         */
+/*------------------------------------------*/
+uint8_t simReadData(uint8_t bus){
+   uint8_t v = simDataLat[bus] & simDevData[bus];
+   simAdvance(SIM_CYC_PIN);
+   return v;
+}
+
+uint8_t simReadClock(uint8_t bus){
+   uint8_t v = simClockLat[bus] & simDevClock[bus];
+   simAdvance(SIM_CYC_PIN);
+   return v;
+}
+
+void simIrqEnable(int irq, uint8_t on){
+   simIrq[irq].ie = on;
+}
+
+void simIrqClear(int irq){
+   simIrq[irq].flag = 0;
+}
+
+void halTimebaseSetup(void){                                                    //No wrap interrupt, a run is shorter than a wrap
+}
+
+uint32_t halNow(void){                                                          //Timer2/3 runs at FCY, same unit as simNow
+   return (uint32_t)simNow;
+}
+
+void halPs2Setup(uint8_t n){                                                    //Lines released, INTx and timer levels set in simReset()
+   simDataLat[n] = simClockLat[n] = 1;
+}
+
+void simTmrStart(uint8_t n, uint16_t ticks){
+   tmrPeriod[n] = (uint64_t)(ticks ? ticks : 1) * 8;                            //1:8 prescale
+   simIrq[tmrIrq[n]].flag = 0;
+   simIrq[tmrIrq[n]].ie = 1;
+   simSchedule(&tmrAgent[n], simNow + tmrPeriod[n]);
+}
+
+void simTmrStop(uint8_t n){
+   simIrq[tmrIrq[n]].ie = 0;
+   simSchedule(&tmrAgent[n], SIM_NEVER);
+}
+
+/*------------------------------------------*/
+/* SPI1 slave peripheral. The master side   */
+/* swaps one byte per call; the slave sees  */
+/* SPI1BUF and SPI1IF                       */
+/*------------------------------------------*/
+void halSpiSetup(void){
+   simIrq[SIM_IRQ_SPI1].ipl = 3;
+   simIrq[SIM_IRQ_CN].ipl = 3;
+   simIrq[SIM_IRQ_SPI1].ie = 1;
+   simIrq[SIM_IRQ_CN].ie = 1;
+}
+
+uint8_t simSpiRead(void){
+   uint8_t v = spiRx;
+   simAdvance(SIM_CYC_PIN);
+   return v;
+}
+
+void simSpiWrite(uint8_t b){
+   simAdvance(SIM_CYC_PIN);
+   spiTx = b;
+   spiTxFull = 1;
+}
+
+void simSpiFlush(void){
+   spiTxFull = 0;
+}
+
+uint8_t simSpiExchange(uint8_t mosi){
+
+   uint8_t miso = 0xFF;
+
+   if(spiTxFull)
+      miso = spiTx;
+   else
+      simSpiUnderruns++;
+   spiTxFull = 0;
+   if(simIrq[SIM_IRQ_SPI1].flag)
+      simSpiOverruns++;
+   spiRx = mosi;
+   simIrqRaise(SIM_IRQ_SPI1);
+   return miso;
+}
+
+void simDelayUs(uint32_t us){
+   simAdvance(SIM_US(us));
+   simCheckDeadline();
+}
+
+void simSpin(void){
+   simAdvance(SIM_CYC_SPIN);
+   simCheckDeadline();
+}
+
+void simCost(uint32_t cyc){
+   simAdvance(cyc);
+}
+
+/*------------------------------------------*/
+/* Idle: the CPU priority is raised around  */
+/* the check and PWRSAV like on the part    */
+/*------------------------------------------*/
+uint8_t simIplRaise(uint8_t ipl){
+
+   uint8_t old = curIpl;
+
+   curIpl = ipl;
+   return old;
+}
+
+void simIplRestore(uint8_t ipl){
+   curIpl = ipl;
+   simAdvance(0);                                                               //Run what came in while masked
+}
+
+static uint8_t simWake(void){
+
+   int i;
+
+   for(i = 0; i < SIM_IRQ_COUNT; i++)
+      if(simIrq[i].ie && simIrq[i].flag && simIrq[i].ipl)
+         return 1;
+   return 0;
+}
+
+/*------------------------------------------*/
+/* PWRSAV #1: skip from agent event to      */
+/* agent event until an enabled flag is up. */
+/* The loop hook stands in for main loop    */
+/* code (the master, firmware calls), so a  */
+/* nap with one set ends after              */
+/* SIM_IDLE_HOOK_US                         */
+/*------------------------------------------*/
+void simIdle(void){
+
+   simAgent_t *a;
+   uint64_t next, slice;
+
+   slice = simNow + SIM_US(SIM_IDLE_HOOK_US);
+   while(!simWake()){
+      next = slice;
+      for(a = agents; a; a = a->next)
+         if(a->at < next)
+            next = a->at;
+      simAdvance(next > simNow ? next - simNow : 0);
+      if(simNow < slice)
+         continue;
+      simCheckDeadline();
+      if(simLoopHook || (simDoneHook && simDoneHook()))
+         return;
+      slice = simNow + SIM_US(SIM_IDLE_HOOK_US);
+   }
+}
+
+int simRunning(void){
+
+   simAdvance(SIM_CYC_LOOP);
+   if(simLoopHook)
+      simLoopHook();
+   simCheckDeadline();
+   return !(simDoneHook && simDoneHook());
+}
+
+void SetUnusedPins(void){                                                       //sup.c stand-in, no spare pins on the host
+}
+
+/*------------------------------------------*/
+/* Statistics helpers                       */
+/*------------------------------------------*/
+void simStatAdd(simStat_t *st, uint32_t v){
+   if(st->n == st->cap){
+      st->cap = st->cap ? st->cap * 2 : 1024;
+      st->v = realloc(st->v, st->cap * sizeof(*st->v));
+   }
+   st->v[st->n++] = v;
+}
+
+static int cmpU32(const void *a, const void *b){
+   uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+   return (x > y) - (x < y);
+}
+
+uint32_t simStatPct(simStat_t *st, double pct){
+
+   uint32_t i;
+
+   if(!st->n)
+      return 0;
+   qsort(st->v, st->n, sizeof(*st->v), cmpU32);
+   i = (uint32_t)(pct / 100.0 * (st->n - 1) + 0.5);
+   return st->v[i];
+}
+
+void simStatFree(simStat_t *st){
+   free(st->v);
+   memset(st, 0, sizeof(*st));
+}
+
+double simWallSec(void){
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
@@ -0,0 +1,84 @@
+/*
+ * File:   sim.h
+ *
+ * Virtual-time engine for running the firmware on a workstation. Time is
+ * counted in instruction cycles (FCY). Simulated devices are "agents" that
+ * schedule their own next event and drive the open-collector bus lines; the
+ * engine resolves the wired-AND of host and device drivers on each PS2 bus,
+ * detects falling clock edges for INT0/INT1, slave select edges for CN and
+ * dispatches the firmware ISRs by priority, letting a higher one preempt a
+ * lower one.
+ */
+
+#ifndef SIM_H
+#define	SIM_H
+
+#include <stdint.h>
+#include "hal.h"
+
+#define SIM_CYC_PER_US      (FCY / 1000000UL)
+#define SIM_US(us)          ((uint64_t)(us) * SIM_CYC_PER_US)
+#define SIM_TO_US(cyc)      ((double)(cyc) / SIM_CYC_PER_US)
+#define SIM_NEVER           UINT64_MAX
+
+//Cycle costs charged to the firmware
+#define SIM_CYC_PIN         1                                                   //Port read
+#define SIM_CYC_SPIN        3                                                   //One pass of a busy-wait loop
+#define SIM_CYC_LOOP        8                                                   //One pass of the main loop
+#define SIM_CYC_ISR_ENTRY   14                                                  //Interrupt latency and context save
+#define SIM_CYC_ISR_EXIT    10                                                  //Context restore and retfie
+
+#define SIM_IDLE_HOOK_US    20                                                  //Longest nap with a simLoopHook set
+
+typedef struct simAgent{
+    uint64_t at;                                                                //Next event time, SIM_NEVER if none
+    void (*fire)(struct simAgent *);                                            //Event handler
+    void (*lines)(struct simAgent *);                                           //Bus line change handler (optional)
+    struct simAgent *next;
+}simAgent_t;
+
+typedef struct{
+    uint8_t  ie;                                                                //Enable
+    uint8_t  flag;                                                              //Pending
+    uint8_t  ipl;                                                               //Priority, higher preempts lower
+    void   (*isr)(void);
+    uint64_t count;                                                             //Dispatches
+    uint64_t cycles;                                                            //Cycles spent in the ISR, nested ones included
+    uint64_t cycMax;                                                            //Longest single dispatch, nested ones included
+    uint64_t raisedAt;                                                          //Time the pending flag was set
+    uint64_t latMax;                                                            //Longest flag to dispatch delay
+}simIrq_t;
+
+typedef struct{                                                                 //Sample set for percentiles
+    uint32_t *v;
+    uint32_t n;
+    uint32_t cap;
+}simStat_t;
+
+extern uint64_t simNow;                                                         //Current virtual time in cycles
+extern uint64_t simDeadline;                                                    //Abort the run past this time
+extern uint8_t  simDevClock[SIM_BUSES];                                         //Device side clock drivers (1 = released)
+extern uint8_t  simDevData[SIM_BUSES];                                          //Device side data drivers (1 = released)
+extern uint64_t simNotifyRise;                                                  //Time KB_FLAG last went high
+extern simIrq_t simIrq[SIM_IRQ_COUNT];
+extern uint32_t simSpiUnderruns;                                                //Master clocked a byte the slave never loaded
+extern uint32_t simSpiOverruns;                                                 //Byte arrived before the ISR read the last one
+extern void (*simLoopHook)(void);                                               //Called once per main loop pass, and in Idle
+extern int  (*simDoneHook)(void);                                               //Return non-zero to leave the main loop
+
+void     simReset(void);
+void     simAttach(simAgent_t *agent);
+void     simSchedule(simAgent_t *agent, uint64_t at);
+void     simAdvance(uint64_t cycles);
+void     simIrqRaise(int irq);
+uint8_t  simSpiExchange(uint8_t mosi);                                          //Master side of one SPI byte
+uint8_t  simWireClock(uint8_t bus);
+uint8_t  simWireData(uint8_t bus);
+int      simRun(int (*entry)(void));                                            //0 = returned, 1 = deadline hit
+
+void     simStatAdd(simStat_t *st, uint32_t v);
+uint32_t simStatPct(simStat_t *st, double pct);
+void     simStatFree(simStat_t *st);
+double   simWallSec(void);
+
+#endif	/* SIM_H */
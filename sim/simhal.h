@@ -0,0 +1,119 @@
+/*
+ * File:   simhal.h
+ *
+ * Host (HOST_SIM) side of hal.h. Pin latches are plain variables that the
+ * simulator samples when virtual time advances; pin reads, delays and busy
+ * waits advance virtual time and may run the firmware ISRs: _INT0Interrupt()
+ * and _INT1Interrupt() on a falling edge of the clock line of bus 0 and 1,
+ * _T1Interrupt() and _T4Interrupt() on a period match of the bus timers,
+ * _SPI1Interrupt() and _CNInterrupt() for the simulated SPI master. Idle
+ * skips virtual time ahead to the next interrupt.
+ */
+
+#ifndef SIMHAL_H
+#define	SIMHAL_H
+
+#include <stdint.h>
+
+/*----------------------------------------------------*/
+/* Pin latches and reads                              */
+/*----------------------------------------------------*/
+#define SIM_BUSES   2                                                           //PS2 buses, one per firmware port
+
+extern uint8_t simDataLat[SIM_BUSES];                                           //Host side data line latches (1 = released)
+extern uint8_t simClockLat[SIM_BUSES];                                          //Host side clock line latches (1 = released)
+extern uint8_t simNotifyLat;                                                    //KB_FLAG notification pin
+extern uint8_t simPinCfg;                                                       //Sink for TRIS/ODC/ANSEL writes
+
+uint8_t simReadData(uint8_t bus);
+uint8_t simReadClock(uint8_t bus);
+
+#define HAL_PS2_DATA(n,v)   (simDataLat[n] = (v))
+#define HAL_PS2_CLOCK(n,v)  (simClockLat[n] = (v))
+#define HAL_PS2_DATA_P(n)   simReadData(n)
+#define HAL_PS2_CLOCK_P(n)  simReadClock(n)
+
+#define KB_FLAG_A   simPinCfg
+#define KB_FLAG_T   simPinCfg
+#define KB_FLAG_L   simNotifyLat
+
+/*----------------------------------------------------*/
+/* Interrupt sources                                  */
+/*----------------------------------------------------*/
+enum{
+    SIM_IRQ_INT0,                                                               //Bus 0 clock falling edge
+    SIM_IRQ_T1,                                                                 //Timer1 period match
+    SIM_IRQ_SPI1,                                                               //Byte exchanged with the host
+    SIM_IRQ_CN,                                                                 //SS1 changed
+    SIM_IRQ_INT1,                                                               //Bus 1 clock falling edge
+    SIM_IRQ_T4,                                                                 //Timer4 period match
+    SIM_IRQ_COUNT
+};
+
+void simIrqEnable(int irq, uint8_t on);
+void simIrqClear(int irq);
+void _INT0Interrupt(void);
+void _T1Interrupt(void);
+void _INT1Interrupt(void);
+void _T4Interrupt(void);
+void _SPI1Interrupt(void);
+void _CNInterrupt(void);
+
+#define HAL_ISR
+#define HAL_PS2_INT(n)      ((n) ? SIM_IRQ_INT1 : SIM_IRQ_INT0)
+#define HAL_PS2_INT_ENABLE(n)  simIrqEnable(HAL_PS2_INT(n), 1)
+#define HAL_PS2_INT_DISABLE(n) simIrqEnable(HAL_PS2_INT(n), 0)
+#define HAL_PS2_INT_CLEAR(n)   simIrqClear(HAL_PS2_INT(n))
+
+/*----------------------------------------------------*/
+/* Timer1 and Timer4, 0.5us ticks like the target     */
+/*----------------------------------------------------*/
+void simTmrStart(uint8_t n, uint16_t ticks);
+void simTmrStop(uint8_t n);
+
+#define HAL_PS2_TICKS(us)   ((uint16_t)((us) * (FCY / 8000000UL)))
+#define HAL_PS2_TMR_START(n,t) simTmrStart(n, t)
+#define HAL_PS2_TMR_STOP(n) simTmrStop(n)
+#define HAL_PS2_TMR_CLEAR(n) simIrqClear((n) ? SIM_IRQ_T4 : SIM_IRQ_T1)
+#define HAL_TICK16()        ((uint16_t)halNow())
+
+/*----------------------------------------------------*/
+/* SPI1 slave link to the host                        */
+/*----------------------------------------------------*/
+extern uint8_t simSsLat;                                                        //Slave select, driven by the simulated master
+
+uint8_t simSpiRead(void);
+void    simSpiWrite(uint8_t b);
+void    simSpiFlush(void);
+
+#define HAL_SS_P            simSsLat
+#define HAL_SPI_READ()      simSpiRead()
+#define HAL_SPI_WRITE(b)    simSpiWrite(b)
+#define HAL_SPI_FLUSH()     simSpiFlush()
+#define HAL_SPI_CLEAR()     simIrqClear(SIM_IRQ_SPI1)
+#define HAL_SPI_LOCK()      simIrqEnable(SIM_IRQ_SPI1, 0)
+#define HAL_SPI_UNLOCK()    simIrqEnable(SIM_IRQ_SPI1, 1)
+#define HAL_LINK_LOCK()     do{ simIrqEnable(SIM_IRQ_SPI1, 0); simIrqEnable(SIM_IRQ_CN, 0); }while(0)
+#define HAL_LINK_UNLOCK()   do{ simIrqEnable(SIM_IRQ_CN, 1); simIrqEnable(SIM_IRQ_SPI1, 1); }while(0)
+#define HAL_CN_CLEAR()      simIrqClear(SIM_IRQ_CN)
+
+/*----------------------------------------------------*/
+/* Timing and main loop                               */
+/*----------------------------------------------------*/
+void simDelayUs(uint32_t us);
+void simSpin(void);
+void simCost(uint32_t cyc);
+int  simRunning(void);
+uint8_t simIplRaise(uint8_t ipl);
+void simIplRestore(uint8_t ipl);
+void simIdle(void);
+
+#define HAL_DELAY_US(us)    simDelayUs(us)
+#define HAL_SPIN()          simSpin()
+#define HAL_COST(cyc)       simCost(cyc)
+#define HAL_RUNNING()       simRunning()
+#define HAL_IDLE_LOCK(s)    ((s) = simIplRaise(7))
+#define HAL_IDLE_UNLOCK(s)  simIplRestore(s)
+#define HAL_IDLE()          simIdle()
+
+#endif	/* SIMHAL_H */
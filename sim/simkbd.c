@@ -0,0 +1,397 @@
+/*----------------------------------------------------------------------------*/
+/* Simulated set 2 PS2 keyboard                                               */
+/*                                                                            */
+/* Device to host: data is changed while clock is high, the host samples on   */
+/* the falling edge. Before every bit, and again before it pulls clock low,   */
+/* the device checks the clock line; if the host is holding it low the frame  */
+/* is abandoned and sent again once the line is released.                     */
+/*                                                                            */
+/* Host to device: clock released with data low is a request to send. The     */
+/* device generates ten clocks and samples data on each rising edge, then     */
+/* pulls data low for one more clock as the line level ACK.                   */
+/*----------------------------------------------------------------------------*/
+#include <stdlib.h>
+#include <string.h>
+#include "simkbd.h"
+
+enum{
+    K_IDLE,
+    K_TX_SETUP,
+    K_TX_FALL,
+    K_TX_RISE,
+    K_RX_WAIT,
+    K_RX_FALL,
+    K_RX_RISE,
+    K_ACK_DATA,
+    K_ACK_FALL,
+    K_ACK_RISE,
+    K_ACK_DONE
+};
+
+static uint8_t parityBit(uint8_t b){                                            //Bit that makes the frame odd parity
+   uint8_t p = 1;
+   while(b){
+      p ^= b & 1;
+      b >>= 1;
+   }
+   return p;
+}
+
+static void after(simKbd_t *kb, uint32_t us){
+   simSchedule(&kb->agent, simNow + SIM_US(us));
+}
+
+static void respond(simKbd_t *kb, uint8_t code, uint32_t delayUs){
+   simKbdByte_t *r = &kb->resp[kb->respHead++ & (SIMKBD_RESP - 1)];
+   r->at = simNow + SIM_US(delayUs);
+   r->code = code;
+   r->tag = SIMKBD_RESP_TAG;
+   r->fault = SIMKBD_OK;
+}
+
+/*------------------------------------------*/
+/* Current frame is off the wire, whole or  */
+/* cut short                                */
+/*------------------------------------------*/
+static void frameDone(simKbd_t *kb){
+   if(kb->fromResp)
+      kb->respTail++;
+   else
+      kb->scriptTail++;
+   kb->framesSent++;
+   kb->lastSent = kb->byte;
+   if(kb->fault)
+      kb->faults++;
+   if(kb->onFrame)
+      kb->onFrame(kb, kb->byte,
+                  kb->fromResp ? SIMKBD_RESP_TAG :
+                  kb->script[(kb->scriptTail - 1) & (SIMKBD_SCRIPT - 1)].tag,
+                  kb->txStart);
+}
+
+static uint32_t idleAfter(simKbd_t *kb){
+   return kb->fault && kb->faultGapUs > kb->gapUs ? kb->faultGapUs : kb->gapUs;
+}
+
+/*------------------------------------------*/
+/* Decide what to do next from idle         */
+/*------------------------------------------*/
+static void kick(simKbd_t *kb){
+
+   simKbdByte_t *next;
+
+   if(!simWireClock(kb->bus)){                                                  //Host inhibit, wait for release
+      kb->sawClock = 0;                                                         //It may have started while we drove the clock
+      return;
+   }
+   if(!simWireData(kb->bus)){                                                   //Request to send
+      kb->state = K_RX_WAIT;
+      after(kb, kb->rtsUs);
+      return;
+   }
+   if(kb->respHead != kb->respTail){                                            //Responses go first
+      next = &kb->resp[kb->respTail & (SIMKBD_RESP - 1)];
+      kb->fromResp = 1;
+   }
+   else if(kb->scriptHead != kb->scriptTail){
+      next = &kb->script[kb->scriptTail & (SIMKBD_SCRIPT - 1)];
+      kb->fromResp = 0;
+   }
+   else{
+      kb->idleSince = simNow;
+      return;
+   }
+   if(next->at > simNow){
+      simSchedule(&kb->agent, next->at);
+      return;
+   }
+   kb->byte = next->code;
+   kb->bit = 0;
+   kb->fault = next->fault;
+   kb->faultArg = next->faultArg;
+   kb->glitchBit = kb->fault == SIMKBD_NO_PULSE ? kb->faultArg : 0;
+   if(!kb->fault && kb->glitchPct &&
+      (uint32_t)(rand() % 100) < kb->glitchPct){                                //Noise eats one of the data/parity pulses
+      kb->glitchBit = 1 + rand() % 9;
+      kb->glitches++;
+   }
+   kb->txStart = simNow;
+   kb->state = K_TX_SETUP;
+   simSchedule(&kb->agent, simNow);
+}
+
+/*------------------------------------------*/
+/* Act on a byte clocked in from the host   */
+/*------------------------------------------*/
+static void command(simKbd_t *kb){
+
+   uint8_t b = kb->byte;
+   uint8_t cmd = kb->expectArg;
+
+   kb->cmdsRcvd++;
+   kb->respTail = kb->respHead;                                                 //A new command discards pending output
+   kb->expectArg = 0;
+
+   if(kb->rxParity != parityBit(b) || !kb->rxStop){
+      kb->cmdErrors++;
+      respond(kb, 0xFE, kb->respUs);
+      return;
+   }
+
+   if(cmd){                                                                     //Argument for an earlier command
+      switch(cmd){
+         case 0xED: kb->leds = b & 0x07; break;
+         case 0xE8: kb->resolution = b; break;
+         case 0xF3:
+            if(!kb->mouse){
+               kb->typematic = b & 0x7F;
+               break;
+            }
+            kb->rates[0] = kb->rates[1];                                        //Sample rate, watch for the knock
+            kb->rates[1] = kb->rates[2];
+            kb->rates[2] = b;
+            if(kb->wheel && kb->rates[0] == 200 && kb->rates[1] == 100 && b == 80)
+               kb->mouseId = 0x03;
+            break;
+         case 0xF0:
+            if(b == 0){
+               respond(kb, 0xFA, kb->respUs);
+               respond(kb, kb->codeSet, kb->respUs);
+               return;
+            }
+            kb->codeSet = b;
+            break;
+      }
+      respond(kb, 0xFA, kb->respUs);
+      return;
+   }
+
+   switch(b){
+      case 0xEE:                                                                //Echo
+         respond(kb, 0xEE, kb->respUs);
+         break;
+      case 0xED:                                                                //Commands with one argument
+      case 0xE8:
+      case 0xF0:
+      case 0xF3:
+         respond(kb, 0xFA, kb->respUs);
+         kb->expectArg = b;
+         break;
+      case 0xF2:                                                                //Device ID
+         respond(kb, 0xFA, kb->respUs);
+         if(kb->mouse)
+            respond(kb, kb->mouseId, kb->respUs);
+         else{
+            respond(kb, 0xAB, kb->respUs);
+            respond(kb, 0x83, kb->respUs);
+         }
+         break;
+      case 0xF4: case 0xF5:
+         kb->reporting = b == 0xF4;
+         respond(kb, 0xFA, kb->respUs);
+         break;
+      case 0xF6:
+      case 0xF7: case 0xF8: case 0xF9: case 0xFA:
+         respond(kb, 0xFA, kb->respUs);
+         break;
+      case 0xFE:                                                                //Resend
+         respond(kb, kb->lastSent, kb->respUs);
+         break;
+      case 0xFF:                                                                //Reset
+         respond(kb, 0xFA, kb->respUs);
+         respond(kb, 0xAA, kb->batUs);
+         if(kb->mouse)
+            respond(kb, 0x00, kb->batUs);                                       //A mouse follows BAT with its ID
+         kb->leds = 0;
+         kb->codeSet = 2;
+         kb->mouseId = 0x00;
+         kb->reporting = 0;
+         break;
+      default:
+         respond(kb, 0xFE, kb->respUs);
+         break;
+   }
+}
+
+static void fire(simAgent_t *agent){
+
+   simKbd_t *kb = (simKbd_t *)agent;
+   uint8_t v;
+
+   switch(kb->state){
+      case K_IDLE:
+         kick(kb);
+         break;
+
+      case K_TX_SETUP:
+         if(!simWireClock(kb->bus)){                                            //Host inhibit, drop the frame
+            simDevData[kb->bus] = 1;
+            kb->aborts++;
+            kb->state = K_IDLE;
+            break;
+         }
+         if(kb->bit == 0)
+            v = 0;
+         else if(kb->bit <= 8)
+            v = (kb->byte >> (kb->bit - 1)) & 1;
+         else if(kb->bit == 9)
+            v = parityBit(kb->byte) ^ (kb->fault == SIMKBD_BAD_PARITY);
+         else
+            v = kb->fault != SIMKBD_BAD_STOP;
+         simDevData[kb->bus] = v;
+         kb->state = K_TX_FALL;
+         after(kb, kb->setupUs);
+         break;
+
+      case K_TX_FALL:
+         if(!simWireClock(kb->bus)){                                            //Host inhibit since the bit went out, drop the frame
+            simDevData[kb->bus] = 1;
+            kb->aborts++;
+            kb->state = K_IDLE;
+            break;
+         }
+         if(kb->bit != kb->glitchBit || !kb->bit)                               //The lost pulse never reaches the host
+            simDevClock[kb->bus] = 0;
+         if(kb->bit == 10)                                                      //Host samples the stop bit now
+            frameDone(kb);
+         kb->state = K_TX_RISE;
+         after(kb, kb->halfUs);
+         break;
+
+      case K_TX_RISE:
+         simDevClock[kb->bus] = 1;
+         if(kb->fault == SIMKBD_TRUNCATE && kb->bit + 1 == kb->faultArg){       //Stop clocking mid-frame
+            frameDone(kb);
+            kb->bit = 11;
+         }
+         if(++kb->bit < 11){
+            kb->state = K_TX_SETUP;
+            after(kb, kb->halfUs - kb->setupUs);
+            break;
+         }
+         simDevData[kb->bus] = 1;                                               //Frame complete
+         kb->sawClock = 1;                                                      //Our own clock release, not the host lifting an inhibit
+         kb->state = K_IDLE;
+         after(kb, idleAfter(kb));
+         break;
+
+      case K_RX_WAIT:
+         if(!simWireClock(kb->bus) || simWireData(kb->bus)){                    //Host gave up
+            kb->state = K_IDLE;
+            simSchedule(&kb->agent, simNow);
+            break;
+         }
+         kb->bit = 0;
+         kb->byte = 0;
+         kb->state = K_RX_FALL;
+         simSchedule(&kb->agent, simNow);
+         break;
+
+      case K_RX_FALL:
+         simDevClock[kb->bus] = 0;
+         kb->state = K_RX_RISE;
+         after(kb, kb->halfUs);
+         break;
+
+      case K_RX_RISE:
+         simDevClock[kb->bus] = 1;
+         v = simWireData(kb->bus);
+         if(kb->bit < 8)
+            kb->byte |= v << kb->bit;
+         else if(kb->bit == 8)
+            kb->rxParity = v;
+         else
+            kb->rxStop = v;
+         if(++kb->bit < 10){
+            kb->state = K_RX_FALL;
+            after(kb, kb->halfUs);
+         }
+         else{
+            kb->state = K_ACK_DATA;
+            after(kb, kb->setupUs);
+         }
+         break;
+
+      case K_ACK_DATA:
+         simDevData[kb->bus] = 0;
+         kb->state = K_ACK_FALL;
+         after(kb, kb->setupUs);
+         break;
+
+      case K_ACK_FALL:
+         simDevClock[kb->bus] = 0;
+         kb->state = K_ACK_RISE;
+         after(kb, kb->halfUs);
+         break;
+
+      case K_ACK_RISE:
+         simDevClock[kb->bus] = 1;
+         kb->state = K_ACK_DONE;
+         after(kb, kb->setupUs);
+         break;
+
+      case K_ACK_DONE:
+         if(!simWireClock(kb->bus))                                             //Host started on the next byte too soon
+            kb->ackInhibits++;
+         simDevData[kb->bus] = 1;
+         command(kb);
+         kb->state = K_IDLE;
+         simSchedule(&kb->agent, simNow);
+         break;
+   }
+}
+
+/*------------------------------------------*/
+/* Host moved a line while we were idle     */
+/*------------------------------------------*/
+static void lines(simAgent_t *agent){
+
+   simKbd_t *kb = (simKbd_t *)agent;
+   uint8_t released = simWireClock(kb->bus) && !kb->sawClock;
+
+   kb->sawClock = simWireClock(kb->bus);
+   if(kb->state != K_IDLE)
+      return;
+   if(simWireClock(kb->bus) && !simWireData(kb->bus)){                          //Request to send
+      kb->state = K_RX_WAIT;
+      after(kb, kb->rtsUs);
+   }
+   else if(released)                                                            //Inhibit lifted
+      after(kb, 50);
+}
+
+void simKbdInit(simKbd_t *kb, uint32_t halfUs){
+   memset(kb, 0, sizeof(*kb));
+   kb->halfUs = halfUs;
+   kb->setupUs = 5;
+   kb->gapUs = 100;
+   kb->rtsUs = 40;
+   kb->respUs = 200;
+   kb->batUs = 500000;
+   kb->codeSet = 2;
+   kb->sawClock = 1;
+   kb->agent.fire = fire;
+   kb->agent.lines = lines;
+   simAttach(&kb->agent);
+}
+
+void simKbdScript(simKbd_t *kb, uint64_t at, uint8_t code, uint8_t tag){
+   simKbdScriptFault(kb, at, code, tag, SIMKBD_OK, 0);
+}
+
+void simKbdScriptFault(simKbd_t *kb, uint64_t at, uint8_t code, uint8_t tag,
+                       uint8_t fault, uint8_t arg){
+   simKbdByte_t *b = &kb->script[kb->scriptHead++ & (SIMKBD_SCRIPT - 1)];
+   b->at = at;
+   b->code = code;
+   b->tag = tag;
+   b->fault = fault;
+   b->faultArg = arg;
+   if(kb->state == K_IDLE && kb->agent.at == SIM_NEVER)
+      simSchedule(&kb->agent, at > simNow ? at : simNow);
+}
+
+uint8_t simKbdIdle(simKbd_t *kb){
+   return kb->state == K_IDLE && kb->scriptHead == kb->scriptTail &&
+          kb->respHead == kb->respTail;
+}
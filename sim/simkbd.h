@@ -0,0 +1,105 @@
+/*
+ * File:   simkbd.h
+ *
+ * Simulated PS2 keyboard for the virtual-time engine. It transmits scripted
+ * scan codes device-to-host, backs off when the host inhibits the clock,
+ * clocks in host-to-device commands (request to send, data, parity, stop,
+ * line ACK) and answers them the way a set 2 keyboard does, or with mouse set
+ * the way a PS2 mouse does (wheel set: it takes the IntelliMouse knock and
+ * becomes ID 0x03). Packets are scripted like scan codes. Optionally it
+ * drops a clock pulse from some frames to model line noise, and scripted
+ * bytes can be sent as broken frames (simKbdScriptFault).
+ */
+
+#ifndef SIMKBD_H
+#define	SIMKBD_H
+
+#include "sim.h"
+
+#define SIMKBD_SCRIPT   16384                                                   //Scripted byte ring, power of two
+#define SIMKBD_RESP     16                                                      //Response ring, power of two
+#define SIMKBD_RESP_TAG 0xFF                                                    //Tag passed to onFrame for responses
+
+typedef enum{                                                                   //Deliberately broken frames
+    SIMKBD_OK,
+    SIMKBD_BAD_PARITY,                                                          //Parity bit inverted
+    SIMKBD_BAD_STOP,                                                            //Data held low for the stop bit
+    SIMKBD_TRUNCATE,                                                            //Clock stops after arg pulses (1..10)
+    SIMKBD_NO_PULSE                                                             //Data/parity pulse arg (1..9) never reaches the host
+}simKbdFault_t;
+
+typedef struct{
+    uint64_t at;                                                                //Earliest send time
+    uint8_t  code;
+    uint8_t  tag;                                                               //Harness defined
+    uint8_t  fault;                                                             //simKbdFault_t
+    uint8_t  faultArg;
+}simKbdByte_t;
+
+typedef struct simKbd{
+    simAgent_t agent;                                                           //Must be first
+    uint8_t  bus;                                                               //PS2 bus it is plugged into, 0 after simKbdInit
+
+    //Timing, all in microseconds
+    uint32_t halfUs;                                                            //Half clock period (30 = 16.7kHz)
+    uint32_t setupUs;                                                           //Data setup before the falling edge
+    uint32_t gapUs;                                                             //Idle time between frames
+    uint32_t rtsUs;                                                             //Delay before clocking in a host byte
+    uint32_t respUs;                                                            //Delay before answering a command
+    uint32_t batUs;                                                             //Reset to BAT completion
+    uint32_t faultGapUs;                                                        //Idle time after a broken frame, if longer than gapUs
+
+    //Device kind, set after simKbdInit
+    uint8_t  mouse;                                                             //Answer like a mouse
+    uint8_t  wheel;                                                             //Mouse takes the IntelliMouse knock
+
+    //Device state
+    uint8_t  state;
+    uint8_t  bit;
+    uint8_t  byte;
+    uint8_t  fromResp;                                                          //Current frame comes from the response ring
+    uint8_t  sawClock;
+    uint8_t  rxParity;
+    uint8_t  rxStop;
+    uint8_t  expectArg;                                                         //Command waiting for its argument
+    uint8_t  lastSent;
+    uint64_t txStart;                                                           //Start bit time of the current frame
+    uint8_t  glitchPct;                                                         //Chance a frame loses one clock pulse
+    uint8_t  glitchBit;                                                         //Pulse left out of the current frame, 0 = none
+    uint8_t  fault;                                                             //Fault of the current frame
+    uint8_t  faultArg;
+
+    simKbdByte_t script[SIMKBD_SCRIPT];
+    uint32_t scriptHead, scriptTail;
+    simKbdByte_t resp[SIMKBD_RESP];
+    uint32_t respHead, respTail;
+
+    //Observable keyboard settings
+    uint8_t  leds;
+    uint8_t  codeSet;
+    uint8_t  typematic;
+    uint8_t  mouseId;                                                           //0x00, 0x03 after the knock
+    uint8_t  rates[3];                                                          //Last three mouse sample rates, newest last
+    uint8_t  resolution;
+    uint8_t  reporting;                                                         //Mouse streaming enabled (F4)
+
+    //Statistics
+    uint32_t framesSent;
+    uint32_t aborts;                                                            //Frames cut short by a host inhibit
+    uint32_t cmdsRcvd;
+    uint32_t cmdErrors;                                                         //Host frames with bad parity or stop
+    uint32_t ackInhibits;                                                       //Host pulled clock low before we let go after the ACK
+    uint32_t glitches;                                                          //Frames sent with a missing clock pulse
+    uint32_t faults;                                                            //Scripted broken frames sent
+    uint64_t idleSince;
+
+    void (*onFrame)(struct simKbd *, uint8_t code, uint8_t tag, uint64_t start);
+}simKbd_t;
+
+void    simKbdInit(simKbd_t *kb, uint32_t halfUs);
+void    simKbdScript(simKbd_t *kb, uint64_t at, uint8_t code, uint8_t tag);
+void    simKbdScriptFault(simKbd_t *kb, uint64_t at, uint8_t code, uint8_t tag,
+                          uint8_t fault, uint8_t arg);
+uint8_t simKbdIdle(simKbd_t *kb);                                               //Nothing queued and bus idle
+
+#endif	/* SIMKBD_H */
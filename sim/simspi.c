@@ -0,0 +1,209 @@
+/*----------------------------------------------------------------------------*/
+/* Simulated SPI master                                                       */
+/*                                                                            */
+/* One transaction per KB_FLAG: SS low, opcode in / length out, then length   */
+/* data bytes, then SS high. Each byte is swapped with the slave at the end   */
+/* of its eight clocks, which raises SPI1IF; the gap before the next byte is  */
+/* what gives the slave ISR time to load SPI1BUF. After deselect the master   */
+/* looks at KB_FLAG again once it has had time to settle.                     */
+/*----------------------------------------------------------------------------*/
+#include <stdlib.h>
+#include <string.h>
+#include "simspi.h"
+#include "host.h"
+
+enum{
+    M_IDLE,
+    M_SELECT,                                                                   //SS about to go low
+    M_OPCODE,                                                                   //Opcode byte in flight
+    M_DATA,                                                                     //Data byte in flight
+    M_DESELECT,                                                                 //SS about to go high
+    M_SETTLE                                                                    //Deselected, recheck KB_FLAG
+};
+
+static void arm(simSpi_t *m){
+
+   uint64_t at = simNow + m->reactCyc;
+
+   if(m->state != M_IDLE || !simNotifyLat)
+      return;
+   if(m->jitterCyc)                                                             //Master busy with something else
+      at += (uint64_t)rand() % (m->jitterCyc + 1);
+   if(at < m->holdUntil)
+      at = m->holdUntil;
+   m->state = M_SELECT;
+   simSchedule(&m->agent, at);
+}
+
+static void fire(simAgent_t *a){
+
+   simSpi_t *m = (simSpi_t *)a;
+   uint8_t b;
+
+   switch(m->state){
+      case M_SELECT:
+         simSsLat = 0;
+         m->state = M_OPCODE;
+         simSchedule(a, simNow + m->selectCyc + m->byteCyc);
+         break;
+
+      case M_OPCODE:
+         m->len = simSpiExchange(HOST_OP_READ);
+         m->idx = 0;
+         m->transactions++;
+         if(!m->len)
+            m->empty++;
+         m->state = m->len ? M_DATA : M_DESELECT;
+         simSchedule(a, simNow + m->gapCyc + (m->len ? m->byteCyc : 0));
+         break;
+
+      case M_DATA:
+         b = simSpiExchange(0x00);
+         m->bytes++;
+         if(m->onByte)
+            m->onByte(m, b);
+         if(++m->idx == m->len){
+            m->state = M_DESELECT;
+            simSchedule(a, simNow + m->gapCyc);
+         }
+         else
+            simSchedule(a, simNow + m->gapCyc + m->byteCyc);
+         break;
+
+      case M_DESELECT:
+         simSsLat = 1;
+         m->state = M_SETTLE;
+         simSchedule(a, simNow + m->reactCyc);
+         break;
+
+      case M_SETTLE:
+         m->state = M_IDLE;
+         arm(m);
+         break;
+   }
+}
+
+static void lines(simAgent_t *a){
+   arm((simSpi_t *)a);
+}
+
+void simSpiInit(simSpi_t *m, uint32_t sckHz, uint32_t gapUs){
+   memset(m, 0, sizeof(*m));
+   m->byteCyc = 8 * (uint64_t)FCY / sckHz;
+   m->gapCyc = SIM_US(gapUs);
+   m->selectCyc = SIM_US(1);
+   m->reactCyc = SIM_US(2);
+   m->agent.fire = fire;
+   m->agent.lines = lines;
+   simAttach(&m->agent);
+}
+
+uint8_t simSpiIdle(simSpi_t *m){
+   return m->state == M_IDLE;
+}
+
+/*------------------------------------------*/
+/* One record transaction (HOST_OP_DIAG,    */
+/* HOST_OP_KEYS), clocked directly rather   */
+/* than by a master agent. Returns the      */
+/* record length; at most max bytes of it   */
+/* are stored in buf                        */
+/*------------------------------------------*/
+uint8_t simSpiRecord(uint8_t op, uint32_t sckHz, uint32_t gapUs, uint8_t *buf, uint8_t max){
+
+   uint64_t byteCyc = 8 * (uint64_t)FCY / sckHz;
+   uint8_t len, i, b;
+
+   simSsLat = 0;
+   simAdvance(SIM_US(1) + byteCyc);
+   simSpiExchange(op);
+   simAdvance(SIM_US(gapUs) + byteCyc);
+   len = simSpiExchange(0x00);
+   for(i = 0; i < len; i++){
+      simAdvance(SIM_US(gapUs) + byteCyc);
+      b = simSpiExchange(0x00);
+      if(i < max)
+         buf[i] = b;
+   }
+   simAdvance(SIM_US(gapUs));
+   simSsLat = 1;
+   simAdvance(SIM_US(2));
+   return len;
+}
+
+/*------------------------------------------*/
+/* One drain with the format byte           */
+/* (HOST_OP_ASCII, HOST_OP_EVENTS), clocked */
+/* directly. Returns the length n and the   */
+/* format in *fmt; at most max of the n     */
+/* bytes are stored in buf                  */
+/*------------------------------------------*/
+uint8_t simSpiDrain(uint8_t op, uint32_t sckHz, uint32_t gapUs, uint8_t *fmt,
+                    uint8_t *buf, uint8_t max){
+
+   uint64_t byteCyc = 8 * (uint64_t)FCY / sckHz;
+   uint8_t len, i, b;
+
+   simSsLat = 0;
+   simAdvance(SIM_US(1) + byteCyc);
+   len = simSpiExchange(op);
+   simAdvance(SIM_US(gapUs) + byteCyc);
+   *fmt = simSpiExchange(0x00);
+   for(i = 0; i < len; i++){
+      simAdvance(SIM_US(gapUs) + byteCyc);
+      b = simSpiExchange(0x00);
+      if(i < max)
+         buf[i] = b;
+   }
+   simAdvance(SIM_US(gapUs));
+   simSsLat = 1;
+   simAdvance(SIM_US(2));
+   return len;
+}
+
+/*------------------------------------------*/
+/* One opcode with an argument byte         */
+/* (HOST_OP_LAYOUT), clocked directly.      */
+/* Returns what came back with the argument */
+/*------------------------------------------*/
+uint8_t simSpiArg(uint8_t op, uint8_t arg, uint32_t sckHz, uint32_t gapUs){
+
+   uint64_t byteCyc = 8 * (uint64_t)FCY / sckHz;
+   uint8_t b;
+
+   simSsLat = 0;
+   simAdvance(SIM_US(1) + byteCyc);
+   simSpiExchange(op);
+   simAdvance(SIM_US(gapUs) + byteCyc);
+   b = simSpiExchange(arg);
+   simAdvance(SIM_US(gapUs));
+   simSsLat = 1;
+   simAdvance(SIM_US(2));
+   return b;
+}
+
+/*------------------------------------------*/
+/* One upload (HOST_OP_MACRO), clocked      */
+/* directly: the length byte, then len      */
+/* bytes from buf. Returns what came back   */
+/* with the length byte                     */
+/*------------------------------------------*/
+uint8_t simSpiUpload(uint8_t op, const uint8_t *buf, uint8_t len, uint32_t sckHz, uint32_t gapUs){
+
+   uint64_t byteCyc = 8 * (uint64_t)FCY / sckHz;
+   uint8_t b, i;
+
+   simSsLat = 0;
+   simAdvance(SIM_US(1) + byteCyc);
+   simSpiExchange(op);
+   simAdvance(SIM_US(gapUs) + byteCyc);
+   b = simSpiExchange(len);
+   for(i = 0; i < len; i++){
+      simAdvance(SIM_US(gapUs) + byteCyc);
+      simSpiExchange(buf[i]);
+   }
+   simAdvance(SIM_US(gapUs));
+   simSsLat = 1;
+   simAdvance(SIM_US(2));
+   return b;
+}
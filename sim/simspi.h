@@ -0,0 +1,49 @@
+/*
+ * File:   simspi.h
+ *
+ * Simulated SPI master for the virtual-time engine. It waits for KB_FLAG,
+ * selects the slave, clocks the READ opcode and the length byte, drains
+ * that many queued bytes and deselects, the way the master controller
+ * talks to host.c.
+ */
+
+#ifndef SIMSPI_H
+#define	SIMSPI_H
+
+#include "sim.h"
+
+typedef struct simSpi{
+    simAgent_t agent;                                                           //Must be first
+
+    //Timing, all in cycles
+    uint64_t byteCyc;                                                           //Eight SCK periods
+    uint64_t gapCyc;                                                            //Master pause between bytes
+    uint64_t selectCyc;                                                         //SS low to the first SCK edge
+    uint64_t reactCyc;                                                          //KB_FLAG high to SS low
+    uint64_t jitterCyc;                                                         //Random extra reaction time, up to this much
+    uint64_t holdUntil;                                                         //Do not start a transaction before this
+
+    //Master state
+    uint8_t  state;
+    uint8_t  len;                                                               //Length byte of the current transaction
+    uint8_t  idx;                                                               //Data bytes clocked so far
+
+    //Statistics
+    uint32_t transactions;
+    uint32_t bytes;                                                             //Data bytes, length bytes not counted
+    uint32_t empty;                                                             //Transactions that found nothing queued
+
+    void (*onByte)(struct simSpi *, uint8_t b);
+}simSpi_t;
+
+void    simSpiInit(simSpi_t *m, uint32_t sckHz, uint32_t gapUs);
+uint8_t simSpiIdle(simSpi_t *m);                                                //Deselected with nothing scheduled
+uint8_t simSpiRecord(uint8_t op, uint32_t sckHz, uint32_t gapUs,
+                     uint8_t *buf, uint8_t max);                                //Read a HOST_OP_DIAG/KEYS record
+uint8_t simSpiDrain(uint8_t op, uint32_t sckHz, uint32_t gapUs, uint8_t *fmt,
+                    uint8_t *buf, uint8_t max);                                 //HOST_OP_ASCII/EVENTS, returns the length
+uint8_t simSpiArg(uint8_t op, uint8_t arg, uint32_t sckHz, uint32_t gapUs);     //HOST_OP_LAYOUT, returns byte 1
+uint8_t simSpiUpload(uint8_t op, const uint8_t *buf, uint8_t len,
+                    uint32_t sckHz, uint32_t gapUs);                            //HOST_OP_MACRO, returns byte 1
+
+#endif	/* SIMSPI_H */
@@ -0,0 +1,247 @@
+/*----------------------------------------------------------------------------*/
+/* SPI host link loopback: keyboard -> firmware -> simulated SPI master       */
+/*                                                                            */
+/* burst:   the master is held off while the keyboard fills the output queue, */
+/*          then drains it; reports data bytes/s on the link and the number   */
+/*          of transactions it took.                                          */
+/* latency: the master reacts to KB_FLAG right away; each character is timed  */
+/*          from the start bit of its make code to the end of the SPI byte    */
+/*          that carried it to the master.                                    */
+/* typing:  lines of words at 30 cps, each ending in Enter, the master        */
+/*          following KB_FLAG; reports transactions per character and the    */
+/*          latency of letters and of Enter, which is what notify moderation  */
+/*          (HOST_NOTIFY_BYTES/US, built into spibench-mod) trades against.   */
+/*                                                                            */
+/* All phases check that the master received exactly the typed text.         */
+/*                                                                            */
+/* usage: spibench [-n runs] [-k keys] [-c clock_hz] [-f sck_hz] [-b gap_us]  */
+/*                 [-s seed]                                                  */
+/*----------------------------------------------------------------------------*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "sim.h"
+#include "simkbd.h"
+#include "simspi.h"
+#include "ps2kb.h"
+#include "host.h"
+
+#define TAG_NONE    0
+#define TAG_CHAR    1
+#define TAG_ENTER   2
+
+static const uint8_t letterCodes[26] = {                                        //Set 2 make codes for a..z
+   0x1C,0x32,0x21,0x23,0x24,0x2B,0x34,0x33,0x43,0x3B,0x42,0x4B,0x3A,
+   0x31,0x44,0x4D,0x15,0x2D,0x1B,0x2C,0x3C,0x2A,0x1D,0x22,0x35,0x1A
+};
+
+extern queue_t xOutBuf;
+extern uint8_t capsLock, numsLock;
+int fwMain(void);
+
+static simKbd_t kbd;
+static simSpi_t spi;
+static char expect[BUFSIZE], got[BUFSIZE];
+static uint32_t nExpect, nGot;
+static uint64_t stamps[BUFSIZE];
+static uint32_t stampHead, stampTail;
+static uint64_t firstByte, lastByte;
+static simStat_t latency, enterLat;
+
+static void onFrame(simKbd_t *kb, uint8_t code, uint8_t tag, uint64_t start){
+   (void)kb; (void)code;
+   if(tag == TAG_CHAR || tag == TAG_ENTER)
+      stamps[stampHead++ % BUFSIZE] = start;
+}
+
+static void onByte(simSpi_t *m, uint8_t b){
+   (void)m;
+   if(!nGot)
+      firstByte = simNow;
+   lastByte = simNow;
+   if(nGot < sizeof(got))
+      got[nGot++] = b;
+   if(stampTail != stampHead)
+      simStatAdd(b == ENTER ? &enterLat : &latency,
+                 (uint32_t)(simNow - stamps[stampTail++ % BUFSIZE]));
+}
+
+static int doneHook(void){
+   return simKbdIdle(&kbd) && simSpiIdle(&spi) && !simNotifyLat &&
+          !qCount(&xOutBuf) && simNow - kbd.idleSince > SIM_US(2000);           //Moderation may still be holding bytes back
+}
+
+static uint64_t buildScript(uint32_t keys, uint32_t gapUs){
+
+   uint64_t t = SIM_US(5000);                                                   //Leave room for kbInitialize()
+   uint32_t i, k;
+
+   for(i = 0; i < keys; i++){
+      k = rand() % 26;
+      simKbdScript(&kbd, t, letterCodes[k], TAG_CHAR);
+      simKbdScript(&kbd, t, 0xF0, TAG_NONE);
+      simKbdScript(&kbd, t, letterCodes[k], TAG_NONE);
+      expect[nExpect++] = 'a' + k;
+      t += SIM_US(gapUs);
+   }
+   return t;
+}
+
+static uint64_t buildLines(uint32_t keys){
+
+   uint64_t t = SIM_US(5000);
+   uint32_t i, k, word = 0;
+
+   for(i = 0; i < keys; i++){
+      if(word >= 3 + (uint32_t)(rand() % 6)){                                  //End of the line
+         simKbdScript(&kbd, t, ENTER_S, TAG_ENTER);
+         simKbdScript(&kbd, t, 0xF0, TAG_NONE);
+         simKbdScript(&kbd, t, ENTER_S, TAG_NONE);
+         expect[nExpect++] = ENTER;
+         t += SIM_US(100000);
+         word = 0;
+         continue;
+      }
+      k = rand() % 26;
+      simKbdScript(&kbd, t, letterCodes[k], TAG_CHAR);
+      simKbdScript(&kbd, t, 0xF0, TAG_NONE);
+      simKbdScript(&kbd, t, letterCodes[k], TAG_NONE);
+      expect[nExpect++] = 'a' + k;
+      t += SIM_US(33333);
+      word++;
+   }
+   return t;
+}
+
+/*------------------------------------------*/
+/* One run; hold > 0 keeps the master off   */
+/* the link until that time, lines types    */
+/* words and Enter instead of spaced keys   */
+/*------------------------------------------*/
+static int runOnce(uint32_t keys, uint32_t hz, uint32_t sckHz, uint32_t gapUs,
+                   uint32_t keyGapUs, uint64_t hold, uint8_t lines){
+
+   uint64_t end;
+
+   simReset();
+   simKbdInit(&kbd, (500000 + hz / 2) / hz);
+   kbd.onFrame = onFrame;
+   simSpiInit(&spi, sckHz, gapUs);
+   spi.onByte = onByte;
+   spi.holdUntil = hold;
+   capsLock = numsLock = 0;
+   nExpect = nGot = 0;
+   stampHead = stampTail = 0;
+   end = lines ? buildLines(keys) : buildScript(keys, keyGapUs);
+   simDoneHook = doneHook;
+   simDeadline = (hold > end ? hold : end) +
+                 (uint64_t)(kbd.scriptHead) * SIM_US(22 * kbd.halfUs + kbd.gapUs) +
+                 SIM_US(50000);
+   if(simRun(fwMain))
+      return -1;
+   return nGot != nExpect || memcmp(got, expect, nExpect);
+}
+
+int main(int argc, char **argv){
+
+   uint32_t runs = 100, keys = 150, hz = 12500, sckHz = 1000000, gapUs = 10, seed = 1;
+   uint32_t n, bad = 0, timeouts = 0, bytes = 0, trans = 0, under = 0, over = 0;
+   uint64_t busy = 0, hold;
+   double t0, wall;
+   int opt, r;
+
+   while((opt = getopt(argc, argv, "n:k:c:f:b:s:")) != -1){
+      switch(opt){
+         case 'n': runs = strtoul(optarg, NULL, 0); break;
+         case 'k': keys = strtoul(optarg, NULL, 0); break;
+         case 'c': hz = strtoul(optarg, NULL, 0); break;
+         case 'f': sckHz = strtoul(optarg, NULL, 0); break;
+         case 'b': gapUs = strtoul(optarg, NULL, 0); break;
+         case 's': seed = strtoul(optarg, NULL, 0); break;
+         default:
+            fprintf(stderr, "usage: %s [-n runs] [-k keys] [-c clock_hz] [-f sck_hz] "
+                            "[-b gap_us] [-s seed]\n", argv[0]);
+            return 2;
+      }
+   }
+   if(keys > BUFSIZE)                                                           //Burst phase must fit the queue
+      keys = BUFSIZE;
+   srand(seed);
+   t0 = simWallSec();
+
+   //Burst: typing lands in the queue first, the master drains it afterwards
+   for(n = 0; n < runs; n++){
+      hold = SIM_US(5000) + (uint64_t)keys * SIM_US(3 * (22 * ((500000 + hz / 2) / hz) + 100)) +
+             SIM_US(5000);                                                      //Past the last break code
+      r = runOnce(keys, hz, sckHz, gapUs, 0, hold, 0);
+      if(r < 0)
+         timeouts++;
+      else if(r)
+         bad++;
+      bytes += spi.bytes;
+      trans += spi.transactions;
+      under += simSpiUnderruns;
+      over += simSpiOverruns;
+      busy += lastByte - hold;
+   }
+   printf("burst            %u runs of %u keys, SCK %u Hz, %u us between bytes\n",
+          runs, keys, sckHz, gapUs);
+   printf("  mismatches     %u\n", bad);
+   printf("  timeouts       %u\n", timeouts);
+   printf("  under/overruns %u/%u\n", under, over);
+   printf("  transactions   %.1f per burst\n", (double)trans / runs);
+   printf("  drain rate     %.0f bytes/s\n", bytes / (SIM_TO_US(busy) * 1e-6));
+
+   //Latency: master follows KB_FLAG, keys spaced so frames never queue up
+   bad = timeouts = 0;
+   trans = bytes = 0;
+   simStatFree(&latency);                                                       //Burst samples include the hold
+   for(n = 0; n < runs; n++){
+      r = runOnce(keys / 5 ? keys / 5 : 1, hz, sckHz, gapUs, 6000, 0, 0);
+      if(r < 0)
+         timeouts++;
+      else if(r)
+         bad++;
+      trans += spi.transactions;
+      bytes += spi.bytes;
+   }
+   printf("latency          %u runs of %u keys\n", runs, keys / 5 ? keys / 5 : 1);
+   printf("  mismatches     %u\n", bad);
+   printf("  timeouts       %u\n", timeouts);
+   printf("  bytes/trans    %.2f\n", trans ? (double)bytes / trans : 0.0);
+   printf("  us             p50 %.1f  p99 %.1f  max %.1f\n",
+          SIM_TO_US(simStatPct(&latency, 50)), SIM_TO_US(simStatPct(&latency, 99)),
+          SIM_TO_US(simStatPct(&latency, 100)));
+
+   //Typing: words and Enter, the master follows KB_FLAG; mostly idle, fewer runs
+   bad = timeouts = 0;
+   trans = bytes = 0;
+   simStatFree(&latency);
+   for(n = 0; n < runs / 5 + 1; n++){
+      r = runOnce(keys / 5 ? keys / 5 : 1, hz, sckHz, gapUs, 0, 0, 1);
+      if(r < 0)
+         timeouts++;
+      else if(r)
+         bad++;
+      trans += spi.transactions;
+      bytes += spi.bytes;
+   }
+   printf("typing           %u runs of %u keys, notify after %u bytes or %u us\n",
+          runs / 5 + 1, keys / 5 ? keys / 5 : 1, HOST_NOTIFY_BYTES, HOST_NOTIFY_US);
+   printf("  mismatches     %u\n", bad);
+   printf("  timeouts       %u\n", timeouts);
+   printf("  trans/char     %.2f\n", bytes ? (double)trans / bytes : 0.0);
+   printf("  letters us     p50 %.1f  p99 %.1f  max %.1f\n",
+          SIM_TO_US(simStatPct(&latency, 50)), SIM_TO_US(simStatPct(&latency, 99)),
+          SIM_TO_US(simStatPct(&latency, 100)));
+   printf("  enter us       p50 %.1f  p99 %.1f  max %.1f\n",
+          SIM_TO_US(simStatPct(&enterLat, 50)), SIM_TO_US(simStatPct(&enterLat, 99)),
+          SIM_TO_US(simStatPct(&enterLat, 100)));
+   simStatFree(&enterLat);
+
+   wall = simWallSec() - t0;
+   printf("wall             %.2f s\n", wall);
+   simStatFree(&latency);
+   return bad || timeouts;
+}
@@ -0,0 +1,273 @@
+/*----------------------------------------------------------------------------*/
+/* Output encoding cost: KB_OUT_ASCII against KB_OUT_UTF8                     */
+/*                                                                            */
+/* Once the firmware is up the harness stops feeding the bus and calls        */
+/* kbPostCode() directly, keystroke after keystroke, for every layout in      */
+/* both formats: the layout dependent keys in turn, plain, shifted or with    */
+/* AltGr, draining the queue whenever it is half full. Reported per layout    */
+/* and format: host nanoseconds per keystroke, queued bytes per keystroke and */
+/* what those bytes cost on the SPI link at 1MHz with a 10us gap.             */
+/*                                                                            */
+/* Then the queue is left to overflow in KB_OUT_UTF8, once refusing new       */
+/* characters (QUEUE_POLICY) and once with Q_DROP_OLDEST: the oldest byte     */
+/* queued must start a character after every keystroke, what is left must     */
+/* decode as UTF-8 from the first byte to the last, and every byte lost must  */
+/* be in the drop count.                                                      */
+/*                                                                            */
+/* Last no pair of layout keys, plain, shifted or with AltGr, may mark the    */
+/* queue urgent in KB_OUT_UTF8: a trail byte such as the 8E of Î (dead ^,     */
+/* then I) is not PLUG_OK.                                                    */
+/*                                                                            */
+/* usage: utf8bench [-k keystrokes]                                           */
+/*----------------------------------------------------------------------------*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "sim.h"
+#include "simkbd.h"
+#include "ps2kb.h"
+
+#define SPI_BYTE_US 18.0                                                        //8 clocks at 1MHz plus the 10us gap
+#define FLOOD_KEYS  (4 * BUFSIZE)                                               //Keystrokes for the overflow checks
+#define LAYOUT_NAME(name) #name,
+
+extern queue_t xOutBuf, *pOutBuf;
+extern kbFlags_t xFlags;
+extern kbEvent_t xEvent;
+extern uint8_t kbOutMode, kbLayout, kbDead;
+extern const kbKeyDesc_t kbKeyMap[256];
+int fwMain(void);
+
+static simKbd_t kbd;
+static uint8_t keys[KB_SLOTS];                                                  //Keycode of each slot
+static uint32_t nKeys, bad;
+static int done;
+
+/*------------------------------------------*/
+/* Keystroke i of the test text             */
+/*------------------------------------------*/
+static void keystroke(uint32_t i){
+   xEvent.type = KB_EV_KEY;
+   xEvent.key = keys[i % KB_SLOTS];
+   xEvent.brk = 0;
+   xEvent.mods = (i / KB_SLOTS) % 8 < 5 ? 0 : (i / KB_SLOTS) % 8 < 7 ? KM_LSHIFT : KM_RALT;
+}
+
+/*------------------------------------------*/
+/* Type n keystrokes, returns the bytes     */
+/* queued                                   */
+/*------------------------------------------*/
+static uint32_t type(uint32_t n, double *ns){
+
+   static uint8_t sink[BUFSIZE];
+   uint32_t i, bytes = 0;
+   double t0;
+
+   t0 = simWallSec();
+   for(i = 0; i < n; i++){
+      keystroke(i);
+      kbPostCode();
+      if(qCount(&xOutBuf) >= BUFSIZE / 2)
+         bytes += qRead(&xOutBuf, sink, BUFSIZE);
+   }
+   bytes += qRead(&xOutBuf, sink, BUFSIZE);
+   *ns = (simWallSec() - t0) * 1e9 / n;
+   return bytes;
+}
+
+/*------------------------------------------*/
+/* The queue must hold whole UTF-8          */
+/* characters only                          */
+/*------------------------------------------*/
+static int wellFormed(void){
+
+   uint8_t b, need = 0;
+
+   while(qGet(&xOutBuf, &b)){
+      if(need){
+         if((b & 0xC0) != 0x80)
+            return 0;
+         need--;
+      }
+      else if((b & 0xE0) == 0xC0)
+         need = 1;
+      else if((b & 0xF0) == 0xE0)
+         need = 2;
+      else if(b & 0x80)
+         return 0;
+   }
+   return !need;
+}
+
+/*------------------------------------------*/
+/* Type into the queue without draining, n  */
+/* keystrokes into a fresh queue in FR.     */
+/* Counts the keystrokes after which the    */
+/* oldest byte is not the start of a        */
+/* character. Returns the bytes queued      */
+/*------------------------------------------*/
+static uint16_t fill(qPolicy_t policy, uint32_t first, uint32_t n, uint32_t *cut){
+
+   uint32_t i;
+   uint8_t b;
+
+   qInit(&xOutBuf, policy);
+   kbLayout = KB_LAYOUT_FR;
+   kbDead = 0;
+   for(i = first; i < first + n; i++){
+      keystroke(i);
+      kbPostCode();
+      if(qPeek(&xOutBuf, &b) && (b & 0xC0) == 0x80)
+         (*cut)++;
+   }
+   return qCount(&xOutBuf);
+}
+
+/*------------------------------------------*/
+/* Overflow the queue. What is left must be */
+/* whole characters and, with the bytes     */
+/* dropped, add up to what the same text    */
+/* makes one keystroke at a time            */
+/*------------------------------------------*/
+static void flood(qPolicy_t policy, const char *name){
+
+   uint32_t i, made = 0, cut = 0;
+   uint16_t left, drops;
+   int whole;
+
+   left = fill(policy, 0, FLOOD_KEYS, &cut);
+   drops = xOutBuf.drops;
+   whole = wellFormed() && !cut;
+   fill(policy, 0, 0, &cut);
+   for(i = 0; i < FLOOD_KEYS; i++){                                             //Emptied after every keystroke
+      keystroke(i);
+      kbPostCode();
+      made += qCount(&xOutBuf);
+      qInit(&xOutBuf, policy);
+   }
+   printf("overflow         %-12s %u bytes queued, %u dropped of %u, %s\n", name, left, drops,
+          made, whole ? "whole characters left" : "SPLIT CHARACTER");
+   if(!whole || !drops || left + drops != made)
+      bad++;
+}
+
+/*------------------------------------------*/
+/* Key pairs that skip notify moderation in */
+/* KB_OUT_UTF8, every layout, so dead keys  */
+/* compose. No layout key is Enter or Esc   */
+/*------------------------------------------*/
+static void urgent(void){
+
+   static const uint8_t mods[3] = {0, KM_LSHIFT, KM_RALT};
+   uint32_t n = 0, total = 0;
+   uint8_t lay, a, b, ma, mb;
+
+   kbOutMode = KB_OUT_UTF8;
+   for(lay = 0; lay < KB_LAYOUTS; lay++){
+      kbLayout = lay;
+      for(a = 0; a < KB_SLOTS; a++)
+         for(ma = 0; ma < 3; ma++)
+            for(b = 0; b < KB_SLOTS; b++)
+               for(mb = 0; mb < 3; mb++){
+                  kbDead = 0;
+                  xFlags.urgent = 0;
+                  xEvent.type = KB_EV_KEY;
+                  xEvent.brk = 0;
+                  xEvent.key = keys[a];
+                  xEvent.mods = mods[ma];
+                  kbPostCode();
+                  xEvent.key = keys[b];
+                  xEvent.mods = mods[mb];
+                  kbPostCode();
+                  n += xFlags.urgent;
+                  total++;
+                  qInit(&xOutBuf, QUEUE_POLICY);
+               }
+   }
+   kbDead = 0;
+   xFlags.urgent = 0;
+   printf("urgent           %u of %u key pairs%s\n", n, total,
+          n ? ", TRAIL BYTE TAKEN FOR A PLUG CODE" : "");
+   if(n)
+      bad++;
+}
+
+/*------------------------------------------*/
+/* First main loop pass: run it all         */
+/*------------------------------------------*/
+static void loopHook(void){
+
+   static const char *names[] = {"ascii", "utf-8"};
+   static const char *layouts[] = {LAYOUTS(LAYOUT_NAME)};
+   uint32_t bytes[2];
+   double ns[2];
+   uint8_t lay, fmt;
+
+   if(done)
+      return;
+   printf("layout   format   ns/key  bytes/key  spi us/key\n");
+   for(lay = 0; lay < KB_LAYOUTS; lay++){
+      for(fmt = 0; fmt < 2; fmt++){
+         kbOutMode = fmt ? KB_OUT_UTF8 : KB_OUT_ASCII;
+         kbLayout = lay;
+         kbDead = 0;
+         bytes[fmt] = type(nKeys, &ns[fmt]);
+         printf("%-8s %-8s %6.1f  %9.3f  %10.1f\n", layouts[lay], names[fmt], ns[fmt],
+                (double)bytes[fmt] / nKeys, SPI_BYTE_US * bytes[fmt] / nKeys);
+      }
+      printf("         encoding %+6.1f ns, %+.1f%% bytes\n", ns[1] - ns[0],
+             bytes[0] ? 100.0 * ((double)bytes[1] - bytes[0]) / bytes[0] : 0.0);
+   }
+
+   kbOutMode = KB_OUT_UTF8;
+   flood(QUEUE_POLICY, "refuse");
+   flood(Q_DROP_OLDEST, "drop oldest");
+   urgent();
+   qInit(&xOutBuf, QUEUE_POLICY);
+   kbOutMode = KB_OUT_ASCII;
+   done = 1;
+}
+
+static int doneHook(void){
+   return done;
+}
+
+int main(int argc, char **argv){
+
+   uint32_t k, n = 0;
+   double t0;
+   int opt;
+
+   nKeys = 1000000;
+   while((opt = getopt(argc, argv, "k:")) != -1){
+      switch(opt){
+         case 'k': nKeys = strtoul(optarg, NULL, 0); break;
+         default:
+            fprintf(stderr, "usage: %s [-k keystrokes]\n", argv[0]);
+            return 2;
+      }
+   }
+   if(!nKeys)
+      nKeys = 1;
+   for(k = 0; k < 256; k++)
+      if(kbKeyMap[k].kind == KC_LAYOUT)
+         keys[kbKeyMap[k].plain] = k, n++;
+   if(n != KB_SLOTS){
+      fprintf(stderr, "%u layout keys in keymap.h, %u slots\n", n, KB_SLOTS);
+      return 1;
+   }
+   t0 = simWallSec();
+
+   simReset();
+   simKbdInit(&kbd, 40);
+   simLoopHook = loopHook;
+   simDoneHook = doneHook;
+   simDeadline = SIM_US(1000000);
+   if(simRun(fwMain)){
+      printf("timeout\n");
+      return 1;
+   }
+   printf("wall             %.2f s\n", simWallSec() - t0);
+   return bad;
+}
@@ -4,6 +4,7 @@
 
 #include <xc.h>
 #include "sup.h"
+#include "ps2port.h"
 
 
 void SetUnusedPins(void)
@@ -57,35 +58,37 @@ void SetUnusedPins(void)
 //   TRISBbits.TRISB7 = 0;                                                      //Pin 16 - RP7/INT0/CN23/PMD5/RB7
 //   LATBbits.LATB7 = 0;
 
+#if PS2_PORTS < 2                                                               //Second PS2 port data and clock otherwise
    TRISBbits.TRISB8 = 0;                                                        //Pin 17 - TCK/RP8/SCL1/CN22/PMD4/RB8
    LATBbits.LATB8 = 0;
 
    TRISBbits.TRISB9 = 0;                                                        //Pin 18 - TDO/RP9/SDA1/CN21/PMD3/RB9
    LATBbits.LATB9 = 0;				
+#endif
                                                                                 //Pin 19 - DISVREG
                                                                                 //Pin 20 - Vcap / VDDCore
 
    TRISBbits.TRISB10 = 0;                                                       //Pin 21 - PGD2/EMUD2/TDI/RP10/CN16/PMD2/RB10
    LATBbits.LATB10 = 0;
 
-   TRISBbits.TRISB11 = 0;                                                       //Pin 22 - PGC2/EMUC2/TMS/RP11/CN15/PMD1/RB11
-   LATBbits.LATB11 = 0;
+// TRISBbits.TRISB11 = 0;                                                       //Pin 22 - PGC2/EMUC2/TMS/RP11/CN15/PMD1/RB11 - SPI1 SS1
+// LATBbits.LATB11 = 0;
 
    AD1PCFGbits.PCFG12 = 1;                                                      //Pin 23 - AN12/RP12/CN14/PMD0/RB12
    TRISBbits.TRISB12 = 0;
    LATBbits.LATB12 = 0;
 
-   AD1PCFGbits.PCFG11 = 1;                                                      //Pin 24 - AN11/RP13/CN13/PMRD/RB13
-   TRISBbits.TRISB13 = 0;
-   LATBbits.LATB13 = 0;
+// AD1PCFGbits.PCFG11 = 1;                                                      //Pin 24 - AN11/RP13/CN13/PMRD/RB13 - SPI1 SCK1
+// TRISBbits.TRISB13 = 0;
+// LATBbits.LATB13 = 0;
 
-   AD1PCFGbits.PCFG10 = 1;                                                      //Pin 25 - AN10/CVREF/RTCC/RP14/CN12/PMWR/RB14
-   TRISBbits.TRISB14 = 0;
-   LATBbits.LATB14 = 0;
+// AD1PCFGbits.PCFG10 = 1;                                                      //Pin 25 - AN10/CVREF/RTCC/RP14/CN12/PMWR/RB14 - SPI1 SDI1
+// TRISBbits.TRISB14 = 0;
+// LATBbits.LATB14 = 0;
 
-   AD1PCFGbits.PCFG9 = 1;                                                       //Pin 26 - AN9/RP15/CN11/PMCS1/RB15
-   TRISBbits.TRISB15 = 0;
-   LATBbits.LATB15 = 0;
+// AD1PCFGbits.PCFG9 = 1;                                                       //Pin 26 - AN9/RP15/CN11/PMCS1/RB15 - SPI1 SDO1
+// TRISBbits.TRISB15 = 0;
+// LATBbits.LATB15 = 0;
                                                                                 //Pin 27 - VSS
                                                                                 //Pin 28 - VDD
 }
@@ -14,7 +14,9 @@ extern "C" {
 
 #define FCY  16000000UL                                                          //16MHz cycle - Used by __delay_ms()
 
+#ifndef NULL
 #define NULL 0x00
+#endif
 #ifdef	__cplusplus
 }
 #endif
@@ -0,0 +1,234 @@
+/*----------------------------------------------------------------------------*/
+/* Typematic repeat                                                           */
+/*                                                                            */
+/* The master picks who repeats a held key with HOST_OP_REPEAT (see host.c),  */
+/* the delay and period, and which keys repeat at all:                        */
+/*                                                                            */
+/* TM_KEYBOARD (power up) leaves it to the keyboard. The delay and period are */
+/* sent with CMD_TYPEMATIC as the nearest the keyboard has, 250 to 1000ms and */
+/* 2 to 30 per second. Every repeat is a make on the wire: one to three       */
+/* frames, an ISR pass per bit and a trip through the decoder.                */
+/*                                                                            */
+/* TM_LOCAL slows the keyboard to its slowest setting (TM_ARG_SLOW) and       */
+/* throws its repeats away; the main loop posts them instead, from the        */
+/* timebase, at any period down to TM_MS_MIN. A held key then costs the bus   */
+/* two makes a second after the first second. Set 2 has no way to turn the    */
+/* keyboard's repeat off (that is set 3 and its make/break only command,      */
+/* and the decoder reads set 2), hence slowing it down.                       */
+/*                                                                            */
+/* As on the keyboard, only the key made last repeats and any other make      */
+/* stops it, modifiers included, and keys whose bit is clear in keys[] do not */
+/* repeat at all. A repeat is posted like the make: translated, through the   */
+/* macros, or as an event record. Repeats due while the output queue is held  */
+/* back are skipped, not posted late.                                         */
+/*                                                                            */
+/* The keyboard forgets CMD_TYPEMATIC on reset; when one is plugged in again  */
+/* kbPlug() has tmRestore() send it again.                                    */
+/*----------------------------------------------------------------------------*/
+#include "hal.h"
+#include "ps2kb.h"
+#include "kbcmd.h"
+#include "typematic.h"
+#include <string.h>                                                             //For memset(), memcpy()
+
+/*------------------------------------------*/
+/* Global variables                         */
+/*------------------------------------------*/
+extern const kbKeyDesc_t kbKeyMap[256];                                         //ps2kb.c
+extern ps2Port_t *pKbPort;
+extern kbFlags_t xFlags, *pFlags;
+
+tmState_t xTypematic, *pTypematic;
+
+#define TM_ON(k)    (pTypematic->cfg.keys[(k) >> 3] & (1 << ((k) & 7)))
+
+void tmInitialize(void){
+
+   uint16_t k;
+
+   pTypematic = &xTypematic;
+   memset(pTypematic,0x00,sizeof(xTypematic));
+   pTypematic->cfg.mode = TM_KEYBOARD;
+   pTypematic->cfg.delay = TM_DELAY_MS;
+   pTypematic->cfg.period = TM_PERIOD_MS;
+   for(k = 0; k < 256; k++)
+      if(kbKeyMap[k].kind != KC_NONE && kbKeyMap[k].kind != KC_MOD &&
+         kbKeyMap[k].kind != KC_LOCK && k != KEY_PAUSE)                         //Pause has no break, it would never stop
+         pTypematic->cfg.keys[k >> 3] |= 1 << (k & 7);
+   pTypematic->rec = pTypematic->cfg;
+}
+
+/*------------------------------------------*/
+/* CMD_TYPEMATIC argument nearest the delay */
+/* and period. Bits 6..5 delay in 250ms,    */
+/* bits 4..0 period (8 + A) * 2^B * 4.17ms  */
+/*------------------------------------------*/
+static uint8_t tmArg(uint16_t delay, uint16_t period){
+
+   uint32_t want = (uint32_t)period * 100, got, err, best = 0xFFFFFFFF;
+   uint8_t r, arg = 0;
+
+   for(r = 0; r < 32; r++){
+      got = (uint32_t)((8 + (r & 7)) << ((r >> 3) & 3)) * 417;                  //Hundredths of a ms
+      err = got > want ? got - want : want - got;
+      if(err < best){
+         best = err;
+         arg = r;
+      }
+   }
+   r = (delay + 125) / 250;
+   r = r ? r - 1 : 0;
+   return (r > 3 ? 3 : r) << 5 | arg;
+}
+
+/*------------------------------------------*/
+/* CMD_TYPEMATIC argument the keyboard      */
+/* should have for a configuration          */
+/*------------------------------------------*/
+static uint8_t tmWant(const tmConfig_t *c){
+   return c->mode == TM_LOCAL ? TM_ARG_SLOW : tmArg(c->delay, c->period);
+}
+
+/*------------------------------------------*/
+/* Every event the decoder produces. Starts */
+/* and stops the local repeat; returns 0    */
+/* for a keyboard repeat that is not wanted */
+/*------------------------------------------*/
+uint8_t tmEvent(const kbEvent_t *ev){
+
+   tmState_t *t = pTypematic;
+
+   if(ev->type != KB_EV_KEY)
+      return 1;
+   if(ev->rep){
+      if(t->cfg.mode == TM_KEYBOARD)
+         return 1;
+      t->dropped++;
+      return 0;
+   }
+   if(ev->brk){
+      if(ev->key == t->key)
+         t->key = 0;
+      return 1;
+   }
+   if(t->cfg.mode == TM_LOCAL && TM_ON(ev->key)){
+      t->key = ev->key;
+      t->at = halNow();
+      t->wait = TM_TICKS(t->cfg.delay);
+   }
+   else
+      t->key = 0;
+   return 1;
+}
+
+/*------------------------------------------*/
+/* Keyboard plugged in again (kbPlug()), it */
+/* is back at TM_ARG_RESET                  */
+/*------------------------------------------*/
+void tmRestore(void){
+
+   pTypematic->key = 0;
+   if(tmWant(&pTypematic->cfg) != TM_ARG_RESET)
+      kbCmdQueue(pKbPort,CMD_TYPEMATIC,tmWant(&pTypematic->cfg));
+}
+
+/*------------------------------------------*/
+/* Take a record the SPI ISR has clocked in */
+/*------------------------------------------*/
+static void tmApply(void){
+
+   tmState_t *t = pTypematic;
+   tmConfig_t *r = &t->rec;
+
+   if(r->mode != TM_KEYBOARD && r->mode != TM_LOCAL)                            //Unknown mode, keep the one in use
+      r->mode = t->cfg.mode;
+   if(r->delay < TM_MS_MIN)
+      r->delay = TM_MS_MIN;
+   if(r->period < TM_MS_MIN)
+      r->period = TM_MS_MIN;
+   if(tmWant(r) != tmWant(&t->cfg))
+      kbCmdQueue(pKbPort,CMD_TYPEMATIC,tmWant(r));
+   t->cfg = *r;
+   if(t->cfg.mode != TM_LOCAL || (t->key && !TM_ON(t->key)))
+      t->key = 0;
+}
+
+/*------------------------------------------*/
+/* Main loop: a record to apply, then the   */
+/* local repeat. One repeat per pass at     */
+/* most; a loop that fell behind by more    */
+/* than a period starts counting again      */
+/* rather than posting a burst              */
+/*------------------------------------------*/
+void tmService(void){
+
+   tmState_t *t = pTypematic;
+   uint32_t now;
+
+   if(t->ready){
+      tmApply();
+      t->ready = 0;
+   }
+   if(!t->key)
+      return;
+   now = halNow();
+   if(now - t->at < t->wait)
+      return;
+   t->at += t->wait;
+   t->wait = TM_TICKS(t->cfg.period);
+   if(now - t->at >= t->wait)
+      t->at = now;
+
+   if(!kbFlowControl() || pFlags->hold){                                        //Host is behind, do not add to it
+      t->skipped++;
+      return;
+   }
+   if(!kbRepeat(t->key)){                                                       //Released or lost in a BAT we have not decoded yet
+      t->key = 0;
+      return;
+   }
+   t->repeats++;
+}
+
+uint8_t tmBusy(void){
+   return pTypematic->ready || pTypematic->key;
+}
+
+/*------------------------------------------*/
+/* SPI ISR, HOST_OP_REPEAT opcode. Returns  */
+/* the mode in use, with TM_BUSY if the     */
+/* record before still waits for the main   */
+/* loop and this one is not taken           */
+/*------------------------------------------*/
+uint8_t tmRxStart(void){
+
+   if(pTypematic->ready)
+      return pTypematic->cfg.mode | TM_BUSY;
+   pTypematic->rec = pTypematic->cfg;                                           //Fields the record leaves out keep their value
+   pTypematic->recLen = 0;
+   pTypematic->recIdx = 0;
+   return pTypematic->cfg.mode;
+}
+
+/*------------------------------------------*/
+/* SPI ISR, one byte after the opcode: the  */
+/* record length (0 = only read the mode,   */
+/* at most sizeof(tmConfig_t)), then that   */
+/* many bytes of the record from the front. */
+/* Returns 0 once the rest of the           */
+/* transaction is ignored                   */
+/*------------------------------------------*/
+uint8_t tmRx(uint8_t b){
+
+   if(!pTypematic->recLen){
+      if(!b || b > sizeof(tmConfig_t))
+         return 0;
+      pTypematic->recLen = b;
+      return 1;
+   }
+   ((uint8_t *)&pTypematic->rec)[pTypematic->recIdx++] = b;
+   if(pTypematic->recIdx < pTypematic->recLen)
+      return 1;
+   pTypematic->ready = 1;
+   return 0;
+}
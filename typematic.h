@@ -0,0 +1,65 @@
+/*
+ * File:   typematic.h
+ */
+
+#ifndef TYPEMATIC_H
+#define	TYPEMATIC_H
+
+#include <stdint.h>
+
+/*----------------------------------------------------*/
+/* Defines                                            */
+/*----------------------------------------------------*/
+#define TM_DELAY_MS     500                                                     //Power up delay and period, the keyboard's own defaults
+#define TM_PERIOD_MS    92                                                      //10.9 per second
+#define TM_MS_MIN       5                                                       //Shortest delay or period taken from the master
+#define TM_ARG_SLOW     0x7F                                                    //CMD_TYPEMATIC argument: 1s delay, 2 per second
+#define TM_ARG_RESET    0x2B                                                    //What the keyboard has after reset: 500ms, 10.9 per second
+#define TM_TICKS(ms)    HAL_US_TICKS((uint32_t)(ms) * 1000)
+
+//Mode, byte 0 of the HOST_OP_REPEAT record
+#define TM_KEYBOARD     0x00                                                    //Keyboard repeats, at the rate nearest the one asked for
+#define TM_LOCAL        0x01                                                    //Keyboard slowed to TM_ARG_SLOW, its repeats dropped, the firmware repeats
+#define TM_BUSY         0x80                                                    //Byte 1 of HOST_OP_REPEAT: the record before not applied yet, this one ignored
+
+/*----------------------------------------------------*/
+/* Structures                                         */
+/*----------------------------------------------------*/
+typedef struct{                                                                 //HOST_OP_REPEAT record, little endian, same layout on PIC24 and host
+    uint8_t  mode;                                                              //TM_KEYBOARD or TM_LOCAL
+    uint8_t  spare;
+    uint16_t delay;                                                             //Make to first repeat, ms
+    uint16_t period;                                                            //Between repeats, ms
+    uint8_t  keys[32];                                                          //Bit (k & 7) of byte k >> 3 set if keycode k repeats
+}tmConfig_t;
+
+typedef struct{
+    tmConfig_t cfg;                                                             //In use
+    uint8_t  key;                                                               //Keycode being repeated (TM_LOCAL), 0 = none
+    uint32_t at;                                                                //halNow() of its make or last repeat
+    uint32_t wait;                                                              //Ticks from at to the next repeat
+    uint32_t repeats;                                                           //Repeats posted by the firmware
+    uint32_t dropped;                                                           //Repeats of the keyboard thrown away
+    uint32_t skipped;                                                           //Firmware repeats not posted, output queue held
+
+    //HOST_OP_REPEAT record being clocked in by the SPI ISR
+    tmConfig_t rec;                                                             //Starts as a copy of cfg, the record overwrites its first bytes
+    uint8_t  recLen;
+    uint8_t  recIdx;
+    volatile uint8_t ready;                                                     //Record complete, tmService() applies it
+}tmState_t;
+
+/*----------------------------------------------------*/
+/* Function declarations                              */
+/*----------------------------------------------------*/
+struct kbEvent;
+
+void            tmInitialize(void);                                             //TM_KEYBOARD, every key but modifiers, locks and Pause repeats
+uint8_t         tmEvent(const struct kbEvent *);                                //Main loop: every decoded event, 0 = drop it
+uint8_t         tmBusy(void);                                                   //Record waiting or a key repeating, the main loop must not idle
+void            tmService(void);                                                //Main loop: apply a record, post a repeat when due
+void            tmRestore(void);                                                //Keyboard plugged in again: send CMD_TYPEMATIC again
+uint8_t         tmRxStart(void);                                                //SPI ISR: HOST_OP_REPEAT opcode, returns byte 1
+uint8_t         tmRx(uint8_t);                                                  //SPI ISR: next record byte, 0 once no more are wanted
+
+#endif	/* TYPEMATIC_H */